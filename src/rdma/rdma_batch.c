@@ -0,0 +1,84 @@
+#include "rdma_batch.h"
+
+int send_batch_init(struct send_batch *batch, struct ibv_qp *qp,
+                    struct completion_table *table, int capacity)
+{
+        memset(batch, 0, sizeof(*batch));
+        if (capacity < 1) {
+                fprintf(stderr, "Invalid send batch size %d\n", capacity);
+                return -EINVAL;
+        }
+
+        batch->entries = calloc(capacity, sizeof(*batch->entries));
+        if (!batch->entries) {
+                fprintf(stderr, "Failed to allocate send batch: -ENOMEM\n");
+                return -ENOMEM;
+        }
+        batch->qp = qp;
+        batch->table = table;
+        batch->capacity = capacity;
+        return 0;
+}
+
+void send_batch_destroy(struct send_batch *batch)
+{
+        free(batch->entries);
+        batch->entries = NULL;
+        batch->capacity = 0;
+        batch->count = 0;
+}
+
+int send_batch_add(struct send_batch *batch, const struct ibv_send_wr *wr)
+{
+        if (wr->num_sge > SEND_BATCH_MAX_SGE) {
+                fprintf(stderr, "Can't batch a WR with %d SGEs\n", wr->num_sge);
+                return -EINVAL;
+        }
+
+        struct send_batch_entry *entry = &batch->entries[batch->count];
+        entry->wr = *wr;
+        memcpy(entry->sge, wr->sg_list, wr->num_sge * sizeof(*wr->sg_list));
+        entry->wr.sg_list = entry->sge;
+        entry->wr.next = NULL;
+
+        /* Chain it behind the previous entry */
+        if (batch->count) {
+                batch->entries[batch->count - 1].wr.next = &entry->wr;
+        }
+        batch->count++;
+
+        if (batch->count == batch->capacity) {
+                return send_batch_flush(batch);
+        }
+        return 0;
+}
+
+int send_batch_flush(struct send_batch *batch)
+{
+        struct ibv_send_wr *bad_wr = NULL;
+
+        if (!batch->count) {
+                return 0;
+        }
+
+        int count = batch->count;
+        batch->count = 0;
+        int ret = ibv_post_send(batch->qp, &batch->entries[0].wr, &bad_wr);
+        batch->flushes++;
+        if (!ret) {
+                batch->posted += count;
+                return 0;
+        }
+
+        /* Everything before bad_wr made it onto the send queue */
+        fprintf(stderr, "Failed to post batch of %d WRs: %s\n", count,
+                strerror(ret));
+        for (struct ibv_send_wr *wr = bad_wr; wr; wr = wr->next) {
+                if (batch->table) {
+                        completion_table_cancel(batch->table, wr->wr_id);
+                }
+                count--;
+        }
+        batch->posted += count;
+        return -ret;
+}
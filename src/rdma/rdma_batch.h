@@ -0,0 +1,79 @@
+/*
+ * rdma_batch.h defines a batch of send WRs posted to a QP together.
+ *
+ * Every ibv_post_send() call rings the device's doorbell, an uncached MMIO
+ * write that dominates the cost of posting a small WR. A send_batch copies
+ * WRs into a linked list as they're added and posts the whole chain with a
+ * single ibv_post_send(), so one doorbell covers the batch. It flushes on
+ * its own once full, and callers flush explicitly before waiting on the
+ * completions of what they've added.
+ */
+
+#ifndef RDMA_BATCH_H
+#define RDMA_BATCH_H
+
+#include "rdma_common.h"
+
+/* Most SGEs a batched WR can carry, matching the QPs' max_send_sge */
+#define SEND_BATCH_MAX_SGE 2
+
+/* Default number of WRs posted per doorbell, 1 posts every WR on its own */
+#define DEFAULT_SEND_BATCH_SIZE 1
+
+/*
+ * A batched WR and its own copy of the scatter-gather list.
+ */
+struct send_batch_entry {
+        struct ibv_send_wr wr;
+        struct ibv_sge sge[SEND_BATCH_MAX_SGE];
+};
+
+struct send_batch {
+        struct ibv_qp *qp;
+
+        /* Table the batched WRs' wr_ids are registered with, so the ones
+         * left unposted by a failed flush can be released. May be NULL.
+         */
+        struct completion_table *table;
+
+        struct send_batch_entry *entries;
+        int capacity;
+        int count;
+
+        /* Doorbells rung and WRs posted, for reporting */
+        unsigned long flushes;
+        unsigned long posted;
+};
+
+/*
+ * Sets up a batch posting up to capacity WRs at a time to qp.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+int send_batch_init(struct send_batch *batch, struct ibv_qp *qp,
+                    struct completion_table *table, int capacity);
+
+/*
+ * Frees a batch. WRs added since the last flush are dropped.
+ */
+void send_batch_destroy(struct send_batch *batch);
+
+/*
+ * Copies wr, and its scatter-gather list, to the end of the batch. wr->next
+ * is ignored. Inline payloads are only copied out of their source when the
+ * batch is flushed, so the source must stay unchanged until then. Flushes
+ * the batch if that made it full.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+int send_batch_add(struct send_batch *batch, const struct ibv_send_wr *wr);
+
+/*
+ * Posts every WR in the batch with a single ibv_post_send(). On failure the
+ * WRs from the rejected one on are dropped and their wr_ids cancelled.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+int send_batch_flush(struct send_batch *batch);
+
+#endif /* RDMA_BATCH_H */
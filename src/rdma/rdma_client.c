@@ -9,11 +9,27 @@
  */
 
 #include "rdma_common.h"
+#include "rdma_pool.h"
+#include "rdma_histogram.h"
+#include "rdma_batch.h"
+#include "rdma_ring.h"
+#include "rdma_iovec.h"
+#include "rdma_kv.h"
+#include "rdma_lock.h"
+#include "rdma_conn_pool.h"
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
 
 /* Server default ipoib information */
 static char *server_addr = "127.0.0.1";
 static char *server_port = "7471";
 
+/* The message given on the command line, and its length */
+static char *message = NULL;
+static size_t message_len = 0;
+
 /* Message source buffer from where we'll write to the server */
 static char *src_buffer = NULL;
 
@@ -32,6 +48,19 @@ static struct ibv_cq *completion_queue = NULL;
 static struct ibv_qp_init_attr qp_init_attr;
 static struct ibv_qp *queue_pair = NULL;
 
+/* Inline data requested for the QP, and the amount the device granted */
+static uint32_t inline_size = DEFAULT_INLINE_SIZE;
+static uint32_t max_inline_data = 0;
+
+/* SGEs per send WR the QP was granted */
+static int max_send_sge = 1;
+
+/* The message is kept in this many separately allocated fragments and
+ * gathered into one WRITE, 0 keeps it contiguous in src_buffer.
+ */
+static int gather_fragments = 0;
+static struct rdma_pool_buffer **fragment_pool_buffers = NULL;
+
 /* --- Scatter-Gather Entry resources */
 static struct ibv_sge client_send_sge, server_recv_sge;
 
@@ -39,6 +68,10 @@ static struct ibv_sge client_send_sge, server_recv_sge;
 static struct ibv_send_wr client_send_wr, *bad_client_send_wr;
 static struct ibv_recv_wr server_recv_wr, *bad_server_recv_wr;
 
+/* Benchmark send WRs are chained and posted post_batch_size at a time */
+static struct send_batch send_batch;
+static int post_batch_size = DEFAULT_SEND_BATCH_SIZE;
+
 /* --- Memory resources --- */
 /* Packed static structs where we'll store buffer metadata for the client and
  * server. Things like the remote key or local key, length of buffer, and
@@ -46,11 +79,182 @@ static struct ibv_recv_wr server_recv_wr, *bad_server_recv_wr;
  */
 static struct rdma_buffer_attr client_metadata, server_metadata;
 
+/* Send our metadata with the connect request and take the server's from its
+ * accept, instead of exchanging them in SENDs once connected
+ */
+static int fast_connect = 0;
+
 /* IBVerbs registered memory regions */
 static struct ibv_mr *client_metadata_mr = NULL;
 static struct ibv_mr *server_metadata_mr = NULL;
-static struct ibv_mr *client_src_mr = NULL;
-static struct ibv_mr *client_dst_mr = NULL;
+
+/* Pre-registered memory the source and destination buffers come from */
+static struct rdma_pool *buffer_pool = NULL;
+static struct rdma_pool_buffer *src_pool_buffer = NULL;
+static struct rdma_pool_buffer *dst_pool_buffer = NULL;
+static uint32_t pool_max_buffer = DEFAULT_POOL_MAX_BUFFER;
+static size_t pool_class_bytes = DEFAULT_POOL_CLASS_BYTES;
+
+/* Routes the client's Work Completions to their handlers by wr_id */
+static struct completion_table completion_table;
+static int cq_batch_size = DEFAULT_CQ_BATCH_SIZE;
+
+/* WRITE the message with an immediate, which notifies the server */
+static int write_imm = 0;
+
+/* Message streams (--ring, --credit-stream) send this many messages of this
+ * size unless -i and -m or -z say otherwise
+ */
+#define DEFAULT_STREAM_MESSAGES 1000000
+#define DEFAULT_STREAM_MESSAGE_SIZE 64
+
+/* Message ring mode: stream benchmark_iterations copies of ring_payload into
+ * a ring_size byte ring on the server. The server pushes its consumer index
+ * into the credit buffer.
+ */
+static uint64_t ring_size = 0;
+static const char *ring_payload = NULL;
+static uint32_t ring_payload_len = 0;
+static struct rdma_pool_buffer *credit_pool_buffer = NULL;
+static unsigned long credit_reads = 0;
+
+/* Credit stream mode: SEND benchmark_iterations messages, never more than
+ * the server has granted credits for
+ */
+static int credit_stream = 0;
+static struct ibv_recv_wr credit_recv_wrs[CREDIT_RECV_DEPTH];
+static uint32_t send_credits = 0; /* Receives the server has granted us */
+static uint32_t credit_recvs_reposted = 0; /* Not yet returned to the server */
+static unsigned long credit_messages = 0;
+static unsigned long credit_stalls = 0;
+
+/* Session mode: SEND every message from session_source over the one
+ * connection, as a credit stream. Each in-flight message has a slot of
+ * message_len bytes in the session buffer.
+ */
+#define DEFAULT_SESSION_MESSAGES 1000
+#define DEFAULT_SESSION_MESSAGE_SIZE 4096
+#define SESSION_SOURCE_STDIN "-"
+#define SESSION_SOURCE_GENERATE "generate"
+static const char *session_source = NULL;
+static FILE *session_file = NULL;
+static char *session_line = NULL;
+static size_t session_line_size = 0;
+static struct rdma_pool_buffer *session_pool_buffer = NULL;
+
+/* File transfer mode: WRITE file_input with immediate, a message_len byte
+ * chunk at a time, into the server's chunk slots. The server pushes the
+ * number of chunks it has written out into the credit buffer.
+ */
+#define DEFAULT_FILE_CHUNK_SIZE (1 << 20)
+static const char *file_input = NULL;
+static int file_fd = -1;
+static struct rdma_pool_buffer *chunk_pool_buffer = NULL;
+
+/* Registration benchmark: for every registration mode, time registering a
+ * fresh benchmark_size byte buffer, the first READ into it, which pays for
+ * any ODP page faults, the steady-state READs after it, and deregistering
+ */
+#define DEFAULT_REGISTRATION_BENCH_SIZE (64 << 20)
+#define REGISTRATION_BENCH_READS 100
+static int registration_bench = 0;
+
+/* Atomic mode: FETCH_AND_ADD 1 to, or COMPARE_AND_SWAP-increment, one of the
+ * server's 64-bit counters benchmark_iterations times. Up to queue_depth
+ * FETCH_AND_ADDs are in flight, each returning the old value into its own
+ * slot of the result buffer. With atomic_clients > 1, that many forked
+ * clients hit the counters at once, all on atomic_counter or each on its own.
+ *
+ * The lock op instead acquires and releases benchmark_iterations times a
+ * random one of lock_span lock words from atomic_counter on, lock_shared_percent
+ * of the time shared. Rounds sweep the clients and lock_span in powers of two
+ * up to atomic_clients and lock_count.
+ */
+enum atomic_op {
+        ATOMIC_OP_NONE,
+        ATOMIC_OP_FETCH_ADD,
+        ATOMIC_OP_CMP_SWAP,
+        ATOMIC_OP_LOCK
+};
+#define DEFAULT_ATOMIC_OPS 1000000
+#define DEFAULT_LOCK_OPS 100000
+#define LOCK_MIN_BACKOFF_NSEC 1000
+#define LOCK_MAX_BACKOFF_NSEC 1000000
+static enum atomic_op atomic_op = ATOMIC_OP_NONE;
+static uint32_t atomic_counter = 0;
+static int atomic_clients = 1;
+static int spread_counters = 0;
+static int atomic_client_index = 0;
+static int atomic_ready_fd = -1, atomic_start_fd = -1, atomic_result_fd = -1;
+static struct rdma_pool_buffer *atomic_pool_buffer = NULL;
+static uint64_t atomic_fetched = 0; /* Value returned by the last atomic */
+static unsigned long atomic_unordered = 0; /* FETCH_AND_ADDs not above the last */
+static uint32_t lock_count = 1;
+static uint32_t lock_span = 1; /* Locks of the current round */
+static int lock_shared_percent = 0;
+static uint32_t lock_lease_ms = DEFAULT_LOCK_LEASE_MS;
+
+/* Key-value mode: load kv_records keys of message_len byte values into the
+ * server's store, then run benchmark_iterations YCSB ycsb_workload
+ * operations on them. The buffers the bucket, reply, request and record go
+ * through all come out of one pooled buffer.
+ */
+#define DEFAULT_KV_VALUE_SIZE 1024
+#define DEFAULT_KV_OPS 1000000
+#define KV_MAX_GET_ATTEMPTS 1000
+#define YCSB_ZIPF_THETA 0.99
+static uint64_t kv_records = 0;
+static char ycsb_workload = 'a';
+static struct kv_regions kv_regions;
+static struct rdma_pool_buffer *kv_pool_buffer = NULL;
+static struct kv_bucket *kv_bucket = NULL;
+static struct kv_reply *kv_reply = NULL;
+static struct kv_request *kv_request = NULL;
+static struct kv_record *kv_record = NULL;
+static unsigned long kv_get_retries = 0;
+
+/* Connection rate mode: open and close connect_total connections,
+ * connect_concurrency at a time, timing each phase of their setup
+ */
+#define DEFAULT_CONNECT_CONCURRENCY 64
+static unsigned long connect_total = 0;
+static int connect_concurrency = DEFAULT_CONNECT_CONCURRENCY;
+
+/* Connection pool mode: -i READs of -z bytes, each over a connection leased
+ * from a pool keeping conn_pool_size of them established
+ */
+#define DEFAULT_CONN_POOL_REQUESTS 10000
+static int conn_pool_size = 0;
+static unsigned long conn_pool_idle_expiry_ms = DEFAULT_CONN_POOL_IDLE_EXPIRY_MS;
+
+/* How long address and route resolution may take */
+#define DEFAULT_CM_TIMEOUT_MS 2000
+static int cm_timeout_ms = DEFAULT_CM_TIMEOUT_MS;
+
+/* Benchmark modes, run instead of the message WRITE/READ. Iterations and
+ * size default per mode when left at 0.
+ */
+#define DEFAULT_LATENCY_ITERATIONS 1000000
+#define DEFAULT_LATENCY_WARMUP 10000
+#define DEFAULT_LATENCY_SIZE 64
+#define DEFAULT_BANDWIDTH_ITERATIONS 5000
+#define DEFAULT_BANDWIDTH_SIZE 65536
+#define DEFAULT_SWEEP_MAX_SIZE (8 << 20)
+#define SWEEP_MIN_SIZE 2
+static enum benchmark_op latency_op = BENCHMARK_OP_NONE;
+static enum benchmark_op bandwidth_op = BENCHMARK_OP_NONE;
+static unsigned long benchmark_iterations = 0;
+static unsigned long latency_warmup = DEFAULT_LATENCY_WARMUP;
+static uint32_t benchmark_size = 0;
+static int queue_depth = DEFAULT_QUEUE_DEPTH;
+static int sweep_sizes = 0;
+static int benchmark_failed = 0;
+
+/* Bandwidth benchmark WRs per signaled one, and the WRs retired so far by
+ * the completions of the signaled ones
+ */
+static int signal_interval = 1;
+static unsigned long benchmark_retired = 0;
 
 static void cleanup_client()
 {
@@ -82,30 +286,60 @@ static void cleanup_client()
                 }
         }
 
-        if (src_buffer) {
+        if (src_pool_buffer) {
                 printf("Freeing message buffer\n");
-                free(src_buffer);
+                rdma_pool_free(buffer_pool, src_pool_buffer);
         }
 
-        if (dst_buffer) {
+        if (dst_pool_buffer) {
                 printf("Freeing dst_buffer\n");
-                free(dst_buffer);
+                rdma_pool_free(buffer_pool, dst_pool_buffer);
         }
 
-        if (client_metadata_mr) {
-                printf("Deregistering ibv_mr client_metadata_mr\n");
-                ibv_dereg_mr(client_metadata_mr);
+        if (credit_pool_buffer) {
+                rdma_pool_free(buffer_pool, credit_pool_buffer);
+        }
+
+        if (session_pool_buffer) {
+                rdma_pool_free(buffer_pool, session_pool_buffer);
+        }
+
+        if (chunk_pool_buffer) {
+                rdma_pool_free(buffer_pool, chunk_pool_buffer);
+        }
+
+        if (atomic_pool_buffer) {
+                rdma_pool_free(buffer_pool, atomic_pool_buffer);
+        }
+
+        if (kv_pool_buffer) {
+                rdma_pool_free(buffer_pool, kv_pool_buffer);
         }
 
-        if (client_src_mr) {
-                printf("Deregistering ibv_mr client_src_mr\n");
-                ibv_dereg_mr(client_src_mr);
+        if (file_fd >= 0) {
+                close(file_fd);
         }
 
-        if (client_dst_mr) {
-                printf("Deregistering ibv_mr client_dst_mr\n");
-                ibv_dereg_mr(client_dst_mr);
+        if (session_file && session_file != stdin) {
+                fclose(session_file);
         }
+        free(session_line);
+
+        if (fragment_pool_buffers) {
+                for (int i = 0; i < gather_fragments; i++) {
+                        if (fragment_pool_buffers[i]) {
+                                rdma_pool_free(buffer_pool,
+                                               fragment_pool_buffers[i]);
+                        }
+                }
+                free(fragment_pool_buffers);
+        }
+
+        if (client_metadata_mr) {
+                printf("Deregistering ibv_mr client_metadata_mr\n");
+                ibv_dereg_mr(client_metadata_mr);
+        }
+
 
         if (server_metadata_mr) {
                 printf("Deregistering ibv_mr server_metadata_mr\n");
@@ -127,6 +361,11 @@ static void cleanup_client()
                 ibv_destroy_comp_channel(completion_channel);
         }
 
+        if (buffer_pool) {
+                printf("Destroying buffer pool\n");
+                rdma_pool_destroy(buffer_pool);
+        }
+
         if (protection_domain) {
                 printf("Deallocating ibv_pd protection_domain\n");
                 ibv_dealloc_pd(protection_domain);
@@ -151,6 +390,73 @@ static void cleanup_client()
                 printf("Destroying CM event channel\n");
                 rdma_destroy_event_channel(cm_event_channel);
         }
+
+        send_batch_destroy(&send_batch);
+        completion_table_destroy(&completion_table);
+}
+
+/*
+ * Completion handler for the client's WRs. The context names the operation
+ * the WR was posted for.
+ */
+static void log_work_completion(struct ibv_wc *wc, void *context)
+{
+        printf("%s (wr_id %lu) completed with status: %s\n",
+               (const char *)context, (unsigned long)wc->wr_id,
+               ibv_wc_status_str(wc->status));
+}
+
+/*
+ * Registers a wr_id for client_send_wr and posts it to the client QP.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int post_client_send_wr(const char *operation)
+{
+        int ret = completion_table_register(&completion_table,
+                                            log_work_completion,
+                                            (void *)operation,
+                                            &client_send_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+
+        ret = ibv_post_send(
+                queue_pair,
+                &client_send_wr,
+                &bad_client_send_wr
+        );
+        if (ret) {
+                fprintf(stderr, "Failed to post %s: %s\n", operation,
+                        strerror(ret));
+                completion_table_cancel(&completion_table, client_send_wr.wr_id);
+                return -ret;
+        }
+        return 0;
+}
+
+/*
+ * Waits until every WR the client has posted so far has completed,
+ * dispatching their WCs in batches.
+ *
+ * Returns 0 if all completed successfully, a negative error code otherwise.
+ */
+static int wait_for_outstanding_completions()
+{
+        int expected_wc = completion_table.outstanding;
+        int ret = process_completions(
+                completion_channel,
+                completion_queue,
+                &completion_table,
+                expected_wc
+        );
+        if (ret < expected_wc) {
+                fprintf(stderr, "Failed to process %d Work Completions: ret=%d\n",
+                        expected_wc, ret);
+                return ret < 0 ? ret : -EIO;
+        }
+        printf("Got %d Work Completions\n", ret);
+        return 0;
 }
 
 static int setup_client()
@@ -193,7 +499,8 @@ static int setup_client()
          * to an RDMA address. If successful, the specified rdma_cm_id will be
          * bound to a local device.
          */
-	ret = rdma_resolve_addr(cm_client_id, NULL, rai->ai_dst_addr, 2000);
+	ret = rdma_resolve_addr(cm_client_id, NULL, rai->ai_dst_addr,
+                                cm_timeout_ms);
 	if (ret) {
                 fprintf(stderr, "Failed rdma_resolve_addr with errno: (%s)\n",
                                 strerror(errno));
@@ -226,11 +533,10 @@ static int setup_client()
         }
 
         /* Resolve the route to the destination address */
-        int timeout_ms = 2000;
-        ret = rdma_resolve_route(cm_client_id, 2000);
+        ret = rdma_resolve_route(cm_client_id, cm_timeout_ms);
         if (ret == -1) {
                 fprintf(stderr, "Failed to resolve route to destination within %d ms: %s\n",
-                                timeout_ms,
+                                cm_timeout_ms,
                                 strerror(errno));
 		return -errno;
         }
@@ -277,6 +583,95 @@ static int setup_protection_domain()
         return 0;
 }
 
+/*
+ * Returns the length of message fragment i, earlier fragments taking the
+ * remainder.
+ */
+static uint32_t fragment_length(int i)
+{
+        return message_len / gather_fragments +
+               ((size_t) i < message_len % gather_fragments);
+}
+
+/*
+ * Splits the message across gather_fragments buffers of its own from the
+ * pool, the way an application might hold a header apart from its payload,
+ * for client_write_message() to gather.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int setup_message_fragments()
+{
+        fragment_pool_buffers = calloc(gather_fragments,
+                                       sizeof(*fragment_pool_buffers));
+        if (!fragment_pool_buffers) {
+                return -ENOMEM;
+        }
+
+        size_t offset = 0;
+        for (int i = 0; i < gather_fragments; i++) {
+                uint32_t length = fragment_length(i);
+                fragment_pool_buffers[i] = rdma_pool_alloc(buffer_pool, length);
+                if (!fragment_pool_buffers[i]) {
+                        fprintf(stderr, "Failed to allocate message fragment from pool\n");
+                        return -ENOMEM;
+                }
+                memcpy(fragment_pool_buffers[i]->addr, message + offset, length);
+                offset += length;
+        }
+        printf("Split message into %d fragments\n", gather_fragments);
+        return 0;
+}
+
+/*
+ * Registers the memory pool under our Protection Domain and takes the source
+ * and destination message buffers from it, copying the message into the
+ * source buffer. This is the only data memory registration the client does.
+ */
+static int setup_buffer_pool()
+{
+        buffer_pool = rdma_pool_create(protection_domain, DEFAULT_POOL_MIN_BUFFER,
+                                       pool_max_buffer, pool_class_bytes,
+                                       (IBV_ACCESS_LOCAL_WRITE|
+                                        IBV_ACCESS_REMOTE_READ|
+                                        IBV_ACCESS_REMOTE_WRITE));
+        if (!buffer_pool) {
+                return -ENOMEM;
+        }
+
+        /* The destination has room for a null terminator */
+        src_pool_buffer = rdma_pool_alloc(buffer_pool, message_len);
+        dst_pool_buffer = rdma_pool_alloc(buffer_pool, message_len + 1);
+        if (!src_pool_buffer || !dst_pool_buffer) {
+                fprintf(stderr, "Failed to allocate message buffers from pool\n");
+                return -ENOMEM;
+        }
+        src_buffer = src_pool_buffer->addr;
+        dst_buffer = dst_pool_buffer->addr;
+
+        if (ring_size || file_input) {
+                credit_pool_buffer = rdma_pool_alloc(buffer_pool,
+                                                     sizeof(uint64_t));
+                if (!credit_pool_buffer) {
+                        fprintf(stderr, "Failed to allocate credit buffer from pool\n");
+                        return -ENOMEM;
+                }
+                *(uint64_t *) credit_pool_buffer->addr = 0;
+        }
+
+        /* Benchmarks send whatever is in the buffer */
+        if (!message) {
+                memset(src_buffer, 'x', message_len);
+                return 0;
+        }
+        memcpy(src_buffer, message, message_len);
+        printf("src_buffer contents: '%.*s'\n", (int)message_len, src_buffer);
+        if (gather_fragments) {
+                return setup_message_fragments();
+        }
+        return 0;
+}
+
 /*
  * Creates a completion channel where I/O completion notifications are sent.
  * This is different from connection management (CM) event notifications.
@@ -298,6 +693,15 @@ static int create_completion_channel()
         return 0;
 }
 
+/*
+ * Returns how many signaled WRs a bandwidth benchmark can have in flight,
+ * which is what the CQ has to hold on top of the other WRs.
+ */
+static int signaled_depth()
+{
+        return (queue_depth + signal_interval - 1) / signal_interval;
+}
+
 /*
  * Create a Completion Queue (CQ) where actual I/O completion metadata is
  * placed. The metadata is packed into a structure called struct ibv_wc
@@ -307,7 +711,8 @@ static int create_completion_channel()
 static int create_completion_queue()
 {
         completion_queue = ibv_create_cq(cm_client_id->verbs, /* device */
-			                 16, /* maximum capacity */
+			                 16 + signaled_depth() +
+                                         (credit_stream ? CREDIT_RECV_DEPTH : 0), /* maximum capacity */
 			                 NULL /* user context, not used here */,
 			                 completion_channel /* IO completion channel */,
 			                 0 /* Signaling vector, not used here */
@@ -336,9 +741,16 @@ static int setup_queue_pairs()
 {
         memset(&qp_init_attr, 0, sizeof(qp_init_attr));
         qp_init_attr.cap.max_recv_sge = 2; /* Maximum SGE per receive posting */
-        qp_init_attr.cap.max_recv_wr = 8; /* Maximum receive posting capacity */
-        qp_init_attr.cap.max_send_sge = 2; /* Maximum SGE per send posting */
-        qp_init_attr.cap.max_send_wr = 8; /* Maximum send posting capacity */
+        qp_init_attr.cap.max_recv_wr = 8 + CREDIT_RECV_DEPTH; /* Maximum receive posting capacity */
+        qp_init_attr.cap.max_send_sge = query_max_send_sge(cm_client_id->verbs,
+                                                           DEFAULT_MAX_SEND_SGE); /* Maximum SGE per send posting */
+        /* Unsignaled WRs hold their send queue slots until a later signaled
+         * WR completes, so the send queue covers the whole queue depth, or a
+         * gathered WRITE split into one WR per fragment
+         */
+        qp_init_attr.cap.max_send_wr = 8 + (gather_fragments > queue_depth ?
+                                            gather_fragments : queue_depth); /* Maximum send posting capacity */
+        qp_init_attr.cap.max_inline_data = inline_size; /* Maximum inline payload */
         qp_init_attr.qp_type = IBV_QPT_RC; /* QP type, RC (Reliable Connection) */
 
         /* We use the same completion queue for both queue pairs */
@@ -349,16 +761,27 @@ static int setup_queue_pairs()
          * successful. After that, we'll capture that QP pointer in an external
          * static variable queue_pair.
          */
-        int ret = rdma_create_qp(cm_client_id, protection_domain, &qp_init_attr);
+        int ret = create_queue_pair(cm_client_id, protection_domain, &qp_init_attr);
 	if (ret) {
 	        fprintf(stderr, "Failed to create Queue Pair: %s\n",
-                        strerror(errno));
-                return -errno;
+                        strerror(-ret));
+                return ret;
 	}
         queue_pair = cm_client_id->qp;
-        printf("Created client Queue Pair:\n");
+        max_inline_data = qp_init_attr.cap.max_inline_data;
+        max_send_sge = qp_init_attr.cap.max_send_sge;
+        printf("Created client Queue Pair with %u bytes inline data, %d SGEs per send:\n",
+               max_inline_data, max_send_sge);
         print_ibv_qp(queue_pair, 1);
-        return 0;
+
+        /* Only the bandwidth benchmark, the message streams and pipelined
+         * FETCH_AND_ADDs keep enough WRs in flight to batch, everything else
+         * needs each WR posted right away.
+         */
+        return send_batch_init(&send_batch, queue_pair, &completion_table,
+                               bandwidth_op != BENCHMARK_OP_NONE || ring_size ||
+                               credit_stream || file_input ||
+                               atomic_op != ATOMIC_OP_NONE ? post_batch_size : 1);
 }
 
 /*
@@ -394,14 +817,22 @@ static int post_metadata_recv_buffer()
         memset(&server_recv_wr, 0, sizeof(server_recv_wr));
         server_recv_wr.sg_list = &server_recv_sge;
 	server_recv_wr.num_sge = 1;
-	int ret = ibv_post_recv(queue_pair, /* the QP this is being posted to */
-		                &server_recv_wr, /* receive work request */
-		                &bad_server_recv_wr /* error WRs */
-                               );
+        int ret = completion_table_register(&completion_table,
+                                            log_work_completion,
+                                            "server metadata RECV",
+                                            &server_recv_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+	ret = ibv_post_recv(queue_pair, /* the QP this is being posted to */
+		            &server_recv_wr, /* receive work request */
+		            &bad_server_recv_wr /* error WRs */
+                           );
         if (ret) {
                 fprintf(stderr, "Failed to post server_recv_wr: %s\n",
-                        strerror(errno));
-		return -errno;
+                        strerror(ret));
+                completion_table_cancel(&completion_table, server_recv_wr.wr_id);
+		return -ret;
         }
         printf("Successfully pre-posted server_recv_wr:\n");
         print_ibv_recv_wr(&server_recv_wr, 0);
@@ -418,6 +849,8 @@ static int connect_to_server()
 {
         struct rdma_conn_param conn_param;
 	struct rdma_cm_event *cm_event = NULL;
+        struct rdma_fast_connect private_data;
+        int kv_offset = 0;
 
         /* Before we connect we have to fill out an rdma_conn_param struct
          * containing connection properties:
@@ -431,9 +864,23 @@ static int connect_to_server()
          * - retry_count: The maximum number of times that a data transfer
          * operation should be retried on the connection when an error occurs.
          */
+        memset(&conn_param, 0, sizeof(conn_param));
         conn_param.initiator_depth = 3;
 	conn_param.responder_resources = 3;
 	conn_param.retry_count = 3;
+        /* A send bandwidth run can outpace the server re-posting receives,
+         * and a WRITE with immediate can beat the server's notification
+         * receive, so retry indefinitely on RNR NAKs instead of failing the
+         * QP.
+         */
+        if (bandwidth_op == BENCHMARK_OP_SEND || write_imm) {
+                conn_param.rnr_retry_count = 7;
+        }
+        if (fast_connect) {
+                fast_connect_init(&private_data, &client_metadata);
+                conn_param.private_data = &private_data;
+                conn_param.private_data_len = sizeof(private_data);
+        }
         int ret = rdma_connect(cm_client_id, &conn_param);
         if (ret) {
                 fprintf(stderr, "Failed to connect to server: %s\n",
@@ -446,6 +893,26 @@ static int connect_to_server()
                 fprintf(stderr, "Failed to process CM event\n");
                 return ret;
         }
+        /* The server's metadata for a fast connect, and where a key-value
+         * store is, after it if both, come in the private data of its accept,
+         * which goes away with the event
+         */
+        if (fast_connect) {
+                if (!parse_fast_connect(cm_event->param.conn.private_data,
+                                        cm_event->param.conn.private_data_len,
+                                        &server_metadata)) {
+                        fprintf(stderr, "Server accepted without its metadata, does it support fast connect?\n");
+                        rdma_ack_cm_event(cm_event);
+                        return -EPROTO;
+                }
+                kv_offset = sizeof(private_data);
+        }
+        if (kv_records &&
+            cm_event->param.conn.private_data_len >= kv_offset + sizeof(kv_regions)) {
+                memcpy(&kv_regions,
+                       (char *) cm_event->param.conn.private_data + kv_offset,
+                       sizeof(kv_regions));
+        }
         /* We got the expected RDMA_CM_EVENT_ESTABLISHED event. ACK the event
          * to free the allocated memory.
          */
@@ -459,9 +926,46 @@ static int connect_to_server()
 		return -errno;
         }
         printf("Successfully connected to server RDMA device\n");
+        if (fast_connect) {
+                printf("Server sent its metadata with its accept:\n");
+                print_rdma_buffer_attr(&server_metadata, 1);
+        }
         return 0;
 }
 
+/*
+ * Describes the buffer the server is to use in client_metadata.
+ */
+static void prepare_client_metadata()
+{
+        /* Our source buffer, where the message is stored, came out of the
+         * pre-registered pool with remote read/write access, so its handle
+         * already carries the lkey/rkey. Use it to satisfy the server's WR
+         * for the client metadata.
+         */
+	client_metadata.address = (uint64_t) src_pool_buffer->addr;
+	client_metadata.length = message_len;
+	client_metadata.stag.local_stag = src_pool_buffer->rkey;
+
+        /* In a write latency benchmark the server WRITEs its echo back to us,
+         * so advertise the buffer we poll for it instead.
+         */
+        if (latency_op == BENCHMARK_OP_WRITE) {
+                client_metadata.address = (uint64_t) dst_pool_buffer->addr;
+                client_metadata.stag.local_stag = dst_pool_buffer->rkey;
+        }
+        /* In ring mode the length sizes the server's ring, and the server
+         * WRITEs its consumer index into our credit buffer. A file transfer
+         * works the same way, with the chunk size and the chunks written out.
+         */
+        if (ring_size || file_input) {
+                client_metadata.address = (uint64_t) credit_pool_buffer->addr;
+                client_metadata.stag.local_stag = credit_pool_buffer->rkey;
+        }
+        printf("Prepared client_metadata:\n");
+        print_rdma_buffer_attr(&client_metadata, 1);
+}
+
 /*
  * 1. Sends our client metadata to the server, completing the server's pre-posted
  *    WR for client metadata.
@@ -475,57 +979,29 @@ static int connect_to_server()
  */
 static int exchange_metadata_with_server()
 {
-        /* First we need to register our source memory region, where
-         * the message is stored. We're allowing the server to read/write
-         * directly to it, so we need to open the access permissions.
-         * Registering this MR gives us the lkey/rkey, which we'll then
-         * use to satisfy the server's WR for the client metadata.
+        /* Populate the client send SGE with our metadata. When it fits in
+         * the QP's inline data the CPU copies it into the WQE, so it needs no
+         * registration at all. Otherwise register a client metadata MR.
          */
-        client_src_mr = ibv_reg_mr(
-                protection_domain, /* Client's PD */
-                src_buffer, /* Source message buffer we're registering */
-                strlen(src_buffer), /* Size of message buffer, in bytes */
-                (IBV_ACCESS_LOCAL_WRITE|
-	         IBV_ACCESS_REMOTE_READ|
-		 IBV_ACCESS_REMOTE_WRITE) /* Access flags for message */
-        );
-        if (!client_src_mr) {
-                fprintf(stderr, "Failed to register client_src_mr: %s\n",
-                        strerror(errno));
-		return -errno;
+	client_send_sge.addr = (uint64_t) &client_metadata;
+	client_send_sge.length = (uint32_t) sizeof(client_metadata);
+	client_send_sge.lkey = 0;
+        if (sizeof(client_metadata) > max_inline_data) {
+                client_metadata_mr = ibv_reg_mr(
+                        protection_domain, /* Client's PD */
+                        &client_metadata, /* Client's metadata buffer */
+                        sizeof(client_metadata), /* Size of client's metadata buffer */
+                        IBV_ACCESS_LOCAL_WRITE /* Only allow our RDMA device to write */
+                );
+                if (!client_metadata_mr) {
+                        fprintf(stderr, "Failed to register client_metadata_mr: %s\n",
+                                strerror(errno));
+                        return -errno;
+                }
+                printf("Registered client_metadata_mr:\n");
+                print_ibv_mr(client_metadata_mr, 1);
+                client_send_sge.lkey = client_metadata_mr->lkey;
         }
-        printf("Registered client_src_mr:\n");
-        print_ibv_mr(client_src_mr, 1);
-
-        /* Prepare the client metadata buffer with information about the MR we
-         * just registered above.
-         */
-	client_metadata.address = (uint64_t) client_src_mr->addr;
-	client_metadata.length = client_src_mr->length;
-	client_metadata.stag.local_stag = client_src_mr->lkey;
-        printf("Prepared client_metadata:\n");
-        print_rdma_buffer_attr(&client_metadata, 1);
-
-        /* Register client metadata MR */
-        client_metadata_mr = ibv_reg_mr(
-                protection_domain, /* Client's PD */
-                &client_metadata, /* Client's metadata buffer */
-                sizeof(client_metadata), /* Size of client's metadata buffer */
-                IBV_ACCESS_LOCAL_WRITE /* Only allow our RDMA device to write */
-        );
-	if (!client_metadata_mr) {
-		fprintf(stderr, "Failed to register client_metadata_mr: %s\n",
-                        strerror(errno));
-		return -errno;
-	}
-        printf("Registered client_metadata_mr:\n");
-        print_ibv_mr(client_metadata_mr, 1);
-
-        /* Populate the client send SGE with information about our metadata MR
-         */
-	client_send_sge.addr = (uint64_t) client_metadata_mr->addr;
-	client_send_sge.length = (uint32_t) client_metadata_mr->length;
-	client_send_sge.lkey = client_metadata_mr->lkey;
 
         /* Link to the send WR. This is a SEND operation, meaning it will
          * complete some RECV WR.
@@ -534,45 +1010,81 @@ static int exchange_metadata_with_server()
 	client_send_wr.sg_list = &client_send_sge;
 	client_send_wr.num_sge = 1;
 	client_send_wr.opcode = IBV_WR_SEND;
-	client_send_wr.send_flags = IBV_SEND_SIGNALED;
+	client_send_wr.send_flags = signaled_send_flags(IBV_WR_SEND,
+                                                        client_send_sge.length,
+                                                        max_inline_data);
 
         /* Post the send WR to the client QP, containing metadata information
          * that the server requested.
          */
-        int ret = ibv_post_send(
-                queue_pair,
-                &client_send_wr,
-                &bad_client_send_wr
-        );
+        int ret = post_client_send_wr("client metadata SEND");
         if (ret) {
-                fprintf(stderr, "Failed to send client metadata: %s\n",
-                        strerror(errno));
-		return -errno;
+		return ret;
         }
         printf("Successfully sent WR for client metadata\n");
 
         /* Process two WCs, one for our send, and one for receiving the
          * server's metadata that we pre-posted earlier.
          */
-        int expected_wc = 2;
-        struct ibv_wc work_completions[expected_wc];
-        ret = process_work_completion_event(
-                completion_channel,
-                work_completions,
-                expected_wc
-        );
-        if (ret != expected_wc) {
-                fprintf(stderr, "Failed to process %d Work Completions: ret=%d\n",
-                        expected_wc, ret);
+        ret = wait_for_outstanding_completions();
+        if (ret) {
 		return ret;
         }
-        printf("Got %d Work Completions\n", ret);
         printf("Now have server_metadata:\n");
         print_rdma_buffer_attr(&server_metadata, 1);
 
         return 0;
 }
 
+/*
+ * Writes the message fragments to the remote server's buffer, back to back,
+ * gathering them straight out of their buffers with one SGE each.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int client_write_fragments()
+{
+        struct rdma_iov iov[gather_fragments];
+
+        /* Pool buffers can be bigger than asked for, so take the
+         * fragments' own lengths
+         */
+        for (int i = 0; i < gather_fragments; i++) {
+                iov[i].base = fragment_pool_buffers[i]->addr;
+                iov[i].length = fragment_length(i);
+                iov[i].lkey = fragment_pool_buffers[i]->lkey;
+        }
+
+        memset(&client_send_wr, 0, sizeof(client_send_wr));
+        client_send_wr.opcode = write_imm ? IBV_WR_RDMA_WRITE_WITH_IMM :
+                                            IBV_WR_RDMA_WRITE;
+        client_send_wr.imm_data = htonl(message_len);
+        client_send_wr.send_flags = IBV_SEND_SIGNALED;
+        client_send_wr.wr.rdma.rkey = server_metadata.stag.remote_stag;
+        client_send_wr.wr.rdma.remote_addr = server_metadata.address;
+
+        const char *operation = write_imm ?
+                "gathered RDMA WRITE with immediate" : "gathered RDMA WRITE";
+        int ret = completion_table_register(&completion_table,
+                                            log_work_completion,
+                                            (void *) operation,
+                                            &client_send_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+        ret = post_send_iov(queue_pair, &client_send_wr, iov, gather_fragments,
+                            max_send_sge, max_inline_data);
+        if (ret) {
+                completion_table_cancel(&completion_table, client_send_wr.wr_id);
+                return ret;
+        }
+        printf("Gathered %lu bytes from %d fragments, %d per WR\n",
+               (unsigned long) rdma_iov_length(iov, gather_fragments),
+               gather_fragments, max_send_sge);
+
+        return wait_for_outstanding_completions();
+}
+
 /*
  * Writes the message from the client source buffer to the remote server's
  * buffer. Since we've already gotten the server metadata through the metadata
@@ -582,10 +1094,14 @@ static int client_write_message()
 {
         int ret = 0;
 
+        if (gather_fragments) {
+                return client_write_fragments();
+        }
+
         /* Populate send SGE with information about where we're writing from */
-	client_send_sge.addr = (uint64_t) client_src_mr->addr;
-	client_send_sge.length = client_src_mr->length;
-	client_send_sge.lkey = client_src_mr->lkey;
+	client_send_sge.addr = (uint64_t) src_pool_buffer->addr;
+	client_send_sge.length = message_len;
+	client_send_sge.lkey = src_pool_buffer->lkey;
 
         /* Fill out client send WR with SGE, this tells the RDMA device what
          * data we're sending. Set opcode to WRITE (instead of SEND like before)
@@ -597,39 +1113,31 @@ static int client_write_message()
 	client_send_wr.sg_list = &client_send_sge;
 	client_send_wr.num_sge = 1;
 	client_send_wr.opcode = IBV_WR_RDMA_WRITE;
-	client_send_wr.send_flags = IBV_SEND_SIGNALED;
 	client_send_wr.wr.rdma.rkey = server_metadata.stag.remote_stag;
 	client_send_wr.wr.rdma.remote_addr = server_metadata.address;
+
+        /* With an immediate, the WRITE also consumes a receive the server
+         * posted, which tells it the message has landed and how long it is.
+         */
+        if (write_imm) {
+                client_send_wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+                client_send_wr.imm_data = htonl(message_len);
+        }
+	client_send_wr.send_flags = signaled_send_flags(client_send_wr.opcode,
+                                                        message_len,
+                                                        max_inline_data);
         printf("Prepared client_send_wr for RDMA write:\n");
         print_ibv_send_wr(&client_send_wr, 1);
 
         /* Send WR, effectively writing our message to server's buffer */
-        ret = ibv_post_send(
-                queue_pair,
-		&client_send_wr,
-	        &bad_client_send_wr
-        );
+        ret = post_client_send_wr(write_imm ? "message RDMA WRITE with immediate" :
+                                              "message RDMA WRITE");
 	if (ret) {
-		fprintf(stderr, "Failed to write message to server: %s\n",
-                        strerror(errno));
-		return -errno;
+		return ret;
 	}
 
         /* Now, process WC for our write */
-        int expected_wc = 1;
-        struct ibv_wc work_completions[expected_wc];
-        ret = process_work_completion_event(
-                completion_channel,
-                work_completions,
-                expected_wc
-        );
-        if (ret != expected_wc) {
-                fprintf(stderr, "Failed to process %d Work Completions: ret=%d\n",
-                        expected_wc, ret);
-		return ret;
-        }
-        printf("Got %d Work Completions\n", ret);
-        return 0;
+        return wait_for_outstanding_completions();
 }
 
 /* Reads the message from the remote server's buffer to a destination buffer on
@@ -642,39 +1150,15 @@ static int client_read_message()
 {
         int ret = 0;
 
-        /* First, we need to allocate enough space to read the message back.
-         * (length of message + 1 for null terminator)
+        /* dst_buffer was taken from the pool during setup with enough space
+         * to read the message back (length of message + 1 for null
+         * terminator), so there is nothing to allocate or register here.
+         * Populate send SGE with information about where we're writing to.
          */
-        size_t buffer_size = strlen(src_buffer) + 1;
-        dst_buffer = calloc(buffer_size, 1);
-        if (!dst_buffer) {
-                fprintf(stderr, "Failed to allocate dst_buffer! -ENOMEM\n");
-                return -ENOMEM;
-        }
-
-        /* Register dst_buffer as MR */
-        client_dst_mr = ibv_reg_mr(
-                protection_domain,
-                dst_buffer,
-                buffer_size - 1,
-                (IBV_ACCESS_LOCAL_WRITE|
-                 IBV_ACCESS_REMOTE_WRITE|
-                 IBV_ACCESS_REMOTE_READ)
-        );
-        if (!client_dst_mr) {
-                fprintf(stderr, "Failed to register dst_buffer as MR: %s\n",
-                        strerror(errno));
-                return -errno;
-        }
-
-        printf("Registered dst_buffer Memory Region %p:\n", client_dst_mr);
-        print_ibv_mr(client_dst_mr, 1);
-
-        /* Populate send SGE with information about where we're writing to */
         memset(&client_send_sge, 0, sizeof(client_send_sge));
-	client_send_sge.addr = (uint64_t) client_dst_mr->addr;
-	client_send_sge.length = client_dst_mr->length;
-	client_send_sge.lkey = client_dst_mr->lkey;
+	client_send_sge.addr = (uint64_t) dst_pool_buffer->addr;
+	client_send_sge.length = message_len;
+	client_send_sge.lkey = dst_pool_buffer->lkey;
 
         /* Fill out client send WR with SGE, this tells the RDMA device what
          * data we're reading. Set opcode to READ because we're reading data
@@ -683,7 +1167,6 @@ static int client_read_message()
          * address and rkey.
          */
         memset(&client_send_wr, 0, sizeof(client_send_wr));
-        client_send_wr.wr_id += 1;
         client_send_wr.sg_list = &client_send_sge;
 	client_send_wr.num_sge = 1;
 	client_send_wr.opcode = IBV_WR_RDMA_READ;
@@ -694,67 +1177,2659 @@ static int client_read_message()
         print_ibv_send_wr(&client_send_wr, 1);
 
         /* Send WR, effectively reading the message from the server's buffer */
-        ret = ibv_post_send(
-                queue_pair,
-		&client_send_wr,
-	        &bad_client_send_wr
-        );
+        ret = post_client_send_wr("message RDMA READ");
 	if (ret) {
-		fprintf(stderr, "Failed to read message from server: %s\n",
-                        strerror(errno));
-		return -errno;
+		return ret;
 	}
 
-        /* Now, process WC for our write */
-        int expected_wc = 1;
-        struct ibv_wc work_completions[expected_wc];
-        ret = process_work_completion_event(
-                completion_channel,
-                work_completions,
-                expected_wc
-        );
-        if (ret != expected_wc) {
-                fprintf(stderr, "Failed to process %d Work Completions: ret=%d\n",
-                        expected_wc, ret);
-		return ret;
+        /* Now, process WC for our read */
+        ret = wait_for_outstanding_completions();
+        if (ret) {
+                return ret;
+        }
+
+        /* Make sure to null-terminate the dst buffer before printing it */
+        dst_buffer[message_len] = '\0';
+        printf("Client read complete. dst_buffer contents: '%s'\n", dst_buffer);
+        return ret;
+}
+
+/*
+ * Completion handler for benchmark WRs. Only failures are reported, anything
+ * else would drown out the measurements. The context carries how many send
+ * WRs the completion retires, which is more than one under selective
+ * signaling.
+ */
+static void check_benchmark_completion(struct ibv_wc *wc, void *context)
+{
+        if (wc->status != IBV_WC_SUCCESS) {
+                benchmark_failed = 1;
+        }
+        benchmark_retired += (uintptr_t) context;
+}
+
+/*
+ * Adds a benchmark send WR moving length bytes between the local buffer and,
+ * for RDMA operations, the server's buffer to the send batch, which posts it
+ * once full or flushed. A signaled WR's completion
+ * retires itself and the unsignaled WRs posted before it, retires in total.
+ * With retires 0 the WR is posted unsignaled and produces no WC.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int post_benchmark_send(enum ibv_wr_opcode opcode,
+                               struct rdma_pool_buffer *local, uint32_t length,
+                               unsigned long retires)
+{
+        client_send_sge.addr = (uint64_t) local->addr;
+        client_send_sge.length = length;
+        client_send_sge.lkey = local->lkey;
+        memset(&client_send_wr, 0, sizeof(client_send_wr));
+        client_send_wr.sg_list = &client_send_sge;
+        client_send_wr.num_sge = 1;
+        client_send_wr.opcode = opcode;
+        client_send_wr.send_flags = signaled_send_flags(opcode, length,
+                                                        max_inline_data);
+        client_send_wr.wr.rdma.rkey = server_metadata.stag.remote_stag;
+        client_send_wr.wr.rdma.remote_addr = server_metadata.address;
+
+        if (!retires) {
+                /* Only a failure would complete it, and that fails the run */
+                client_send_wr.send_flags &= ~IBV_SEND_SIGNALED;
+                client_send_wr.wr_id = UINT64_MAX;
+                return send_batch_add(&send_batch, &client_send_wr);
+        }
+
+        int ret = completion_table_register(&completion_table,
+                                            check_benchmark_completion,
+                                            (void *)(uintptr_t) retires,
+                                            &client_send_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+        /* A failed flush releases the wr_id itself */
+        return send_batch_add(&send_batch, &client_send_wr);
+}
+
+/*
+ * Posts a receive for the server's echo into the destination buffer.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int post_benchmark_recv(uint32_t length)
+{
+        server_recv_sge.addr = (uint64_t) dst_pool_buffer->addr;
+        server_recv_sge.length = length;
+        server_recv_sge.lkey = dst_pool_buffer->lkey;
+        memset(&server_recv_wr, 0, sizeof(server_recv_wr));
+        server_recv_wr.sg_list = &server_recv_sge;
+        server_recv_wr.num_sge = 1;
+
+        int ret = completion_table_register(&completion_table,
+                                            check_benchmark_completion, NULL,
+                                            &server_recv_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+        ret = ibv_post_recv(queue_pair, &server_recv_wr, &bad_server_recv_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to post echo receive: %s\n",
+                        strerror(ret));
+                completion_table_cancel(&completion_table, server_recv_wr.wr_id);
+                return -ret;
+        }
+        return 0;
+}
+
+/*
+ * Waits for every outstanding benchmark WR, quietly.
+ *
+ * Returns 0 if all completed successfully, a negative error code otherwise.
+ */
+static int reap_benchmark_completions()
+{
+        int expected_wc = completion_table.outstanding;
+        int ret = process_completions(completion_channel, completion_queue,
+                                      &completion_table, expected_wc);
+        if (ret < expected_wc || benchmark_failed) {
+                return ret < 0 ? ret : -EIO;
+        }
+        return 0;
+}
+
+/*
+ * One round trip of the latency benchmark. seq (1 to 255) is stamped into
+ * the last byte of every message, which is what the write ping-pong polls on.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int latency_round_trip(uint8_t seq, uint64_t *elapsed_nsec)
+{
+        volatile uint8_t *echo_last_byte = (uint8_t *) dst_buffer +
+                                           benchmark_size - 1;
+        uint64_t start = monotonic_nsec();
+        int ret = 0;
+
+        switch (latency_op) {
+                case BENCHMARK_OP_WRITE:
+                        src_buffer[benchmark_size - 1] = seq;
+                        ret = post_benchmark_send(IBV_WR_RDMA_WRITE,
+                                                  src_pool_buffer,
+                                                  benchmark_size, 1);
+                        if (ret) {
+                                return ret;
+                        }
+                        while (*echo_last_byte != seq) {
+                                /* Spin until the server's WRITE lands */
+                        }
+                        *elapsed_nsec = monotonic_nsec() - start;
+                        /* Our WRITE's own WC is reaped outside the measurement */
+                        return reap_benchmark_completions();
+                case BENCHMARK_OP_SEND:
+                        src_buffer[benchmark_size - 1] = seq;
+                        ret = post_benchmark_recv(benchmark_size);
+                        if (!ret) {
+                                ret = post_benchmark_send(IBV_WR_SEND,
+                                                          src_pool_buffer,
+                                                          benchmark_size, 1);
+                        }
+                        break;
+                case BENCHMARK_OP_READ:
+                        ret = post_benchmark_send(IBV_WR_RDMA_READ,
+                                                  dst_pool_buffer,
+                                                  benchmark_size, 1);
+                        break;
+                default:
+                        return -EINVAL;
+        }
+        if (!ret) {
+                ret = reap_benchmark_completions();
+        }
+        *elapsed_nsec = monotonic_nsec() - start;
+        return ret;
+}
+
+/*
+ * Runs latency_warmup + benchmark_iterations round trips of latency_op against
+ * a server started with the same --latency operation, and prints the latency
+ * distribution of the measured (non-warmup) iterations.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int run_latency_benchmark()
+{
+        struct latency_histogram histogram;
+        uint64_t elapsed_nsec = 0;
+
+        int ret = latency_histogram_init(&histogram,
+                                         DEFAULT_HISTOGRAM_PRECISION_BITS);
+        if (ret) {
+                return ret;
+        }
+
+        printf("Running %s latency benchmark: %lu iterations (+%lu warmup) of %u bytes\n",
+               benchmark_op_str(latency_op), benchmark_iterations, latency_warmup,
+               benchmark_size);
+        for (unsigned long i = 0; i < latency_warmup + benchmark_iterations; i++) {
+                ret = latency_round_trip(i % 255 + 1, &elapsed_nsec);
+                if (ret) {
+                        fprintf(stderr, "Round trip %lu failed: %d\n", i, ret);
+                        break;
+                }
+                if (i >= latency_warmup) {
+                        latency_histogram_record(&histogram, elapsed_nsec);
+                }
+        }
+
+        enum ibv_wr_opcode opcode = latency_op == BENCHMARK_OP_SEND ?
+                                    IBV_WR_SEND : IBV_WR_RDMA_WRITE;
+        int inlined = latency_op != BENCHMARK_OP_READ &&
+                      (signaled_send_flags(opcode, benchmark_size,
+                                           max_inline_data) & IBV_SEND_INLINE);
+        printf("%s latency, %u bytes, completion mode %s, inline %s:\n",
+               benchmark_op_str(latency_op), benchmark_size,
+               completion_mode_str(get_completion_mode()),
+               inlined ? "yes" : "no");
+        print_latency_histogram(&histogram, 1);
+        latency_histogram_destroy(&histogram);
+        return ret;
+}
+
+/*
+ * Pushes benchmark_iterations operations of size bytes through the QP,
+ * keeping up to queue_depth of them in flight, and measures the throughput.
+ * Only every signal_interval-th WR, and the last one, is signaled. Each of
+ * their completions frees the send queue slots of every WR before it.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int measure_bandwidth(uint32_t size)
+{
+        enum ibv_wr_opcode opcode = IBV_WR_RDMA_WRITE;
+        struct rdma_pool_buffer *local = src_pool_buffer;
+        unsigned long posted = 0, unsignaled = 0;
+        int ret = 0;
+
+        if (bandwidth_op == BENCHMARK_OP_SEND) {
+                opcode = IBV_WR_SEND;
+        } else if (bandwidth_op == BENCHMARK_OP_READ) {
+                opcode = IBV_WR_RDMA_READ;
+                local = dst_pool_buffer;
+        }
+
+        benchmark_retired = 0;
+        uint64_t start = monotonic_nsec();
+        while (benchmark_retired < benchmark_iterations) {
+                /* Top the send queue back up to queue_depth */
+                while (posted < benchmark_iterations &&
+                       posted - benchmark_retired < (unsigned long) queue_depth) {
+                        unsignaled++;
+                        posted++;
+                        int signaled = unsignaled == (unsigned long) signal_interval ||
+                                       posted == benchmark_iterations;
+                        ret = post_benchmark_send(opcode, local, size,
+                                                  signaled ? unsignaled : 0);
+                        if (ret) {
+                                return ret;
+                        }
+                        if (signaled) {
+                                unsignaled = 0;
+                        }
+                }
+                /* Post whatever is left before waiting on it */
+                ret = send_batch_flush(&send_batch);
+                if (ret) {
+                        return ret;
+                }
+
+                ret = process_completions(completion_channel, completion_queue,
+                                          &completion_table, 1);
+                if (ret < 0 || benchmark_failed) {
+                        fprintf(stderr, "Bandwidth benchmark failed at %lu operations\n",
+                                benchmark_retired);
+                        return ret < 0 ? ret : -EIO;
+                }
+        }
+        double seconds = (monotonic_nsec() - start) / 1e9;
+
+        int inlined = signaled_send_flags(opcode, size, max_inline_data) &
+                      IBV_SEND_INLINE;
+        printf(" %10u %12lu %12.2f %12.3f %8s\n", size, benchmark_iterations,
+               (double) size * benchmark_iterations * 8 / seconds / 1e9,
+               benchmark_iterations / seconds / 1e6, inlined ? "yes" : "no");
+        return 0;
+}
+
+/*
+ * Runs bandwidth_op at benchmark_size, or with --all-sizes at every power of
+ * two from SWEEP_MIN_SIZE up to benchmark_size, against a server started
+ * with the same --bandwidth operation.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int run_bandwidth_benchmark()
+{
+        uint32_t size = sweep_sizes ? SWEEP_MIN_SIZE : benchmark_size;
+        int ret = 0;
+
+        printf("Running %s bandwidth benchmark, queue depth %d, signaling every %d WRs, posting up to %d WRs per doorbell, completion mode %s, inline up to %u bytes:\n",
+               benchmark_op_str(bandwidth_op), queue_depth, signal_interval,
+               post_batch_size, completion_mode_str(get_completion_mode()),
+               max_inline_data);
+        printf(" %10s %12s %12s %12s %8s\n", "bytes", "iterations", "Gb/s",
+               "Mops/s", "inline");
+        for (; size <= benchmark_size; size *= 2) {
+                ret = measure_bandwidth(size);
+                if (ret || !sweep_sizes) {
+                        break;
+                }
+        }
+        printf("Posted %lu WRs with %lu doorbells\n", send_batch.posted,
+               send_batch.flushes);
+        return ret;
+}
+
+/*
+ * Adds a ring WR to the send batch: an RDMA WRITE of span from our local ring
+ * to the server's, or with span NULL, an RDMA READ of the server's ring
+ * control block into our credit buffer.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int post_ring_wr(const struct ring_span *span)
+{
+        memset(&client_send_wr, 0, sizeof(client_send_wr));
+        if (span) {
+                client_send_sge.addr = (uint64_t) src_pool_buffer->addr +
+                                       span->offset;
+                client_send_sge.length = span->length;
+                client_send_sge.lkey = src_pool_buffer->lkey;
+                client_send_wr.opcode = IBV_WR_RDMA_WRITE;
+                client_send_wr.wr.rdma.remote_addr = server_metadata.address +
+                                                     span->offset;
+        } else {
+                client_send_sge.addr = (uint64_t) credit_pool_buffer->addr;
+                client_send_sge.length = sizeof(uint64_t);
+                client_send_sge.lkey = credit_pool_buffer->lkey;
+                client_send_wr.opcode = IBV_WR_RDMA_READ;
+                client_send_wr.wr.rdma.remote_addr = server_metadata.address +
+                        offsetof(struct ring_control, consumer_index);
+        }
+        client_send_wr.sg_list = &client_send_sge;
+        client_send_wr.num_sge = 1;
+        client_send_wr.send_flags = signaled_send_flags(client_send_wr.opcode,
+                                                        client_send_sge.length,
+                                                        max_inline_data);
+        client_send_wr.wr.rdma.rkey = server_metadata.stag.remote_stag;
+
+        int ret = completion_table_register(&completion_table,
+                                            check_benchmark_completion,
+                                            (void *)(uintptr_t) 1,
+                                            &client_send_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+        return send_batch_add(&send_batch, &client_send_wr);
+}
+
+/*
+ * Posts whatever is batched and reaps completions until at most max_inflight
+ * of the posted ring WRs are still outstanding.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int reap_ring_wrs(unsigned long posted, unsigned long max_inflight)
+{
+        int ret = send_batch_flush(&send_batch);
+        if (ret) {
+                return ret;
+        }
+        while (posted - benchmark_retired > max_inflight) {
+                ret = process_completions(completion_channel, completion_queue,
+                                          &completion_table, 1);
+                if (ret < 0 || benchmark_failed) {
+                        fprintf(stderr, "Ring WR failed after %lu WRs\n",
+                                benchmark_retired);
+                        return ret < 0 ? ret : -EIO;
+                }
+        }
+        return 0;
+}
+
+/*
+ * Takes whatever consumer index the server last pushed into the credit
+ * buffer.
+ */
+static void take_pushed_credits(struct ring_producer *producer)
+{
+        uint64_t *credits = credit_pool_buffer->addr;
+        ring_producer_update_tail(producer,
+                                  __atomic_load_n(credits, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Pulls the server's current consumer index with an RDMA READ, for when the
+ * pushed credits don't leave room for the next frame.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int pull_ring_credits(struct ring_producer *producer,
+                             unsigned long *posted)
+{
+        int ret = post_ring_wr(NULL);
+        if (ret) {
+                return ret;
+        }
+        (*posted)++;
+        credit_reads++;
+
+        /* The READ completes behind every WRITE posted before it */
+        ret = reap_ring_wrs(*posted, 0);
+        if (ret) {
+                return ret;
+        }
+        take_pushed_credits(producer);
+        return 0;
+}
+
+/*
+ * Streams benchmark_iterations messages through the server's ring, keeping up
+ * to queue_depth WRITEs in flight, then waits for the server to consume all
+ * of them and reports the rate.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int run_ring_stream()
+{
+        struct ring_producer producer;
+        struct ring_span spans[2];
+        unsigned long posted = 0;
+        int ret = 0;
+
+        /* Without -m, stream filler out of the otherwise unused dst_buffer */
+        if (!ring_payload) {
+                memset(dst_buffer, 'x', ring_payload_len);
+                ring_payload = dst_buffer;
+        }
+        ring_producer_init(&producer, src_pool_buffer->addr, ring_size);
+        printf("Streaming %lu messages of %u bytes through a %lu byte ring, queue depth %d\n",
+               benchmark_iterations, ring_payload_len, (unsigned long) ring_size,
+               queue_depth);
+
+        benchmark_retired = 0;
+        uint64_t start = monotonic_nsec();
+        for (unsigned long i = 0; i < benchmark_iterations;) {
+                take_pushed_credits(&producer);
+                int count = ring_producer_append(&producer, ring_payload,
+                                                 ring_payload_len, spans);
+                if (count == -EAGAIN) {
+                        ret = pull_ring_credits(&producer, &posted);
+                        if (ret) {
+                                return ret;
+                        }
+                        continue;
+                }
+                if (count < 0) {
+                        fprintf(stderr, "Failed to append message %lu: %d\n",
+                                i, count);
+                        return count;
+                }
+
+                for (int span = 0; span < count; span++) {
+                        ret = post_ring_wr(&spans[span]);
+                        if (ret) {
+                                return ret;
+                        }
+                        posted++;
+                }
+                i++;
+
+                if (posted - benchmark_retired >= (unsigned long) queue_depth) {
+                        ret = reap_ring_wrs(posted, queue_depth - 1);
+                        if (ret) {
+                                return ret;
+                        }
+                }
+        }
+
+        /* Done once the server has consumed every frame */
+        ret = reap_ring_wrs(posted, 0);
+        while (!ret && producer.tail < producer.head) {
+                take_pushed_credits(&producer);
+                if (producer.tail < producer.head) {
+                        ret = pull_ring_credits(&producer, &posted);
+                }
+        }
+        if (ret) {
+                return ret;
+        }
+        double seconds = (monotonic_nsec() - start) / 1e9;
+
+        printf("Streamed %lu messages in %.3f s: %.3f Mmsgs/s, %.2f Gb/s of payload, %lu credit READs\n",
+               benchmark_iterations, seconds,
+               benchmark_iterations / seconds / 1e6,
+               (double) ring_payload_len * benchmark_iterations * 8 / seconds / 1e9,
+               credit_reads);
+        return 0;
+}
+
+static int post_credit_recv(struct ibv_recv_wr *recv_wr);
+
+/*
+ * Completion handler for a credit message from the server. Its immediate is
+ * the number of receives granted. The receive is re-posted right away and
+ * handed back to the server with our next SEND.
+ */
+static void on_credit_message(struct ibv_wc *wc, void *context)
+{
+        if (wc->status != IBV_WC_SUCCESS ||
+            wc->opcode != IBV_WC_RECV || !(wc->wc_flags & IBV_WC_WITH_IMM)) {
+                benchmark_failed = 1;
+                return;
+        }
+        send_credits += ntohl(wc->imm_data);
+        credit_messages++;
+        if (post_credit_recv(context)) {
+                benchmark_failed = 1;
+                return;
+        }
+        credit_recvs_reposted++;
+}
+
+/*
+ * Posts a zero-length receive for a credit message.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int post_credit_recv(struct ibv_recv_wr *recv_wr)
+{
+        struct ibv_recv_wr *bad_recv_wr = NULL;
+
+        memset(recv_wr, 0, sizeof(*recv_wr));
+        int ret = completion_table_register(&completion_table,
+                                            on_credit_message, recv_wr,
+                                            &recv_wr->wr_id);
+        if (ret) {
+                return ret;
+        }
+        ret = ibv_post_recv(queue_pair, recv_wr, &bad_recv_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to post credit receive: %s\n",
+                        strerror(ret));
+                completion_table_cancel(&completion_table, recv_wr->wr_id);
+                return -ret;
+        }
+        return 0;
+}
+
+/*
+ * Posts the credit message receives. They queue up behind the server metadata
+ * receive, so the metadata SEND still lands where it should.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int post_credit_recvs()
+{
+        for (int i = 0; i < CREDIT_RECV_DEPTH; i++) {
+                int ret = post_credit_recv(&credit_recv_wrs[i]);
+                if (ret) {
+                        return ret;
+                }
+        }
+        return 0;
+}
+
+/*
+ * Adds a SEND of the length bytes at payload, registered under lkey, to the
+ * send batch, spending one credit. Its immediate returns the credit message
+ * receives we've re-posted since the last one.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int post_credit_send(const void *payload, uint32_t length, uint32_t lkey)
+{
+        client_send_sge.addr = (uint64_t) payload;
+        client_send_sge.length = length;
+        client_send_sge.lkey = lkey;
+        memset(&client_send_wr, 0, sizeof(client_send_wr));
+        client_send_wr.sg_list = &client_send_sge;
+        client_send_wr.num_sge = 1;
+        client_send_wr.opcode = IBV_WR_SEND_WITH_IMM;
+        client_send_wr.send_flags = signaled_send_flags(IBV_WR_SEND_WITH_IMM,
+                                                        length,
+                                                        max_inline_data);
+        client_send_wr.imm_data = htonl(credit_recvs_reposted);
+
+        int ret = completion_table_register(&completion_table,
+                                            check_benchmark_completion,
+                                            (void *)(uintptr_t) 1,
+                                            &client_send_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+        ret = send_batch_add(&send_batch, &client_send_wr);
+        if (ret) {
+                return ret;
+        }
+        credit_recvs_reposted = 0;
+        send_credits--;
+        return 0;
+}
+
+/*
+ * SENDs benchmark_iterations messages, keeping up to queue_depth in flight
+ * but never more than the server has granted credits for, and reports the
+ * rate and how often we ran out of credits.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int run_credit_stream()
+{
+        unsigned long posted = 0;
+        int stalled = 0;
+        int ret = 0;
+
+        printf("Streaming %lu messages of %lu bytes with credit-based flow control, queue depth %d\n",
+               benchmark_iterations, (unsigned long) message_len, queue_depth);
+
+        benchmark_retired = 0;
+        uint64_t start = monotonic_nsec();
+        while (posted < benchmark_iterations || benchmark_retired < posted) {
+                if (posted < benchmark_iterations && send_credits &&
+                    posted - benchmark_retired < (unsigned long) queue_depth) {
+                        ret = post_credit_send(src_pool_buffer->addr,
+                                               message_len,
+                                               src_pool_buffer->lkey);
+                        if (ret) {
+                                return ret;
+                        }
+                        posted++;
+                        stalled = 0;
+                        continue;
+                }
+                if (posted < benchmark_iterations && !send_credits && !stalled) {
+                        credit_stalls++;
+                        stalled = 1;
+                }
+
+                /* Out of credits or window, wait for the server */
+                ret = send_batch_flush(&send_batch);
+                if (ret) {
+                        return ret;
+                }
+                ret = process_completions(completion_channel, completion_queue,
+                                          &completion_table, 1);
+                if (ret < 0 || benchmark_failed) {
+                        fprintf(stderr, "Credit stream failed after %lu messages\n",
+                                benchmark_retired);
+                        return ret < 0 ? ret : -EIO;
+                }
+        }
+        double seconds = (monotonic_nsec() - start) / 1e9;
+
+        printf("Sent %lu messages in %.3f s: %.3f Mmsgs/s, %.2f Gb/s, %lu credit messages, %lu credit stalls\n",
+               benchmark_iterations, seconds,
+               benchmark_iterations / seconds / 1e6,
+               (double) message_len * benchmark_iterations * 8 / seconds / 1e9,
+               credit_messages, credit_stalls);
+        return 0;
+}
+
+/* --- Session ---
+ *
+ * With --session, the client keeps its one connection for every message it
+ * has to send: the address and route resolution, QP creation, memory
+ * registration and metadata exchange are paid once rather than per message.
+ * Messages are the lines of a file or stdin, or benchmark_iterations
+ * generated ones of benchmark_size bytes, and travel as a credit stream, so
+ * the server serves the connection until we disconnect.
+ */
+
+/*
+ * Opens the session's message source.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int open_session_source()
+{
+        if (!strcmp(session_source, SESSION_SOURCE_GENERATE)) {
+                return 0;
+        }
+        if (!strcmp(session_source, SESSION_SOURCE_STDIN)) {
+                session_file = stdin;
+                return 0;
+        }
+        session_file = fopen(session_source, "r");
+        if (!session_file) {
+                fprintf(stderr, "Failed to open session messages %s: %s\n",
+                        session_source, strerror(errno));
+                return -errno;
+        }
+        return 0;
+}
+
+/*
+ * Fills slot, which has room for message_len bytes, with the session's
+ * next message. Empty lines are skipped and the newline is dropped.
+ *
+ * Returns the message length, 0 once the source is exhausted, or a negative
+ * error code.
+ */
+static int next_session_message(char *slot, unsigned long sent)
+{
+        if (!session_file) {
+                if (sent == benchmark_iterations) {
+                        return 0;
+                }
+                snprintf(slot, message_len, "message %lu ", sent);
+                size_t length = strlen(slot);
+                memset(slot + length, 'x', message_len - length);
+                return message_len;
+        }
+
+        ssize_t length;
+        do {
+                length = getline(&session_line, &session_line_size,
+                                 session_file);
+                if (length < 0) {
+                        return ferror(session_file) ? -EIO : 0;
+                }
+                if (length && session_line[length - 1] == '\n') {
+                        length--;
+                }
+        } while (!length);
+
+        if ((size_t) length > message_len) {
+                fprintf(stderr, "Session message %lu is %ld bytes, more than --size %lu\n",
+                        sent, (long) length, (unsigned long) message_len);
+                return -EMSGSIZE;
+        }
+        memcpy(slot, session_line, length);
+        return length;
+}
+
+/*
+ * SENDs every message of the session, up to queue_depth at a time and
+ * within the credits the server has granted, then reports the rate.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int run_session()
+{
+        unsigned long posted = 0;
+        uint64_t bytes = 0;
+        int exhausted = 0;
+        int ret = 0;
+
+        session_pool_buffer = rdma_pool_alloc(buffer_pool,
+                                              (uint64_t) message_len * queue_depth);
+        if (!session_pool_buffer) {
+                fprintf(stderr, "Failed to allocate session buffer from pool\n");
+                return -ENOMEM;
+        }
+        printf("Session sending messages of up to %lu bytes from %s, queue depth %d\n",
+               (unsigned long) message_len, session_source, queue_depth);
+
+        benchmark_retired = 0;
+        uint64_t start = monotonic_nsec();
+        while (!exhausted || benchmark_retired < posted) {
+                if (!exhausted && send_credits &&
+                    posted - benchmark_retired < (unsigned long) queue_depth) {
+                        /* Completions retire in order, so the oldest slot
+                         * is free once the window has room
+                         */
+                        char *slot = (char *) session_pool_buffer->addr +
+                                     (posted % queue_depth) * message_len;
+
+                        /* Reading stdin may block, don't hold back what's
+                         * already been read
+                         */
+                        if (session_file == stdin) {
+                                ret = send_batch_flush(&send_batch);
+                                if (ret) {
+                                        return ret;
+                                }
+                        }
+                        ret = next_session_message(slot, posted);
+                        if (ret < 0) {
+                                return ret;
+                        }
+                        if (!ret) {
+                                exhausted = 1;
+                                continue;
+                        }
+                        bytes += ret;
+                        ret = post_credit_send(slot, ret,
+                                               session_pool_buffer->lkey);
+                        if (ret) {
+                                return ret;
+                        }
+                        posted++;
+                        continue;
+                }
+
+                ret = send_batch_flush(&send_batch);
+                if (ret) {
+                        return ret;
+                }
+                ret = process_completions(completion_channel, completion_queue,
+                                          &completion_table, 1);
+                if (ret < 0 || benchmark_failed) {
+                        fprintf(stderr, "Session failed after %lu messages\n",
+                                benchmark_retired);
+                        return ret < 0 ? ret : -EIO;
+                }
+        }
+        double seconds = (monotonic_nsec() - start) / 1e9;
+
+        printf("Session sent %lu messages, %lu bytes in %.3f s over one connection, %lu credit messages\n",
+               posted, (unsigned long) bytes, seconds, credit_messages);
+        return 0;
+}
+
+/* --- File transfer ---
+ *
+ * With --file, the file is read a chunk at a time into registered chunk
+ * buffers, and each chunk goes out as a WRITE with immediate into the next of
+ * the server's chunk slots, whose number the server advertises through its
+ * buffer length. The immediate holds the chunk length. Up to queue_depth chunks are in flight, so the next
+ * chunks are being read and transferred while the server writes out the
+ * earlier ones. A slot comes back once the server says it has written out its
+ * chunk, a local buffer once its WRITE has completed.
+ */
+
+/*
+ * Reads length bytes of the file at offset into buffer.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int read_file_chunk(char *buffer, uint32_t length, uint64_t offset)
+{
+        for (uint32_t done = 0; done < length; ) {
+                ssize_t n = pread(file_fd, buffer + done, length - done,
+                                  offset + done);
+                if (n <= 0) {
+                        fprintf(stderr, "Failed to read %s at %lu: %s\n",
+                                file_input, (unsigned long) (offset + done),
+                                n ? strerror(errno) : "unexpected end of file");
+                        return n ? -errno : -EIO;
+                }
+                done += n;
+        }
+        return 0;
+}
+
+/*
+ * Adds the WRITE with immediate of a chunk from local into the server's slot
+ * to the send batch.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int post_chunk_write(const char *local, uint32_t length, uint64_t slot)
+{
+        client_send_sge.addr = (uint64_t) local;
+        client_send_sge.length = length;
+        client_send_sge.lkey = chunk_pool_buffer->lkey;
+        memset(&client_send_wr, 0, sizeof(client_send_wr));
+        client_send_wr.sg_list = &client_send_sge;
+        client_send_wr.num_sge = length ? 1 : 0;
+        client_send_wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+        client_send_wr.send_flags = signaled_send_flags(IBV_WR_RDMA_WRITE_WITH_IMM,
+                                                        length, max_inline_data);
+        client_send_wr.imm_data = htonl(length);
+        client_send_wr.wr.rdma.rkey = server_metadata.stag.remote_stag;
+        client_send_wr.wr.rdma.remote_addr = server_metadata.address +
+                                             slot * message_len;
+
+        int ret = completion_table_register(&completion_table,
+                                            check_benchmark_completion,
+                                            (void *)(uintptr_t) 1,
+                                            &client_send_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+        return send_batch_add(&send_batch, &client_send_wr);
+}
+
+/*
+ * Returns the number of chunks the server has written out.
+ */
+static uint64_t chunks_acked()
+{
+        return __atomic_load_n((uint64_t *) credit_pool_buffer->addr,
+                               __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Streams the file to the server and waits for it to be written out, then
+ * reports the throughput.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int run_file_transfer()
+{
+        struct stat file_stat;
+        uint32_t chunk_size = message_len;
+        uint64_t posted = 0;
+        int ret = 0;
+
+        if (fstat(file_fd, &file_stat)) {
+                fprintf(stderr, "Failed to stat %s: %s\n", file_input,
+                        strerror(errno));
+                return -errno;
+        }
+        uint64_t file_size = file_stat.st_size;
+        uint64_t chunks = (file_size + chunk_size - 1) / chunk_size;
+        uint64_t slots = server_metadata.length / chunk_size;
+        if (!slots) {
+                fprintf(stderr, "Server has no room for a %u byte chunk\n",
+                        chunk_size);
+                return -EINVAL;
+        }
+        uint64_t window = slots < (uint64_t) queue_depth ?
+                          slots : (uint64_t) queue_depth;
+        if (window * chunk_size > UINT32_MAX) {
+                fprintf(stderr, "%lu chunk buffers of %u bytes exceed %u bytes\n",
+                        (unsigned long) window, chunk_size, UINT32_MAX);
+                return -EINVAL;
+        }
+        chunk_pool_buffer = rdma_pool_alloc(buffer_pool, window * chunk_size);
+        if (!chunk_pool_buffer) {
+                fprintf(stderr, "Failed to allocate chunk buffers from pool\n");
+                return -ENOMEM;
+        }
+        printf("Sending %s, %lu bytes in %lu chunks of %u bytes, %lu in flight over %lu server slots\n",
+               file_input, (unsigned long) file_size, (unsigned long) chunks,
+               chunk_size, (unsigned long) window, (unsigned long) slots);
+
+        benchmark_retired = 0;
+        uint64_t start = monotonic_nsec();
+        while (posted < chunks || benchmark_retired < posted ||
+               chunks_acked() < chunks) {
+                if (posted < chunks && posted - benchmark_retired < window &&
+                    posted - chunks_acked() < slots) {
+                        char *local = (char *) chunk_pool_buffer->addr +
+                                      (posted % window) * chunk_size;
+                        uint64_t offset = posted * chunk_size;
+                        uint32_t length = file_size - offset < chunk_size ?
+                                          file_size - offset : chunk_size;
+                        ret = read_file_chunk(local, length, offset);
+                        if (ret) {
+                                return ret;
+                        }
+                        ret = post_chunk_write(local, length, posted % slots);
+                        if (ret) {
+                                return ret;
+                        }
+                        posted++;
+                        continue;
+                }
+
+                ret = send_batch_flush(&send_batch);
+                if (ret) {
+                        return ret;
+                }
+                /* Block for our own WRITEs, spin for the server's progress */
+                if (benchmark_retired < posted &&
+                    (posted == chunks || posted - benchmark_retired >= window)) {
+                        ret = process_completions(completion_channel,
+                                                  completion_queue,
+                                                  &completion_table, 1);
+                } else {
+                        ret = drain_completion_queue(completion_queue,
+                                                     &completion_table);
+                }
+                if (ret < 0 || benchmark_failed) {
+                        fprintf(stderr, "File transfer failed after %lu chunks\n",
+                                (unsigned long) chunks_acked());
+                        return ret < 0 ? ret : -EIO;
+                }
+        }
+        double seconds = (monotonic_nsec() - start) / 1e9;
+
+        printf("Sent %lu bytes in %.3f s: %.2f MB/s, %.2f Gb/s\n",
+               (unsigned long) file_size, seconds,
+               seconds > 0 ? file_size / seconds / 1e6 : 0,
+               seconds > 0 ? file_size * 8 / seconds / 1e9 : 0);
+        return 0;
+}
+
+/* --- Registration benchmark --- */
+
+/*
+ * READs the server's buffer into local and waits for it.
+ *
+ * Returns the microseconds it took if successful, a negative error code
+ * otherwise.
+ */
+static double timed_read(struct rdma_pool_buffer *local)
+{
+        struct timespec start;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int ret = post_benchmark_send(IBV_WR_RDMA_READ, local, local->length, 1);
+        if (!ret) {
+                ret = send_batch_flush(&send_batch);
+        }
+        if (!ret) {
+                ret = reap_benchmark_completions();
+        }
+        return ret ? ret : elapsed_usec(&start);
+}
+
+/*
+ * Runs the registration benchmark in every mode, on a fresh buffer each
+ * time, and prints a row per mode.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int run_registration_bench()
+{
+        enum registration_mode selected = get_registration_mode();
+        int ret = 0;
+
+        printf("Registration costs of a %u byte buffer, steady state averaged over %d READs:\n",
+               benchmark_size, REGISTRATION_BENCH_READS);
+        printf("%-10s %-10s %14s %14s %14s %14s\n", "mode", "granted",
+               "register us", "first READ us", "steady READ us",
+               "deregister us");
+
+        for (enum registration_mode mode = REGISTRATION_PINNED;
+             mode <= REGISTRATION_IMPLICIT_ODP && !ret; mode++) {
+                enum registration_mode granted;
+                struct rdma_pool_buffer local;
+                struct timespec start;
+
+                memset(&local, 0, sizeof(local));
+                local.addr = alloc_rdma_memory(benchmark_size);
+                if (!local.addr) {
+                        ret = -ENOMEM;
+                        break;
+                }
+                local.length = benchmark_size;
+
+                set_registration_mode(mode);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                struct ibv_mr *mr = register_rdma_memory(protection_domain,
+                                                         local.addr,
+                                                         benchmark_size,
+                                                         IBV_ACCESS_LOCAL_WRITE,
+                                                         &granted);
+                double register_usec = elapsed_usec(&start);
+                if (!mr) {
+                        fprintf(stderr, "Failed to register benchmark buffer: %s\n",
+                                strerror(errno));
+                        free_rdma_memory(local.addr);
+                        ret = -errno;
+                        break;
+                }
+                local.lkey = mr->lkey;
+
+                double first_usec = timed_read(&local);
+                double steady_usec = 0;
+                for (int i = 0; i < REGISTRATION_BENCH_READS && first_usec >= 0; i++) {
+                        double usec = timed_read(&local);
+                        if (usec < 0) {
+                                first_usec = usec;
+                                break;
+                        }
+                        steady_usec += usec;
+                }
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                deregister_rdma_memory(mr);
+                double deregister_usec = elapsed_usec(&start);
+                free_rdma_memory(local.addr);
+
+                if (first_usec < 0) {
+                        fprintf(stderr, "Registration benchmark READ failed in %s mode\n",
+                                registration_mode_str(mode));
+                        ret = (int) first_usec;
+                        break;
+                }
+                printf("%-10s %-10s %14.1f %14.1f %14.1f %14.1f\n",
+                       registration_mode_str(mode),
+                       registration_mode_str(granted), register_usec,
+                       first_usec, steady_usec / REGISTRATION_BENCH_READS,
+                       deregister_usec);
+        }
+
+        set_registration_mode(selected);
+        return ret;
+}
+
+/* --- Atomic counters ---
+ *
+ * With --atomic, the server (run with -A) advertises an array of 64-bit
+ * counters instead of a buffer. FETCH_AND_ADD and COMPARE_AND_SWAP execute on
+ * the server's HCA, which serializes them against every other client's, so
+ * a counter hands out unique, increasing numbers without the server's CPU
+ * taking part. FETCH_AND_ADD always succeeds and is pipelined.
+ * COMPARE_AND_SWAP only increments the counter if it still holds the value
+ * last seen, and has to be retried with the value it returned otherwise, so
+ * contention shows up as retries.
+ *
+ * With -X lock, the server (run with -l) advertises lock words instead (see
+ * rdma_lock.h), and COMPARE_AND_SWAP takes and drops locks on them. A client
+ * that finds a lock held in a conflicting mode backs off for a random time
+ * that doubles with every attempt, and takes over a lock whose lease ran out.
+ */
+
+/*
+ * What a forked atomic client reports back to the parent through its pipe.
+ */
+struct atomic_result {
+        unsigned long ops;
+        unsigned long retries;
+        unsigned long backoffs; /* Lock found held */
+        unsigned long recoveries; /* Lock taken over from an expired lease */
+        unsigned long lost; /* Lock taken over from us before we released it */
+        uint64_t nsec;
+        int status;
+};
+
+static int parse_atomic_op(const char *str, enum atomic_op *op)
+{
+        if (strcmp(str, "faa") == 0) {
+                *op = ATOMIC_OP_FETCH_ADD;
+        } else if (strcmp(str, "cas") == 0) {
+                *op = ATOMIC_OP_CMP_SWAP;
+        } else if (strcmp(str, "lock") == 0) {
+                *op = ATOMIC_OP_LOCK;
+        } else {
+                fprintf(stderr, "Unknown atomic operation '%s'\n", str);
+                return -EINVAL;
+        }
+        return 0;
+}
+
+/*
+ * Completion handler for an atomic WR. The context is the result slot the
+ * counter's old value landed in. Successive FETCH_AND_ADDs of one client
+ * execute in order, so each must return more than the one before it.
+ */
+static void on_atomic_completion(struct ibv_wc *wc, void *context)
+{
+        uint64_t value = *(volatile uint64_t *) context;
+
+        if (wc->status != IBV_WC_SUCCESS) {
+                benchmark_failed = 1;
+        } else {
+                if (atomic_op == ATOMIC_OP_FETCH_ADD && benchmark_retired &&
+                    value <= atomic_fetched) {
+                        atomic_unordered++;
+                }
+                atomic_fetched = value;
+        }
+        benchmark_retired++;
+}
+
+/*
+ * Adds an atomic WR on the counter at remote_addr to the send batch, with its
+ * result going to slot.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int post_atomic(enum ibv_wr_opcode opcode, uint64_t remote_addr,
+                       uint64_t *slot, uint64_t compare_add, uint64_t swap)
+{
+        client_send_sge.addr = (uint64_t) slot;
+        client_send_sge.length = sizeof(*slot);
+        client_send_sge.lkey = atomic_pool_buffer->lkey;
+        memset(&client_send_wr, 0, sizeof(client_send_wr));
+        client_send_wr.sg_list = &client_send_sge;
+        client_send_wr.num_sge = 1;
+        client_send_wr.opcode = opcode;
+        client_send_wr.send_flags = IBV_SEND_SIGNALED;
+        client_send_wr.wr.atomic.remote_addr = remote_addr;
+        client_send_wr.wr.atomic.rkey = server_metadata.stag.remote_stag;
+        client_send_wr.wr.atomic.compare_add = compare_add;
+        client_send_wr.wr.atomic.swap = swap;
+
+        int ret = completion_table_register(&completion_table,
+                                            on_atomic_completion, slot,
+                                            &client_send_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+        return send_batch_add(&send_batch, &client_send_wr);
+}
+
+/*
+ * FETCH_AND_ADDs 1 to the counter at remote_addr benchmark_iterations times,
+ * keeping up to queue_depth in flight.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int run_fetch_add(uint64_t remote_addr)
+{
+        uint64_t *slots = atomic_pool_buffer->addr;
+        unsigned long posted = 0;
+
+        while (benchmark_retired < benchmark_iterations) {
+                /* Completions come in order, so a slot is free again once
+                 * queue_depth later atomics may be posted
+                 */
+                while (posted < benchmark_iterations &&
+                       posted - benchmark_retired < (unsigned long) queue_depth) {
+                        int ret = post_atomic(IBV_WR_ATOMIC_FETCH_AND_ADD,
+                                              remote_addr,
+                                              &slots[posted % queue_depth], 1, 0);
+                        if (ret) {
+                                return ret;
+                        }
+                        posted++;
+                }
+                int ret = send_batch_flush(&send_batch);
+                if (ret) {
+                        return ret;
+                }
+                ret = process_completions(completion_channel, completion_queue,
+                                          &completion_table, 1);
+                if (ret < 0 || benchmark_failed) {
+                        return ret < 0 ? ret : -EIO;
+                }
+        }
+        return 0;
+}
+
+/*
+ * COMPARE_AND_SWAPs the word at remote_addr from expected to swap and waits
+ * for it. The word's old value is returned in *old, so the swap happened if
+ * it is expected.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int compare_swap(uint64_t remote_addr, uint64_t expected, uint64_t swap,
+                        uint64_t *old)
+{
+        int ret = post_atomic(IBV_WR_ATOMIC_CMP_AND_SWP, remote_addr,
+                              atomic_pool_buffer->addr, expected, swap);
+        if (!ret) {
+                ret = send_batch_flush(&send_batch);
+        }
+        if (!ret) {
+                ret = reap_benchmark_completions();
+        }
+        *old = atomic_fetched;
+        return ret;
+}
+
+/*
+ * Increments the counter at remote_addr benchmark_iterations times with
+ * COMPARE_AND_SWAP, one at a time since each depends on the value the last
+ * one returned. Counts the ones that lost a race to another client in
+ * retries.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int run_compare_swap(uint64_t remote_addr, unsigned long *retries)
+{
+        uint64_t expected = 0;
+        uint64_t old;
+
+        for (unsigned long swapped = 0; swapped < benchmark_iterations; ) {
+                int ret = compare_swap(remote_addr, expected, expected + 1, &old);
+                if (ret) {
+                        return ret;
+                }
+                if (old == expected) {
+                        swapped++;
+                        expected++;
+                } else {
+                        (*retries)++;
+                        expected = old;
+                }
+        }
+        return 0;
+}
+
+/*
+ * Spins for a random time of up to *backoff_nsec, then doubles it for the
+ * next attempt.
+ */
+static void lock_backoff(uint64_t *backoff_nsec)
+{
+        uint64_t until = monotonic_nsec() + drand48() * *backoff_nsec;
+
+        while (monotonic_nsec() < until);
+        if (*backoff_nsec < LOCK_MAX_BACKOFF_NSEC) {
+                *backoff_nsec *= 2;
+        }
+}
+
+/*
+ * Acquires the lock at remote_addr, shared or exclusively for owner, and
+ * returns the word it left in the lock in *held.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int acquire_lock(uint64_t remote_addr, int shared, uint16_t owner,
+                        uint64_t *held, struct atomic_result *result)
+{
+        uint64_t backoff_nsec = LOCK_MIN_BACKOFF_NSEC;
+        uint64_t current = 0; /* What a free lock most likely holds */
+        uint64_t next, old;
+
+        for (;;) {
+                enum lock_state state = lock_acquire_word(current, shared, owner,
+                                                          lock_clock_ms(),
+                                                          lock_lease_ms, &next);
+                if (state == LOCK_HELD) {
+                        result->backoffs++;
+                        lock_backoff(&backoff_nsec);
+                        /* Swapping the word for itself reads it */
+                        next = current;
+                }
+                int ret = compare_swap(remote_addr, current, next, &old);
+                if (ret) {
+                        return ret;
+                }
+                if (old == current && state != LOCK_HELD) {
+                        result->recoveries += state == LOCK_EXPIRED;
+                        *held = next;
+                        return 0;
+                }
+                if (state != LOCK_HELD) {
+                        result->retries++;
+                }
+                current = old;
+        }
+}
+
+/*
+ * Releases the lock at remote_addr, which we left holding held. A shared
+ * release has to account for the holders that came and went since.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int release_lock(uint64_t remote_addr, int shared, uint64_t held,
+                        struct atomic_result *result)
+{
+        uint64_t current = held;
+        uint64_t old;
+
+        for (;;) {
+                int ret = compare_swap(remote_addr, current,
+                                       lock_release_word(current, shared), &old);
+                if (ret || old == current) {
+                        return ret;
+                }
+                /* Our lease ran out and someone else took the lock over */
+                if (!shared || lock_word_owner(old) || !lock_word_readers(old)) {
+                        result->lost++;
+                        return 0;
+                }
+                /* Readers joining may push the lease out, but they can't while
+                 * the lease we left is live, and no one can take the lock
+                 * over. Once it ran out, a new lease may be a new group's,
+                 * whose count isn't ours to take from.
+                 */
+                if (lock_word_lease(old) != lock_word_lease(held) &&
+                    !lock_word_held(held, lock_clock_ms())) {
+                        result->lost++;
+                        return 0;
+                }
+                result->retries++;
+                current = old;
+        }
+}
+
+/*
+ * Takes this client's owner id from the word at the end of the server's lock
+ * table.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int take_lock_owner_id(uint16_t *owner)
+{
+        uint64_t words = server_metadata.length / sizeof(uint64_t);
+        uint64_t remote_addr = server_metadata.address +
+                               (words - 1) * sizeof(uint64_t);
+
+        int ret = post_atomic(IBV_WR_ATOMIC_FETCH_AND_ADD, remote_addr,
+                              atomic_pool_buffer->addr, 1, 0);
+        if (!ret) {
+                ret = send_batch_flush(&send_batch);
+        }
+        if (!ret) {
+                ret = reap_benchmark_completions();
+        }
+        *owner = lock_owner_id(atomic_fetched);
+        return ret;
+}
+
+/*
+ * Acquires and releases a random one of lock_span locks from remote_addr on
+ * benchmark_iterations times, shared lock_shared_percent of the time.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int run_locks(uint64_t remote_addr, struct atomic_result *result)
+{
+        uint16_t owner;
+        uint64_t held;
+
+        int ret = take_lock_owner_id(&owner);
+        if (ret) {
+                return ret;
+        }
+
+        srand48(getpid());
+        for (unsigned long i = 0; i < benchmark_iterations; i++) {
+                uint64_t lock_addr = remote_addr +
+                                     (uint64_t) (drand48() * lock_span) *
+                                     sizeof(uint64_t);
+                int shared = drand48() * 100 < lock_shared_percent;
+                ret = acquire_lock(lock_addr, shared, owner, &held, result);
+                if (!ret) {
+                        ret = release_lock(lock_addr, shared, held, result);
+                }
+                if (ret) {
+                        return ret;
+                }
+        }
+        return 0;
+}
+
+/*
+ * Tells the parent this forked client is connected, then waits for it to
+ * start every client at once by closing the start pipe.
+ */
+static void wait_for_atomic_start()
+{
+        char ready = 1;
+        char start;
+
+        if (write(atomic_ready_fd, &ready, 1) != 1) {
+                fprintf(stderr, "Client %d failed to report ready: %s\n",
+                        atomic_client_index, strerror(errno));
+        }
+        close(atomic_ready_fd);
+        atomic_ready_fd = -1;
+        while (read(atomic_start_fd, &start, 1) > 0);
+        close(atomic_start_fd);
+        atomic_start_fd = -1;
+}
+
+/*
+ * Runs the atomic benchmark on this client's counter and reports the rate,
+ * to the parent as well if this is a forked client.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int run_atomic_benchmark()
+{
+        struct atomic_result result;
+        uint32_t counters = server_metadata.length / sizeof(uint64_t);
+        /* A lock table's last word hands out owner ids */
+        if (atomic_op == ATOMIC_OP_LOCK && counters) {
+                counters--;
+        }
+        uint32_t counter = atomic_counter +
+                           (spread_counters ? atomic_client_index : 0);
+        uint32_t last = counter + (atomic_op == ATOMIC_OP_LOCK ? lock_span - 1 : 0);
+
+        memset(&result, 0, sizeof(result));
+        if (last >= counters || last < counter) {
+                fprintf(stderr, "Server has %u counters, no counter %u\n",
+                        counters, last);
+                result.status = -EINVAL;
+        } else {
+                atomic_pool_buffer = rdma_pool_alloc(buffer_pool,
+                                                     queue_depth * sizeof(uint64_t));
+                if (!atomic_pool_buffer) {
+                        fprintf(stderr, "Failed to allocate atomic result buffer from pool\n");
+                        result.status = -ENOMEM;
+                }
+        }
+        if (atomic_start_fd >= 0) {
+                /* Join the start either way, so the others aren't held up */
+                wait_for_atomic_start();
+        }
+        if (result.status) {
+                goto report;
+        }
+
+        uint64_t remote_addr = server_metadata.address +
+                               counter * sizeof(uint64_t);
+        benchmark_retired = 0;
+        uint64_t start = monotonic_nsec();
+        if (atomic_op == ATOMIC_OP_FETCH_ADD) {
+                result.status = run_fetch_add(remote_addr);
+        } else if (atomic_op == ATOMIC_OP_LOCK) {
+                result.status = run_locks(remote_addr, &result);
+        } else {
+                result.status = run_compare_swap(remote_addr, &result.retries);
+        }
+        result.nsec = monotonic_nsec() - start;
+        result.ops = benchmark_iterations;
+        if (result.status) {
+                fprintf(stderr, "Atomic benchmark failed: %s\n",
+                        strerror(-result.status));
+                goto report;
+        }
+        if (atomic_op == ATOMIC_OP_LOCK) {
+                /* The sweep prints a row for all the clients */
+                goto report;
+        }
+
+        double usec = result.nsec / 1e3;
+        printf("Client %d: %lu %s on counter %u in %.3f s: %.3f Mops/s, %.3f us/op, %lu retries, last value %lu\n",
+               atomic_client_index, result.ops,
+               atomic_op == ATOMIC_OP_FETCH_ADD ? "FETCH_AND_ADDs" :
+                                                  "COMPARE_AND_SWAPs",
+               counter, usec / 1e6, result.ops / usec, usec / result.ops,
+               result.retries, (unsigned long) atomic_fetched);
+        if (atomic_unordered) {
+                fprintf(stderr, "%lu FETCH_AND_ADDs returned a value not above the last\n",
+                        atomic_unordered);
+                result.status = -EIO;
+        }
+
+report:
+        if (atomic_result_fd >= 0 &&
+            write(atomic_result_fd, &result, sizeof(result)) != sizeof(result)) {
+                fprintf(stderr, "Client %d failed to report its result: %s\n",
+                        atomic_client_index, strerror(errno));
+        }
+        return result.status;
+}
+
+/*
+ * Collects the forked atomic clients: starts them all at once when they are
+ * connected, then sums up what they report into total, whose nsec is the
+ * slowest client's.
+ *
+ * Returns 0 if every client succeeded, a negative error code otherwise.
+ */
+static int collect_atomic_clients(pid_t *pids, int ready_fd, int start_fd,
+                                  int result_fd, struct atomic_result *total)
+{
+        struct atomic_result result;
+        int reported = 0, connected = 0;
+        int ret = 0;
+        char ready;
+
+        /* Each client closes its end once ready, or exits */
+        while (read(ready_fd, &ready, 1) > 0) {
+                connected++;
+        }
+        if (atomic_op != ATOMIC_OP_LOCK) {
+                printf("%d of %d atomic clients connected, starting\n",
+                       connected, atomic_clients);
+        }
+        close(start_fd);
+
+        while (read(result_fd, &result, sizeof(result)) == sizeof(result)) {
+                reported++;
+                if (result.status) {
+                        ret = result.status;
+                        continue;
+                }
+                total->ops += result.ops;
+                total->retries += result.retries;
+                total->backoffs += result.backoffs;
+                total->recoveries += result.recoveries;
+                total->lost += result.lost;
+                if (result.nsec > total->nsec) {
+                        total->nsec = result.nsec;
+                }
+        }
+
+        for (int i = 0; i < atomic_clients; i++) {
+                int status;
+                if (waitpid(pids[i], &status, 0) < 0 ||
+                    !WIFEXITED(status) || WEXITSTATUS(status)) {
+                        ret = ret ? ret : -EIO;
+                }
+        }
+        if (reported < atomic_clients) {
+                fprintf(stderr, "Only %d of %d atomic clients reported\n",
+                        reported, atomic_clients);
+                ret = ret ? ret : -EIO;
+        }
+        if (atomic_op != ATOMIC_OP_LOCK && total->ops && total->nsec) {
+                double usec = total->nsec / 1e3;
+                printf("%d clients on %s: %lu ops in %.3f s: %.3f Mops/s aggregate, %lu retries\n",
+                       atomic_clients,
+                       spread_counters ? "a counter each" : "one counter",
+                       total->ops, usec / 1e6, total->ops / usec,
+                       total->retries);
+        }
+        return ret;
+}
+
+/*
+ * Forks atomic_clients clients, each of which connects on its own, and
+ * collects them into total.
+ *
+ * Returns 1 in a forked client, which carries on as client
+ * atomic_client_index, or the outcome of the run in the parent.
+ */
+static int fork_atomic_clients(struct atomic_result *total)
+{
+        int ready_pipe[2], start_pipe[2], result_pipe[2];
+        pid_t pids[atomic_clients];
+        int ret = 0;
+
+        memset(total, 0, sizeof(*total));
+        if (pipe(ready_pipe) || pipe(start_pipe) || pipe(result_pipe)) {
+                fprintf(stderr, "Failed to create pipes: %s\n", strerror(errno));
+                return -errno;
+        }
+
+        /* Don't hand the children what's still buffered */
+        fflush(stdout);
+        fflush(stderr);
+        for (int i = 0; i < atomic_clients; i++) {
+                pids[i] = fork();
+                if (pids[i] == 0) {
+                        close(ready_pipe[0]);
+                        close(start_pipe[1]);
+                        close(result_pipe[0]);
+                        atomic_client_index = i;
+                        atomic_ready_fd = ready_pipe[1];
+                        atomic_start_fd = start_pipe[0];
+                        atomic_result_fd = result_pipe[1];
+                        return 1;
+                }
+                if (pids[i] < 0) {
+                        fprintf(stderr, "Failed to fork atomic client %d: %s\n",
+                                i, strerror(errno));
+                        ret = -errno;
+                        for (int j = 0; j < i; j++) {
+                                kill(pids[j], SIGTERM);
+                                waitpid(pids[j], NULL, 0);
+                        }
+                        break;
+                }
+        }
+
+        close(ready_pipe[1]);
+        close(start_pipe[0]);
+        close(result_pipe[1]);
+        if (!ret) {
+                ret = collect_atomic_clients(pids, ready_pipe[0], start_pipe[1],
+                                             result_pipe[0], total);
+        } else {
+                close(start_pipe[1]);
+        }
+        close(ready_pipe[0]);
+        close(result_pipe[0]);
+        return ret;
+}
+
+/*
+ * Runs the lock benchmark over every combination of a power of two clients,
+ * up to atomic_clients, and locks, up to lock_count, printing a row for each.
+ *
+ * Returns 1 in a forked client, which carries on with its round's
+ * atomic_clients and lock_span, or the outcome of the sweep in the parent.
+ */
+static int run_lock_sweep()
+{
+        struct atomic_result total;
+        int max_clients = atomic_clients;
+
+        printf("%d%% shared, %u ms leases, %lu acquisitions per client\n",
+               lock_shared_percent, lock_lease_ms, benchmark_iterations);
+        printf("%8s %8s %14s %12s %12s %10s %10s %8s\n", "clients", "locks",
+               "acquires/s", "us/acquire", "retries/op", "backoffs",
+               "recoveries", "lost");
+        for (atomic_clients = 1; ; atomic_clients *= 2) {
+                if (atomic_clients > max_clients) {
+                        atomic_clients = max_clients;
+                }
+                for (lock_span = 1; ; lock_span *= 2) {
+                        if (lock_span > lock_count) {
+                                lock_span = lock_count;
+                        }
+                        int ret = fork_atomic_clients(&total);
+                        if (ret) {
+                                return ret;
+                        }
+                        /* Each client times its own acquire and release pairs */
+                        double usec = total.nsec / 1e3;
+                        printf("%8d %8u %14.0f %12.3f %12.3f %10lu %10lu %8lu\n",
+                               atomic_clients, lock_span, total.ops / usec * 1e6,
+                               usec * atomic_clients / total.ops,
+                               (double) total.retries / total.ops,
+                               total.backoffs, total.recoveries, total.lost);
+                        if (lock_span == lock_count) {
+                                break;
+                        }
+                }
+                if (atomic_clients == max_clients) {
+                        break;
+                }
+        }
+        return 0;
+}
+
+/* --- Key-value store ---
+ *
+ * With --kv, the server (run with -K) hosts a key-value store (see
+ * rdma_kv.h) and hands us its index and heap regions as we connect. A GET
+ * READs the key's bucket, then its value record, and validates both,
+ * starting over when either was caught mid-update. The server's CPU never
+ * sees it. A PUT is SENT to the server, which applies it and replies.
+ *
+ * The workload is YCSB-style: a load phase PUTs kv_records keys, then the
+ * run phase mixes GETs and PUTs of keys drawn from a Zipfian distribution,
+ * in the proportions of the YCSB core workload picked with --ycsb.
+ */
+
+/*
+ * YCSB's Zipfian generator (Gray et al., "Quickly Generating Billion-Record
+ * Synthetic Databases"), over items 0 to items - 1, item 0 most popular.
+ */
+struct zipf_generator {
+        uint64_t items;
+        double theta;
+        double alpha;
+        double zetan;
+        double eta;
+};
+
+static void zipf_init(struct zipf_generator *zipf, uint64_t items,
+                      double theta)
+{
+        double zeta2 = 1 + pow(0.5, theta);
+
+        zipf->items = items;
+        zipf->theta = theta;
+        zipf->alpha = 1 / (1 - theta);
+        zipf->zetan = 0;
+        for (uint64_t i = 1; i <= items; i++) {
+                zipf->zetan += 1 / pow(i, theta);
+        }
+        zipf->eta = (1 - pow(2.0 / items, 1 - theta)) /
+                    (1 - zeta2 / zipf->zetan);
+}
+
+static uint64_t zipf_next(const struct zipf_generator *zipf)
+{
+        double u = drand48();
+        double uz = u * zipf->zetan;
+
+        if (uz < 1) {
+                return 0;
+        }
+        if (uz < 1 + pow(0.5, zipf->theta)) {
+                return 1;
+        }
+        uint64_t item = zipf->items *
+                        pow(zipf->eta * u - zipf->eta + 1, zipf->alpha);
+        return item < zipf->items ? item : zipf->items - 1;
+}
+
+/*
+ * Returns the fraction of YCSB core workload a, b or c operations that are
+ * reads (GETs), the rest being updates (PUTs).
+ */
+static double ycsb_read_fraction(char workload)
+{
+        switch (workload) {
+                case 'a':
+                        return 0.5;
+                case 'b':
+                        return 0.95;
+                default:
+                        return 1.0;
+        }
+}
+
+/*
+ * READs length bytes at offset of a server region into local, and waits for
+ * it.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int kv_read(void *local, uint32_t length,
+                   const struct rdma_buffer_attr *region, uint64_t offset)
+{
+        client_send_sge.addr = (uint64_t) local;
+        client_send_sge.length = length;
+        client_send_sge.lkey = kv_pool_buffer->lkey;
+        memset(&client_send_wr, 0, sizeof(client_send_wr));
+        client_send_wr.sg_list = &client_send_sge;
+        client_send_wr.num_sge = 1;
+        client_send_wr.opcode = IBV_WR_RDMA_READ;
+        client_send_wr.send_flags = IBV_SEND_SIGNALED;
+        client_send_wr.wr.rdma.rkey = region->stag.remote_stag;
+        client_send_wr.wr.rdma.remote_addr = region->address + offset;
+
+        int ret = completion_table_register(&completion_table,
+                                            check_benchmark_completion,
+                                            (void *) 1, &client_send_wr.wr_id);
+        if (!ret) {
+                ret = send_batch_add(&send_batch, &client_send_wr);
+        }
+        if (!ret) {
+                ret = send_batch_flush(&send_batch);
+        }
+        if (!ret) {
+                ret = reap_benchmark_completions();
+        }
+        return ret;
+}
+
+/*
+ * Looks key up with READs alone. Copies its value into the record buffer and
+ * sets *length to its length, or to -1 if the key isn't in the store.
+ *
+ * Returns 0 if successful, -EAGAIN if the key's bucket or record kept
+ * changing under us, or another negative error code.
+ */
+static int kv_get(uint64_t key, int64_t *length)
+{
+        uint64_t bucket_count = kv_regions.index.length / sizeof(struct kv_bucket);
+        uint64_t home = kv_hash(key) % bucket_count;
+        uint64_t probe = 0;
+
+        for (int attempt = 0; attempt < KV_MAX_GET_ATTEMPTS; ) {
+                uint64_t bucket_index = (home + probe) % bucket_count;
+                int ret = kv_read(kv_bucket, sizeof(*kv_bucket),
+                                  &kv_regions.index,
+                                  bucket_index * sizeof(*kv_bucket));
+                if (ret) {
+                        return ret;
+                }
+                if (!kv_bucket_valid(kv_bucket)) {
+                        kv_get_retries++;
+                        attempt++;
+                        continue;
+                }
+
+                int has_room;
+                const struct kv_entry *entry = kv_bucket_find(kv_bucket, key,
+                                                              &has_room);
+                if (!entry) {
+                        if (has_room || ++probe == bucket_count) {
+                                *length = -1;
+                                return 0;
+                        }
+                        continue;
+                }
+
+                uint32_t value_length = kv_location_length(entry->location);
+                if (value_length > message_len) {
+                        fprintf(stderr, "Key %lu holds a %u byte value, more than %lu\n",
+                                (unsigned long) key, value_length,
+                                (unsigned long) message_len);
+                        return -EMSGSIZE;
+                }
+                ret = kv_read(kv_record, sizeof(*kv_record) + value_length,
+                              &kv_regions.heap,
+                              kv_location_offset(entry->location));
+                if (ret) {
+                        return ret;
+                }
+                if (kv_record_valid(kv_record, key, value_length)) {
+                        *length = value_length;
+                        return 0;
+                }
+                /* The bucket changed since we READ it, start over */
+                kv_get_retries++;
+                attempt++;
+                probe = 0;
+        }
+        return -EAGAIN;
+}
+
+/*
+ * SENDs a PUT of the length value bytes already in the request buffer under
+ * key, and waits for the server's reply.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int kv_put_remote(uint64_t key, uint32_t length)
+{
+        kv_request->op = KV_OP_PUT;
+        kv_request->length = length;
+        kv_request->key = key;
+
+        server_recv_sge.addr = (uint64_t) kv_reply;
+        server_recv_sge.length = sizeof(*kv_reply);
+        server_recv_sge.lkey = kv_pool_buffer->lkey;
+        memset(&server_recv_wr, 0, sizeof(server_recv_wr));
+        server_recv_wr.sg_list = &server_recv_sge;
+        server_recv_wr.num_sge = 1;
+        int ret = completion_table_register(&completion_table,
+                                            check_benchmark_completion, NULL,
+                                            &server_recv_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+        ret = ibv_post_recv(queue_pair, &server_recv_wr, &bad_server_recv_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to post key-value reply receive: %s\n",
+                        strerror(ret));
+                completion_table_cancel(&completion_table, server_recv_wr.wr_id);
+                return -ret;
+        }
+
+        client_send_sge.addr = (uint64_t) kv_request;
+        client_send_sge.length = sizeof(*kv_request) + length;
+        client_send_sge.lkey = kv_pool_buffer->lkey;
+        memset(&client_send_wr, 0, sizeof(client_send_wr));
+        client_send_wr.sg_list = &client_send_sge;
+        client_send_wr.num_sge = 1;
+        client_send_wr.opcode = IBV_WR_SEND;
+        client_send_wr.send_flags = signaled_send_flags(IBV_WR_SEND,
+                                                        client_send_sge.length,
+                                                        max_inline_data);
+        ret = completion_table_register(&completion_table,
+                                        check_benchmark_completion, (void *) 1,
+                                        &client_send_wr.wr_id);
+        if (!ret) {
+                ret = send_batch_add(&send_batch, &client_send_wr);
+        }
+        if (!ret) {
+                ret = send_batch_flush(&send_batch);
+        }
+        if (!ret) {
+                ret = reap_benchmark_completions();
+        }
+        if (ret) {
+                return ret;
+        }
+        if (kv_reply->key != key) {
+                fprintf(stderr, "Reply for key %lu to PUT of key %lu\n",
+                        (unsigned long) kv_reply->key, (unsigned long) key);
+                return -EIO;
+        }
+        return kv_reply->status;
+}
+
+/*
+ * Fills the request's value for key: length bytes cycling through the
+ * alphabet from a letter picked by the key.
+ */
+static void fill_kv_value(uint64_t key, uint32_t length)
+{
+        for (uint32_t i = 0; i < length; i++) {
+                kv_request->value[i] = 'a' + (key + i) % 26;
+        }
+}
+
+/*
+ * Carves the key-value buffers out of one pooled buffer, each starting on a
+ * cache line: the bucket, the reply, then the request and the record, which
+ * have the same header size.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int setup_kv_buffers()
+{
+        uint64_t request_size = kv_record_size(message_len);
+
+        kv_pool_buffer = rdma_pool_alloc(buffer_pool,
+                                         2 * KV_RECORD_ALIGNMENT +
+                                         2 * request_size);
+        if (!kv_pool_buffer) {
+                fprintf(stderr, "Failed to allocate key-value buffers from pool\n");
+                return -ENOMEM;
+        }
+        char *buffer = kv_pool_buffer->addr;
+        kv_bucket = (struct kv_bucket *) buffer;
+        kv_reply = (struct kv_reply *) (buffer + sizeof(*kv_bucket));
+        kv_request = (struct kv_request *) (buffer + 2 * KV_RECORD_ALIGNMENT);
+        kv_record = (struct kv_record *) ((char *) kv_request + request_size);
+        return 0;
+}
+
+/*
+ * Runs the YCSB-style load and run phases against the server's store, and
+ * prints throughput and GET and PUT latencies.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int run_kv_benchmark()
+{
+        struct latency_histogram get_histogram, put_histogram;
+        struct zipf_generator zipf;
+        unsigned long gets = 0, puts = 0, misses = 0;
+        int64_t length;
+
+        uint64_t bucket_count = kv_regions.index.length / sizeof(struct kv_bucket);
+        if (!bucket_count) {
+                fprintf(stderr, "Server didn't hand out a key-value store\n");
+                return -EINVAL;
+        }
+        int ret = setup_kv_buffers();
+        if (ret) {
+                return ret;
+        }
+        printf("Key-value store on server: %lu buckets, %u byte heap\n",
+               (unsigned long) bucket_count, kv_regions.heap.length);
+
+        uint64_t start = monotonic_nsec();
+        for (uint64_t key = 0; key < kv_records; key++) {
+                fill_kv_value(key, message_len);
+                ret = kv_put_remote(key, message_len);
+                if (ret) {
+                        fprintf(stderr, "Loading key %lu failed: %s\n",
+                                (unsigned long) key, strerror(-ret));
+                        return ret;
+                }
+        }
+        double seconds = (monotonic_nsec() - start) / 1e9;
+        printf("Loaded %lu records of %lu bytes in %.3f s: %.0f PUTs/s\n",
+               (unsigned long) kv_records, (unsigned long) message_len, seconds,
+               seconds > 0 ? kv_records / seconds : 0);
+
+        ret = latency_histogram_init(&get_histogram,
+                                     DEFAULT_HISTOGRAM_PRECISION_BITS);
+        if (ret) {
+                return ret;
+        }
+        ret = latency_histogram_init(&put_histogram,
+                                     DEFAULT_HISTOGRAM_PRECISION_BITS);
+        if (ret) {
+                latency_histogram_destroy(&get_histogram);
+                return ret;
+        }
+
+        zipf_init(&zipf, kv_records, YCSB_ZIPF_THETA);
+        srand48(monotonic_nsec());
+        double read_fraction = ycsb_read_fraction(ycsb_workload);
+        start = monotonic_nsec();
+        for (unsigned long i = 0; i < benchmark_iterations && !ret; i++) {
+                uint64_t key = zipf_next(&zipf);
+                uint64_t op_start = monotonic_nsec();
+                if (drand48() < read_fraction) {
+                        ret = kv_get(key, &length);
+                        latency_histogram_record(&get_histogram,
+                                                 monotonic_nsec() - op_start);
+                        misses += !ret && length < 0;
+                        gets++;
+                } else {
+                        fill_kv_value(key, message_len);
+                        ret = kv_put_remote(key, message_len);
+                        latency_histogram_record(&put_histogram,
+                                                 monotonic_nsec() - op_start);
+                        puts++;
+                }
+                if (ret) {
+                        fprintf(stderr, "Operation %lu on key %lu failed: %s\n",
+                                i, (unsigned long) key, strerror(-ret));
+                }
+        }
+        seconds = (monotonic_nsec() - start) / 1e9;
+
+        if (!ret) {
+                printf("YCSB workload %c: %lu ops (%lu GETs, %lu PUTs) in %.3f s: %.0f ops/s, %lu GET retries, %lu misses\n",
+                       ycsb_workload, gets + puts, gets, puts, seconds,
+                       seconds > 0 ? (gets + puts) / seconds : 0,
+                       kv_get_retries, misses);
+                if (gets) {
+                        printf("GET latency:\n");
+                        print_latency_histogram(&get_histogram, 1);
+                }
+                if (puts) {
+                        printf("PUT latency:\n");
+                        print_latency_histogram(&put_histogram, 1);
+                }
+        }
+        latency_histogram_destroy(&get_histogram);
+        latency_histogram_destroy(&put_histogram);
+        return ret;
+}
+
+/* --- Connection rate ---
+ *
+ * With --connect-rate, the client opens and closes connect_total connections
+ * to the server, connect_concurrency at a time, all driven by the CM events
+ * of one channel. Each connection times every phase of its setup: resolving
+ * the address and the route, creating its QP and the connect handshake, and
+ * then its disconnect. The PD and CQ are created once, on the first
+ * connection's device, and shared by every QP. The connections exchange no
+ * metadata and post no WRs, so all that is measured is the CM.
+ */
+
+enum connect_phase {
+        CONNECT_PHASE_ADDR,
+        CONNECT_PHASE_ROUTE,
+        CONNECT_PHASE_QP,
+        CONNECT_PHASE_CONNECT,
+        CONNECT_PHASE_SETUP, /* All of the above */
+        CONNECT_PHASE_DISCONNECT,
+        CONNECT_PHASES
+};
+
+static const char *connect_phase_names[CONNECT_PHASES] = {
+        "resolve address",
+        "resolve route",
+        "create QP",
+        "connect",
+        "setup total",
+        "disconnect"
+};
+
+/*
+ * A connection in flight, the context of its CM id.
+ */
+struct connect_probe {
+        struct rdma_cm_id *cm_id;
+        uint64_t start_nsec; /* When its CM id was created */
+        uint64_t phase_nsec; /* When its current phase started */
+        struct connect_probe *prev, *next;
+};
+
+static struct latency_histogram connect_histograms[CONNECT_PHASES];
+static struct connect_probe *connect_probes = NULL;
+
+/*
+ * Records how long the phase ending now took, and starts the next one.
+ */
+static void end_connect_phase(struct connect_probe *probe,
+                              enum connect_phase phase)
+{
+        uint64_t now = monotonic_nsec();
+
+        latency_histogram_record(&connect_histograms[phase],
+                                 now - probe->phase_nsec);
+        probe->phase_nsec = now;
+}
+
+/*
+ * Tears down a connection that is done, or failed. Its CM id must not have
+ * any un-ACKed CM events.
+ */
+static void destroy_connect_probe(struct connect_probe *probe)
+{
+        if (probe->cm_id->qp) {
+                rdma_destroy_qp(probe->cm_id);
+        }
+        rdma_destroy_id(probe->cm_id);
+        if (probe->prev) {
+                probe->prev->next = probe->next;
+        } else {
+                connect_probes = probe->next;
+        }
+        if (probe->next) {
+                probe->next->prev = probe->prev;
+        }
+        free(probe);
+}
+
+/*
+ * Creates the CM id of a new connection and starts resolving the server's
+ * address.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int start_connect_probe()
+{
+        struct connect_probe *probe = calloc(1, sizeof(*probe));
+        if (!probe) {
+                fprintf(stderr, "Failed to allocate connection: -ENOMEM\n");
+                return -ENOMEM;
+        }
+        probe->start_nsec = probe->phase_nsec = monotonic_nsec();
+        if (rdma_create_id(cm_event_channel, &probe->cm_id, probe,
+                           RDMA_PS_TCP)) {
+                int ret = -errno;
+                fprintf(stderr, "Creating CM id failed: %s\n", strerror(errno));
+                free(probe);
+                return ret;
+        }
+        probe->next = connect_probes;
+        if (connect_probes) {
+                connect_probes->prev = probe;
+        }
+        connect_probes = probe;
+
+        if (rdma_resolve_addr(probe->cm_id, NULL, rai->ai_dst_addr,
+                              cm_timeout_ms)) {
+                int ret = -errno;
+                fprintf(stderr, "Failed rdma_resolve_addr: %s\n",
+                        strerror(errno));
+                destroy_connect_probe(probe);
+                return ret;
+        }
+        return 0;
+}
+
+/*
+ * Creates the QP of a connection whose route is resolved, along with the
+ * shared PD and CQ for the first connection, and connects it.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int connect_probe(struct connect_probe *probe)
+{
+        struct rdma_cm_id *cm_id = probe->cm_id;
+        struct rdma_conn_param conn_param;
+        struct ibv_qp_init_attr init_attr;
+
+        if (!protection_domain) {
+                protection_domain = ibv_alloc_pd(cm_id->verbs);
+                if (!protection_domain) {
+                        fprintf(stderr, "Failed to create Protection Domain: %s\n",
+                                strerror(errno));
+                        return -errno;
+                }
+                /* Every connection holds a QP on it, nothing more */
+                completion_queue = ibv_create_cq(cm_id->verbs,
+                                                 2 * connect_concurrency,
+                                                 NULL, NULL, 0);
+                if (!completion_queue) {
+                        fprintf(stderr, "Failed to create Completion Queue: %s\n",
+                                strerror(errno));
+                        return -errno;
+                }
+        }
+        if (protection_domain->context != cm_id->verbs) {
+                fprintf(stderr, "Connection resolved to a different RDMA device than the first\n");
+                return -EINVAL;
+        }
+
+        memset(&init_attr, 0, sizeof(init_attr));
+        init_attr.qp_type = IBV_QPT_RC;
+        init_attr.cap.max_send_wr = 1;
+        init_attr.cap.max_recv_wr = 1;
+        init_attr.cap.max_send_sge = 1;
+        init_attr.cap.max_recv_sge = 1;
+        init_attr.send_cq = completion_queue;
+        init_attr.recv_cq = completion_queue;
+        int ret = create_queue_pair(cm_id, protection_domain, &init_attr);
+        if (ret) {
+                fprintf(stderr, "Failed to create QP: %s\n", strerror(-ret));
+                return ret;
+        }
+        end_connect_phase(probe, CONNECT_PHASE_QP);
+
+        memset(&conn_param, 0, sizeof(conn_param));
+        conn_param.initiator_depth = 3;
+        conn_param.responder_resources = 3;
+        conn_param.retry_count = 3;
+        if (rdma_connect(cm_id, &conn_param)) {
+                fprintf(stderr, "Failed to connect to server: %s\n",
+                        strerror(errno));
+                return -errno;
+        }
+        return 0;
+}
+
+/*
+ * Moves a connection on to its next phase on a CM event for it.
+ *
+ * Returns 1 once the connection is closed, 0 while it is still in flight, a
+ * negative error code if it failed.
+ */
+static int handle_connect_event(struct connect_probe *probe,
+                                enum rdma_cm_event_type type, int status)
+{
+        switch (type) {
+                case RDMA_CM_EVENT_ADDR_RESOLVED:
+                        end_connect_phase(probe, CONNECT_PHASE_ADDR);
+                        if (rdma_resolve_route(probe->cm_id, cm_timeout_ms)) {
+                                fprintf(stderr, "Failed rdma_resolve_route: %s\n",
+                                        strerror(errno));
+                                return -errno;
+                        }
+                        return 0;
+                case RDMA_CM_EVENT_ROUTE_RESOLVED:
+                        end_connect_phase(probe, CONNECT_PHASE_ROUTE);
+                        return connect_probe(probe);
+                case RDMA_CM_EVENT_ESTABLISHED:
+                        end_connect_phase(probe, CONNECT_PHASE_CONNECT);
+                        latency_histogram_record(&connect_histograms[CONNECT_PHASE_SETUP],
+                                                 probe->phase_nsec -
+                                                 probe->start_nsec);
+                        if (rdma_disconnect(probe->cm_id)) {
+                                fprintf(stderr, "Disconnecting from server failed: %s\n",
+                                        strerror(errno));
+                                return -errno;
+                        }
+                        return 0;
+                case RDMA_CM_EVENT_DISCONNECTED:
+                        end_connect_phase(probe, CONNECT_PHASE_DISCONNECT);
+                        return 1;
+                default:
+                        fprintf(stderr, "Connection failed on CM event %s (status %d)\n",
+                                rdma_event_str(type), status);
+                        return -ECONNABORTED;
+        }
+}
+
+/*
+ * Opens and closes connect_total connections, keeping connect_concurrency of
+ * them in flight, and prints the rate and each phase's latency percentiles.
+ *
+ * Returns 0 if every connection succeeded, a negative error code otherwise.
+ */
+static int run_connect_rate()
+{
+        struct rdma_cm_event *cm_event = NULL;
+        unsigned long started = 0, closed = 0, failed = 0;
+        int in_flight = 0;
+        int ret = 0;
+
+        for (int i = 0; i < CONNECT_PHASES; i++) {
+                ret = latency_histogram_init(&connect_histograms[i],
+                                             DEFAULT_HISTOGRAM_PRECISION_BITS);
+                if (ret) {
+                        while (i--) {
+                                latency_histogram_destroy(&connect_histograms[i]);
+                        }
+                        return ret;
+                }
+        }
+
+        cm_event_channel = rdma_create_event_channel();
+        if (!cm_event_channel) {
+                fprintf(stderr, "Creating CM event channel failed: %s\n",
+                        strerror(errno));
+                ret = -errno;
+                goto out;
+        }
+        hints.ai_port_space = RDMA_PS_TCP;
+        hints.ai_flags = RAI_NUMERICHOST;
+        if (rdma_getaddrinfo(server_addr, server_port, &hints, &rai)) {
+                fprintf(stderr, "Failed rdma_getaddrinfo: %s\n", strerror(errno));
+                ret = -errno;
+                goto out;
+        }
+
+        printf("Opening and closing %lu connections, %d at a time\n",
+               connect_total, connect_concurrency);
+        uint64_t start = monotonic_nsec();
+        while (closed + failed < connect_total) {
+                while (in_flight < connect_concurrency && started < connect_total) {
+                        started++;
+                        if (start_connect_probe()) {
+                                failed++;
+                        } else {
+                                in_flight++;
+                        }
+                }
+                if (!in_flight) {
+                        continue;
+                }
+
+                if (rdma_get_cm_event(cm_event_channel, &cm_event)) {
+                        fprintf(stderr, "Blocking for CM events failed: %s\n",
+                                strerror(errno));
+                        ret = -errno;
+                        break;
+                }
+                struct connect_probe *probe = cm_event->id->context;
+                enum rdma_cm_event_type type = cm_event->event;
+                int status = cm_event->status;
+                rdma_ack_cm_event(cm_event);
+
+                int done = handle_connect_event(probe, type, status);
+                if (done) {
+                        destroy_connect_probe(probe);
+                        in_flight--;
+                        if (done > 0) {
+                                closed++;
+                        } else {
+                                failed++;
+                        }
+                }
+        }
+        double usec = (monotonic_nsec() - start) / 1e3;
+
+        printf("%lu connections opened and closed in %.3f s: %.0f connections/s, %lu failed\n",
+               closed, usec / 1e6, closed / usec * 1e6, failed);
+        for (int i = 0; i < CONNECT_PHASES; i++) {
+                printf("%s:\n", connect_phase_names[i]);
+                print_latency_histogram(&connect_histograms[i], 1);
+        }
+        if (!ret && failed) {
+                ret = -ECONNABORTED;
         }
-        printf("Got %d Work Completions\n", ret);
 
-        /* Make sure to null-terminate the dst buffer before printing it */
-        dst_buffer[strlen(src_buffer)] = '\0';
-        printf("Client read complete. dst_buffer contents: '%s'\n", dst_buffer);
+out:
+        while (connect_probes) {
+                destroy_connect_probe(connect_probes);
+        }
+        for (int i = 0; i < CONNECT_PHASES; i++) {
+                latency_histogram_destroy(&connect_histograms[i]);
+        }
+        return ret;
+}
+
+/* --- Connection pool ---
+ *
+ * With --conn-pool, the client keeps conn_pool_size connections to the server
+ * established in an rdma_conn_pool, and makes every request over one it
+ * leases: a READ of the server's buffer, after which the connection goes back
+ * to the pool. A request that fails closes its connection, and the next lease
+ * replaces it. None of them pays for a CM handshake, which --connect-rate
+ * measures.
+ */
+
+/*
+ * READs length bytes of the server's buffer into conn's own, busy-polling its
+ * CQ for the completion.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int pooled_read(struct rdma_conn *conn, uint32_t length)
+{
+        struct ibv_send_wr wr, *bad_wr = NULL;
+        struct ibv_sge sge;
+        struct ibv_wc wc;
+        int n = 0;
+
+        if (length > conn->server.length) {
+                length = conn->server.length;
+        }
+        sge.addr = (uint64_t) conn->buffer->addr;
+        sge.length = length;
+        sge.lkey = conn->buffer->lkey;
+        memset(&wr, 0, sizeof(wr));
+        wr.opcode = IBV_WR_RDMA_READ;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.wr.rdma.remote_addr = conn->server.address;
+        wr.wr.rdma.rkey = conn->server.stag.remote_stag;
+        int ret = ibv_post_send(conn->qp, &wr, &bad_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to post pooled READ: %s\n",
+                        strerror(ret));
+                return -ret;
+        }
+
+        while ((n = ibv_poll_cq(conn->cq, 1, &wc)) == 0) {
+        }
+        if (n < 0) {
+                fprintf(stderr, "Failed to poll CQ: %d\n", n);
+                return -EIO;
+        }
+        if (wc.status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "Pooled READ failed: %s\n",
+                        ibv_wc_status_str(wc.status));
+                return -EIO;
+        }
+        return 0;
+}
+
+/*
+ * Makes benchmark_iterations requests over connections leased from a pool,
+ * and prints the latency percentiles of the leases and the whole requests,
+ * along with the pool's counters.
+ *
+ * Returns 0 if every request succeeded, a negative error code otherwise.
+ */
+static int run_conn_pool_benchmark()
+{
+        struct latency_histogram lease_histogram, request_histogram;
+        struct rdma_conn_pool *pool = NULL;
+        unsigned long failed = 0;
+        int ret = 0;
+
+        ret = latency_histogram_init(&lease_histogram,
+                                     DEFAULT_HISTOGRAM_PRECISION_BITS);
+        if (ret) {
+                return ret;
+        }
+        ret = latency_histogram_init(&request_histogram,
+                                     DEFAULT_HISTOGRAM_PRECISION_BITS);
+        if (ret) {
+                latency_histogram_destroy(&lease_histogram);
+                return ret;
+        }
+
+        hints.ai_port_space = RDMA_PS_TCP;
+        hints.ai_flags = RAI_NUMERICHOST;
+        if (rdma_getaddrinfo(server_addr, server_port, &hints, &rai)) {
+                fprintf(stderr, "Failed rdma_getaddrinfo: %s\n", strerror(errno));
+                ret = -errno;
+                goto out;
+        }
+
+        uint64_t start = monotonic_nsec();
+        pool = rdma_conn_pool_create(rai, conn_pool_size, benchmark_size,
+                                     cm_timeout_ms, conn_pool_idle_expiry_ms);
+        if (!pool) {
+                ret = -ECONNREFUSED;
+                goto out;
+        }
+        printf("Established %d pooled connections in %.3f ms\n",
+               conn_pool_size, (monotonic_nsec() - start) / 1e6);
+
+        printf("Making %lu requests of %u bytes over pooled connections\n",
+               benchmark_iterations, benchmark_size);
+        for (unsigned long i = 0; i < benchmark_iterations; i++) {
+                start = monotonic_nsec();
+                struct rdma_conn *conn = rdma_conn_pool_lease(pool);
+                if (!conn) {
+                        ret = -ECONNREFUSED;
+                        break;
+                }
+                uint64_t leased = monotonic_nsec();
+                int request_ret = pooled_read(conn, benchmark_size);
+                rdma_conn_pool_return(conn, request_ret != 0);
+                if (request_ret) {
+                        failed++;
+                        continue;
+                }
+                uint64_t end = monotonic_nsec();
+                latency_histogram_record(&lease_histogram, leased - start);
+                latency_histogram_record(&request_histogram, end - start);
+        }
+
+        printf("lease:\n");
+        print_latency_histogram(&lease_histogram, 1);
+        printf("request:\n");
+        print_latency_histogram(&request_histogram, 1);
+        printf("%lu requests failed\n", failed);
+        print_rdma_conn_pool(pool, 0);
+        if (!ret && failed) {
+                ret = -EIO;
+        }
+
+out:
+        rdma_conn_pool_destroy(pool);
+        latency_histogram_destroy(&request_histogram);
+        latency_histogram_destroy(&lease_histogram);
         return ret;
 }
 
 static void print_usage()
 {
-        printf("Usage:\n\t./rdma-client -m <message> -s <server_host> -p <server_port>\n");
+        printf("Usage:\n\t./rdma-client -m <message> -s <server_host> -p <server_port> [options]\n");
+        printf("Options:\n");
+        printf("\t-c, --completion <event|poll|hybrid>\tHow to wait for Work Completions (default: event)\n");
+        printf("\t-b, --spin-budget <polls>\t\tCQ polls before a hybrid wait blocks (default: %d)\n",
+               DEFAULT_SPIN_BUDGET);
+        printf("\t-n, --cq-batch <wcs>\t\t\tWCs drained per ibv_poll_cq() call (default: %d)\n",
+               DEFAULT_CQ_BATCH_SIZE);
+        printf("\t-P, --pool-class-bytes <bytes>\t\tMemory pool bytes per size class (default: %d)\n",
+               DEFAULT_POOL_CLASS_BYTES);
+        printf("\t-M, --pool-max-buffer <bytes>\t\tLargest pooled buffer; bigger ones are registered on demand (default: %d)\n",
+               DEFAULT_POOL_MAX_BUFFER);
+        printf("\t-H, --hugepages <none|2m|1g>\t\tBack registered buffers with hugepages (default: none)\n");
+        printf("\t-r, --registration <pinned|odp|implicit>\tRegister memory pinned or with On-Demand Paging, falling back to pinned (default: pinned)\n");
+        printf("\t-O, --registration-bench\t\tCompare registration, first-touch and steady-state READ costs per registration mode, on -z bytes (default: %d)\n",
+               DEFAULT_REGISTRATION_BENCH_SIZE);
+        printf("\t-D, --fast-connect\t\t\tExchange buffer metadata in the connection's private data instead of SENDs\n");
+        printf("\t-I, --inline <bytes>\t\t\tInline data requested for the QP, 0 to disable (default: %d)\n",
+               DEFAULT_INLINE_SIZE);
+        printf("\t-W, --write-imm\t\t\t\tWRITE the message with an immediate that notifies the server (server needs -W too)\n");
+        printf("\t-g, --gather <fragments>\t\tKeep the message in this many buffers and gather them into one WRITE (at most %d)\n",
+               RDMA_IOV_MAX);
+        printf("\t-R, --ring <bytes>\t\t\tStream -i messages (-m, or -z bytes) through a ring of this size on the server (server needs -R too)\n");
+        printf("\t-C, --credit-stream\t\t\tSEND -i messages (-m, or -z bytes) under credit-based flow control (server needs -C too)\n");
+        printf("\t-F, --file <path>\t\t\tWRITE a file to the server in -z byte chunks, -q in flight (server needs -F too)\n");
+        printf("\t-T, --session <file|-|generate>\t\tSEND every line of a file or stdin, or -i generated messages, over one connection (server needs -T too)\n");
+        printf("\t-K, --kv <records>\t\t\tLoad this many -z byte records into the server's key-value store, then run -i YCSB operations on them (server needs -K)\n");
+        printf("\t-Y, --ycsb <a|b|c>\t\t\tYCSB core workload to run: 50%%, 95%% or 100%% GETs, the rest PUTs (default: a)\n");
+        printf("\t-X, --atomic <faa|cas|lock>\t\tIncrement a server counter -i times with FETCH_AND_ADD or COMPARE_AND_SWAP (server needs -A), or take and drop locks -i times (server needs -l)\n");
+        printf("\t-x, --counter <index>\t\t\tCounter to increment (default: 0)\n");
+        printf("\t-j, --atomic-clients <n>\t\tFork n clients incrementing counters at once (default: 1)\n");
+        printf("\t-U, --spread-counters\t\t\tGive each forked client its own counter, from --counter on, instead of sharing one\n");
+        printf("\t-l, --locks <n>\t\t\t\tSweep the locks taken at random, from --counter on, up to n (default: 1)\n");
+        printf("\t-o, --shared <percent>\t\t\tTake this many percent of locks shared (default: 0)\n");
+        printf("\t-E, --lease <ms>\t\t\tLock lease, after which another client may take a lock over (default: %d)\n",
+               DEFAULT_LOCK_LEASE_MS);
+        printf("\t-N, --connect-rate <connections>\tOpen and close this many connections, timing each phase of their setup (server needs -e)\n");
+        printf("\t-J, --connect-concurrency <n>\t\tConnections kept in flight by --connect-rate (default: %d)\n",
+               DEFAULT_CONNECT_CONCURRENCY);
+        printf("\t-G, --conn-pool <n>\t\t\tMake -i READs of -z bytes over connections leased from a pool keeping n established (server needs -e)\n");
+        printf("\t-e, --idle-expiry <ms>\t\t\tHow long pooled connections beyond --conn-pool stay idle before closing, 0 for ever (default: %d)\n",
+               DEFAULT_CONN_POOL_IDLE_EXPIRY_MS);
+        printf("\t-t, --cm-timeout <ms>\t\t\tTimeout of address and route resolution (default: %d)\n",
+               DEFAULT_CM_TIMEOUT_MS);
+        printf("\t-L, --latency <write|send|read>\t\tRun a latency benchmark instead of sending a message (server needs -L too)\n");
+        printf("\t-B, --bandwidth <write|send|read>\tRun a bandwidth benchmark instead of sending a message (server needs -B too)\n");
+        printf("\t-q, --queue-depth <wrs>\t\t\tBandwidth benchmark operations or FETCH_AND_ADDs kept in flight (default: %d)\n",
+               DEFAULT_QUEUE_DEPTH);
+        printf("\t-S, --signal-every <wrs>\t\tSignal only every Nth bandwidth benchmark WR, at most the queue depth (default: 1)\n");
+        printf("\t-k, --post-batch <wrs>\t\t\tChain up to N bandwidth benchmark WRs per ibv_post_send(), at most the queue depth (default: %d)\n",
+               DEFAULT_SEND_BATCH_SIZE);
+        printf("\t-a, --all-sizes\t\t\t\tSweep bandwidth over sizes from %d bytes up to --size (default: %d)\n",
+               SWEEP_MIN_SIZE, DEFAULT_SWEEP_MAX_SIZE);
+        printf("\t-i, --iterations <n>\t\t\tMeasured benchmark iterations (default: %d latency, %d bandwidth, %d atomic, %d lock, %d key-value)\n",
+               DEFAULT_LATENCY_ITERATIONS, DEFAULT_BANDWIDTH_ITERATIONS,
+               DEFAULT_ATOMIC_OPS, DEFAULT_LOCK_OPS, DEFAULT_KV_OPS);
+        printf("\t-w, --warmup <n>\t\t\tBenchmark iterations run before measuring (default: %d)\n",
+               DEFAULT_LATENCY_WARMUP);
+        printf("\t-z, --size <bytes>\t\t\tBenchmark, largest session message, file chunk or key-value value size (default: %d latency, %d bandwidth, %d session, %d file, %d key-value)\n",
+               DEFAULT_LATENCY_SIZE, DEFAULT_BANDWIDTH_SIZE,
+               DEFAULT_SESSION_MESSAGE_SIZE, DEFAULT_FILE_CHUNK_SIZE,
+               DEFAULT_KV_VALUE_SIZE);
         printf("Example:\n\t./rdma-client -m \"hello\" -s 192.168.0.105 -p 20021\n");
+        printf("\t./rdma-client -L write -z 64 -s 192.168.0.105 -p 20021\n");
+        printf("\t./rdma-client -B write -a -q 64 -s 192.168.0.105 -p 20021\n");
+        printf("\tcat messages.txt | ./rdma-client -T - -s 192.168.0.105 -p 20021\n");
+        printf("\t./rdma-client -X faa -j 8 -s 192.168.0.105 -p 20021\n");
+        printf("\t./rdma-client -X lock -j 16 -l 1024 -o 50 -s 192.168.0.105 -p 20021\n");
+        printf("\t./rdma-client -N 10000 -J 256 -s 192.168.0.105 -p 20021\n");
+        printf("\t./rdma-client -G 8 -z 4096 -s 192.168.0.105 -p 20021\n");
 }
 
+static struct option long_options[] = {
+        {"message", required_argument, NULL, 'm'},
+        {"server", required_argument, NULL, 's'},
+        {"port", required_argument, NULL, 'p'},
+        {"completion", required_argument, NULL, 'c'},
+        {"spin-budget", required_argument, NULL, 'b'},
+        {"cq-batch", required_argument, NULL, 'n'},
+        {"pool-class-bytes", required_argument, NULL, 'P'},
+        {"pool-max-buffer", required_argument, NULL, 'M'},
+        {"hugepages", required_argument, NULL, 'H'},
+        {"registration", required_argument, NULL, 'r'},
+        {"registration-bench", no_argument, NULL, 'O'},
+        {"fast-connect", no_argument, NULL, 'D'},
+        {"inline", required_argument, NULL, 'I'},
+        {"write-imm", no_argument, NULL, 'W'},
+        {"gather", required_argument, NULL, 'g'},
+        {"ring", required_argument, NULL, 'R'},
+        {"credit-stream", no_argument, NULL, 'C'},
+        {"session", required_argument, NULL, 'T'},
+        {"file", required_argument, NULL, 'F'},
+        {"kv", required_argument, NULL, 'K'},
+        {"ycsb", required_argument, NULL, 'Y'},
+        {"atomic", required_argument, NULL, 'X'},
+        {"counter", required_argument, NULL, 'x'},
+        {"atomic-clients", required_argument, NULL, 'j'},
+        {"spread-counters", no_argument, NULL, 'U'},
+        {"locks", required_argument, NULL, 'l'},
+        {"shared", required_argument, NULL, 'o'},
+        {"lease", required_argument, NULL, 'E'},
+        {"connect-rate", required_argument, NULL, 'N'},
+        {"connect-concurrency", required_argument, NULL, 'J'},
+        {"conn-pool", required_argument, NULL, 'G'},
+        {"idle-expiry", required_argument, NULL, 'e'},
+        {"cm-timeout", required_argument, NULL, 't'},
+        {"latency", required_argument, NULL, 'L'},
+        {"bandwidth", required_argument, NULL, 'B'},
+        {"queue-depth", required_argument, NULL, 'q'},
+        {"signal-every", required_argument, NULL, 'S'},
+        {"post-batch", required_argument, NULL, 'k'},
+        {"all-sizes", no_argument, NULL, 'a'},
+        {"iterations", required_argument, NULL, 'i'},
+        {"warmup", required_argument, NULL, 'w'},
+        {"size", required_argument, NULL, 'z'},
+        {NULL, 0, NULL, 0}
+};
+
 int main(int argc, char **argv)
 {
 
         int option;
-        size_t message_len;
-        while ((option = getopt(argc, argv, "m:s:p:")) != -1) {
+        enum completion_mode completion_mode = COMPLETION_MODE_EVENT;
+        unsigned long spin_budget = DEFAULT_SPIN_BUDGET;
+        enum hugepage_mode hugepage_mode = HUGEPAGE_NONE;
+        enum registration_mode registration_mode = REGISTRATION_PINNED;
+        while ((option = getopt_long(argc, argv, "m:s:p:c:b:n:P:M:H:r:ODI:Wg:R:CT:F:K:Y:X:x:j:Ul:o:E:N:J:G:e:t:L:B:q:S:k:ai:w:z:", long_options,
+                                     NULL)) != -1) {
                 switch (option) {
                         case 'm':
-                                /* Allocate some space for our message */
-                                message_len = strlen(optarg);
-                                src_buffer = calloc(message_len + 1, sizeof(char));
-                                if (!src_buffer) {
-                                        fprintf(stderr, "Failed to allocate memory for message\n");
-                                        return -ENOMEM;
-                                }
-
-                                /* Copy the passed argument from optarg to our
-                                 * allocated message buffer. We'll free it when
-                                 * we clean up the client resources.
+                                /* The message is copied into a registered
+                                 * buffer from the pool once it exists.
                                  */
-                                strncpy(src_buffer, optarg, message_len);
-                                printf("src_buffer contents: '%s'\n",
-                                       src_buffer);
+                                message = optarg;
+                                message_len = strlen(optarg);
                                 break;
                         case 's':
                                 server_addr = optarg;
@@ -762,20 +3837,524 @@ int main(int argc, char **argv)
                         case 'p':
                                 server_port = optarg;
                                 break;
+                        case 'c':
+                                if (parse_completion_mode(optarg,
+                                                          &completion_mode)) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'b':
+                                spin_budget = strtoul(optarg, NULL, 10);
+                                break;
+                        case 'n':
+                                cq_batch_size = atoi(optarg);
+                                if (cq_batch_size < 1) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'P':
+                                pool_class_bytes = strtoul(optarg, NULL, 10);
+                                break;
+                        case 'M':
+                                pool_max_buffer = strtoul(optarg, NULL, 10);
+                                break;
+                        case 'H':
+                                if (parse_hugepage_mode(optarg,
+                                                        &hugepage_mode)) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'r':
+                                if (parse_registration_mode(optarg,
+                                                            &registration_mode)) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'O':
+                                registration_bench = 1;
+                                break;
+                        case 'D':
+                                fast_connect = 1;
+                                break;
+                        case 'N':
+                                connect_total = strtoul(optarg, NULL, 10);
+                                if (!connect_total) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'J':
+                                connect_concurrency = atoi(optarg);
+                                if (connect_concurrency < 1) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'G':
+                                conn_pool_size = atoi(optarg);
+                                if (conn_pool_size < 1) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'e':
+                                conn_pool_idle_expiry_ms = strtoul(optarg, NULL, 10);
+                                break;
+                        case 't':
+                                cm_timeout_ms = atoi(optarg);
+                                if (cm_timeout_ms < 1) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'I':
+                                inline_size = strtoul(optarg, NULL, 10);
+                                break;
+                        case 'W':
+                                write_imm = 1;
+                                break;
+                        case 'g':
+                                gather_fragments = atoi(optarg);
+                                if (gather_fragments < 1 ||
+                                    gather_fragments > RDMA_IOV_MAX) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'C':
+                                credit_stream = 1;
+                                break;
+                        case 'T':
+                                session_source = optarg;
+                                break;
+                        case 'F':
+                                file_input = optarg;
+                                break;
+                        case 'K':
+                                kv_records = strtoull(optarg, NULL, 10);
+                                if (!kv_records) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'Y':
+                                if (strlen(optarg) != 1 ||
+                                    !strchr("abc", optarg[0])) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                ycsb_workload = optarg[0];
+                                break;
+                        case 'X':
+                                if (parse_atomic_op(optarg, &atomic_op)) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'x':
+                                atomic_counter = strtoul(optarg, NULL, 10);
+                                break;
+                        case 'j':
+                                atomic_clients = atoi(optarg);
+                                if (atomic_clients < 1) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'U':
+                                spread_counters = 1;
+                                break;
+                        case 'l':
+                                lock_count = strtoul(optarg, NULL, 10);
+                                if (!lock_count) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'o':
+                                lock_shared_percent = atoi(optarg);
+                                if (lock_shared_percent < 0 ||
+                                    lock_shared_percent > 100) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'E':
+                                lock_lease_ms = strtoul(optarg, NULL, 10);
+                                /* Leases compare by distance on a 32-bit clock */
+                                if (!lock_lease_ms || lock_lease_ms > INT32_MAX) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'R':
+                                ring_size = strtoull(optarg, NULL, 10);
+                                if (!ring_data_size(ring_size)) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'L':
+                                if (parse_benchmark_op(optarg, &latency_op)) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'B':
+                                if (parse_benchmark_op(optarg, &bandwidth_op)) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'q':
+                                queue_depth = atoi(optarg);
+                                if (queue_depth < 1) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'S':
+                                signal_interval = atoi(optarg);
+                                if (signal_interval < 1) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'k':
+                                post_batch_size = atoi(optarg);
+                                if (post_batch_size < 1) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'a':
+                                sweep_sizes = 1;
+                                break;
+                        case 'i':
+                                benchmark_iterations = strtoul(optarg, NULL, 10);
+                                break;
+                        case 'w':
+                                latency_warmup = strtoul(optarg, NULL, 10);
+                                break;
+                        case 'z':
+                                benchmark_size = strtoul(optarg, NULL, 10);
+                                if (!benchmark_size) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
                         default:
-                                print_usage;
+                                print_usage();
                                 exit(1);
                 }
 
         }
+        set_completion_mode(completion_mode, spin_budget);
+        printf("Completion mode: %s, spin budget: %lu\n",
+               completion_mode_str(completion_mode), spin_budget);
+        set_hugepage_mode(hugepage_mode);
+        printf("Hugepages: %s\n", hugepage_mode_str(hugepage_mode));
+        set_registration_mode(registration_mode);
+        printf("Registration: %s\n", registration_mode_str(registration_mode));
 
-        if (!src_buffer) {
+        if (connect_total) {
+                if (message || session_source || file_input || write_imm ||
+                    ring_size || credit_stream || registration_bench ||
+                    fast_connect || kv_records || atomic_op != ATOMIC_OP_NONE ||
+                    latency_op != BENCHMARK_OP_NONE ||
+                    bandwidth_op != BENCHMARK_OP_NONE) {
+                        fprintf(stderr, "--connect-rate runs on its own\n");
+                        print_usage();
+                        return 1;
+                }
+        }
+        if (conn_pool_size) {
+                if (message || session_source || file_input || write_imm ||
+                    ring_size || credit_stream || registration_bench ||
+                    connect_total || kv_records || atomic_op != ATOMIC_OP_NONE ||
+                    latency_op != BENCHMARK_OP_NONE ||
+                    bandwidth_op != BENCHMARK_OP_NONE) {
+                        fprintf(stderr, "--conn-pool runs on its own\n");
+                        print_usage();
+                        return 1;
+                }
+                if (!benchmark_iterations) {
+                        benchmark_iterations = DEFAULT_CONN_POOL_REQUESTS;
+                }
+                if (!benchmark_size) {
+                        benchmark_size = DEFAULT_LATENCY_SIZE;
+                }
+        } else if (conn_pool_idle_expiry_ms != DEFAULT_CONN_POOL_IDLE_EXPIRY_MS) {
+                fprintf(stderr, "--idle-expiry only applies to --conn-pool\n");
+                print_usage();
+                return 1;
+        }
+        if (registration_bench) {
+                if (message || session_source || file_input || write_imm ||
+                    ring_size || credit_stream ||
+                    latency_op != BENCHMARK_OP_NONE ||
+                    bandwidth_op != BENCHMARK_OP_NONE) {
+                        fprintf(stderr, "--registration-bench runs on its own\n");
+                        print_usage();
+                        return 1;
+                }
+                /* The server's buffer, READ back, is as big as ours */
+                if (!benchmark_size) {
+                        benchmark_size = DEFAULT_REGISTRATION_BENCH_SIZE;
+                }
+        }
+        if (session_source) {
+                if (message || credit_stream) {
+                        fprintf(stderr, "--session takes its messages from its source, not -m or --credit-stream\n");
+                        print_usage();
+                        return 1;
+                }
+                /* A session is a credit stream of real messages */
+                credit_stream = 1;
+                if (!benchmark_size) {
+                        benchmark_size = DEFAULT_SESSION_MESSAGE_SIZE;
+                }
+                if (!benchmark_iterations) {
+                        benchmark_iterations = DEFAULT_SESSION_MESSAGES;
+                }
+        }
+        if (file_input) {
+                if (message || write_imm || session_source || credit_stream ||
+                    ring_size) {
+                        fprintf(stderr, "--file can't be combined with -m, --write-imm, --ring, --credit-stream or --session\n");
+                        print_usage();
+                        return 1;
+                }
+                if (!benchmark_size) {
+                        benchmark_size = DEFAULT_FILE_CHUNK_SIZE;
+                }
+        }
+        if (kv_records) {
+                if (message || write_imm || ring_size || credit_stream ||
+                    session_source || file_input || registration_bench ||
+                    atomic_op != ATOMIC_OP_NONE ||
+                    latency_op != BENCHMARK_OP_NONE ||
+                    bandwidth_op != BENCHMARK_OP_NONE) {
+                        fprintf(stderr, "--kv runs on its own\n");
+                        print_usage();
+                        return 1;
+                }
+                if (!benchmark_iterations) {
+                        benchmark_iterations = DEFAULT_KV_OPS;
+                }
+                if (!benchmark_size) {
+                        benchmark_size = DEFAULT_KV_VALUE_SIZE;
+                }
+                if (benchmark_size > KV_MAX_VALUE_LENGTH) {
+                        fprintf(stderr, "Key-value values can't exceed %u bytes\n",
+                                KV_MAX_VALUE_LENGTH);
+                        return 1;
+                }
+        }
+        if (atomic_op != ATOMIC_OP_NONE) {
+                if (message || write_imm || ring_size || credit_stream ||
+                    session_source || file_input || registration_bench ||
+                    latency_op != BENCHMARK_OP_NONE ||
+                    bandwidth_op != BENCHMARK_OP_NONE) {
+                        fprintf(stderr, "--atomic runs on its own\n");
+                        print_usage();
+                        return 1;
+                }
+                /* Every atomic returns a value, so every one is signaled */
+                if (signal_interval != 1) {
+                        fprintf(stderr, "--signal-every doesn't apply to --atomic\n");
+                        print_usage();
+                        return 1;
+                }
+                if (atomic_op == ATOMIC_OP_LOCK && spread_counters) {
+                        fprintf(stderr, "--spread-counters doesn't apply to locks\n");
+                        print_usage();
+                        return 1;
+                }
+                if (!benchmark_iterations) {
+                        benchmark_iterations = atomic_op == ATOMIC_OP_LOCK ?
+                                               DEFAULT_LOCK_OPS :
+                                               DEFAULT_ATOMIC_OPS;
+                }
+                /* The server hands out counters, not a buffer of ours */
+                benchmark_size = sizeof(uint64_t);
+        } else if (atomic_clients > 1 || spread_counters) {
+                fprintf(stderr, "--atomic-clients and --spread-counters only apply to --atomic\n");
+                print_usage();
+                return 1;
+        }
+        if (atomic_op != ATOMIC_OP_LOCK &&
+            (lock_count > 1 || lock_shared_percent ||
+             lock_lease_ms != DEFAULT_LOCK_LEASE_MS)) {
+                fprintf(stderr, "--locks, --shared and --lease only apply to --atomic lock\n");
+                print_usage();
+                return 1;
+        }
+        if (latency_op != BENCHMARK_OP_NONE && bandwidth_op != BENCHMARK_OP_NONE) {
+                fprintf(stderr, "Pick one of --latency and --bandwidth\n");
+                print_usage();
+                return 1;
+        }
+        if ((latency_op != BENCHMARK_OP_NONE || bandwidth_op != BENCHMARK_OP_NONE) &&
+            (write_imm || ring_size || credit_stream || file_input)) {
+                fprintf(stderr, "Benchmarks can't be combined with --write-imm, --ring, --credit-stream or --file\n");
+                print_usage();
+                return 1;
+        }
+        if (gather_fragments &&
+            (latency_op != BENCHMARK_OP_NONE || bandwidth_op != BENCHMARK_OP_NONE ||
+             ring_size || credit_stream || !message)) {
+                fprintf(stderr, "--gather only applies to sending a -m message\n");
+                print_usage();
+                return 1;
+        }
+        if (gather_fragments > (int) message_len) {
+                fprintf(stderr, "Can't split a %lu byte message into %d fragments\n",
+                        (unsigned long) message_len, gather_fragments);
+                return 1;
+        }
+        if (ring_size && credit_stream) {
+                fprintf(stderr, "Pick one of --ring and --credit-stream\n");
+                print_usage();
+                return 1;
+        }
+        if (credit_stream) {
+                /* Stream the message, or -z bytes of filler */
+                if (!message && !benchmark_size) {
+                        benchmark_size = DEFAULT_STREAM_MESSAGE_SIZE;
+                }
+                if (!benchmark_iterations) {
+                        benchmark_iterations = DEFAULT_STREAM_MESSAGES;
+                }
+        }
+        if (ring_size) {
+                /* The ring carries the message, the buffers hold the ring */
+                if (message) {
+                        ring_payload_len = message_len;
+                } else {
+                        ring_payload_len = benchmark_size ? benchmark_size :
+                                           DEFAULT_STREAM_MESSAGE_SIZE;
+                }
+                if (!ring_payload_len ||
+                    ring_payload_len > ring_max_payload(ring_size)) {
+                        fprintf(stderr, "Ring messages must be 1 to %u bytes for a %lu byte ring\n",
+                                ring_max_payload(ring_size),
+                                (unsigned long) ring_size);
+                        return 1;
+                }
+                if (ring_size > UINT32_MAX) {
+                        fprintf(stderr, "Ring can't exceed %u bytes\n", UINT32_MAX);
+                        return 1;
+                }
+                ring_payload = message;
+                if (!benchmark_iterations) {
+                        benchmark_iterations = DEFAULT_STREAM_MESSAGES;
+                }
+                message = NULL;
+                benchmark_size = 0;
+                message_len = ring_size;
+        }
+        /* Every other mode signals each of its queue_depth WRs, which the
+         * CQ is only sized for with every WR signaled.
+         */
+        if (signal_interval != 1 && bandwidth_op == BENCHMARK_OP_NONE) {
+                fprintf(stderr, "--signal-every only applies to --bandwidth\n");
+                print_usage();
+                return 1;
+        }
+        /* A window without a signaled WR would never complete */
+        if (signal_interval > queue_depth) {
+                fprintf(stderr, "--signal-every can't exceed --queue-depth\n");
+                print_usage();
+                return 1;
+        }
+        /* A batch bigger than the in-flight window would never fill */
+        if (post_batch_size > queue_depth) {
+                fprintf(stderr, "--post-batch can't exceed --queue-depth\n");
+                print_usage();
+                return 1;
+        }
+        if (latency_op != BENCHMARK_OP_NONE) {
+                if (!benchmark_iterations) {
+                        benchmark_iterations = DEFAULT_LATENCY_ITERATIONS;
+                }
+                if (!benchmark_size) {
+                        benchmark_size = DEFAULT_LATENCY_SIZE;
+                }
+        } else if (bandwidth_op != BENCHMARK_OP_NONE) {
+                if (!benchmark_iterations) {
+                        benchmark_iterations = DEFAULT_BANDWIDTH_ITERATIONS;
+                }
+                if (!benchmark_size) {
+                        benchmark_size = sweep_sizes ? DEFAULT_SWEEP_MAX_SIZE :
+                                                       DEFAULT_BANDWIDTH_SIZE;
+                }
+        }
+        if (benchmark_size) {
+                /* Buffers are sized for the largest benchmark message */
+                message = NULL;
+                message_len = benchmark_size;
+        } else if (!message && !ring_size && !connect_total) {
                 printf("Please provide a string message to send/recv\n");
                 print_usage();
                 return 1;
         }
 
-        int ret = setup_client();
+        int ret = 0;
+        if (atomic_op == ATOMIC_OP_LOCK) {
+                /* The parent only coordinates the rounds, each child is a client */
+                ret = run_lock_sweep();
+                if (ret <= 0) {
+                        return ret;
+                }
+        } else if (atomic_clients > 1) {
+                /* The parent only coordinates, each child is a client */
+                struct atomic_result total;
+                ret = fork_atomic_clients(&total);
+                if (ret <= 0) {
+                        return ret;
+                }
+        }
+
+        if (connect_total) {
+                ret = run_connect_rate();
+                cleanup_client();
+                return ret;
+        }
+        if (conn_pool_size) {
+                ret = run_conn_pool_benchmark();
+                cleanup_client();
+                return ret;
+        }
+
+        ret = completion_table_init(&completion_table, 16 + signaled_depth(),
+                                    cq_batch_size);
+        if (ret) {
+                return ret;
+        }
+
+        if (session_source) {
+                ret = open_session_source();
+                if (ret) {
+                        cleanup_client();
+                        return ret;
+                }
+        }
+        if (file_input) {
+                file_fd = open(file_input, O_RDONLY);
+                if (file_fd < 0) {
+                        fprintf(stderr, "Failed to open %s: %s\n", file_input,
+                                strerror(errno));
+                        cleanup_client();
+                        return -errno;
+                }
+        }
+
+        ret = setup_client();
         if (ret) {
                 cleanup_client();
                 return ret;
@@ -787,38 +4366,104 @@ int main(int argc, char **argv)
                 return ret;
         }
 
-        ret = create_completion_channel();
+        ret = setup_buffer_pool();
         if (ret) {
                 cleanup_client();
                 return ret;
         }
 
-        ret = create_completion_queue();
+        ret = create_completion_channel();
         if (ret) {
                 cleanup_client();
                 return ret;
         }
 
-        ret = setup_queue_pairs();
+        ret = create_completion_queue();
         if (ret) {
                 cleanup_client();
                 return ret;
         }
 
-        ret = post_metadata_recv_buffer();
+        ret = setup_queue_pairs();
         if (ret) {
                 cleanup_client();
                 return ret;
         }
 
+        /* A fast connect has no metadata SEND coming from the server */
+        if (!fast_connect) {
+                ret = post_metadata_recv_buffer();
+                if (ret) {
+                        cleanup_client();
+                        return ret;
+                }
+        }
+
+        if (credit_stream) {
+                ret = post_credit_recvs();
+                if (ret) {
+                        cleanup_client();
+                        return ret;
+                }
+        }
+
+        prepare_client_metadata();
         ret = connect_to_server();
         if (ret) {
                 cleanup_client();
                 return ret;
         }
 
-        ret = exchange_metadata_with_server();
-        if (ret) {
+        if (!fast_connect) {
+                ret = exchange_metadata_with_server();
+                if (ret) {
+                        cleanup_client();
+                        return ret;
+                }
+        }
+
+        if (latency_op != BENCHMARK_OP_NONE) {
+                ret = run_latency_benchmark();
+                cleanup_client();
+                return ret;
+        }
+        if (bandwidth_op != BENCHMARK_OP_NONE) {
+                ret = run_bandwidth_benchmark();
+                cleanup_client();
+                return ret;
+        }
+        if (ring_size) {
+                ret = run_ring_stream();
+                cleanup_client();
+                return ret;
+        }
+        if (session_source) {
+                ret = run_session();
+                cleanup_client();
+                return ret;
+        }
+        if (file_input) {
+                ret = run_file_transfer();
+                cleanup_client();
+                return ret;
+        }
+        if (registration_bench) {
+                ret = run_registration_bench();
+                cleanup_client();
+                return ret;
+        }
+        if (atomic_op != ATOMIC_OP_NONE) {
+                ret = run_atomic_benchmark();
+                cleanup_client();
+                return ret;
+        }
+        if (kv_records) {
+                ret = run_kv_benchmark();
+                cleanup_client();
+                return ret;
+        }
+        if (credit_stream) {
+                ret = run_credit_stream();
                 cleanup_client();
                 return ret;
         }
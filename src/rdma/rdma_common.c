@@ -36,52 +36,181 @@ int process_rdma_event(struct rdma_event_channel *event_channel,
         return 0;
 }
 
-int process_work_completion_event(struct ibv_comp_channel *completion_channel,
-                                  struct ibv_wc *wc, int expected_wc)
+void fast_connect_init(struct rdma_fast_connect *fast_connect,
+                       const struct rdma_buffer_attr *buffer)
+{
+        fast_connect->magic = htonl(RDMA_FAST_CONNECT_MAGIC);
+        fast_connect->buffer = *buffer;
+}
+
+int parse_fast_connect(const void *private_data, uint8_t len,
+                       struct rdma_buffer_attr *buffer)
+{
+        struct rdma_fast_connect fast_connect;
+
+        if (!private_data || len < sizeof(fast_connect)) {
+                return 0;
+        }
+        memcpy(&fast_connect, private_data, sizeof(fast_connect));
+        if (ntohl(fast_connect.magic) != RDMA_FAST_CONNECT_MAGIC) {
+                return 0;
+        }
+        *buffer = fast_connect.buffer;
+        return 1;
+}
+
+/* Completion strategy used by process_work_completion_event() */
+static enum completion_mode completion_mode = COMPLETION_MODE_EVENT;
+static unsigned long completion_spin_budget = DEFAULT_SPIN_BUDGET;
+
+void set_completion_mode(enum completion_mode mode, unsigned long spin_budget)
+{
+        completion_mode = mode;
+        completion_spin_budget = spin_budget;
+}
+
+enum completion_mode get_completion_mode()
+{
+        return completion_mode;
+}
+
+int parse_completion_mode(const char *str, enum completion_mode *mode)
+{
+        if (strcmp(str, "event") == 0) {
+                *mode = COMPLETION_MODE_EVENT;
+        } else if (strcmp(str, "poll") == 0) {
+                *mode = COMPLETION_MODE_POLL;
+        } else if (strcmp(str, "hybrid") == 0) {
+                *mode = COMPLETION_MODE_HYBRID;
+        } else {
+                fprintf(stderr, "Unknown completion mode '%s'\n", str);
+                return -EINVAL;
+        }
+        return 0;
+}
+
+const char *completion_mode_str(enum completion_mode mode)
+{
+        switch (mode) {
+                case COMPLETION_MODE_EVENT:
+                        return "event";
+                case COMPLETION_MODE_POLL:
+                        return "poll";
+                case COMPLETION_MODE_HYBRID:
+                        return "hybrid";
+                default:
+                        return "unknown";
+        }
+}
+
+/*
+ * Polls the CQ once for up to expected_wc - *total_wc WC elements, appending
+ * them to wc and advancing *total_wc.
+ *
+ * Returns the number of WC elements retrieved, or a negative value if polling
+ * failed.
+ */
+static int poll_completion_queue(struct ibv_cq *cq, struct ibv_wc *wc,
+                                 int expected_wc, int *total_wc)
+{
+        int ret = ibv_poll_cq(
+                cq, /* The CQ we're polling */
+                expected_wc - *total_wc, /* Remaining WC elements */
+                wc + *total_wc
+        );
+        if (ret < 0) {
+                fprintf(stderr, "Failed to poll the CQ for a WC event: %s\n",
+                        strerror(-ret));
+                return ret;
+        }
+        *total_wc += ret;
+        return ret;
+}
+
+/*
+ * Blocks for the next IO completion event on completion_channel, ACKs it and
+ * re-arms the CQ that raised it, storing that CQ in *cq_ptr.
+ *
+ * Returns 0 if successful, -errno otherwise.
+ */
+static int wait_for_cq_event(struct ibv_comp_channel *completion_channel,
+                             struct ibv_cq **cq_ptr)
 {
-        struct ibv_cq *cq_ptr = NULL;
         void *context = NULL; /* User-defined CQ context, N/A here */
-        int ret = 0;
-        int total_wc = 0; /* Number of WC elements we've processed so far */
 
         /* Blocks and waits for the next IO completion event */
-        ret = ibv_get_cq_event(
+        int ret = ibv_get_cq_event(
                 completion_channel, /* IO Completion Channel */
-                &cq_ptr, /* Which CQ has activity, should match same CQ we created */
-                &context /* User context for CQ, which we didn't set */
+                cq_ptr, /* Which CQ has activity */
+                &context /* User context for CQ */
         );
         if (ret) {
                 fprintf(stderr, "Failed to get CQ event: %s\n",
                         strerror(errno));
-		return -errno;
+                return -errno;
         }
 
-        /* Immediately request more notifications */
-        ret = ibv_req_notify_cq(cq_ptr, 0);
+        /* ACK the CQ event. We only get 1 CQ event notification for n WR
+         * elements; this is not the number of WC elements we got/expected.
+         */
+        ibv_ack_cq_events(*cq_ptr, 1);
+
+        /* Immediately request more notifications, before polling, so a WC
+         * arriving after our last poll still raises an event.
+         */
+        ret = ibv_req_notify_cq(*cq_ptr, 0);
         if (ret) {
                 fprintf(stderr, "Failed to request notifications for CQ events: %s\n",
                         strerror(errno));
-		return -errno;
+                return -errno;
         }
+        return 0;
+}
 
-        /* Since we've received a CQ notification, we now need to process
-         * expected_wc WC elements. ibv_poll_cq() can return 0 or more WC
-         * elements, or errno in the case of failure to poll.
+int process_work_completion_event(struct ibv_comp_channel *completion_channel,
+                                  struct ibv_cq *cq,
+                                  struct ibv_wc *wc, int expected_wc)
+{
+        struct ibv_cq *cq_ptr = NULL;
+        int ret = 0;
+        int total_wc = 0; /* Number of WC elements we've processed so far */
+        unsigned long spins = 0;
+
+        /* Unless we're in pure event mode, spin on the CQ first. WCs found
+         * here never touch the completion channel, which saves the interrupt
+         * and wakeup latency. The CQ stays armed the whole time; if it fires
+         * for completions we've already polled, the stale event is consumed
+         * harmlessly by the next blocking wait.
          */
-        do {
-                ret = ibv_poll_cq(
-                        cq_ptr, /* The CQ we got a notification for */
-                        expected_wc - total_wc, /* Remaining WC elements */
-                        wc + total_wc
-                );
+        while (completion_mode != COMPLETION_MODE_EVENT &&
+               total_wc < expected_wc &&
+               (completion_mode == COMPLETION_MODE_POLL ||
+                spins < completion_spin_budget)) {
+                ret = poll_completion_queue(cq, wc, expected_wc, &total_wc);
                 if (ret < 0) {
-                        /* ret is errno, in case of failure */
-                        fprintf(stderr, "Failed to poll the CQ for a WC event: %s\n",
-                                strerror(ret));
-		        return -ret;
+                        return ret;
                 }
-                total_wc += ret;
-        } while (total_wc < expected_wc);
+                spins++;
+        }
+
+        while (total_wc < expected_wc) {
+                ret = wait_for_cq_event(completion_channel, &cq_ptr);
+                if (ret) {
+                        return ret;
+                }
+
+                /* Drain whatever is on the CQ now. ibv_poll_cq() can return 0
+                 * or more WC elements; once it comes back empty we go back to
+                 * waiting for the next notification.
+                 */
+                do {
+                        ret = poll_completion_queue(cq_ptr, wc, expected_wc,
+                                                    &total_wc);
+                        if (ret < 0) {
+                                return ret;
+                        }
+                } while (ret > 0 && total_wc < expected_wc);
+        }
 
         /* Now that we've gotten expected_wc WC elements, we need to check each
          * one's status.
@@ -97,42 +226,821 @@ int process_work_completion_event(struct ibv_comp_channel *completion_channel,
                        ibv_wc_status_str(wc[i].status));
         }
 
-        /* Finally, ACK the CQ event. We only got 1 CQ event notification for
-         * n WR elements; this is not the number of WC elements we got/expected.
-         */
-        ibv_ack_cq_events(cq_ptr, 1);
+        return total_wc;
+}
+
+int completion_table_init(struct completion_table *table, uint32_t capacity,
+                          int batch_size)
+{
+        memset(table, 0, sizeof(*table));
+        table->slots = calloc(capacity, sizeof(*table->slots));
+        table->wc = calloc(batch_size, sizeof(*table->wc));
+        if (!table->slots || !table->wc) {
+                fprintf(stderr, "Failed to allocate completion table: -ENOMEM\n");
+                completion_table_destroy(table);
+                return -ENOMEM;
+        }
+        table->capacity = capacity;
+        table->batch_size = batch_size;
+
+        /* Chain all slots onto the free list */
+        for (uint32_t i = 0; i < capacity; i++) {
+                table->slots[i].next_free = (i + 1 < capacity) ? (int64_t) i + 1 : -1;
+        }
+        table->free_head = capacity ? 0 : -1;
+        return 0;
+}
+
+void completion_table_destroy(struct completion_table *table)
+{
+        free(table->slots);
+        free(table->wc);
+        memset(table, 0, sizeof(*table));
+        table->free_head = -1;
+}
+
+/*
+ * Doubles the capacity of a full completion table, chaining the new slots
+ * onto the free list.
+ */
+static int grow_completion_table(struct completion_table *table)
+{
+        uint32_t capacity = table->capacity ? table->capacity * 2 : 16;
+        struct completion_slot *slots = realloc(table->slots,
+                                                capacity * sizeof(*slots));
+        if (!slots) {
+                fprintf(stderr, "Failed to grow completion table: -ENOMEM\n");
+                return -ENOMEM;
+        }
+
+        for (uint32_t i = table->capacity; i < capacity; i++) {
+                slots[i].callback = NULL;
+                slots[i].context = NULL;
+                slots[i].next_free = (i + 1 < capacity) ? i + 1 : table->free_head;
+        }
+        table->free_head = table->capacity;
+        table->slots = slots;
+        table->capacity = capacity;
+        return 0;
+}
+
+int completion_table_register(struct completion_table *table,
+                              completion_callback callback, void *context,
+                              uint64_t *wr_id)
+{
+        if (table->free_head == -1 && grow_completion_table(table)) {
+                return -ENOMEM;
+        }
+
+        int64_t index = table->free_head;
+        struct completion_slot *slot = &table->slots[index];
+        table->free_head = slot->next_free;
+        slot->callback = callback;
+        slot->context = context;
+        slot->next_free = -1;
+        table->outstanding++;
+
+        *wr_id = (uint64_t) index;
+        return 0;
+}
+
+void completion_table_cancel(struct completion_table *table, uint64_t wr_id)
+{
+        if (wr_id >= table->capacity || !table->slots[wr_id].callback) {
+                return;
+        }
+
+        struct completion_slot *slot = &table->slots[wr_id];
+        slot->callback = NULL;
+        slot->context = NULL;
+        slot->next_free = table->free_head;
+        table->free_head = (int64_t) wr_id;
+        table->outstanding--;
+}
+
+void completion_table_cancel_context(struct completion_table *table,
+                                     void *context)
+{
+        for (uint32_t i = 0; i < table->capacity; i++) {
+                if (table->slots[i].callback &&
+                    table->slots[i].context == context) {
+                        completion_table_cancel(table, i);
+                }
+        }
+}
+
+/*
+ * Routes a single WC to the callback registered for its wr_id, releasing the
+ * slot first so the callback may reuse it.
+ *
+ * Returns 0 if the WC completed successfully, -1 otherwise.
+ */
+static int dispatch_work_completion(struct completion_table *table,
+                                    struct ibv_wc *wc)
+{
+        if (wc->status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "Failed status %s (%d) for wr_id %lu\n",
+                        ibv_wc_status_str(wc->status), wc->status,
+                        (unsigned long) wc->wr_id);
+        }
+
+        if (wc->wr_id >= table->capacity || !table->slots[wc->wr_id].callback) {
+                fprintf(stderr, "No handler registered for wr_id %lu\n",
+                        (unsigned long) wc->wr_id);
+                return -1;
+        }
+
+        struct completion_slot slot = table->slots[wc->wr_id];
+        completion_table_cancel(table, wc->wr_id);
+        slot.callback(wc, slot.context);
+
+        return wc->status == IBV_WC_SUCCESS ? 0 : -1;
+}
+
+/*
+ * Polls cq a batch at a time until it comes back short, which means the CQ is
+ * empty, dispatching every WC. *failed is set if any WC had a failed status.
+ *
+ * Returns the number of WCs dispatched, or a negative value if polling failed.
+ */
+static int dispatch_completion_batches(struct ibv_cq *cq,
+                                       struct completion_table *table,
+                                       int *failed)
+{
+        int total_wc = 0;
+        int ret = 0;
+
+        do {
+                ret = ibv_poll_cq(cq, table->batch_size, table->wc);
+                if (ret < 0) {
+                        fprintf(stderr, "Failed to poll the CQ for a WC event: %s\n",
+                                strerror(-ret));
+                        return ret;
+                }
+                for (int i = 0; i < ret; i++) {
+                        if (dispatch_work_completion(table, &table->wc[i])) {
+                                *failed = 1;
+                        }
+                }
+                total_wc += ret;
+        } while (ret == table->batch_size);
 
         return total_wc;
 }
 
+int drain_completion_queue(struct ibv_cq *cq, struct completion_table *table)
+{
+        int failed = 0;
+        return dispatch_completion_batches(cq, table, &failed);
+}
+
+int process_completions(struct ibv_comp_channel *completion_channel,
+                        struct ibv_cq *cq, struct completion_table *table,
+                        int min_wc)
+{
+        struct ibv_cq *cq_ptr = cq;
+        int total_wc = 0;
+        int failed = 0;
+        int ret = 0;
+        unsigned long spins = 0;
+
+        for (;;) {
+                /* Drain everything that's ready, a batch at a time */
+                ret = dispatch_completion_batches(cq_ptr, table, &failed);
+                if (ret < 0) {
+                        return ret;
+                }
+                total_wc += ret;
+
+                if (total_wc >= min_wc) {
+                        break;
+                }
+
+                /* Keep spinning while the strategy allows it, otherwise block
+                 * until the CQ raises its next event.
+                 */
+                if (completion_mode == COMPLETION_MODE_POLL ||
+                    (completion_mode == COMPLETION_MODE_HYBRID &&
+                     spins++ < completion_spin_budget)) {
+                        continue;
+                }
+                ret = wait_for_cq_event(completion_channel, &cq_ptr);
+                if (ret) {
+                        return ret;
+                }
+        }
+
+        return failed ? -1 : total_wc;
+}
+
+/* How register_rdma_memory() registers Memory Regions */
+static enum registration_mode registration_mode = REGISTRATION_PINNED;
+
+/* Access an RC QP's Memory Regions need ODP support for */
+#define RC_ODP_CAPS (IBV_ODP_SUPPORT_SEND | IBV_ODP_SUPPORT_RECV | \
+                     IBV_ODP_SUPPORT_WRITE | IBV_ODP_SUPPORT_READ)
+
+/* Most Protection Domains with an implicit ODP MR at a time */
+#define MAX_IMPLICIT_MRS 8
+
+/*
+ * The implicit ODP MR of a Protection Domain, shared by every range
+ * registered under it. Registration can happen from server workers, so the
+ * table is guarded by implicit_mrs_lock.
+ */
+struct implicit_mr {
+        struct ibv_pd *pd;
+        struct ibv_mr *mr;
+        int users;
+};
+
+static struct implicit_mr implicit_mrs[MAX_IMPLICIT_MRS];
+static pthread_mutex_t implicit_mrs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Most devices whose ODP capabilities are cached at a time */
+#define MAX_ODP_DEVICES 8
+
+/*
+ * The ODP capabilities of a device, queried on its first registration
+ * rather than on every one. Guarded by odp_devices_lock.
+ */
+struct odp_device {
+        struct ibv_context *context;
+        struct ibv_odp_caps caps;
+};
+
+static struct odp_device odp_devices[MAX_ODP_DEVICES];
+static pthread_mutex_t odp_devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void set_registration_mode(enum registration_mode mode)
+{
+        registration_mode = mode;
+}
+
+enum registration_mode get_registration_mode()
+{
+        return registration_mode;
+}
+
+int parse_registration_mode(const char *str, enum registration_mode *mode)
+{
+        if (strcmp(str, "pinned") == 0) {
+                *mode = REGISTRATION_PINNED;
+        } else if (strcmp(str, "odp") == 0) {
+                *mode = REGISTRATION_ODP;
+        } else if (strcmp(str, "implicit") == 0) {
+                *mode = REGISTRATION_IMPLICIT_ODP;
+        } else {
+                fprintf(stderr, "Unknown registration mode '%s'\n", str);
+                return -EINVAL;
+        }
+        return 0;
+}
+
+const char *registration_mode_str(enum registration_mode mode)
+{
+        switch (mode) {
+                case REGISTRATION_PINNED:
+                        return "pinned";
+                case REGISTRATION_ODP:
+                        return "odp";
+                case REGISTRATION_IMPLICIT_ODP:
+                        return "implicit";
+                default:
+                        return "unknown";
+        }
+}
+
+/*
+ * Fills caps with the ODP capabilities of the device behind context, querying
+ * it only the first time.
+ *
+ * Returns 0 if successful, -1 if the device couldn't be queried.
+ */
+static int query_odp_caps(struct ibv_context *context, struct ibv_odp_caps *caps)
+{
+        struct odp_device *free_slot = NULL;
+        struct ibv_device_attr_ex attr;
+        int ret = 0;
+
+        pthread_mutex_lock(&odp_devices_lock);
+        for (int i = 0; i < MAX_ODP_DEVICES; i++) {
+                if (odp_devices[i].context == context) {
+                        *caps = odp_devices[i].caps;
+                        pthread_mutex_unlock(&odp_devices_lock);
+                        return 0;
+                }
+                if (!odp_devices[i].context && !free_slot) {
+                        free_slot = &odp_devices[i];
+                }
+        }
+        memset(&attr, 0, sizeof(attr));
+        if (ibv_query_device_ex(context, NULL, &attr)) {
+                ret = -1;
+        } else {
+                *caps = attr.odp_caps;
+                if (free_slot) {
+                        free_slot->context = context;
+                        free_slot->caps = attr.odp_caps;
+                }
+        }
+        pthread_mutex_unlock(&odp_devices_lock);
+        return ret;
+}
+
+/*
+ * Returns the most capable mode, up to mode, that the device behind pd
+ * supports for RC QPs accessing memory with access.
+ */
+static enum registration_mode supported_registration_mode(struct ibv_pd *pd,
+                                                          enum registration_mode mode,
+                                                          int access)
+{
+        struct ibv_odp_caps caps;
+        uint32_t rc_odp_caps = RC_ODP_CAPS;
+
+        if (mode == REGISTRATION_PINNED) {
+                return mode;
+        }
+        if (access & IBV_ACCESS_REMOTE_ATOMIC) {
+                rc_odp_caps |= IBV_ODP_SUPPORT_ATOMIC;
+        }
+        if (query_odp_caps(pd->context, &caps) ||
+            !(caps.general_caps & IBV_ODP_SUPPORT) ||
+            (caps.per_transport_caps.rc_odp_caps & rc_odp_caps) !=
+            rc_odp_caps) {
+                return REGISTRATION_PINNED;
+        }
+        if (mode == REGISTRATION_IMPLICIT_ODP &&
+            !(caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT)) {
+                return REGISTRATION_ODP;
+        }
+        return mode;
+}
+
+/*
+ * Takes a reference on pd's implicit ODP MR, registering it on first use.
+ *
+ * Returns the MR if successful, NULL otherwise.
+ */
+static struct ibv_mr *acquire_implicit_mr(struct ibv_pd *pd, int access)
+{
+        struct implicit_mr *free_slot = NULL;
+        struct ibv_mr *mr = NULL;
+
+        pthread_mutex_lock(&implicit_mrs_lock);
+        for (int i = 0; i < MAX_IMPLICIT_MRS; i++) {
+                if (implicit_mrs[i].pd == pd) {
+                        implicit_mrs[i].users++;
+                        mr = implicit_mrs[i].mr;
+                        break;
+                }
+                if (!implicit_mrs[i].pd && !free_slot) {
+                        free_slot = &implicit_mrs[i];
+                }
+        }
+        if (!mr && free_slot) {
+                mr = ibv_reg_mr(pd, NULL, SIZE_MAX,
+                                access | IBV_ACCESS_ON_DEMAND);
+                if (mr) {
+                        free_slot->pd = pd;
+                        free_slot->mr = mr;
+                        free_slot->users = 1;
+                }
+        }
+        pthread_mutex_unlock(&implicit_mrs_lock);
+        return mr;
+}
+
+/*
+ * Registers a range in mode, without looking at what the device supports.
+ */
+static struct ibv_mr *register_in_mode(struct ibv_pd *pd, void *addr,
+                                       size_t length, int access,
+                                       enum registration_mode mode)
+{
+        switch (mode) {
+                case REGISTRATION_IMPLICIT_ODP:
+                        return acquire_implicit_mr(pd, access);
+                case REGISTRATION_ODP:
+                        return ibv_reg_mr(pd, addr, length,
+                                          access | IBV_ACCESS_ON_DEMAND);
+                default:
+                        return ibv_reg_mr(pd, addr, length, access);
+        }
+}
+
+/*
+ * register_rdma_memory() for a mode at most REGISTRATION_ODP when
+ * explicit is set.
+ */
+static struct ibv_mr *register_memory(struct ibv_pd *pd, void *addr,
+                                      size_t length, int access, int explicit,
+                                      enum registration_mode *granted)
+{
+        enum registration_mode mode = registration_mode;
+        if (explicit && mode == REGISTRATION_IMPLICIT_ODP) {
+                mode = REGISTRATION_ODP;
+        }
+
+        enum registration_mode supported = supported_registration_mode(pd, mode,
+                                                                   access);
+        if (supported != mode) {
+                fprintf(stderr, "Device doesn't support %s registration, using %s\n",
+                        registration_mode_str(mode),
+                        registration_mode_str(supported));
+        }
+
+        /* Fall back a mode at a time if the registration itself fails */
+        for (mode = supported; ; mode--) {
+                struct ibv_mr *mr = register_in_mode(pd, addr, length, access,
+                                                     mode);
+                if (mr) {
+                        if (granted) {
+                                *granted = mode;
+                        }
+                        return mr;
+                }
+                if (mode == REGISTRATION_PINNED) {
+                        return NULL;
+                }
+                fprintf(stderr, "Failed %s registration: %s, falling back\n",
+                        registration_mode_str(mode), strerror(errno));
+        }
+}
+
+struct ibv_mr *register_rdma_memory(struct ibv_pd *pd, void *addr,
+                                    size_t length, int access,
+                                    enum registration_mode *granted)
+{
+        return register_memory(pd, addr, length, access, 0, granted);
+}
+
+struct ibv_mr *register_exclusive_rdma_memory(struct ibv_pd *pd, void *addr,
+                                              size_t length, int access,
+                                              enum registration_mode *granted)
+{
+        return register_memory(pd, addr, length, access, 1, granted);
+}
+
+void deregister_rdma_memory(struct ibv_mr *mr)
+{
+        if (!mr) {
+                return;
+        }
+
+        pthread_mutex_lock(&implicit_mrs_lock);
+        for (int i = 0; i < MAX_IMPLICIT_MRS; i++) {
+                if (implicit_mrs[i].mr != mr) {
+                        continue;
+                }
+                if (--implicit_mrs[i].users) {
+                        mr = NULL;
+                } else {
+                        memset(&implicit_mrs[i], 0, sizeof(implicit_mrs[i]));
+                }
+                break;
+        }
+        pthread_mutex_unlock(&implicit_mrs_lock);
+
+        if (mr) {
+                ibv_dereg_mr(mr);
+        }
+}
+
+/* Page size backing alloc_rdma_memory() */
+static enum hugepage_mode hugepage_mode = HUGEPAGE_NONE;
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#define PAGE_SIZE_4K (1UL << 12)
+#define HUGEPAGE_SIZE_2M (1UL << 21)
+#define HUGEPAGE_SIZE_1G (1UL << 30)
+
+void set_hugepage_mode(enum hugepage_mode mode)
+{
+        hugepage_mode = mode;
+}
+
+int parse_hugepage_mode(const char *str, enum hugepage_mode *mode)
+{
+        if (strcmp(str, "none") == 0) {
+                *mode = HUGEPAGE_NONE;
+        } else if (strcmp(str, "2m") == 0) {
+                *mode = HUGEPAGE_2M;
+        } else if (strcmp(str, "1g") == 0) {
+                *mode = HUGEPAGE_1G;
+        } else {
+                fprintf(stderr, "Unknown hugepage mode '%s'\n", str);
+                return -EINVAL;
+        }
+        return 0;
+}
+
+const char *hugepage_mode_str(enum hugepage_mode mode)
+{
+        switch (mode) {
+                case HUGEPAGE_NONE:
+                        return "none";
+                case HUGEPAGE_2M:
+                        return "2m";
+                case HUGEPAGE_1G:
+                        return "1g";
+                default:
+                        return "unknown";
+        }
+}
+
+/*
+ * Hugepage memory is mmap()ed, and unmapping it needs the exact length that
+ * was mapped, which depends on whether the hugetlb mapping or the fallback
+ * succeeded. Keep track of each mapping so free_rdma_memory() only needs the
+ * address. Server workers allocate and free memory concurrently, so the list
+ * is guarded by hugepage_mappings_lock.
+ */
+struct hugepage_mapping {
+        void *addr;
+        size_t length;
+        struct hugepage_mapping *next;
+};
+
+static struct hugepage_mapping *hugepage_mappings = NULL;
+static pthread_mutex_t hugepage_mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t align_to(size_t size, size_t page)
+{
+        return (size + page - 1) & ~(page - 1);
+}
+
+static int track_hugepage_mapping(void *addr, size_t length)
+{
+        struct hugepage_mapping *mapping = calloc(1, sizeof(*mapping));
+        if (!mapping) {
+                fprintf(stderr, "Failed to allocate mapping! -ENOMEM\n");
+                munmap(addr, length);
+                return -ENOMEM;
+        }
+        mapping->addr = addr;
+        mapping->length = length;
+        pthread_mutex_lock(&hugepage_mappings_lock);
+        mapping->next = hugepage_mappings;
+        hugepage_mappings = mapping;
+        pthread_mutex_unlock(&hugepage_mappings_lock);
+        return 0;
+}
+
+/*
+ * Maps length bytes of anonymous memory aligned to a 2M boundary and advises
+ * the kernel to back it with transparent hugepages. The mapping is
+ * over-allocated by 2M and trimmed so it can start on a hugepage boundary.
+ *
+ * Returns a pointer to the memory if successful, NULL otherwise.
+ */
+static void *map_transparent_hugepages(size_t length)
+{
+        size_t padded = length + HUGEPAGE_SIZE_2M;
+        char *raw = mmap(NULL, padded, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+                fprintf(stderr, "Failed to map %zu bytes: %s\n", padded,
+                        strerror(errno));
+                return NULL;
+        }
+
+        char *addr = (char *)(((uintptr_t)raw + HUGEPAGE_SIZE_2M - 1) &
+                              ~(HUGEPAGE_SIZE_2M - 1));
+        if (addr > raw) {
+                munmap(raw, addr - raw);
+        }
+        if (raw + padded > addr + length) {
+                munmap(addr + length, raw + padded - (addr + length));
+        }
+
+        if (madvise(addr, length, MADV_HUGEPAGE)) {
+                fprintf(stderr, "madvise(MADV_HUGEPAGE) failed, using 4K pages: %s\n",
+                        strerror(errno));
+        }
+
+        /* Fault in every page now rather than on first access */
+        for (size_t offset = 0; offset < length; offset += PAGE_SIZE_4K) {
+                addr[offset] = 0;
+        }
+        return addr;
+}
+
+void *alloc_rdma_memory(size_t size)
+{
+        if (hugepage_mode == HUGEPAGE_NONE) {
+                void *addr = NULL;
+                if (posix_memalign(&addr, PAGE_SIZE_4K, size)) {
+                        fprintf(stderr, "Failed to allocate %zu bytes! -ENOMEM\n",
+                                size);
+                        return NULL;
+                }
+                /* Zeroing also faults in every page */
+                memset(addr, 0, size);
+                return addr;
+        }
+
+        size_t length = align_to(size, hugepage_mode == HUGEPAGE_1G ?
+                                 HUGEPAGE_SIZE_1G : HUGEPAGE_SIZE_2M);
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE;
+        flags |= (hugepage_mode == HUGEPAGE_1G ? 30 : 21) << MAP_HUGE_SHIFT;
+
+        void *addr = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (addr != MAP_FAILED) {
+                printf("Mapped %zu bytes of %s hugepages at %p\n", length,
+                       hugepage_mode_str(hugepage_mode), addr);
+                return track_hugepage_mapping(addr, length) ? NULL : addr;
+        }
+
+        fprintf(stderr, "Failed to map %zu bytes of %s hugepages (%s), "
+                "falling back to transparent hugepages\n", length,
+                hugepage_mode_str(hugepage_mode), strerror(errno));
+        length = align_to(size, HUGEPAGE_SIZE_2M);
+        addr = map_transparent_hugepages(length);
+        if (!addr) {
+                return NULL;
+        }
+        printf("Mapped %zu bytes of transparent hugepages at %p\n", length,
+               addr);
+        return track_hugepage_mapping(addr, length) ? NULL : addr;
+}
+
+void free_rdma_memory(void *addr)
+{
+        if (!addr) {
+                return;
+        }
+
+        struct hugepage_mapping *mapping = NULL;
+        pthread_mutex_lock(&hugepage_mappings_lock);
+        struct hugepage_mapping **link = &hugepage_mappings;
+        for (; *link; link = &(*link)->next) {
+                if ((*link)->addr == addr) {
+                        mapping = *link;
+                        *link = mapping->next;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&hugepage_mappings_lock);
+
+        if (mapping) {
+                munmap(addr, mapping->length);
+                free(mapping);
+                return;
+        }
+        free(addr);
+}
+
+double elapsed_usec(const struct timespec *start)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - start->tv_sec) * 1e6 +
+               (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+uint64_t monotonic_nsec()
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int parse_benchmark_op(const char *str, enum benchmark_op *op)
+{
+        if (strcmp(str, "write") == 0) {
+                *op = BENCHMARK_OP_WRITE;
+        } else if (strcmp(str, "send") == 0) {
+                *op = BENCHMARK_OP_SEND;
+        } else if (strcmp(str, "read") == 0) {
+                *op = BENCHMARK_OP_READ;
+        } else {
+                fprintf(stderr, "Unknown benchmark operation '%s'\n", str);
+                return -EINVAL;
+        }
+        return 0;
+}
+
+const char *benchmark_op_str(enum benchmark_op op)
+{
+        switch (op) {
+                case BENCHMARK_OP_NONE:
+                        return "none";
+                case BENCHMARK_OP_WRITE:
+                        return "write";
+                case BENCHMARK_OP_SEND:
+                        return "send";
+                case BENCHMARK_OP_READ:
+                        return "read";
+                default:
+                        return "unknown";
+        }
+}
+
+int create_queue_pair(struct rdma_cm_id *id, struct ibv_pd *pd,
+                      struct ibv_qp_init_attr *init_attr)
+{
+        uint32_t requested_inline = init_attr->cap.max_inline_data;
+
+        if (!rdma_create_qp(id, pd, init_attr)) {
+                return 0;
+        }
+        if (!requested_inline) {
+                return -errno;
+        }
+
+        fprintf(stderr, "Failed to create QP with %u bytes inline data: %s, retrying without\n",
+                requested_inline, strerror(errno));
+        init_attr->cap.max_inline_data = 0;
+        if (rdma_create_qp(id, pd, init_attr)) {
+                return -errno;
+        }
+        return 0;
+}
+
+unsigned int signaled_send_flags(enum ibv_wr_opcode opcode, uint32_t length,
+                                 uint32_t max_inline)
+{
+        /* Only SEND and WRITE variants have a local payload to inline */
+        switch (opcode) {
+                case IBV_WR_SEND:
+                case IBV_WR_SEND_WITH_IMM:
+                case IBV_WR_RDMA_WRITE:
+                case IBV_WR_RDMA_WRITE_WITH_IMM:
+                        if (length && length <= max_inline) {
+                                return IBV_SEND_SIGNALED | IBV_SEND_INLINE;
+                        }
+                        return IBV_SEND_SIGNALED;
+                default:
+                        return IBV_SEND_SIGNALED;
+        }
+}
+
 struct ibv_mr *create_rdma_buffer(struct ibv_pd *pd, uint32_t size_bytes,
                                     enum ibv_access_flags perms)
 {
         struct ibv_mr *mr = NULL;
+        struct timespec start;
         if (!pd) {
                 fprintf(stderr, "No Protection Domain defined!\n");
                 return NULL;
         }
 
-        void *buffer = calloc(1, size_bytes);
+        void *buffer = alloc_rdma_memory(size_bytes);
         if (!buffer) {
-                fprintf(stderr, "Failed to allocate buffer! -ENOMEM\n");
                 return NULL;
         }
         printf("Allocated buffer %p of size %u bytes\n", buffer, size_bytes);
 
-        mr = ibv_reg_mr(pd, buffer, size_bytes, perms);
+        enum registration_mode granted;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        mr = register_memory(pd, buffer, size_bytes, perms, 1, &granted);
         if (!mr) {
                 fprintf(stderr, "Failed to register buffer as MR: %s\n",
                         strerror(errno));
+                free_rdma_memory(buffer);
                 return NULL;
         }
 
-        printf("Registered Memory Region %p:\n", mr);
+        printf("Registered %s Memory Region %p in %.1f us (hugepages: %s):\n",
+               registration_mode_str(granted), mr, elapsed_usec(&start),
+               hugepage_mode_str(hugepage_mode));
         print_ibv_mr(mr, 0);
         return mr;
 }
 
+void destroy_rdma_buffer(struct ibv_mr *mr)
+{
+        if (!mr) {
+                return;
+        }
+
+        void *addr = mr->addr;
+        deregister_rdma_memory(mr);
+        free_rdma_memory(addr);
+}
+
+int set_fd_nonblocking(int fd)
+{
+        int flags = fcntl(fd, F_GETFL);
+        if (flags == -1) {
+                fprintf(stderr, "Failed to get flags for fd %d: %s\n", fd,
+                        strerror(errno));
+                return -errno;
+        }
+
+        if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+                fprintf(stderr, "Failed to make fd %d non-blocking: %s\n", fd,
+                        strerror(errno));
+                return -errno;
+        }
+        return 0;
+}
+
 static void print_bits(int value) {
         for (int i = ((sizeof(value) * 8) - 1); i >= 0; i--) {
                 printf("%u", (value >> i) & 1);
@@ -11,6 +11,11 @@
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -49,6 +54,33 @@ struct __attribute((packed)) rdma_buffer_attr {
   } stag;
 };
 
+/*
+ * Fast connect carries the rdma_buffer_attr exchange in the connection's
+ * private data instead of a SEND each way: the client's in its connect
+ * request, the server's in its accept. The magic tells it apart from the
+ * zeroes the IB CM pads private data with.
+ */
+#define RDMA_FAST_CONNECT_MAGIC 0x46434f4e /* "FCON" */
+struct __attribute((packed)) rdma_fast_connect {
+        uint32_t magic;
+        struct rdma_buffer_attr buffer;
+};
+
+/*
+ * Fills in fast_connect with the magic and buffer, to send as private data.
+ */
+void fast_connect_init(struct rdma_fast_connect *fast_connect,
+                       const struct rdma_buffer_attr *buffer);
+
+/*
+ * Copies the buffer out of len bytes of private data received with a CM
+ * event, if they carry a fast connect.
+ *
+ * Returns 1 if they do, 0 otherwise.
+ */
+int parse_fast_connect(const void *private_data, uint8_t len,
+                       struct rdma_buffer_attr *buffer);
+
 /*
  * Converts a set of bitflags to a human-readable string.
  * If there are more than 1 flags set, they are separated by the '|' character.
@@ -144,10 +176,55 @@ int process_rdma_event(struct rdma_event_channel *event_channel,
                        struct rdma_cm_event **event,
                        enum rdma_cm_event_type expected_type);
 
+/*
+ * Strategies for waiting on Work Completions:
+ *
+ * - COMPLETION_MODE_EVENT: sleep on the completion channel until the CQ
+ *   raises an event, then poll. Cheapest on CPU, but every wait pays for an
+ *   interrupt and a wakeup.
+ * - COMPLETION_MODE_POLL: busy-poll the CQ with ibv_poll_cq() and never
+ *   block. Lowest latency, burns a core while waiting.
+ * - COMPLETION_MODE_HYBRID: busy-poll for up to spin_budget polls, then fall
+ *   back to blocking on the completion channel.
+ */
+enum completion_mode {
+        COMPLETION_MODE_EVENT,
+        COMPLETION_MODE_POLL,
+        COMPLETION_MODE_HYBRID
+};
+
+/* Default number of ibv_poll_cq() calls made before a hybrid wait blocks */
+#define DEFAULT_SPIN_BUDGET 100000
+
+/*
+ * Selects the strategy process_work_completion_event() uses to wait for Work
+ * Completions. spin_budget is only used by COMPLETION_MODE_HYBRID.
+ */
+void set_completion_mode(enum completion_mode mode, unsigned long spin_budget);
+
+/*
+ * Returns the strategy selected with set_completion_mode().
+ */
+enum completion_mode get_completion_mode();
+
+/*
+ * Parses "event", "poll" or "hybrid" into *mode.
+ *
+ * Returns 0 if successful, -EINVAL otherwise.
+ */
+int parse_completion_mode(const char *str, enum completion_mode *mode);
+
+/*
+ * Returns the human-readable name of a completion mode.
+ */
+const char *completion_mode_str(enum completion_mode mode);
+
 /*
  * process_work_completion_event processes expected_wc Work Completion events
- * on the completion_channel IO Completion Channel. WC elements are stored in
- * the ibv_wc array starting at the wc pointer.
+ * on the cq Completion Queue, waiting according to the strategy selected with
+ * set_completion_mode(). When the strategy blocks, it does so on the
+ * completion_channel IO Completion Channel cq was created with. WC elements
+ * are stored in the ibv_wc array starting at the wc pointer.
  *
  * Returns the total number of WC elements successfully retrieved from the CQ.
  *
@@ -161,16 +238,332 @@ int process_rdma_event(struct rdma_event_channel *event_channel,
  *           https://www.rdmamojo.com/2013/03/16/ibv_ack_cq_events/
  */
 int process_work_completion_event(struct ibv_comp_channel *completion_channel,
+                                  struct ibv_cq *cq,
                                   struct ibv_wc *wc,
                                   int expected_wc);
 
+/*
+ * Called for every Work Completion routed through a completion_table. The WC
+ * may carry a failed status, so handlers need to check wc->status.
+ */
+typedef void (*completion_callback)(struct ibv_wc *wc, void *context);
+
+/*
+ * A registered wr_id: the handler and context its completion is routed to.
+ * Free slots have a NULL callback and are chained through next_free.
+ */
+struct completion_slot {
+        completion_callback callback;
+        void *context;
+        int64_t next_free;
+};
+
+/*
+ * Maps wr_id values to the callback and context that handle their completion.
+ * This lets many WRs be outstanding on a CQ at once: their WCs are drained up
+ * to batch_size at a time per ibv_poll_cq() call and dispatched in bulk.
+ *
+ * A wr_id is the index of its slot. Slots are one-shot: a slot is released
+ * right before its callback runs, so callbacks may register new WRs (e.g.
+ * re-post a receive) without growing the table.
+ */
+struct completion_table {
+        struct completion_slot *slots;
+        uint32_t capacity;
+        int64_t free_head; /* First free slot, -1 if the table is full */
+        uint32_t outstanding; /* Number of registered, uncompleted wr_ids */
+        int batch_size; /* Maximum WCs retrieved per ibv_poll_cq() call */
+        struct ibv_wc *wc; /* Scratch array of batch_size WCs */
+};
+
+/* Default number of WCs retrieved per ibv_poll_cq() call */
+#define DEFAULT_CQ_BATCH_SIZE 16
+
+/*
+ * Initializes a completion table with room for capacity outstanding wr_ids,
+ * draining up to batch_size WCs per poll. The table grows on demand.
+ *
+ * Returns 0 if successful, -ENOMEM otherwise.
+ */
+int completion_table_init(struct completion_table *table, uint32_t capacity,
+                          int batch_size);
+
+/*
+ * Frees a completion table's memory. Outstanding wr_ids are dropped.
+ */
+void completion_table_destroy(struct completion_table *table);
+
+/*
+ * Reserves a wr_id whose completion will be routed to callback(wc, context).
+ * Use the resulting *wr_id in the WR that's posted next.
+ *
+ * Returns 0 if successful, -ENOMEM if the table could not grow.
+ */
+int completion_table_register(struct completion_table *table,
+                              completion_callback callback, void *context,
+                              uint64_t *wr_id);
+
+/*
+ * Releases a registered wr_id without dispatching it, e.g. when posting the
+ * WR failed.
+ */
+void completion_table_cancel(struct completion_table *table, uint64_t wr_id);
+
+/*
+ * Releases every outstanding wr_id registered with context, e.g. when the
+ * connection context belongs to is being destroyed and its WCs will never be
+ * delivered.
+ */
+void completion_table_cancel_context(struct completion_table *table,
+                                     void *context);
+
+/*
+ * Drains the cq Completion Queue without blocking, batch_size WCs per
+ * ibv_poll_cq() call, and dispatches each WC to the callback registered for
+ * its wr_id.
+ *
+ * Returns the number of WCs dispatched, or a negative value if polling failed.
+ */
+int drain_completion_queue(struct ibv_cq *cq, struct completion_table *table);
+
+/*
+ * Waits until at least min_wc WCs have been dispatched from the cq
+ * Completion Queue, using the strategy selected with set_completion_mode().
+ * Every WC found along the way is dispatched, so more than min_wc may be
+ * handled.
+ *
+ * Returns the number of WCs dispatched, or a negative value if polling or
+ * waiting failed, or if any dispatched WC had a failed status.
+ */
+int process_completions(struct ibv_comp_channel *completion_channel,
+                        struct ibv_cq *cq, struct completion_table *table,
+                        int min_wc);
+
+/*
+ * Page sizes backing memory handed out by alloc_rdma_memory():
+ *
+ * - HUGEPAGE_NONE: regular 4K pages from the heap.
+ * - HUGEPAGE_2M / HUGEPAGE_1G: explicit hugetlb pages (MAP_HUGETLB). If the
+ *   hugetlb pool can't satisfy the mapping, fall back to a 2M-aligned
+ *   anonymous mapping advised for transparent hugepages.
+ *
+ * Fewer, larger pages mean fewer pages to pin at registration time and fewer
+ * translation entries for the device to cache, which matters for multi-GB
+ * buffers.
+ */
+enum hugepage_mode {
+        HUGEPAGE_NONE,
+        HUGEPAGE_2M,
+        HUGEPAGE_1G
+};
+
+/*
+ * Selects the page size used by alloc_rdma_memory().
+ */
+void set_hugepage_mode(enum hugepage_mode mode);
+
+/*
+ * Parses "none", "2m" or "1g" into *mode.
+ *
+ * Returns 0 if successful, -EINVAL otherwise.
+ */
+int parse_hugepage_mode(const char *str, enum hugepage_mode *mode);
+
+/*
+ * Returns the human-readable name of a hugepage mode.
+ */
+const char *hugepage_mode_str(enum hugepage_mode mode);
+
+/*
+ * Allocates zeroed, page-aligned memory of at least size bytes to be
+ * registered as a Memory Region, backed according to set_hugepage_mode().
+ * Every page is faulted in before returning, so registration and the first
+ * transfers don't pay for page faults.
+ *
+ * Returns a pointer to the memory if successful, NULL otherwise.
+ */
+void *alloc_rdma_memory(size_t size);
+
+/*
+ * Frees memory returned by alloc_rdma_memory().
+ */
+void free_rdma_memory(void *addr);
+
+/*
+ * How register_rdma_memory() registers Memory Regions:
+ *
+ * - REGISTRATION_PINNED: ibv_reg_mr() pins every page of the range up front.
+ * - REGISTRATION_ODP: On-Demand Paging (IBV_ACCESS_ON_DEMAND). Nothing is
+ *   pinned; the device faults pages in on first access and follows the
+ *   kernel when they move, so registering huge or sparse buffers is cheap
+ *   and the first transfer touching a page pays instead.
+ * - REGISTRATION_IMPLICIT_ODP: a single ODP MR covering the whole address
+ *   space, registered once per Protection Domain and shared by every range.
+ *   Its rkey exposes all of the process' memory to the peers it's given to.
+ *
+ * A mode the device doesn't support falls back to the next one down, ending
+ * with pinned MRs.
+ */
+enum registration_mode {
+        REGISTRATION_PINNED,
+        REGISTRATION_ODP,
+        REGISTRATION_IMPLICIT_ODP
+};
+
+/*
+ * Selects the mode used by register_rdma_memory() and create_rdma_buffer().
+ */
+void set_registration_mode(enum registration_mode mode);
+
+/*
+ * Returns the mode selected with set_registration_mode().
+ */
+enum registration_mode get_registration_mode();
+
+/*
+ * Parses "pinned", "odp" or "implicit" into *mode.
+ *
+ * Returns 0 if successful, -EINVAL otherwise.
+ */
+int parse_registration_mode(const char *str, enum registration_mode *mode);
+
+/*
+ * Returns the human-readable name of a registration mode.
+ */
+const char *registration_mode_str(enum registration_mode mode);
+
+/*
+ * Registers length bytes at addr under pd with access, according to
+ * set_registration_mode(). If granted isn't NULL, it's set to the mode the
+ * device actually allowed. An implicit ODP MR covers addr without starting
+ * at it, so callers must use their own addr rather than the MR's.
+ *
+ * Returns an ibv_mr pointer if successful, NULL otherwise.
+ */
+struct ibv_mr *register_rdma_memory(struct ibv_pd *pd, void *addr,
+                                    size_t length, int access,
+                                    enum registration_mode *granted);
+
+/*
+ * Registers length bytes at addr like register_rdma_memory() does, except
+ * that the MR is always one of its own covering just that range, explicit
+ * ODP standing in for implicit, so its rkey reaches nothing else.
+ *
+ * Returns an ibv_mr pointer if successful, NULL otherwise.
+ */
+struct ibv_mr *register_exclusive_rdma_memory(struct ibv_pd *pd, void *addr,
+                                              size_t length, int access,
+                                              enum registration_mode *granted);
+
+/*
+ * Releases an MR from register_rdma_memory() or
+ * register_exclusive_rdma_memory(). The shared implicit ODP MR is
+ * only deregistered once its last user releases it.
+ */
+void deregister_rdma_memory(struct ibv_mr *mr);
+
+/*
+ * Returns the microseconds elapsed since start, per CLOCK_MONOTONIC.
+ */
+double elapsed_usec(const struct timespec *start);
+
+/*
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t monotonic_nsec();
+
+/*
+ * Operations the client's benchmark modes can drive against a server running
+ * the matching mode:
+ *
+ * - BENCHMARK_OP_WRITE: RDMA WRITE into the peer's buffer. The receiver
+ *   notices by polling the buffer's last byte.
+ * - BENCHMARK_OP_SEND: SEND into a RECV posted by the peer.
+ * - BENCHMARK_OP_READ: RDMA READ from the peer's buffer. The server is
+ *   passive.
+ */
+enum benchmark_op {
+        BENCHMARK_OP_NONE,
+        BENCHMARK_OP_WRITE,
+        BENCHMARK_OP_SEND,
+        BENCHMARK_OP_READ
+};
+
+/* Default number of WRs a bandwidth benchmark keeps in flight */
+#define DEFAULT_QUEUE_DEPTH 16
+
+/*
+ * Credit streams (--credit-stream) SEND messages into receives the peer
+ * granted credits for, so a sender never overruns the receive queue and
+ * never sees an RNR NAK. Credits come back in zero-length SEND with
+ * immediate messages, the immediate holding the number of receives re-posted.
+ * Those credit messages need receives of their own: each side keeps
+ * CREDIT_RECV_DEPTH posted for them, and the data sender returns the ones
+ * it re-posts in the immediate of its data SENDs.
+ */
+#define CREDIT_RECV_DEPTH 8
+
+/*
+ * Parses "write", "send" or "read" into *op.
+ *
+ * Returns 0 if successful, -EINVAL otherwise.
+ */
+int parse_benchmark_op(const char *str, enum benchmark_op *op);
+
+/*
+ * Returns the human-readable name of a benchmark operation.
+ */
+const char *benchmark_op_str(enum benchmark_op op);
+
+/* Inline data requested for every QP. Payloads up to what the device grants
+ * are copied into the WQE by the CPU, so the HCA skips the DMA read and the
+ * source needs no lkey. 0 disables inlining.
+ */
+#define DEFAULT_INLINE_SIZE 256
+
+/*
+ * Creates a QP for id like rdma_create_qp(), asking for
+ * init_attr->cap.max_inline_data bytes of inline data. Devices that refuse
+ * that much get the QP retried without inline data. On success
+ * init_attr->cap holds the capacities actually granted.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+int create_queue_pair(struct rdma_cm_id *id, struct ibv_pd *pd,
+                      struct ibv_qp_init_attr *init_attr);
+
+/*
+ * Returns the send_flags for a signaled WR of opcode moving length bytes:
+ * IBV_SEND_SIGNALED, plus IBV_SEND_INLINE when the opcode carries a local
+ * payload of at most max_inline bytes.
+ */
+unsigned int signaled_send_flags(enum ibv_wr_opcode opcode, uint32_t length,
+                                 uint32_t max_inline);
+
 /*
  * Creates and registers a buffer of size size_bytes as a Memory Region under
- * the pd Protection Domain.
+ * the pd Protection Domain. The buffer comes from alloc_rdma_memory(), and is
+ * registered like register_rdma_memory() does, except that it gets an MR of
+ * its own, explicit ODP standing in for implicit.
  *
  * Returns an ibv_mr pointer if successful, NULL otherwise.
  */
 struct ibv_mr *create_rdma_buffer(struct ibv_pd *pd, uint32_t size_bytes,
                          enum ibv_access_flags perms);
 
+/*
+ * Deregisters a Memory Region made by create_rdma_buffer() and frees its
+ * buffer.
+ */
+void destroy_rdma_buffer(struct ibv_mr *mr);
+
+/*
+ * Puts the file descriptor fd into non-blocking mode, so that reads from an
+ * empty CM event channel or completion channel return EAGAIN instead of
+ * blocking. Used when multiplexing channels with epoll.
+ *
+ * Returns 0 if successful, -errno otherwise.
+ */
+int set_fd_nonblocking(int fd);
+
 #endif /* RDMA_COMMON_H */
\ No newline at end of file
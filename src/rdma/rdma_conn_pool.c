@@ -0,0 +1,398 @@
+#include "rdma_conn_pool.h"
+
+/*
+ * Tears down a connection in whatever state it got to. An established one is
+ * disconnected without waiting for the server to acknowledge it.
+ */
+static void close_conn(struct rdma_conn *conn)
+{
+        if (conn->cm_id && conn->cm_id->qp) {
+                rdma_disconnect(conn->cm_id);
+                rdma_destroy_qp(conn->cm_id);
+        }
+        if (conn->cm_id) {
+                rdma_destroy_id(conn->cm_id);
+        }
+        if (conn->cq) {
+                ibv_destroy_cq(conn->cq);
+        }
+        if (conn->channel) {
+                rdma_destroy_event_channel(conn->channel);
+        }
+        rdma_pool_free(conn->pool->buffers, conn->buffer);
+        free(conn);
+}
+
+/*
+ * Waits for the CM event ending a step of setting up conn, and ACKs it.
+ *
+ * Returns 0 if it was expected_type, a negative error code otherwise.
+ */
+static int wait_for_conn_event(struct rdma_conn *conn,
+                               enum rdma_cm_event_type expected_type)
+{
+        struct rdma_cm_event *cm_event = NULL;
+
+        if (process_rdma_event(conn->channel, &cm_event, expected_type)) {
+                return -ECONNABORTED;
+        }
+        rdma_ack_cm_event(cm_event);
+        return 0;
+}
+
+/*
+ * Creates the PD and buffer pool every connection shares, on the device the
+ * first connection resolved to.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int setup_pool_resources(struct rdma_conn_pool *pool,
+                                struct ibv_context *verbs)
+{
+        if (pool->pd) {
+                if (pool->pd->context != verbs) {
+                        fprintf(stderr, "Connection resolved to a different RDMA device than the pool's\n");
+                        return -EINVAL;
+                }
+                return 0;
+        }
+
+        pool->pd = ibv_alloc_pd(verbs);
+        if (!pool->pd) {
+                fprintf(stderr, "Failed to create Protection Domain: %s\n",
+                        strerror(errno));
+                return -errno;
+        }
+        /* One buffer per connection kept, more are registered on demand */
+        size_t class_bytes = (size_t) pool->buffer_size *
+                             (pool->size ? pool->size : 1);
+        pool->buffers = rdma_pool_create(pool->pd, pool->buffer_size,
+                                         pool->buffer_size, class_bytes,
+                                         (IBV_ACCESS_LOCAL_WRITE|
+                                          IBV_ACCESS_REMOTE_READ|
+                                          IBV_ACCESS_REMOTE_WRITE));
+        if (!pool->buffers) {
+                return -ENOMEM;
+        }
+        return 0;
+}
+
+/*
+ * Creates conn's CQ and QP once its route is resolved, and connects it,
+ * handing the server our buffer and getting the server's with its accept.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int connect_conn(struct rdma_conn_pool *pool, struct rdma_conn *conn)
+{
+        struct rdma_cm_id *cm_id = conn->cm_id;
+        struct ibv_qp_init_attr init_attr;
+        struct rdma_conn_param conn_param;
+        struct rdma_fast_connect private_data;
+        struct rdma_buffer_attr buffer_attr;
+        struct rdma_cm_event *cm_event = NULL;
+
+        int ret = setup_pool_resources(pool, cm_id->verbs);
+        if (ret) {
+                return ret;
+        }
+        conn->cq = ibv_create_cq(cm_id->verbs, 2 * RDMA_CONN_QUEUE_DEPTH,
+                                 NULL, NULL, 0);
+        if (!conn->cq) {
+                fprintf(stderr, "Failed to create Completion Queue: %s\n",
+                        strerror(errno));
+                return -errno;
+        }
+
+        memset(&init_attr, 0, sizeof(init_attr));
+        init_attr.qp_type = IBV_QPT_RC;
+        init_attr.cap.max_send_wr = RDMA_CONN_QUEUE_DEPTH;
+        init_attr.cap.max_recv_wr = RDMA_CONN_QUEUE_DEPTH;
+        init_attr.cap.max_send_sge = 1;
+        init_attr.cap.max_recv_sge = 1;
+        init_attr.cap.max_inline_data = DEFAULT_INLINE_SIZE;
+        init_attr.send_cq = conn->cq;
+        init_attr.recv_cq = conn->cq;
+        ret = create_queue_pair(cm_id, pool->pd, &init_attr);
+        if (ret) {
+                fprintf(stderr, "Failed to create QP: %s\n", strerror(-ret));
+                return ret;
+        }
+        conn->qp = cm_id->qp;
+        conn->max_inline_data = init_attr.cap.max_inline_data;
+
+        conn->buffer = rdma_pool_alloc(pool->buffers, pool->buffer_size);
+        if (!conn->buffer) {
+                fprintf(stderr, "Failed to allocate connection buffer from pool\n");
+                return -ENOMEM;
+        }
+        buffer_attr.address = (uint64_t) conn->buffer->addr;
+        buffer_attr.length = pool->buffer_size;
+        buffer_attr.stag.local_stag = conn->buffer->rkey;
+
+        memset(&conn_param, 0, sizeof(conn_param));
+        conn_param.initiator_depth = 3;
+        conn_param.responder_resources = 3;
+        conn_param.retry_count = 3;
+        fast_connect_init(&private_data, &buffer_attr);
+        conn_param.private_data = &private_data;
+        conn_param.private_data_len = sizeof(private_data);
+        if (rdma_connect(cm_id, &conn_param)) {
+                fprintf(stderr, "Failed to connect to server: %s\n",
+                        strerror(errno));
+                return -errno;
+        }
+        if (process_rdma_event(conn->channel, &cm_event,
+                               RDMA_CM_EVENT_ESTABLISHED)) {
+                return -ECONNABORTED;
+        }
+        if (!parse_fast_connect(cm_event->param.conn.private_data,
+                                cm_event->param.conn.private_data_len,
+                                &conn->server)) {
+                fprintf(stderr, "Server accepted without its metadata, does it support fast connect?\n");
+                rdma_ack_cm_event(cm_event);
+                return -EPROTO;
+        }
+        rdma_ack_cm_event(cm_event);
+        return 0;
+}
+
+/*
+ * Establishes a new connection for pool, blocking until the server accepts
+ * it.
+ *
+ * Returns the connection if successful, NULL otherwise.
+ */
+static struct rdma_conn *open_conn(struct rdma_conn_pool *pool)
+{
+        struct rdma_conn *conn = calloc(1, sizeof(*conn));
+        if (!conn) {
+                fprintf(stderr, "Failed to allocate connection: -ENOMEM\n");
+                return NULL;
+        }
+        conn->pool = pool;
+
+        conn->channel = rdma_create_event_channel();
+        if (!conn->channel) {
+                fprintf(stderr, "Creating CM event channel failed: %s\n",
+                        strerror(errno));
+                goto err;
+        }
+        if (rdma_create_id(conn->channel, &conn->cm_id, conn, RDMA_PS_TCP)) {
+                fprintf(stderr, "Creating CM id failed: %s\n", strerror(errno));
+                goto err;
+        }
+        if (rdma_resolve_addr(conn->cm_id, NULL,
+                              (struct sockaddr *) &pool->server,
+                              pool->timeout_ms)) {
+                fprintf(stderr, "Failed rdma_resolve_addr: %s\n",
+                        strerror(errno));
+                goto err;
+        }
+        if (wait_for_conn_event(conn, RDMA_CM_EVENT_ADDR_RESOLVED)) {
+                goto err;
+        }
+        if (rdma_resolve_route(conn->cm_id, pool->timeout_ms)) {
+                fprintf(stderr, "Failed rdma_resolve_route: %s\n",
+                        strerror(errno));
+                goto err;
+        }
+        if (wait_for_conn_event(conn, RDMA_CM_EVENT_ROUTE_RESOLVED) ||
+            connect_conn(pool, conn)) {
+                goto err;
+        }
+
+        /* From now on a CM event only ever means the connection is gone,
+         * which the health check picks up without blocking.
+         */
+        if (set_fd_nonblocking(conn->channel->fd)) {
+                goto err;
+        }
+        return conn;
+
+err:
+        close_conn(conn);
+        return NULL;
+}
+
+/*
+ * Returns 1 if an idle connection is still usable: no CM event came in for
+ * it, a disconnect or error, and its QP didn't drop out of RTS.
+ */
+static int conn_healthy(struct rdma_conn *conn)
+{
+        struct rdma_cm_event *cm_event = NULL;
+        struct ibv_qp_attr attr;
+        struct ibv_qp_init_attr init_attr;
+
+        if (rdma_get_cm_event(conn->channel, &cm_event) == 0) {
+                printf("Closing pooled connection %p on CM event %s\n", conn,
+                       rdma_event_str(cm_event->event));
+                rdma_ack_cm_event(cm_event);
+                return 0;
+        }
+        if (errno != EAGAIN) {
+                fprintf(stderr, "Failed to get CM event: %s\n", strerror(errno));
+                return 0;
+        }
+        if (ibv_query_qp(conn->qp, &attr, IBV_QP_STATE, &init_attr)) {
+                fprintf(stderr, "Failed to query QP: %s\n", strerror(errno));
+                return 0;
+        }
+        return attr.qp_state == IBV_QPS_RTS;
+}
+
+struct rdma_conn_pool *rdma_conn_pool_create(const struct rdma_addrinfo *server,
+                                             int size, uint32_t buffer_size,
+                                             int timeout_ms,
+                                             unsigned long idle_expiry_ms)
+{
+        if (server->ai_dst_len > sizeof(struct sockaddr_storage) ||
+            !buffer_size || size < 0) {
+                fprintf(stderr, "Invalid connection pool parameters\n");
+                return NULL;
+        }
+
+        struct rdma_conn_pool *pool = calloc(1, sizeof(*pool));
+        if (!pool) {
+                fprintf(stderr, "Failed to allocate connection pool! -ENOMEM\n");
+                return NULL;
+        }
+        memcpy(&pool->server, server->ai_dst_addr, server->ai_dst_len);
+        pool->timeout_ms = timeout_ms;
+        pool->buffer_size = buffer_size;
+        pool->size = size;
+        pool->idle_expiry_nsec = (uint64_t) idle_expiry_ms * 1000000;
+
+        if (rdma_conn_pool_maintain(pool)) {
+                rdma_conn_pool_destroy(pool);
+                return NULL;
+        }
+        return pool;
+}
+
+void rdma_conn_pool_destroy(struct rdma_conn_pool *pool)
+{
+        if (!pool) {
+                return;
+        }
+
+        if (pool->leased_count) {
+                fprintf(stderr, "Destroying connection pool with %d connection(s) leased\n",
+                        pool->leased_count);
+        }
+        while (pool->idle) {
+                struct rdma_conn *conn = pool->idle;
+                pool->idle = conn->next;
+                close_conn(conn);
+        }
+        rdma_pool_destroy(pool->buffers);
+        if (pool->pd) {
+                ibv_dealloc_pd(pool->pd);
+        }
+        free(pool);
+}
+
+struct rdma_conn *rdma_conn_pool_lease(struct rdma_conn_pool *pool)
+{
+        struct rdma_conn *conn = NULL;
+
+        pool->leases++;
+        while (pool->idle) {
+                conn = pool->idle;
+                pool->idle = conn->next;
+                pool->idle_count--;
+                conn->next = NULL;
+                if (conn_healthy(conn)) {
+                        pool->leased_count++;
+                        return conn;
+                }
+                pool->unhealthy++;
+                close_conn(conn);
+        }
+
+        pool->misses++;
+        conn = open_conn(pool);
+        if (conn) {
+                pool->leased_count++;
+        }
+        return conn;
+}
+
+void rdma_conn_pool_return(struct rdma_conn *conn, int failed)
+{
+        struct rdma_conn_pool *pool = conn->pool;
+
+        pool->leased_count--;
+        if (failed) {
+                close_conn(conn);
+                return;
+        }
+        conn->idle_nsec = monotonic_nsec();
+        conn->next = pool->idle;
+        pool->idle = conn;
+        pool->idle_count++;
+}
+
+int rdma_conn_pool_maintain(struct rdma_conn_pool *pool)
+{
+        uint64_t now = monotonic_nsec();
+        struct rdma_conn **link = &pool->idle;
+        int kept = 0;
+
+        /* The most recently returned connections make up the pool's size,
+         * those after them are the surplus a burst of leases left behind
+         */
+        while (*link) {
+                struct rdma_conn *conn = *link;
+                int expired = kept >= pool->size && pool->idle_expiry_nsec &&
+                              now - conn->idle_nsec >= pool->idle_expiry_nsec;
+                if (!expired && conn_healthy(conn)) {
+                        kept++;
+                        link = &conn->next;
+                        continue;
+                }
+                if (expired) {
+                        pool->expired++;
+                } else {
+                        pool->unhealthy++;
+                }
+                *link = conn->next;
+                pool->idle_count--;
+                close_conn(conn);
+        }
+
+        while (pool->idle_count < pool->size) {
+                struct rdma_conn *conn = open_conn(pool);
+                if (!conn) {
+                        return -ECONNREFUSED;
+                }
+                conn->idle_nsec = monotonic_nsec();
+                conn->next = pool->idle;
+                pool->idle = conn;
+                pool->idle_count++;
+        }
+        return 0;
+}
+
+void print_rdma_conn_pool(const struct rdma_conn_pool *pool, int i)
+{
+        char indent[i+1];
+        memset(indent, '\t', i);
+        indent[i] = '\0';
+
+        if (!pool) {
+                printf("%s(null)\n", indent);
+                return;
+        }
+
+        printf("%srdma_conn_pool{\n", indent);
+        printf("%s\tsize: %d\n", indent, pool->size);
+        printf("%s\tidle: %d\n", indent, pool->idle_count);
+        printf("%s\tleased: %d\n", indent, pool->leased_count);
+        printf("%s\tleases: %lu\n", indent, pool->leases);
+        printf("%s\tmisses: %lu\n", indent, pool->misses);
+        printf("%s\tunhealthy: %lu\n", indent, pool->unhealthy);
+        printf("%s\texpired: %lu\n", indent, pool->expired);
+        printf("%s}\n", indent);
+}
@@ -0,0 +1,131 @@
+/*
+ * rdma_conn_pool.h defines a pool of established client connections to one
+ * server endpoint, so that a request doesn't pay for a connection's setup.
+ *
+ * Setting up a connection takes address and route resolution and a CM
+ * handshake, on top of creating its CQ and QP, which adds up to around a
+ * millisecond. The pool keeps connections that are already through all of
+ * that, with their buffer metadata exchanged, ready to be leased: a caller
+ * leases a connection, uses its QP and returns it.
+ *
+ * Every connection connects fast, carrying its buffer metadata in the
+ * connection's private data (see struct rdma_fast_connect), so the server
+ * must support fast connect. Each one has a CM event channel of its own, so
+ * it can be checked for a disconnect without disturbing the others, and a CQ
+ * without a completion channel that its user polls.
+ */
+
+#ifndef RDMA_CONN_POOL_H
+#define RDMA_CONN_POOL_H
+
+#include "rdma_common.h"
+#include "rdma_pool.h"
+
+/* Default number of idle connections kept established */
+#define DEFAULT_CONN_POOL_SIZE 4
+
+/* Default time a connection beyond the pool's size stays idle before it is
+ * closed
+ */
+#define DEFAULT_CONN_POOL_IDLE_EXPIRY_MS 10000
+
+/* Send and receive WRs a connection's QP takes, and half its CQ */
+#define RDMA_CONN_QUEUE_DEPTH 16
+
+struct rdma_conn_pool;
+
+/*
+ * An established connection, either idle in its pool or leased.
+ */
+struct rdma_conn {
+        struct rdma_conn_pool *pool;
+        struct rdma_event_channel *channel; /* Non-blocking once established */
+        struct rdma_cm_id *cm_id;
+        struct ibv_cq *cq;
+        struct ibv_qp *qp;
+        uint32_t max_inline_data; /* Inline data granted to qp */
+
+        /* Our buffer, which the server was given, and the server's */
+        struct rdma_pool_buffer *buffer;
+        struct rdma_buffer_attr server;
+
+        uint64_t idle_nsec; /* When it was last returned */
+        struct rdma_conn *next; /* Next idle connection */
+};
+
+struct rdma_conn_pool {
+        struct sockaddr_storage server;
+        int timeout_ms; /* Of address and route resolution */
+        uint32_t buffer_size; /* Of every connection's buffer */
+        int size; /* Idle connections kept established */
+        uint64_t idle_expiry_nsec;
+
+        /* Shared by every connection, created with the first one */
+        struct ibv_pd *pd;
+        struct rdma_pool *buffers;
+
+        /* Idle connections, the most recently returned first */
+        struct rdma_conn *idle;
+        int idle_count;
+        int leased_count;
+
+        unsigned long leases;
+        unsigned long misses; /* Leases that had to connect */
+        unsigned long unhealthy; /* Idle connections found dead and closed */
+        unsigned long expired; /* Idle connections closed for idling too long */
+};
+
+/*
+ * Creates a pool of connections to the destination rdma_getaddrinfo()
+ * resolved in server, each advertising a buffer of buffer_size bytes, and
+ * establishes size of them. Connections returned when size are already idle
+ * stay established for idle_expiry_ms, 0 to keep them until the pool is
+ * destroyed. timeout_ms bounds address and route resolution.
+ *
+ * Returns the pool if successful, NULL otherwise.
+ */
+struct rdma_conn_pool *rdma_conn_pool_create(const struct rdma_addrinfo *server,
+                                             int size, uint32_t buffer_size,
+                                             int timeout_ms,
+                                             unsigned long idle_expiry_ms);
+
+/*
+ * Closes every idle connection and frees the pool. Leased connections must
+ * have been returned.
+ */
+void rdma_conn_pool_destroy(struct rdma_conn_pool *pool);
+
+/*
+ * Leases the most recently returned idle connection that passes a health
+ * check: no CM event, such as a disconnect, came in for it and its QP is
+ * still in RTS. Connections that fail it are closed. With no healthy idle
+ * connection left, a new one is established.
+ *
+ * Returns the connection if successful, NULL otherwise.
+ */
+struct rdma_conn *rdma_conn_pool_lease(struct rdma_conn_pool *pool);
+
+/*
+ * Returns a leased connection to its pool. The caller must have reaped all
+ * completions of the WRs it posted. A connection that failed, an error
+ * completion say, is closed instead.
+ */
+void rdma_conn_pool_return(struct rdma_conn *conn, int failed);
+
+/*
+ * Closes idle connections that fail a health check, and those beyond the
+ * pool's size that idled past its expiry, then establishes connections until
+ * size are idle. Meant to be called periodically, and between bursts of
+ * leases.
+ *
+ * Returns 0 if successful, a negative error code if a connection couldn't be
+ * established.
+ */
+int rdma_conn_pool_maintain(struct rdma_conn_pool *pool);
+
+/*
+ * Prints an rdma_conn_pool struct in human-readable terms.
+ */
+void print_rdma_conn_pool(const struct rdma_conn_pool *pool, int i);
+
+#endif /* RDMA_CONN_POOL_H */
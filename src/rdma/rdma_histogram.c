@@ -0,0 +1,130 @@
+#include "rdma_histogram.h"
+
+/*
+ * Buckets 0 to 2^precision_bits - 1 hold the values themselves. Above that,
+ * each power of two [2^k, 2^(k+1)) maps to half as many buckets, each
+ * covering 2^(k - precision_bits + 1) values.
+ */
+static uint32_t bucket_index(const struct latency_histogram *histogram,
+                             uint64_t value)
+{
+        uint64_t sub_buckets = 1ULL << histogram->precision_bits;
+        uint64_t half = sub_buckets >> 1;
+
+        if (value < sub_buckets) {
+                return (uint32_t) value;
+        }
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - histogram->precision_bits + 1;
+        return (uint32_t) (sub_buckets + (shift - 1) * half +
+                           ((value >> shift) - half));
+}
+
+/*
+ * Highest value that falls in bucket index.
+ */
+static uint64_t bucket_highest_value(const struct latency_histogram *histogram,
+                                     uint32_t index)
+{
+        uint64_t sub_buckets = 1ULL << histogram->precision_bits;
+        uint64_t half = sub_buckets >> 1;
+
+        if (index < sub_buckets) {
+                return index;
+        }
+        uint64_t offset = index - sub_buckets;
+        int shift = offset / half + 1;
+        uint64_t sub = offset % half + half;
+        return ((sub + 1) << shift) - 1;
+}
+
+int latency_histogram_init(struct latency_histogram *histogram,
+                           int precision_bits)
+{
+        memset(histogram, 0, sizeof(*histogram));
+        if (precision_bits < 2 || precision_bits > 16) {
+                fprintf(stderr, "Invalid histogram precision %d bits\n",
+                        precision_bits);
+                return -EINVAL;
+        }
+        histogram->precision_bits = precision_bits;
+        histogram->bucket_count = (1U << precision_bits) +
+                (64 - precision_bits) * (1U << (precision_bits - 1));
+        histogram->counts = calloc(histogram->bucket_count,
+                                   sizeof(*histogram->counts));
+        if (!histogram->counts) {
+                fprintf(stderr, "Failed to allocate histogram: -ENOMEM\n");
+                return -ENOMEM;
+        }
+        histogram->min = UINT64_MAX;
+        return 0;
+}
+
+void latency_histogram_destroy(struct latency_histogram *histogram)
+{
+        free(histogram->counts);
+        memset(histogram, 0, sizeof(*histogram));
+}
+
+void latency_histogram_record(struct latency_histogram *histogram,
+                              uint64_t value)
+{
+        histogram->counts[bucket_index(histogram, value)]++;
+        histogram->total_count++;
+        histogram->sum += value;
+        if (value < histogram->min) {
+                histogram->min = value;
+        }
+        if (value > histogram->max) {
+                histogram->max = value;
+        }
+}
+
+uint64_t latency_histogram_percentile(const struct latency_histogram *histogram,
+                                      double percentile)
+{
+        if (!histogram->total_count) {
+                return 0;
+        }
+
+        /* Rank of the value we're after, counting from 1 */
+        uint64_t rank = (uint64_t) (percentile / 100.0 * histogram->total_count + 0.5);
+        if (rank < 1) {
+                rank = 1;
+        }
+
+        uint64_t seen = 0;
+        for (uint32_t i = 0; i < histogram->bucket_count; i++) {
+                seen += histogram->counts[i];
+                if (seen >= rank) {
+                        uint64_t value = bucket_highest_value(histogram, i);
+                        return value < histogram->max ? value : histogram->max;
+                }
+        }
+        return histogram->max;
+}
+
+void print_latency_histogram(const struct latency_histogram *histogram, int i)
+{
+        char indent[i+1];
+        memset(indent, '\t', i);
+        indent[i] = '\0';
+
+        if (!histogram->total_count) {
+                printf("%s(no samples)\n", indent);
+                return;
+        }
+
+        printf("%ssamples: %lu\n", indent,
+               (unsigned long) histogram->total_count);
+        printf("%smin:   %10.2f us\n", indent, histogram->min / 1e3);
+        printf("%sp50:   %10.2f us\n", indent,
+               latency_histogram_percentile(histogram, 50.0) / 1e3);
+        printf("%sp99:   %10.2f us\n", indent,
+               latency_histogram_percentile(histogram, 99.0) / 1e3);
+        printf("%sp99.9: %10.2f us\n", indent,
+               latency_histogram_percentile(histogram, 99.9) / 1e3);
+        printf("%smax:   %10.2f us\n", indent, histogram->max / 1e3);
+        printf("%smean:  %10.2f us\n", indent,
+               histogram->sum / histogram->total_count / 1e3);
+}
@@ -0,0 +1,67 @@
+/*
+ * rdma_histogram.h defines a high-dynamic-range (HDR) histogram used to record
+ * latencies in the client's benchmark modes.
+ *
+ * Values are bucketed log-linearly: every power-of-two range is split into the
+ * same number of linear sub-buckets, so each recorded value is kept within a
+ * fixed relative precision no matter its magnitude. Recording is a couple of
+ * shifts and an increment, cheap enough to run on every iteration, and tail
+ * percentiles like p99.9 stay accurate across nanoseconds to seconds.
+ */
+
+#ifndef RDMA_HISTOGRAM_H
+#define RDMA_HISTOGRAM_H
+
+#include "rdma_common.h"
+
+/* Default precision: 2^7 sub-buckets per power of two, under 1% error */
+#define DEFAULT_HISTOGRAM_PRECISION_BITS 8
+
+struct latency_histogram {
+        int precision_bits;
+        uint32_t bucket_count;
+        uint64_t *counts;
+
+        /* Exact statistics, alongside the bucketed counts */
+        uint64_t total_count;
+        uint64_t min;
+        uint64_t max;
+        double sum;
+};
+
+/*
+ * Initializes a histogram covering the whole uint64_t range, with
+ * 2^(precision_bits - 1) sub-buckets per power of two. precision_bits must be
+ * between 2 and 16.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+int latency_histogram_init(struct latency_histogram *histogram,
+                           int precision_bits);
+
+/*
+ * Frees a histogram's memory.
+ */
+void latency_histogram_destroy(struct latency_histogram *histogram);
+
+/*
+ * Records one value.
+ */
+void latency_histogram_record(struct latency_histogram *histogram,
+                              uint64_t value);
+
+/*
+ * Returns the value at or below which percentile percent of the recorded
+ * values fall, as the highest value equivalent to its bucket. Returns 0 for
+ * an empty histogram.
+ */
+uint64_t latency_histogram_percentile(const struct latency_histogram *histogram,
+                                      double percentile);
+
+/*
+ * Prints min/p50/p99/p99.9/max and the mean of a histogram of nanosecond
+ * values, in microseconds.
+ */
+void print_latency_histogram(const struct latency_histogram *histogram, int i);
+
+#endif /* RDMA_HISTOGRAM_H */
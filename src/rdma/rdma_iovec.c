@@ -0,0 +1,103 @@
+#include "rdma_iovec.h"
+
+int query_max_send_sge(struct ibv_context *verbs, int wanted)
+{
+        struct ibv_device_attr device_attr;
+
+        int ret = ibv_query_device(verbs, &device_attr);
+        if (ret) {
+                fprintf(stderr, "Failed to query device, using 1 SGE per WR: %s\n",
+                        strerror(ret));
+                return 1;
+        }
+        if (device_attr.max_sge < 1) {
+                return 1;
+        }
+        return device_attr.max_sge < wanted ? device_attr.max_sge : wanted;
+}
+
+uint64_t rdma_iov_length(const struct rdma_iov *iov, int iovcnt)
+{
+        uint64_t length = 0;
+
+        for (int i = 0; i < iovcnt; i++) {
+                length += iov[i].length;
+        }
+        return length;
+}
+
+int post_send_iov(struct ibv_qp *qp, const struct ibv_send_wr *wr,
+                  const struct rdma_iov *iov, int iovcnt, int max_sge,
+                  uint32_t max_inline)
+{
+        struct ibv_send_wr *bad_wr = NULL;
+
+        if (iovcnt < 0 || iovcnt > RDMA_IOV_MAX || max_sge < 1) {
+                fprintf(stderr, "Can't gather %d buffers %d at a time\n",
+                        iovcnt, max_sge);
+                return -EINVAL;
+        }
+
+        struct ibv_sge sges[iovcnt ? iovcnt : 1];
+        int num_sge = 0;
+        for (int i = 0; i < iovcnt; i++) {
+                if (!iov[i].length) {
+                        continue;
+                }
+                sges[num_sge].addr = (uint64_t) iov[i].base;
+                sges[num_sge].length = iov[i].length;
+                sges[num_sge].lkey = iov[i].lkey;
+                num_sge++;
+        }
+
+        uint64_t length = rdma_iov_length(iov, iovcnt);
+        unsigned int send_flags = wr->send_flags;
+        if (length && length <= max_inline) {
+                send_flags |= IBV_SEND_INLINE;
+        }
+
+        int is_write = wr->opcode == IBV_WR_RDMA_WRITE ||
+                       wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM;
+        if (num_sge > max_sge && !is_write) {
+                fprintf(stderr, "Can't send %d buffers with %d SGEs per WR\n",
+                        num_sge, max_sge);
+                return -E2BIG;
+        }
+
+        /* Each WR of the chain takes the next max_sge buffers, WRITEs to
+         * where the previous one left off, and stays silent unless it's the
+         * last. They all carry wr's wr_id, so a failure flushing any of them
+         * lands with wr's handler.
+         */
+        int num_wrs = num_sge > max_sge ? (num_sge + max_sge - 1) / max_sge : 1;
+        struct ibv_send_wr wrs[num_wrs];
+        uint64_t remote_offset = 0;
+        for (int i = 0; i < num_wrs; i++) {
+                int first = i * max_sge;
+                int count = num_sge - first < max_sge ? num_sge - first : max_sge;
+
+                wrs[i] = *wr;
+                wrs[i].sg_list = count ? &sges[first] : NULL;
+                wrs[i].num_sge = count;
+                wrs[i].next = i + 1 < num_wrs ? &wrs[i + 1] : NULL;
+                wrs[i].send_flags = send_flags;
+                if (is_write) {
+                        wrs[i].wr.rdma.remote_addr += remote_offset;
+                }
+                if (i + 1 < num_wrs) {
+                        wrs[i].opcode = IBV_WR_RDMA_WRITE;
+                        wrs[i].send_flags &= ~IBV_SEND_SIGNALED;
+                }
+                for (int j = first; j < first + count; j++) {
+                        remote_offset += sges[j].length;
+                }
+        }
+
+        int ret = ibv_post_send(qp, &wrs[0], &bad_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to post %d gathered WRs: %s\n", num_wrs,
+                        strerror(ret));
+                return -ret;
+        }
+        return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * rdma_iovec.h defines an iovec-style API for sending disjoint buffers, e.g.
+ * a header and its payload, as one SEND or RDMA WRITE.
+ *
+ * Each buffer becomes a scatter-gather entry of the WR, so the HCA gathers
+ * them straight out of application memory and nothing is staged through a
+ * contiguous copy first. A QP takes as many SGEs per send WR as the device
+ * reports in ibv_device_attr.max_sge, up to what it was created with. A
+ * WRITE gathering more buffers than that is split into a chain of WRITEs to
+ * consecutive remote ranges, posted with a single ibv_post_send(). A SEND
+ * can't be split without splitting the message, so it's refused instead.
+ */
+
+#ifndef RDMA_IOVEC_H
+#define RDMA_IOVEC_H
+
+#include "rdma_common.h"
+
+/* Most SGEs per send WR we ask a QP for, more only makes every WQE bigger */
+#define DEFAULT_MAX_SEND_SGE 16
+
+/* Most buffers one post_send_iov() call gathers */
+#define RDMA_IOV_MAX 1024
+
+/*
+ * A registered buffer to gather from, lkey being that of the Memory Region
+ * it lies in. lkey is ignored when the WR goes inline.
+ */
+struct rdma_iov {
+        const void *base;
+        uint32_t length;
+        uint32_t lkey;
+};
+
+/*
+ * Returns the number of SGEs per send WR to create QPs on verbs with: the
+ * device's max_sge, capped at wanted. Falls back to 1 if the device can't be
+ * queried.
+ */
+int query_max_send_sge(struct ibv_context *verbs, int wanted);
+
+/*
+ * Returns the total number of bytes in iov.
+ */
+uint64_t rdma_iov_length(const struct rdma_iov *iov, int iovcnt);
+
+/*
+ * Posts the iovcnt buffers in iov as the payload of wr, whose sg_list,
+ * num_sge and next are ignored. wr->send_flags gets IBV_SEND_INLINE added
+ * when the whole payload fits in max_inline bytes. Zero-length buffers are
+ * skipped.
+ *
+ * A WRITE (with or without immediate) over more than max_sge buffers goes
+ * out as a chain of unsignaled WRITEs ending in one that carries wr's
+ * wr_id, send_flags and immediate, so wr's completion still covers the
+ * whole payload.
+ *
+ * Returns 0 if successful, -E2BIG if a SEND needs more than max_sge SGEs,
+ * or another negative error code.
+ */
+int post_send_iov(struct ibv_qp *qp, const struct ibv_send_wr *wr,
+                  const struct rdma_iov *iov, int iovcnt, int max_sge,
+                  uint32_t max_inline);
+
+#endif /* RDMA_IOVEC_H */
@@ -0,0 +1,235 @@
+#include "rdma_kv.h"
+
+/* FNV-1a, continuing from hash */
+static uint32_t kv_checksum(uint32_t hash, const void *data, size_t length)
+{
+        const unsigned char *bytes = data;
+
+        for (size_t i = 0; i < length; i++) {
+                hash ^= bytes[i];
+                hash *= 16777619U;
+        }
+        return hash;
+}
+
+static uint32_t kv_bucket_checksum(const struct kv_bucket *bucket)
+{
+        return kv_checksum(2166136261U, bucket->entries,
+                           sizeof(bucket->entries));
+}
+
+static uint32_t kv_record_checksum(const struct kv_record *record)
+{
+        uint32_t hash = kv_checksum(2166136261U, &record->key,
+                                    sizeof(record->key));
+        hash = kv_checksum(hash, &record->length, sizeof(record->length));
+        return kv_checksum(hash, record->value, record->length);
+}
+
+uint64_t kv_hash(uint64_t key)
+{
+        /* splitmix64's finalizer, so sequential keys spread out */
+        key ^= key >> 30;
+        key *= 0xbf58476d1ce4e5b9ULL;
+        key ^= key >> 27;
+        key *= 0x94d049bb133111ebULL;
+        return key ^ (key >> 31);
+}
+
+uint64_t kv_location(uint64_t offset, uint32_t length)
+{
+        return offset << KV_LENGTH_BITS | length;
+}
+
+uint64_t kv_location_offset(uint64_t location)
+{
+        return location >> KV_LENGTH_BITS;
+}
+
+uint32_t kv_location_length(uint64_t location)
+{
+        return location & KV_MAX_VALUE_LENGTH;
+}
+
+uint64_t kv_record_size(uint32_t length)
+{
+        uint64_t size = sizeof(struct kv_record) + (uint64_t) length;
+        return (size + KV_RECORD_ALIGNMENT - 1) &
+               ~((uint64_t) KV_RECORD_ALIGNMENT - 1);
+}
+
+int kv_bucket_valid(const struct kv_bucket *bucket)
+{
+        return !(bucket->version & 1) &&
+               bucket->checksum == kv_bucket_checksum(bucket);
+}
+
+const struct kv_entry *kv_bucket_find(const struct kv_bucket *bucket,
+                                      uint64_t key, int *has_room)
+{
+        *has_room = 0;
+        for (int i = 0; i < KV_BUCKET_ENTRIES; i++) {
+                if (!bucket->entries[i].location) {
+                        *has_room = 1;
+                } else if (bucket->entries[i].key == key) {
+                        return &bucket->entries[i];
+                }
+        }
+        return NULL;
+}
+
+int kv_record_valid(const struct kv_record *record, uint64_t key,
+                    uint32_t length)
+{
+        return record->key == key && record->length == length &&
+               record->checksum == kv_record_checksum(record);
+}
+
+void kv_store_init(struct kv_store *store, void *index, uint64_t bucket_count,
+                   void *heap, uint64_t heap_size)
+{
+        memset(store, 0, sizeof(*store));
+        store->buckets = index;
+        store->bucket_count = bucket_count;
+        store->heap = heap;
+        store->heap_size = heap_size;
+        store->heap_used = KV_RECORD_ALIGNMENT;
+        for (uint64_t i = 0; i < bucket_count; i++) {
+                store->buckets[i].checksum = kv_bucket_checksum(&store->buckets[i]);
+        }
+}
+
+/*
+ * Returns the entry for key, either the one holding it or the first empty one
+ * along its probe sequence, or NULL if the index is full.
+ */
+static struct kv_entry *kv_find_slot(struct kv_store *store, uint64_t key,
+                                     struct kv_bucket **bucket)
+{
+        uint64_t home = kv_hash(key) % store->bucket_count;
+        struct kv_entry *empty = NULL;
+
+        for (uint64_t probe = 0; probe < store->bucket_count; probe++) {
+                *bucket = &store->buckets[(home + probe) % store->bucket_count];
+                for (int i = 0; i < KV_BUCKET_ENTRIES; i++) {
+                        struct kv_entry *entry = &(*bucket)->entries[i];
+                        if (!entry->location) {
+                                empty = empty ? empty : entry;
+                        } else if (entry->key == key) {
+                                return entry;
+                        }
+                }
+                /* Entries are never removed, so the key isn't further on */
+                if (empty) {
+                        return empty;
+                }
+        }
+        return NULL;
+}
+
+/*
+ * Returns the free list for records of size bytes, or NULL if they're too
+ * big to have one.
+ */
+static uint64_t *kv_free_list(struct kv_store *store, uint64_t size)
+{
+        uint64_t lines = size / KV_RECORD_ALIGNMENT;
+        return lines <= KV_FREE_LISTS ? &store->free_lists[lines - 1] : NULL;
+}
+
+/*
+ * Returns the heap offset of size free bytes for a record, or 0 if the heap
+ * is full.
+ */
+static uint64_t kv_alloc_record(struct kv_store *store, uint64_t size)
+{
+        uint64_t *free_list = kv_free_list(store, size);
+
+        if (free_list && *free_list) {
+                uint64_t offset = *free_list;
+                struct kv_record *record = (struct kv_record *) (store->heap + offset);
+                memcpy(free_list, record->value, sizeof(*free_list));
+                store->heap_free -= size;
+                return offset;
+        }
+        if (size > store->heap_size - store->heap_used) {
+                return 0;
+        }
+        uint64_t offset = store->heap_used;
+        store->heap_used += size;
+        return offset;
+}
+
+/*
+ * Puts a replaced record on its free list. Writing the link over its value
+ * also breaks its checksum, for clients still about to READ it.
+ */
+static void kv_free_record(struct kv_store *store, uint64_t location)
+{
+        uint64_t offset = kv_location_offset(location);
+        uint64_t size = kv_record_size(kv_location_length(location));
+        uint64_t *free_list = kv_free_list(store, size);
+        if (!free_list) {
+                return;
+        }
+
+        struct kv_record *record = (struct kv_record *) (store->heap + offset);
+        memcpy(record->value, free_list, sizeof(*free_list));
+        *free_list = offset;
+        store->heap_free += size;
+}
+
+int kv_put(struct kv_store *store, uint64_t key, const void *value,
+           uint32_t length)
+{
+        struct kv_bucket *bucket = NULL;
+
+        if (length > KV_MAX_VALUE_LENGTH) {
+                return -EINVAL;
+        }
+        uint64_t size = kv_record_size(length);
+        struct kv_entry *entry = kv_find_slot(store, key, &bucket);
+        if (!entry) {
+                return -ENOSPC;
+        }
+
+        /* A record of the same size is rewritten where it is, anything else
+         * is written out before any bucket points at it.
+         */
+        uint64_t replaced = entry->location;
+        uint64_t offset;
+        if (replaced && kv_record_size(kv_location_length(replaced)) == size) {
+                offset = kv_location_offset(replaced);
+                replaced = 0;
+        } else {
+                offset = kv_alloc_record(store, size);
+                if (!offset) {
+                        return -ENOSPC;
+                }
+        }
+        struct kv_record *record = (struct kv_record *) (store->heap + offset);
+        record->key = key;
+        record->length = length;
+        memcpy(record->value, value, length);
+        __atomic_store_n(&record->checksum, kv_record_checksum(record),
+                         __ATOMIC_RELEASE);
+
+        uint64_t location = kv_location(offset, length);
+        if (entry->location == location) {
+                return 0;
+        }
+        if (!entry->location) {
+                store->keys++;
+        }
+        __atomic_store_n(&bucket->version, bucket->version + 1, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        entry->key = key;
+        entry->location = location;
+        bucket->checksum = kv_bucket_checksum(bucket);
+        __atomic_store_n(&bucket->version, bucket->version + 1, __ATOMIC_RELEASE);
+
+        if (replaced) {
+                kv_free_record(store, replaced);
+        }
+        return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * rdma_kv.h defines a key-value store laid out in registered server memory so
+ * that clients can look keys up with RDMA READs alone.
+ *
+ * The store is two regions. The index is an open-addressing hash table of
+ * cache-line sized buckets, each holding up to KV_BUCKET_ENTRIES keys and the
+ * location of their value. A key lives in its home bucket, kv_hash() modulo
+ * the number of buckets, or the first bucket after it with room. The heap
+ * holds value records. A PUT whose record is the size of the one it replaces
+ * rewrites that record in place. Any other PUT writes a new record, taken
+ * from the free list of its size or the end of the heap, then points the
+ * key's bucket entry at it, and the record it replaced goes on a free list.
+ *
+ * Only the server writes. It guards each bucket update with the bucket's
+ * version, odd while the update is in progress, and a checksum over the
+ * bucket's entries, so a client that READs a bucket mid-update can tell and
+ * retry. A record carries its key and a checksum over its contents, which
+ * catches a record READ while it was rewritten or reused for another key, so
+ * the client retries from the bucket.
+ */
+
+#ifndef RDMA_KV_H
+#define RDMA_KV_H
+
+#include "rdma_common.h"
+
+/* Keys held per bucket, which fill a 64 byte cache line with its header */
+#define KV_BUCKET_ENTRIES 3
+
+/* Value records start on a cache line, and offset 0 of the heap is never
+ * one, which is what an empty entry's location reads as
+ */
+#define KV_RECORD_ALIGNMENT 64
+
+/* Records of up to KV_FREE_LISTS cache lines are reclaimed once replaced,
+ * on a free list per size. Larger ones are only ever rewritten in place.
+ */
+#define KV_FREE_LISTS 256
+
+/* A location packs a record's heap offset above its value length */
+#define KV_LENGTH_BITS 24
+#define KV_MAX_VALUE_LENGTH ((1U << KV_LENGTH_BITS) - 1)
+
+/* PUT, the only operation sent to the server, GETs are READs */
+#define KV_OP_PUT 1
+
+struct kv_entry {
+        uint64_t key;
+        uint64_t location; /* 0 if the entry is empty */
+};
+
+struct kv_bucket {
+        uint64_t version; /* Odd while the server updates the bucket */
+        struct kv_entry entries[KV_BUCKET_ENTRIES];
+        uint32_t checksum; /* Over the entries */
+        uint32_t reserved;
+} __attribute__((aligned(64)));
+
+/*
+ * A value in the heap, followed by its length bytes.
+ */
+struct kv_record {
+        uint64_t key;
+        uint32_t length;
+        uint32_t checksum; /* Over key, length and the value */
+        char value[];
+};
+
+/*
+ * Where the store lives on the server, handed to clients when they connect.
+ */
+struct __attribute((packed)) kv_regions {
+        struct rdma_buffer_attr index;
+        struct rdma_buffer_attr heap;
+};
+
+/*
+ * A PUT request SENT to the server, followed by its length value bytes.
+ */
+struct kv_request {
+        uint32_t op;
+        uint32_t length;
+        uint64_t key;
+        char value[];
+};
+
+/*
+ * The server's reply to a request.
+ */
+struct kv_reply {
+        int32_t status; /* 0, or a negative error code */
+        uint32_t reserved;
+        uint64_t key;
+};
+
+/*
+ * Server side of the store, over its index and heap.
+ */
+struct kv_store {
+        struct kv_bucket *buckets;
+        uint64_t bucket_count;
+        char *heap;
+        uint64_t heap_size;
+        uint64_t heap_used; /* Up to the first byte never handed out */
+        uint64_t heap_free; /* Bytes below heap_used on a free list */
+        uint64_t keys;
+
+        /* Heap offset of the first free record of i + 1 cache lines, 0 if
+         * none. Each free record holds the offset of the next in its value.
+         */
+        uint64_t free_lists[KV_FREE_LISTS];
+};
+
+/*
+ * Returns the hash of key that picks its home bucket.
+ */
+uint64_t kv_hash(uint64_t key);
+
+/*
+ * Returns the location of a record at heap offset offset holding length
+ * value bytes, and takes one apart.
+ */
+uint64_t kv_location(uint64_t offset, uint32_t length);
+uint64_t kv_location_offset(uint64_t location);
+uint32_t kv_location_length(uint64_t location);
+
+/*
+ * Returns the bytes a record holding length value bytes takes up in the heap.
+ */
+uint64_t kv_record_size(uint32_t length);
+
+/*
+ * Returns 1 if a bucket READ from the server is consistent, 0 if it was
+ * caught mid-update.
+ */
+int kv_bucket_valid(const struct kv_bucket *bucket);
+
+/*
+ * Returns the entry holding key in a valid bucket, or NULL. *has_room is set
+ * to whether the bucket has an empty entry, in which case the key can't be
+ * in any bucket after it either.
+ */
+const struct kv_entry *kv_bucket_find(const struct kv_bucket *bucket,
+                                      uint64_t key, int *has_room);
+
+/*
+ * Returns 1 if a record READ from the server holds key's length byte value
+ * intact, 0 otherwise.
+ */
+int kv_record_valid(const struct kv_record *record, uint64_t key,
+                    uint32_t length);
+
+/*
+ * Sets up an empty store over a zeroed index of bucket_count buckets, whose
+ * checksums it fills in, and a heap of heap_size bytes.
+ */
+void kv_store_init(struct kv_store *store, void *index, uint64_t bucket_count,
+                   void *heap, uint64_t heap_size);
+
+/*
+ * Stores length bytes of value under key, replacing any earlier value.
+ * Replaced records are reused, except those beyond KV_FREE_LISTS cache lines
+ * that a PUT of another size replaced.
+ *
+ * Returns 0 if successful, -ENOSPC if the heap or the index is full, or
+ * -EINVAL if the value is too long.
+ */
+int kv_put(struct kv_store *store, uint64_t key, const void *value,
+           uint32_t length);
+
+#endif /* RDMA_KV_H */
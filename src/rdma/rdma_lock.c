@@ -0,0 +1,85 @@
+#include "rdma_lock.h"
+
+uint64_t lock_word(uint32_t lease, uint16_t owner, uint16_t readers)
+{
+        return (uint64_t) lease << 32 | (uint64_t) owner << 16 | readers;
+}
+
+uint32_t lock_word_lease(uint64_t word)
+{
+        return word >> 32;
+}
+
+uint16_t lock_word_owner(uint64_t word)
+{
+        return word >> 16;
+}
+
+uint16_t lock_word_readers(uint64_t word)
+{
+        return word;
+}
+
+uint16_t lock_owner_id(uint64_t ticket)
+{
+        return ticket % LOCK_MAX_OWNERS + 1;
+}
+
+uint32_t lock_clock_ms()
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Leases wrap every 49 days, so compare them by their distance */
+static int lease_expired(uint32_t lease, uint32_t now)
+{
+        return (int32_t) (now - lease) >= 0;
+}
+
+int lock_word_held(uint64_t word, uint32_t now)
+{
+        return (lock_word_owner(word) || lock_word_readers(word)) &&
+               !lease_expired(lock_word_lease(word), now);
+}
+
+enum lock_state lock_acquire_word(uint64_t current, int shared, uint16_t owner,
+                                  uint32_t now, uint32_t lease_ms,
+                                  uint64_t *next)
+{
+        uint32_t lease = now + lease_ms;
+        int taken = lock_word_owner(current) || lock_word_readers(current);
+
+        if (taken && lease_expired(lock_word_lease(current), now)) {
+                *next = shared ? lock_word(lease, 0, 1) :
+                                 lock_word(lease, owner, 0);
+                return LOCK_EXPIRED;
+        }
+        if (!taken) {
+                *next = shared ? lock_word(lease, 0, 1) :
+                                 lock_word(lease, owner, 0);
+                return LOCK_AVAILABLE;
+        }
+        if (!shared || lock_word_owner(current) ||
+            lock_word_readers(current) == LOCK_MAX_READERS) {
+                return LOCK_HELD;
+        }
+
+        /* Joining shared holders, the lease covers the longest of them */
+        if (lease_expired(lease, lock_word_lease(current))) {
+                lease = lock_word_lease(current);
+        }
+        *next = lock_word(lease, 0, lock_word_readers(current) + 1);
+        return LOCK_AVAILABLE;
+}
+
+uint64_t lock_release_word(uint64_t current, int shared)
+{
+        if (!shared || lock_word_readers(current) <= 1) {
+                return 0;
+        }
+        return lock_word(lock_word_lease(current), 0,
+                         lock_word_readers(current) - 1);
+}
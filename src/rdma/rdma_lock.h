@@ -0,0 +1,82 @@
+/*
+ * rdma_lock.h defines the 64-bit lock words of the server's lock table,
+ * which clients acquire and release with RDMA COMPARE_AND_SWAP, so taking a
+ * lock never involves the server's CPU.
+ *
+ * A lock word packs, from the top: the lease, the exclusive owner and the
+ * number of shared holders. A free lock has neither owner nor holders,
+ * whatever its lease says. Every acquisition stamps the lease with when it
+ * runs out, in milliseconds of CLOCK_REALTIME truncated to 32 bits. A lock
+ * whose lease has run out is free for the taking, which recovers it from a
+ * holder that died with it. That takes the clients' clocks to agree to well
+ * within a lease, and a holder to release the lock before its lease runs
+ * out, or find it was taken over when its release fails.
+ */
+
+#ifndef RDMA_LOCK_H
+#define RDMA_LOCK_H
+
+#include "rdma_common.h"
+
+/* Default lease of an acquisition */
+#define DEFAULT_LOCK_LEASE_MS 1000
+
+/* Most shared holders a lock word counts */
+#define LOCK_MAX_READERS 0xffff
+
+/*
+ * A lock table ends in one more word that isn't a lock. Each client
+ * FETCH_AND_ADDs it once for a ticket, which lock_owner_id() turns into the
+ * client's owner id, so ids only repeat after LOCK_MAX_OWNERS clients.
+ */
+#define LOCK_MAX_OWNERS 0xffff
+
+/*
+ * What an acquisition can do with a lock in the state it was last seen in.
+ */
+enum lock_state {
+        LOCK_HELD, /* Held in a conflicting mode, back off */
+        LOCK_AVAILABLE, /* Free, or held shared by others for a shared acquisition */
+        LOCK_EXPIRED /* Held, but its lease ran out */
+};
+
+/*
+ * Returns a lock word, and takes one apart.
+ */
+uint64_t lock_word(uint32_t lease, uint16_t owner, uint16_t readers);
+uint32_t lock_word_lease(uint64_t word);
+uint16_t lock_word_owner(uint64_t word);
+uint16_t lock_word_readers(uint64_t word);
+
+/*
+ * Returns the owner id, never 0, handed out with ticket.
+ */
+uint16_t lock_owner_id(uint64_t ticket);
+
+/*
+ * Returns the current time in lease units.
+ */
+uint32_t lock_clock_ms();
+
+/*
+ * Returns 1 if word is held, by an owner or shared holders, under a lease
+ * that hasn't run out at now.
+ */
+int lock_word_held(uint64_t word, uint32_t now);
+
+/*
+ * Works out how owner can acquire the lock last seen holding current, at now,
+ * for lease_ms: exclusively or shared. Unless it returns LOCK_HELD, *next is
+ * set to the word to COMPARE_AND_SWAP current for.
+ */
+enum lock_state lock_acquire_word(uint64_t current, int shared, uint16_t owner,
+                                  uint32_t now, uint32_t lease_ms,
+                                  uint64_t *next);
+
+/*
+ * Returns the word releasing an acquisition of the lock, exclusive or shared,
+ * turns current into.
+ */
+uint64_t lock_release_word(uint64_t current, int shared);
+
+#endif /* RDMA_LOCK_H */
@@ -0,0 +1,235 @@
+#include "rdma_pool.h"
+
+/* Each size class starts on its own page */
+#define POOL_CLASS_ALIGNMENT 4096
+
+static size_t align_up(size_t value, size_t alignment)
+{
+        return (value + alignment - 1) & ~(alignment - 1);
+}
+
+struct rdma_pool *rdma_pool_create(struct ibv_pd *pd, uint32_t min_buffer_size,
+                                   uint32_t max_buffer_size, size_t class_bytes,
+                                   int access)
+{
+        if (!pd) {
+                fprintf(stderr, "No Protection Domain defined!\n");
+                return NULL;
+        }
+
+        struct rdma_pool *pool = calloc(1, sizeof(*pool));
+        if (!pool) {
+                fprintf(stderr, "Failed to allocate pool! -ENOMEM\n");
+                return NULL;
+        }
+        pool->pd = pd;
+        pool->access = access;
+
+        /* Lay out the size classes back to back, page-aligned, and count the
+         * total number of buffer handles we need.
+         */
+        uint32_t total_buffers = 0;
+        size_t offsets[RDMA_POOL_MAX_CLASSES];
+        for (uint64_t size = min_buffer_size;
+             size && size <= max_buffer_size &&
+             pool->num_classes < RDMA_POOL_MAX_CLASSES;
+             size <<= 1) {
+                struct rdma_pool_class *class = &pool->classes[pool->num_classes];
+                class->buffer_size = (uint32_t) size;
+                class->count = class_bytes / size ? class_bytes / size : 1;
+
+                offsets[pool->num_classes] = pool->size;
+                pool->size = align_up(pool->size + size * class->count,
+                                      POOL_CLASS_ALIGNMENT);
+                total_buffers += class->count;
+                pool->num_classes++;
+        }
+        if (!pool->num_classes) {
+                fprintf(stderr, "Invalid pool buffer sizes %u - %u\n",
+                        min_buffer_size, max_buffer_size);
+                free(pool);
+                return NULL;
+        }
+
+        pool->buffers = calloc(total_buffers, sizeof(*pool->buffers));
+        if (pool->buffers) {
+                pool->memory = alloc_rdma_memory(pool->size);
+        }
+        if (!pool->buffers || !pool->memory) {
+                fprintf(stderr, "Failed to allocate %zu byte pool! -ENOMEM\n",
+                        pool->size);
+                rdma_pool_destroy(pool);
+                return NULL;
+        }
+
+        /* The one and only registration for every pooled buffer */
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pool->mr = register_rdma_memory(pd, pool->memory, pool->size, access,
+                                        &pool->registration);
+        if (!pool->mr) {
+                fprintf(stderr, "Failed to register pool as MR: %s\n",
+                        strerror(errno));
+                rdma_pool_destroy(pool);
+                return NULL;
+        }
+        double reg_usec = elapsed_usec(&start);
+
+        /* Carve each class into buffers, chaining them onto its free list */
+        struct rdma_pool_buffer *buffer = pool->buffers;
+        for (int c = 0; c < pool->num_classes; c++) {
+                struct rdma_pool_class *class = &pool->classes[c];
+                char *class_memory = (char *)pool->memory + offsets[c];
+                for (uint32_t i = 0; i < class->count; i++, buffer++) {
+                        buffer->addr = class_memory + (size_t)i * class->buffer_size;
+                        buffer->length = class->buffer_size;
+                        buffer->lkey = pool->mr->lkey;
+                        buffer->rkey = pool->mr->rkey;
+                        buffer->size_class = c;
+                        buffer->next_free = class->free_list;
+                        class->free_list = buffer;
+                }
+                class->free_count = class->count;
+        }
+
+        printf("Registered %zu byte memory pool with %d size classes in %.1f us (%s):\n",
+               pool->size, pool->num_classes, reg_usec,
+               registration_mode_str(pool->registration));
+        print_rdma_pool(pool, 1);
+        return pool;
+}
+
+void rdma_pool_destroy(struct rdma_pool *pool)
+{
+        if (!pool) {
+                return;
+        }
+
+        if (pool->mr) {
+                deregister_rdma_memory(pool->mr);
+        }
+        free_rdma_memory(pool->memory);
+        free(pool->buffers);
+        free(pool);
+}
+
+/*
+ * Registers a dedicated buffer for a request the pool can't serve. This is
+ * the slow path the pool exists to avoid, so it's reported.
+ */
+static struct rdma_pool_buffer *alloc_oversize_buffer(struct rdma_pool *pool,
+                                                      uint32_t size)
+{
+        struct rdma_pool_buffer *buffer = calloc(1, sizeof(*buffer));
+        if (!buffer) {
+                fprintf(stderr, "Failed to allocate buffer handle! -ENOMEM\n");
+                return NULL;
+        }
+
+        printf("Pool can't serve %u bytes, registering a dedicated buffer\n",
+               size);
+        buffer->mr = create_rdma_buffer(pool->pd, size, pool->access);
+        if (!buffer->mr) {
+                free(buffer);
+                return NULL;
+        }
+        buffer->addr = buffer->mr->addr;
+        buffer->length = size;
+        buffer->lkey = buffer->mr->lkey;
+        buffer->rkey = buffer->mr->rkey;
+        buffer->size_class = -1;
+        return buffer;
+}
+
+struct rdma_pool_buffer *rdma_pool_alloc(struct rdma_pool *pool, uint32_t size)
+{
+        for (int c = 0; c < pool->num_classes; c++) {
+                struct rdma_pool_class *class = &pool->classes[c];
+                if (class->buffer_size < size) {
+                        continue;
+                }
+                if (!class->free_list) {
+                        /* Class exhausted, don't steal from bigger classes */
+                        break;
+                }
+
+                struct rdma_pool_buffer *buffer = class->free_list;
+                class->free_list = buffer->next_free;
+                class->free_count--;
+                buffer->next_free = NULL;
+                memset(buffer->addr, 0, buffer->length);
+                return buffer;
+        }
+
+        return alloc_oversize_buffer(pool, size);
+}
+
+struct rdma_pool_buffer *rdma_pool_alloc_remote(struct rdma_pool *pool,
+                                                uint32_t size, int access)
+{
+        struct rdma_pool_buffer *buffer = rdma_pool_alloc(pool, size);
+        if (!buffer) {
+                return NULL;
+        }
+
+        buffer->remote_mr = register_exclusive_rdma_memory(pool->pd,
+                                                           buffer->addr,
+                                                           buffer->length,
+                                                           access, NULL);
+        if (!buffer->remote_mr) {
+                fprintf(stderr, "Failed to register %u byte buffer for remote access: %s\n",
+                        buffer->length, strerror(errno));
+                rdma_pool_free(pool, buffer);
+                return NULL;
+        }
+        buffer->rkey = buffer->remote_mr->rkey;
+        return buffer;
+}
+
+void rdma_pool_free(struct rdma_pool *pool, struct rdma_pool_buffer *buffer)
+{
+        if (!buffer) {
+                return;
+        }
+
+        if (buffer->remote_mr) {
+                deregister_rdma_memory(buffer->remote_mr);
+                buffer->remote_mr = NULL;
+                buffer->rkey = buffer->mr ? buffer->mr->rkey : pool->mr->rkey;
+        }
+
+        if (buffer->size_class < 0) {
+                destroy_rdma_buffer(buffer->mr);
+                free(buffer);
+                return;
+        }
+
+        struct rdma_pool_class *class = &pool->classes[buffer->size_class];
+        buffer->next_free = class->free_list;
+        class->free_list = buffer;
+        class->free_count++;
+}
+
+void print_rdma_pool(const struct rdma_pool *pool, int i)
+{
+        char indent[i+1];
+        memset(indent, '\t', i);
+        indent[i] = '\0';
+
+        if (!pool) {
+                printf("%s(null)\n", indent);
+                return;
+        }
+
+        printf("%srdma_pool{\n", indent);
+        printf("%s\tmemory: %p\n", indent, pool->memory);
+        printf("%s\tsize: %zu\n", indent, pool->size);
+        printf("%s\tlkey: %u\n", indent, pool->mr ? pool->mr->lkey : 0);
+        printf("%s\trkey: %u\n", indent, pool->mr ? pool->mr->rkey : 0);
+        for (int c = 0; c < pool->num_classes; c++) {
+                printf("%s\tclass[%d]{ buffer_size: %u, count: %u, free: %u }\n",
+                       indent, c, pool->classes[c].buffer_size,
+                       pool->classes[c].count, pool->classes[c].free_count);
+        }
+        printf("%s}\n", indent);
+}
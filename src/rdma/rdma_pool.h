@@ -0,0 +1,125 @@
+/*
+ * rdma_pool.h defines a pool of pre-registered memory shared by the client
+ * and server sources.
+ *
+ * Registering memory with ibv_reg_mr() pins and maps every page of a buffer,
+ * which makes it by far the most expensive step of setting up a connection.
+ * The pool registers one large region per Protection Domain up front and
+ * carves it into power-of-two size classes, so handing out a buffer is a
+ * free-list pop instead of a calloc() plus an ibv_reg_mr().
+ */
+
+#ifndef RDMA_POOL_H
+#define RDMA_POOL_H
+
+#include "rdma_common.h"
+
+/* Upper bound on the number of power-of-two size classes in a pool */
+#define RDMA_POOL_MAX_CLASSES 32
+
+/* Default pool layout: 64 B to 1 MiB buffers, 1 MiB of memory per class */
+#define DEFAULT_POOL_MIN_BUFFER 64
+#define DEFAULT_POOL_MAX_BUFFER (1 << 20)
+#define DEFAULT_POOL_CLASS_BYTES (1 << 20)
+
+/*
+ * Handle to a buffer allocated from an rdma_pool. Carries everything needed
+ * to use the buffer in an SGE (addr, lkey) or advertise it to a peer (addr,
+ * rkey). length is the usable size, which may exceed the requested size.
+ */
+struct rdma_pool_buffer {
+        void *addr;
+        uint32_t length;
+        uint32_t lkey;
+        uint32_t rkey;
+
+        /* Size class the buffer belongs to, -1 if it didn't fit any class
+         * and was registered on its own (mr is set in that case).
+         */
+        int size_class;
+        struct ibv_mr *mr;
+
+        /* MR of the buffer's own that rkey comes from, if it was allocated
+         * with rdma_pool_alloc_remote()
+         */
+        struct ibv_mr *remote_mr;
+        struct rdma_pool_buffer *next_free;
+};
+
+/*
+ * A size class: count buffers of buffer_size bytes each.
+ */
+struct rdma_pool_class {
+        uint32_t buffer_size;
+        uint32_t count;
+        uint32_t free_count;
+        struct rdma_pool_buffer *free_list;
+};
+
+struct rdma_pool {
+        struct ibv_pd *pd;
+        int access; /* ibv_access_flags every buffer is registered with */
+
+        /* The single registered region backing all size classes */
+        void *memory;
+        size_t size;
+        struct ibv_mr *mr;
+        enum registration_mode registration; /* How mr was registered */
+
+        int num_classes;
+        struct rdma_pool_class classes[RDMA_POOL_MAX_CLASSES];
+        struct rdma_pool_buffer *buffers; /* Handles for all pooled buffers */
+};
+
+/*
+ * Creates a pool under the pd Protection Domain with power-of-two size classes
+ * from min_buffer_size to max_buffer_size bytes. Each class gets class_bytes of
+ * memory (at least one buffer). The whole pool is registered once with the
+ * given access flags, in the mode selected with set_registration_mode().
+ *
+ * Returns the pool if successful, NULL otherwise.
+ */
+struct rdma_pool *rdma_pool_create(struct ibv_pd *pd, uint32_t min_buffer_size,
+                                   uint32_t max_buffer_size, size_t class_bytes,
+                                   int access);
+
+/*
+ * Deregisters and frees a pool. Buffers still allocated from it become
+ * invalid.
+ */
+void rdma_pool_destroy(struct rdma_pool *pool);
+
+/*
+ * Allocates a zeroed buffer of at least size bytes from the smallest size
+ * class that fits. Requests larger than the biggest class, or hitting an
+ * exhausted class, fall back to registering a dedicated buffer.
+ *
+ * Returns a buffer handle if successful, NULL otherwise.
+ */
+struct rdma_pool_buffer *rdma_pool_alloc(struct rdma_pool *pool, uint32_t size);
+
+/*
+ * Allocates a buffer like rdma_pool_alloc() does, then registers an MR over
+ * just that buffer with the given access flags, and hands out its rkey. A
+ * pool registered for local access only can then give each peer a buffer its
+ * rkey is confined to, where the pool's rkey would reach every buffer in it.
+ * Every call pays for that registration, which plain rdma_pool_alloc()
+ * avoids, so only buffers whose rkey goes to a peer should come from here.
+ *
+ * Returns a buffer handle if successful, NULL otherwise.
+ */
+struct rdma_pool_buffer *rdma_pool_alloc_remote(struct rdma_pool *pool,
+                                                uint32_t size, int access);
+
+/*
+ * Returns a buffer to its pool, deregistering the MR of its own
+ * rdma_pool_alloc_remote() gave it.
+ */
+void rdma_pool_free(struct rdma_pool *pool, struct rdma_pool_buffer *buffer);
+
+/*
+ * Prints an rdma_pool struct in human-readable terms.
+ */
+void print_rdma_pool(const struct rdma_pool *pool, int i);
+
+#endif /* RDMA_POOL_H */
@@ -0,0 +1,185 @@
+#include "rdma_ring.h"
+
+static uint64_t ring_align(uint64_t value)
+{
+        return (value + RING_ALIGNMENT - 1) & ~((uint64_t) RING_ALIGNMENT - 1);
+}
+
+/* Sequence numbers skip 0, which is what a zeroed frame reads as */
+static uint32_t next_sequence(uint32_t sequence)
+{
+        return sequence + 1 ? sequence + 1 : 1;
+}
+
+uint64_t ring_data_size(uint64_t ring_size)
+{
+        if (ring_size < sizeof(struct ring_control) + 2 * ring_frame_size(1)) {
+                return 0;
+        }
+        return (ring_size - sizeof(struct ring_control)) &
+               ~((uint64_t) RING_ALIGNMENT - 1);
+}
+
+uint32_t ring_frame_size(uint32_t length)
+{
+        return ring_align(sizeof(struct ring_frame_header) + (uint64_t) length +
+                          sizeof(uint32_t));
+}
+
+uint32_t ring_max_payload(uint64_t ring_size)
+{
+        /* A frame no bigger than half the data region always fits after
+         * padding out the end of it, once the ring has drained.
+         */
+        uint64_t max_frame = (ring_data_size(ring_size) / 2) &
+                             ~((uint64_t) RING_ALIGNMENT - 1);
+        uint64_t overhead = sizeof(struct ring_frame_header) + sizeof(uint32_t);
+        if (max_frame <= overhead) {
+                return 0;
+        }
+        max_frame -= overhead;
+        return max_frame > UINT32_MAX - RING_ALIGNMENT ?
+               UINT32_MAX - RING_ALIGNMENT : (uint32_t) max_frame;
+}
+
+void ring_producer_init(struct ring_producer *producer, void *ring,
+                        uint64_t ring_size)
+{
+        memset(producer, 0, sizeof(*producer));
+        producer->data = (char *) ring + sizeof(struct ring_control);
+        producer->data_size = ring_data_size(ring_size);
+}
+
+void ring_producer_update_tail(struct ring_producer *producer,
+                               uint64_t consumer_index)
+{
+        if (consumer_index > producer->tail && consumer_index <= producer->head) {
+                producer->tail = consumer_index;
+        }
+}
+
+int ring_producer_append(struct ring_producer *producer, const void *payload,
+                         uint32_t length, struct ring_span spans[2])
+{
+        if (!length || length > producer->data_size / 2 ||
+            ring_frame_size(length) > producer->data_size / 2) {
+                return -EINVAL;
+        }
+
+        uint32_t frame_size = ring_frame_size(length);
+        uint64_t position = producer->head % producer->data_size;
+        uint64_t pad = 0;
+        if (position + frame_size > producer->data_size) {
+                pad = producer->data_size - position;
+        }
+        if (producer->head + pad + frame_size - producer->tail >
+            producer->data_size) {
+                return -EAGAIN;
+        }
+
+        int count = 0;
+        struct ring_frame_header *header;
+        if (pad) {
+                /* Only the header matters, the rest of the padding is zero */
+                producer->sequence = next_sequence(producer->sequence);
+                header = (struct ring_frame_header *) (producer->data + position);
+                header->length = RING_PAD_FRAME;
+                header->sequence = producer->sequence;
+                spans[count].offset = sizeof(struct ring_control) + position;
+                spans[count].length = sizeof(*header);
+                count++;
+                producer->head += pad;
+                position = 0;
+        }
+
+        producer->sequence = next_sequence(producer->sequence);
+        char *frame = producer->data + position;
+        header = (struct ring_frame_header *) frame;
+        header->length = length;
+        header->sequence = producer->sequence;
+        memcpy(frame + sizeof(*header), payload, length);
+        memcpy(frame + frame_size - sizeof(uint32_t), &producer->sequence,
+               sizeof(uint32_t));
+        spans[count].offset = sizeof(struct ring_control) + position;
+        spans[count].length = frame_size;
+        count++;
+        producer->head += frame_size;
+        return count;
+}
+
+void ring_consumer_init(struct ring_consumer *consumer, void *ring,
+                        uint64_t ring_size)
+{
+        memset(consumer, 0, sizeof(*consumer));
+        consumer->control = ring;
+        consumer->data = (char *) ring + sizeof(struct ring_control);
+        consumer->data_size = ring_data_size(ring_size);
+        consumer->sequence = 1;
+}
+
+/*
+ * Publishes the consumer index for the producer's next credit READ or
+ * our next credit WRITE.
+ */
+static void publish_consumer_index(struct ring_consumer *consumer)
+{
+        __atomic_store_n(&consumer->control->consumer_index, consumer->tail,
+                         __ATOMIC_RELEASE);
+}
+
+int ring_consumer_peek(struct ring_consumer *consumer, void **payload)
+{
+        for (;;) {
+                uint64_t position = consumer->tail % consumer->data_size;
+                struct ring_frame_header *header =
+                        (struct ring_frame_header *) (consumer->data + position);
+
+                /* The header may land in pieces, the sequence number tells
+                 * when all of it has.
+                 */
+                uint32_t sequence = __atomic_load_n(&header->sequence,
+                                                    __ATOMIC_ACQUIRE);
+                uint32_t length = __atomic_load_n(&header->length,
+                                                  __ATOMIC_ACQUIRE);
+                if (sequence != consumer->sequence || !length) {
+                        return -EAGAIN;
+                }
+
+                if (length == RING_PAD_FRAME) {
+                        memset(header, 0, sizeof(*header));
+                        consumer->tail += consumer->data_size - position;
+                        consumer->sequence = next_sequence(consumer->sequence);
+                        publish_consumer_index(consumer);
+                        continue;
+                }
+
+                uint32_t frame_size = ring_frame_size(length);
+                if (position + frame_size > consumer->data_size) {
+                        fprintf(stderr, "Corrupt ring frame of %u bytes at %lu\n",
+                                length, (unsigned long) position);
+                        return -EIO;
+                }
+                uint32_t *trailer = (uint32_t *) (consumer->data + position +
+                                                  frame_size - sizeof(uint32_t));
+                if (__atomic_load_n(trailer, __ATOMIC_ACQUIRE) !=
+                    consumer->sequence) {
+                        return -EAGAIN;
+                }
+
+                *payload = consumer->data + position + sizeof(*header);
+                return length;
+        }
+}
+
+void ring_consumer_release(struct ring_consumer *consumer)
+{
+        uint64_t position = consumer->tail % consumer->data_size;
+        struct ring_frame_header *header =
+                (struct ring_frame_header *) (consumer->data + position);
+        uint32_t frame_size = ring_frame_size(header->length);
+
+        memset(header, 0, frame_size);
+        consumer->tail += frame_size;
+        consumer->sequence = next_sequence(consumer->sequence);
+        publish_consumer_index(consumer);
+}
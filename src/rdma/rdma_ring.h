@@ -0,0 +1,141 @@
+/*
+ * rdma_ring.h defines a one-sided message ring: a circular buffer on the
+ * receiver that a sender appends framed messages to with RDMA WRITE, so a
+ * whole stream flows over one connection without the receiver posting any
+ * receives or copying anything out.
+ *
+ * The ring buffer starts with a struct ring_control holding the consumer
+ * index, followed by the data region. A frame is a ring_frame_header, the
+ * payload, and a copy of the header's sequence number in its last 4 bytes,
+ * padded to RING_ALIGNMENT. The receiver polls the next frame's header and
+ * then its trailer, which lands last, hands out the payload in place, and
+ * zeroes the frame once done with it. Frames never wrap around the end of the
+ * data region: a padding frame fills whatever is left first.
+ *
+ * Indexes count bytes and only ever grow, offsets are taken modulo the data
+ * region size. The sender learns how far the receiver has got, its credits,
+ * from the consumer index: pushed by the receiver with an RDMA WRITE every so
+ * often, and pulled with an RDMA READ of the ring_control when it runs out.
+ */
+
+#ifndef RDMA_RING_H
+#define RDMA_RING_H
+
+#include "rdma_common.h"
+
+/* Frames start and end on this boundary */
+#define RING_ALIGNMENT 8
+
+/* Header length of a padding frame, which fills the data region's tail */
+#define RING_PAD_FRAME 0xffffffffU
+
+/*
+ * Start of the ring buffer. The consumer index gets a cache line to itself,
+ * so the receiver updating it never shares a line with incoming frames.
+ */
+struct ring_control {
+        uint64_t consumer_index; /* Bytes of the data region consumed */
+        uint8_t reserved[56];
+};
+
+struct __attribute((packed)) ring_frame_header {
+        uint32_t length; /* Payload bytes, or RING_PAD_FRAME */
+        uint32_t sequence; /* Never 0, repeated in the frame's trailer */
+};
+
+/*
+ * Range of the ring buffer the sender has to WRITE to the receiver's copy.
+ * offset counts from the start of the ring buffer, so it applies to both.
+ */
+struct ring_span {
+        uint64_t offset;
+        uint32_t length;
+};
+
+/*
+ * Sending side. Frames are built in a local ring buffer laid out like the
+ * receiver's, then written to the same offsets.
+ */
+struct ring_producer {
+        char *data; /* Local copy of the data region */
+        uint64_t data_size;
+        uint64_t head; /* Bytes appended */
+        uint64_t tail; /* Latest consumer index we know of */
+        uint32_t sequence; /* Sequence number of the last frame */
+};
+
+/*
+ * Receiving side, over the registered ring buffer the sender WRITEs to.
+ */
+struct ring_consumer {
+        struct ring_control *control;
+        char *data;
+        uint64_t data_size;
+        uint64_t tail; /* Bytes consumed */
+        uint32_t sequence; /* Sequence number of the next frame */
+};
+
+/*
+ * Returns the data region size of a ring buffer of ring_size bytes, or 0 if
+ * ring_size is too small to hold a ring.
+ */
+uint64_t ring_data_size(uint64_t ring_size);
+
+/*
+ * Returns the bytes a frame with a length byte payload takes up.
+ */
+uint32_t ring_frame_size(uint32_t length);
+
+/*
+ * Returns the largest payload a ring buffer of ring_size bytes can carry.
+ */
+uint32_t ring_max_payload(uint64_t ring_size);
+
+/*
+ * Sets up a producer building frames in ring, a local buffer of ring_size
+ * bytes.
+ */
+void ring_producer_init(struct ring_producer *producer, void *ring,
+                        uint64_t ring_size);
+
+/*
+ * Takes a consumer index learned from the receiver. Indexes can arrive out
+ * of order, so older ones are ignored.
+ */
+void ring_producer_update_tail(struct ring_producer *producer,
+                               uint64_t consumer_index);
+
+/*
+ * Frames length bytes of payload into the local ring, behind a padding frame
+ * if it would otherwise wrap. spans is filled with the ranges to WRITE to the
+ * receiver, in order.
+ *
+ * Returns the number of spans (1 or 2), -EAGAIN if the ring is too full
+ * until more credits come in, or -EINVAL if the payload can never fit.
+ */
+int ring_producer_append(struct ring_producer *producer, const void *payload,
+                         uint32_t length, struct ring_span spans[2]);
+
+/*
+ * Sets up a consumer over ring, the ring_size byte buffer the producer
+ * WRITEs to. The buffer must start out zeroed.
+ */
+void ring_consumer_init(struct ring_consumer *consumer, void *ring,
+                        uint64_t ring_size);
+
+/*
+ * Looks for the next complete message, consuming any padding frame in its
+ * way. The message stays in the ring until ring_consumer_release().
+ *
+ * Returns the payload length with *payload pointing at it, -EAGAIN if the
+ * next message hasn't fully landed yet, or -EIO if its header is corrupt.
+ */
+int ring_consumer_peek(struct ring_consumer *consumer, void **payload);
+
+/*
+ * Releases the message returned by the last ring_consumer_peek(), zeroing its
+ * frame and publishing the new consumer index.
+ */
+void ring_consumer_release(struct ring_consumer *consumer);
+
+#endif /* RDMA_RING_H */
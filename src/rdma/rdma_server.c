@@ -8,7 +8,18 @@
  *      https://github.com/animeshtrivedi/rdma-example
  */
 
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
 #include "rdma_common.h"
+#include "rdma_pool.h"
+#include "rdma_ring.h"
+#include "rdma_kv.h"
+#include "rdma_lock.h"
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 static char *server_addr = "127.0.0.1";
 static char *server_port = "7471";
@@ -18,22 +29,56 @@ static struct rdma_event_channel *cm_event_channel;
 static struct rdma_cm_id *cm_server_id, *cm_client_id;
 static struct rdma_addrinfo *rai, hints;
 
+/* Connection requests the CM queues up for us to accept */
+#define DEFAULT_LISTEN_BACKLOG 1024
+static int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+
 /* RDMA Queue Pair and Protection Domain resources */
 static struct ibv_pd *protection_domain = NULL;
 static struct ibv_qp *client_queue_pair = NULL;
 static struct ibv_cq *completion_queue = NULL;
 static struct ibv_comp_channel *io_completion_channel = NULL;
+
+/* Buffer pools are registered for local access only, so their rkey is never
+ * given out. The buffer a client is told about gets an MR of its own with
+ * these, which confines the client's rkey to its own buffer. That MR is
+ * registered for every connection, once its buffer's size is known, so each
+ * connection pays an ibv_reg_mr() over its buffer, pinning it unless ODP is
+ * selected. Caching the MR with the pooled buffer would hand the next client
+ * an rkey the previous one still knows, and a memory window can't be bound
+ * before a fast connect accept carries its rkey.
+ */
+#define CLIENT_BUFFER_ACCESS (IBV_ACCESS_LOCAL_WRITE| \
+                              IBV_ACCESS_REMOTE_READ| \
+                              IBV_ACCESS_REMOTE_WRITE)
+
 static struct ibv_qp_init_attr qp_init_attr;
 
+/* Inline data requested for client QPs, and the amount the device granted
+ * the single-client QP
+ */
+static uint32_t inline_size = DEFAULT_INLINE_SIZE;
+static uint32_t max_inline_data = 0;
+
 /* Memory resources */
 static struct ibv_mr *client_metadata_mr = NULL;
 static struct ibv_mr *server_metadata_mr = NULL;
-static struct ibv_mr *server_buffer_mr = NULL;
+
+/* Pre-registered memory that client buffers are allocated from */
+static struct rdma_pool *buffer_pool = NULL;
+static uint32_t pool_max_buffer = DEFAULT_POOL_MAX_BUFFER;
+static size_t pool_class_bytes = DEFAULT_POOL_CLASS_BYTES;
+static struct rdma_pool_buffer *server_pool_buffer = NULL;
 
 /* Receive buffer to which the server will store metadata about the client */
 static struct rdma_buffer_attr client_metadata;
 /* Send buffer from where client will retrieve metadata about the server */
 static struct rdma_buffer_attr server_metadata;
+
+/* The client sent its metadata with its connect request, and gets ours with
+ * our accept, so there is no metadata SEND either way
+ */
+static int fast_connect = 0;
 /* Server's send and receive scatter-gather entries (SGE) for work requests */
 static struct ibv_sge client_recv_sge, server_send_sge;
 
@@ -41,23 +86,497 @@ static struct ibv_sge client_recv_sge, server_send_sge;
 static struct ibv_recv_wr client_recv_wr, *bad_client_recv_wr = NULL;
 static struct ibv_send_wr server_send_wr, *bad_server_send_wr = NULL;
 
-/* Dynamically allocated and registered memory accessible by the client */
+/* Pooled, pre-registered memory accessible by the client */
 void *server_buffer = NULL;
 
+/* Routes Work Completions to their handlers by wr_id, for both the
+ * single-client path and every connection in the event loop.
+ */
+static struct completion_table completion_table;
+static int cq_batch_size = DEFAULT_CQ_BATCH_SIZE;
+
+/* Benchmarks the single-client path serves after the metadata exchange */
+static enum benchmark_op latency_op = BENCHMARK_OP_NONE;
+static enum benchmark_op bandwidth_op = BENCHMARK_OP_NONE;
+static int queue_depth = DEFAULT_QUEUE_DEPTH;
+static struct ibv_recv_wr *sink_recv_wrs = NULL; /* Send bandwidth receives */
+
+/* Clients WRITE their message with an immediate that notifies us */
+static int write_imm = 0;
+
+/* The single client streams messages into a ring in our buffer */
+static int ring_mode = 0;
+
+/*
+ * A receive for a credit stream message, landing in its own slot of
+ * stream_pool_buffer.
+ */
+struct stream_receive {
+        struct ibv_recv_wr wr;
+        struct ibv_sge sge;
+};
+
+/* The single client SENDs a stream under credit-based flow control */
+static int credit_stream = 0;
+
+/* The stream is an rdma-client --session, every message of which we print */
+static int session_mode = 0;
+
+/* The single client WRITEs a file, chunk by chunk, into queue_depth chunk
+ * slots of our buffer, and we write it out to file_output
+ */
+static const char *file_output = NULL;
+static int file_fd = -1;
+static struct ibv_recv_wr *chunk_recv_wrs = NULL;
+static struct rdma_pool_buffer *chunk_counter_pool_buffer = NULL;
+static struct stream_receive *stream_receives = NULL;
+static struct rdma_pool_buffer *stream_pool_buffer = NULL;
+
+/* Clients FETCH_AND_ADD and COMPARE_AND_SWAP an array of 64-bit counters,
+ * advertised in place of their buffer. No server CPU is spent on them.
+ */
+static uint32_t atomic_counter_count = 0;
+static struct ibv_mr *atomic_counters_mr = NULL;
+static int lock_table = 0; /* The counters are lock words (see rdma_lock.h) */
+
+/* The single client GETs from a key-value store of kv_bucket_count buckets
+ * and a kv_heap_size byte heap with READs, and SENDs us its PUTs
+ */
+#define DEFAULT_KV_HEAP_SIZE (256 << 20)
+static uint32_t kv_bucket_count = 0;
+static uint32_t kv_heap_size = DEFAULT_KV_HEAP_SIZE;
+static struct kv_store kv_store;
+static struct ibv_mr *kv_index_mr = NULL, *kv_heap_mr = NULL;
+static struct kv_regions kv_regions; /* Sent with our accept */
+static struct stream_receive *kv_receives = NULL;
+static struct rdma_pool_buffer *kv_request_pool_buffer = NULL;
+static struct rdma_pool_buffer *kv_reply_pool_buffer = NULL;
+
+/* Completion Queue depth of each worker, shared by all of its connections */
+#define WORKER_CQ_DEPTH 1024
+/* Send and receive WRs a connection may have outstanding on its CQ */
+#define WRS_PER_CONNECTION 16
+
+/*
+ * Commands the acceptor thread queues for a worker. Every CM event for a
+ * connection is forwarded to the worker owning it, so only that worker ever
+ * touches the connection.
+ */
+enum worker_command_type {
+        WORKER_CONNECT_REQUEST,
+        WORKER_ESTABLISHED,
+        WORKER_DISCONNECTED,
+        WORKER_CONNECT_ERROR,
+        WORKER_STOP
+};
+
+struct worker_command {
+        enum worker_command_type type;
+        struct rdma_cm_id *cm_id;
+        /* A connect request's fast connect metadata, which goes away with
+         * the CM event
+         */
+        int fast_connect;
+        struct rdma_buffer_attr client_metadata;
+        struct worker_command *next;
+};
+
+/*
+ * A worker thread pinned to one core. It runs its own epoll loop over its
+ * command eventfd and a single completion channel, and owns one CQ, created on
+ * its own completion vector, that all of its connections share. Its
+ * completion table and memory pool are private, so workers never contend
+ * with each other.
+ */
+struct worker {
+        int index;
+        int cpu;
+        pthread_t thread;
+        int epoll_fd;
+        int started; /* Thread was created and must be joined */
+        int running;
+
+        /* Queue of commands from the acceptor, signalled through command_fd */
+        int command_fd;
+        pthread_mutex_t command_lock;
+        struct worker_command *commands, *commands_tail;
+
+        /* Created on the first connection, once the device is known */
+        struct ibv_comp_channel *completion_channel;
+        struct ibv_cq *completion_queue;
+        int cq_depth;
+        int comp_vector;
+        struct rdma_pool *buffer_pool;
+        struct completion_table completion_table;
+
+        /* Connections owned by this worker. connection_count is also read by
+         * the acceptor to pick the least-loaded worker.
+         */
+        struct client_connection *connections;
+        int connection_count;
+};
+
+static struct worker *workers = NULL;
+static int worker_count = 0;
+static int next_worker = 0; /* Round-robin tie-breaker for pick_worker() */
+
+/*
+ * Per-client state for connections served by the event loop. These mirror the
+ * static globals used by the single-client path above.
+ */
+struct client_connection {
+        struct rdma_cm_id *cm_id;
+        struct worker *worker; /* Owning worker, NULL in the single event loop */
+        struct ibv_comp_channel *completion_channel;
+        struct ibv_cq *completion_queue;
+        struct ibv_qp *queue_pair;
+        uint32_t max_inline_data; /* Inline data granted to queue_pair */
+
+        /* Pooled buffers holding a struct rdma_buffer_attr each, for the
+         * metadata exchange, and the WRs that move them.
+         */
+        struct rdma_pool_buffer *client_metadata, *server_metadata;
+        struct ibv_sge client_recv_sge, server_send_sge;
+        struct ibv_recv_wr client_recv_wr;
+        struct ibv_send_wr server_send_wr;
+
+        /* Buffer the client reads/writes, sized by its advertised length */
+        struct rdma_pool_buffer *buffer;
+
+        int pooled; /* From the accept pool, and returned to it when done */
+        int timewait; /* In timewait_connections, its client gone */
+        int established; /* RDMA_CM_EVENT_ESTABLISHED received */
+        int metadata_sent; /* Server metadata SEND completed, or went with the accept */
+
+        /* Doubly-linked list of all live connections */
+        struct client_connection *prev, *next;
+
+        /* Next in its qp_connections bucket */
+        struct client_connection *qp_next;
+};
+
+static int serve_multiple_clients = 0;
+static int epoll_fd = -1;
+static struct client_connection *connections = NULL;
+static int connection_count = 0;
+static volatile sig_atomic_t event_loop_running = 1;
+
+/* Default number of receive WRs kept posted on the Shared Receive Queue */
+#define DEFAULT_SRQ_DEPTH 64
+
+/*
+ * A receive WR posted on the Shared Receive Queue, with the pooled buffer it
+ * lands in. Which client QP consumes it is only known on completion.
+ */
+struct srq_receive {
+        struct rdma_pool_buffer *buffer;
+        struct ibv_sge sge;
+        struct ibv_recv_wr wr;
+        int posted;
+};
+
+/*
+ * In SRQ mode every client QP draws its receives from one Shared Receive Queue
+ * instead of owning its own, so posted receive memory is bounded by srq_depth
+ * rather than growing with the number of clients. When fewer than a quarter of
+ * the receives remain posted, the device raises IBV_EVENT_SRQ_LIMIT_REACHED on
+ * the async event fd and the event loop reposts them all in one batch.
+ */
+static int use_srq = 0;
+static int srq_depth = DEFAULT_SRQ_DEPTH;
+static struct ibv_srq *shared_receive_queue = NULL;
+static struct srq_receive *srq_receives = NULL;
+static int srq_posted = 0;
+
+/*
+ * The event loop's connections, hashed by QP number, which is all the WC of
+ * an SRQ receive says about the client that sent it.
+ */
+#define QP_CONNECTION_BUCKETS 1024
+static struct client_connection *qp_connections[QP_CONNECTION_BUCKETS];
+
+static struct client_connection **qp_connection_bucket(uint32_t qp_num)
+{
+        return &qp_connections[qp_num & (QP_CONNECTION_BUCKETS - 1)];
+}
+
+static void index_connection_qp(struct client_connection *conn)
+{
+        struct client_connection **bucket =
+                qp_connection_bucket(conn->queue_pair->qp_num);
+
+        conn->qp_next = *bucket;
+        *bucket = conn;
+}
+
+/*
+ * Removes a connection from qp_connections, if it's there.
+ */
+static void unindex_connection_qp(struct client_connection *conn)
+{
+        if (!conn->queue_pair) {
+                return;
+        }
+        for (struct client_connection **link =
+                     qp_connection_bucket(conn->queue_pair->qp_num);
+             *link; link = &(*link)->qp_next) {
+                if (*link == conn) {
+                        *link = conn->qp_next;
+                        conn->qp_next = NULL;
+                        return;
+                }
+        }
+}
+
+/*
+ * Finds the live connection owning the QP with number qp_num.
+ */
+static struct client_connection *find_connection_by_qp_num(uint32_t qp_num)
+{
+        for (struct client_connection *conn = *qp_connection_bucket(qp_num);
+             conn; conn = conn->qp_next) {
+                if (conn->queue_pair->qp_num == qp_num) {
+                        return conn;
+                }
+        }
+        return NULL;
+}
+
+/*
+ * With an accept pool, accept_pool_size connections are created up front,
+ * QP and metadata buffers included, on one CQ and completion channel shared
+ * by all of them. A connection request takes a spare connection, so
+ * accepting it creates no verbs objects. Its buffer still comes with an MR
+ * of its own (see CLIENT_BUFFER_ACCESS), which a fast connect registers
+ * before rdma_accept(). Once its client is gone, the connection's
+ * QP is reset and the connection waits in timewait_connections, holding on to
+ * its CM id until RDMA_CM_EVENT_TIMEWAIT_EXIT, so packets still in flight
+ * for the old connection can't reach the next client on its QP. Then it goes
+ * back to the spares. Requests beyond the spares get a connection created
+ * for them.
+ */
+static int accept_pool_size = 0;
+static struct ibv_comp_channel *accept_pool_channel = NULL;
+static struct ibv_cq *accept_pool_cq = NULL;
+static struct client_connection *spare_connections = NULL;
+static struct client_connection *timewait_connections = NULL;
+
+/*
+ * A connection's completion table, memory pool, connection list and count are
+ * its worker's when it has one, the event loop's globals otherwise.
+ */
+static struct completion_table *connection_completion_table(struct client_connection *conn)
+{
+        return conn->worker ? &conn->worker->completion_table : &completion_table;
+}
+
+static struct rdma_pool *connection_pool(struct client_connection *conn)
+{
+        return conn->worker ? conn->worker->buffer_pool : buffer_pool;
+}
+
+static struct client_connection **connection_list(struct client_connection *conn)
+{
+        return conn->worker ? &conn->worker->connections : &connections;
+}
+
+static int *connection_counter(struct client_connection *conn)
+{
+        return conn->worker ? &conn->worker->connection_count : &connection_count;
+}
+
+/*
+ * Adds a connection to its connection list, and takes it off.
+ */
+static void link_client_connection(struct client_connection *conn)
+{
+        struct client_connection **list = connection_list(conn);
+
+        __atomic_add_fetch(connection_counter(conn), 1, __ATOMIC_RELAXED);
+        conn->next = *list;
+        if (*list) {
+                (*list)->prev = conn;
+        }
+        *list = conn;
+}
+
+static void unlink_client_connection(struct client_connection *conn)
+{
+        struct client_connection **list = connection_list(conn);
+
+        if (conn->prev) {
+                conn->prev->next = conn->next;
+        } else if (*list == conn) {
+                *list = conn->next;
+        }
+        if (conn->next) {
+                conn->next->prev = conn->prev;
+        }
+        conn->prev = conn->next = NULL;
+        __atomic_sub_fetch(connection_counter(conn), 1, __ATOMIC_RELAXED);
+}
+
+static int recycle_pooled_connection(struct client_connection *conn);
+
+/*
+ * Returns the CQ whose WCs have to be dispatched before a connection goes
+ * away: one it shares with others, a worker's or the accept pool's, or its
+ * own when its QP draws receives from the SRQ, since the SRQ receives it
+ * consumed complete there and only go back to the SRQ once dispatched. NULL
+ * if its CQ can simply go away with it.
+ */
+static struct ibv_cq *draining_connection_cq(struct client_connection *conn)
+{
+        if (conn->worker) {
+                return conn->worker->completion_queue;
+        }
+        if (conn->pooled) {
+                return accept_pool_cq;
+        }
+        return shared_receive_queue ? conn->completion_queue : NULL;
+}
+
+/*
+ * Cancels the WRs still outstanding on a connection, which will never
+ * complete. On a CQ from draining_connection_cq() its QP is reset first, so
+ * it generates no more WCs, and the ones it already queued are dispatched:
+ * cancelling first would free wr_id slots a stale WC still names, and once
+ * another connection reuses them, that WC would run its callback. The
+ * connection leaves qp_connections before, so SRQ receives it consumed are
+ * only released.
+ *
+ * Returns 0 if successful, a negative error code if the QP can't be reset,
+ * in which case its WRs are cancelled anyway.
+ */
+static int quiesce_client_connection(struct client_connection *conn)
+{
+        struct completion_table *table = connection_completion_table(conn);
+        struct ibv_cq *cq = draining_connection_cq(conn);
+        struct ibv_qp_attr attr;
+        int ret = 0;
+
+        unindex_connection_qp(conn);
+        if (conn->queue_pair && cq) {
+                memset(&attr, 0, sizeof(attr));
+                attr.qp_state = IBV_QPS_RESET;
+                ret = ibv_modify_qp(conn->queue_pair, &attr, IBV_QP_STATE);
+                if (ret) {
+                        fprintf(stderr, "Failed to reset QP: %s\n", strerror(ret));
+                        ret = -ret;
+                } else {
+                        drain_completion_queue(cq, table);
+                }
+        }
+        completion_table_cancel_context(table, conn);
+        return ret;
+}
+
+/*
+ * Releases all resources held by a connection, in reverse order that they were
+ * created, and unlinks it from the connection list. A connection from the
+ * accept pool goes back to the pool instead. The connection's CM id must
+ * not have any un-ACKed CM events when this is called.
+ */
+static void destroy_client_connection(struct client_connection *conn)
+{
+        struct rdma_pool *pool = connection_pool(conn);
+
+        if (conn->pooled && conn->cm_id && !recycle_pooled_connection(conn)) {
+                return;
+        }
+
+        quiesce_client_connection(conn);
+
+        if (conn->completion_channel && epoll_fd != -1) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->completion_channel->fd,
+                          NULL);
+        }
+
+        /* The CM only knows about the QPs it created */
+        if (conn->queue_pair && conn->pooled) {
+                ibv_destroy_qp(conn->queue_pair);
+        } else if (conn->queue_pair) {
+                rdma_destroy_qp(conn->cm_id);
+        }
+
+        /* Return the connection's buffers to the pool */
+        rdma_pool_free(pool, conn->buffer);
+        rdma_pool_free(pool, conn->server_metadata);
+        rdma_pool_free(pool, conn->client_metadata);
+
+        if (conn->completion_queue) {
+                ibv_destroy_cq(conn->completion_queue);
+        }
+
+        if (conn->completion_channel) {
+                ibv_destroy_comp_channel(conn->completion_channel);
+        }
+
+        if (conn->cm_id) {
+                rdma_destroy_id(conn->cm_id);
+        }
+
+        unlink_client_connection(conn);
+        free(conn);
+}
+
+/*
+ * Destroys the Shared Receive Queue and returns its receive buffers to the
+ * pool. All QPs attached to it must already be destroyed.
+ */
+static void destroy_shared_receive_queue()
+{
+        if (shared_receive_queue) {
+                printf("Destroying shared receive queue\n");
+                ibv_destroy_srq(shared_receive_queue);
+                shared_receive_queue = NULL;
+        }
+
+        if (!srq_receives) {
+                return;
+        }
+        for (int i = 0; i < srq_depth; i++) {
+                if (srq_receives[i].posted) {
+                        completion_table_cancel(&completion_table,
+                                                srq_receives[i].wr.wr_id);
+                }
+                rdma_pool_free(buffer_pool, srq_receives[i].buffer);
+        }
+        free(srq_receives);
+        srq_receives = NULL;
+        srq_posted = 0;
+}
+
+static void stop_workers();
+static int setup_atomic_counters(struct ibv_pd *pd);
+static int setup_kv_store(struct ibv_pd *pd);
+static void print_atomic_counters();
+static void print_lock_table();
+static void destroy_accept_pool();
+
 /* Cleans up all allocated/registered resources, in reverse order that they were
  * created, conditionally if they've been allocated or initalized.
  */
 void cleanup_server()
 {
-        /* Destroy server memory buffer */
-        if (server_buffer) {
-                free(server_buffer);
+        /* Workers tear down their own clients before exiting */
+        stop_workers();
+
+        /* Tear down any clients still connected to the event loop. Their
+         * resources live under the shared protection domain.
+         */
+        while (connections) {
+                destroy_client_connection(connections);
+        }
+        destroy_accept_pool();
+        if (epoll_fd != -1) {
+                close(epoll_fd);
         }
 
-        /* De-register server buffer memory region */
-        if (server_buffer_mr) {
-                printf("Deregistering ibv_mr server_buffer_mr\n");
-                ibv_dereg_mr(server_buffer_mr);
+        /* Return server memory buffer to the pool */
+        if (server_pool_buffer) {
+                printf("Freeing server buffer\n");
+                rdma_pool_free(buffer_pool, server_pool_buffer);
         }
 
         /* De-register server metadata memory region */
@@ -72,6 +591,26 @@ void cleanup_server()
                 ibv_dereg_mr(client_metadata_mr);
         }
 
+        free(sink_recv_wrs);
+        free(stream_receives);
+        if (stream_pool_buffer) {
+                rdma_pool_free(buffer_pool, stream_pool_buffer);
+        }
+        free(chunk_recv_wrs);
+        if (chunk_counter_pool_buffer) {
+                rdma_pool_free(buffer_pool, chunk_counter_pool_buffer);
+        }
+        if (file_fd >= 0) {
+                close(file_fd);
+        }
+        free(kv_receives);
+        if (kv_request_pool_buffer) {
+                rdma_pool_free(buffer_pool, kv_request_pool_buffer);
+        }
+        if (kv_reply_pool_buffer) {
+                rdma_pool_free(buffer_pool, kv_reply_pool_buffer);
+        }
+
         /* Destroy queue pairs */
         if (client_queue_pair) {
                 printf("Destroying queue pairs\n");
@@ -90,6 +629,27 @@ void cleanup_server()
                 ibv_destroy_comp_channel(io_completion_channel);
         }
 
+        destroy_shared_receive_queue();
+
+        if (atomic_counters_mr) {
+                printf("Destroying atomic counters\n");
+                destroy_rdma_buffer(atomic_counters_mr);
+        }
+        if (kv_index_mr) {
+                printf("Destroying key-value index\n");
+                destroy_rdma_buffer(kv_index_mr);
+        }
+        if (kv_heap_mr) {
+                printf("Destroying key-value heap\n");
+                destroy_rdma_buffer(kv_heap_mr);
+        }
+
+        /* De-register and free the buffer pool */
+        if (buffer_pool) {
+                printf("Destroying buffer pool\n");
+                rdma_pool_destroy(buffer_pool);
+        }
+
         /* Deallocate protection domain*/
         if (protection_domain) {
                 printf("Deallocating protection domain\n");
@@ -117,6 +677,8 @@ void cleanup_server()
                 printf("Destroying server CM event channel\n");
                 rdma_destroy_event_channel(cm_event_channel);
         }
+
+        completion_table_destroy(&completion_table);
 	printf("Successfully cleaned up all server resources.\n");
 }
 
@@ -127,10 +689,6 @@ void cleanup_server()
  * 3. Get RDMA address info for our RDMA device
  * 4. Bind our RDMA device to an address
  * 5. Set up the server to listen on that address
- * 6. Block for an RDMA_CM_EVENT_CONNECT_REQUEST event on
- *    the event channel, capturing the client's CM id when
- *    we receive one.
- * 7. Ack the event, freeing it as a result.
  */
 int setup_server()
 {
@@ -180,9 +738,10 @@ int setup_server()
                server_port);
 
         /* Initiate a listen on the RDMA IP address and port.
-         * This is a non-blocking call. Allow a backlog of up to 8 clients.
+         * This is a non-blocking call. Allow a backlog of up to
+         * listen_backlog clients.
          */
-        ret = rdma_listen(cm_server_id, 8);
+        ret = rdma_listen(cm_server_id, listen_backlog);
         if (ret == -1) {
                 fprintf(stderr, "Listening for CM events failed: (%s)\n",
                                 strerror(errno));
@@ -191,6 +750,19 @@ int setup_server()
         printf("Server is listening successfully at: %s, port: %d \n",
                inet_ntoa(((struct sockaddr_in *)rai->ai_src_addr)->sin_addr),
 	       ntohs(((struct sockaddr_in *)rai->ai_src_addr)->sin_port));
+        return ret;
+}
+
+/*
+ * Waits for a single client to connect:
+ * 1. Block for an RDMA_CM_EVENT_CONNECT_REQUEST event on
+ *    the event channel, capturing the client's CM id when
+ *    we receive one.
+ * 2. Ack the event, freeing it as a result.
+ */
+static int wait_for_client_connection()
+{
+        int ret = 0;
 
         /* We expect the client to connect and generate a
          * RDMA_CM_EVENT_CONNECT_REQUEST. We wait (block) on the
@@ -214,6 +786,9 @@ int setup_server()
          * acknowledging the event, which also frees the struct.
 	 */
 	cm_client_id = cm_event->id;
+        fast_connect = parse_fast_connect(cm_event->param.conn.private_data,
+                                          cm_event->param.conn.private_data_len,
+                                          &client_metadata);
         ret = rdma_ack_cm_event(cm_event);
         if (ret == -1) {
                 fprintf(stderr, "Failed to ACK CM event %s: (%s)\n",
@@ -223,6 +798,10 @@ int setup_server()
         }
         printf("New RDMA connection stored in cm_client_id %p:\n", cm_client_id);
         print_rdma_cm_id(cm_client_id, 1);
+        if (fast_connect) {
+                printf("Client sent its metadata with its connect request:\n");
+                print_rdma_buffer_attr(&client_metadata, 1);
+        }
 
         return ret;
 }
@@ -253,6 +832,27 @@ int setup_communication_resources()
         printf("Created Protection Domain for client's verbs provider:\n");
         print_ibv_pd(protection_domain, 1);
 
+        /* Register the memory pool the client's buffer will come from */
+        buffer_pool = rdma_pool_create(protection_domain, DEFAULT_POOL_MIN_BUFFER,
+                                       pool_max_buffer, pool_class_bytes,
+                                       IBV_ACCESS_LOCAL_WRITE);
+        if (!buffer_pool) {
+                return -ENOMEM;
+        }
+
+        if (atomic_counter_count) {
+                ret = setup_atomic_counters(protection_domain);
+                if (ret) {
+                        return ret;
+                }
+        }
+        if (kv_bucket_count) {
+                ret = setup_kv_store(protection_domain);
+                if (ret) {
+                        return ret;
+                }
+        }
+
         /* Create a Completion Channel (CC) where I/O completion notifications
          * are sent. A CC is tied to an RDMA device, so we will use
          * cm_client_id->verbs here.
@@ -272,7 +872,8 @@ int setup_communication_resources()
 	 * is called "work"
 	 */
 	completion_queue = ibv_create_cq(cm_client_id->verbs, /* which device */
-		                         16, /* maximum capacity */
+		                         16 + queue_depth +
+		                         (credit_stream ? CREDIT_RECV_DEPTH : 0), /* maximum capacity */
 		                         NULL, /* user context, not used here */
 		                         io_completion_channel, /* IO completion channel to use */
 		                         0 /* signaling vector, not used here */
@@ -307,8 +908,9 @@ int setup_communication_resources()
         qp_init_attr.qp_type = IBV_QPT_RC; /* QP type Reliable Connection */
         qp_init_attr.cap.max_recv_sge = 2; /* Max SGE per receive posting */
         qp_init_attr.cap.max_send_sge = 2; /* Max SGE per send posting */
-        qp_init_attr.cap.max_recv_wr = 8;  /* Max receive posting capacity */
+        qp_init_attr.cap.max_recv_wr = 8 + queue_depth;  /* Max receive posting capacity */
         qp_init_attr.cap.max_send_wr = 8;  /* Max send posting capacity */
+        qp_init_attr.cap.max_inline_data = inline_size; /* Max inline payload */
         /* Use the same CQ for both send/receive completion events */
         qp_init_attr.recv_cq = completion_queue; /* Where to notify for receive completion operations */
         qp_init_attr.send_cq = completion_queue; /* Where to notify for send completion operations */
@@ -316,22 +918,35 @@ int setup_communication_resources()
         /* Finally, create a QP. After this call, the ibv_qp reference will be
          * stored in the client's CM id: client_cm_id->qp.
          */
-        ret = rdma_create_qp(
+        ret = create_queue_pair(
                 cm_client_id, /* Which connection id */
                 protection_domain, /* Which protection domain */
                 &qp_init_attr /* Initial QP attributes */
         );
         if (ret) {
                 fprintf(stderr, "Failed to create QP: %s\n",
-                        strerror(errno));
-		return -errno;
+                        strerror(-ret));
+		return ret;
         }
         client_queue_pair = cm_client_id->qp;
-        printf("Created QP for client on server\n");
+        max_inline_data = qp_init_attr.cap.max_inline_data;
+        printf("Created QP for client on server with %u bytes inline data\n",
+               max_inline_data);
 
         return ret;
 }
 
+/*
+ * Completion handler for the single-client path's WRs. The context names the
+ * operation the WR was posted for.
+ */
+static void log_work_completion(struct ibv_wc *wc, void *context)
+{
+        printf("%s (wr_id %lu) completed with status: %s\n",
+               (const char *)context, (unsigned long)wc->wr_id,
+               ibv_wc_status_str(wc->status));
+}
+
 /*
  * Pre-posts a receive buffer to capture metadata about the client:
  * 1. Register our client_metadata memory section as a memory region (MR).
@@ -364,14 +979,24 @@ static int post_metadata_recv_buffer()
         memset(&client_recv_wr, 0, sizeof(client_recv_wr));
         client_recv_wr.sg_list = &client_recv_sge;
         client_recv_wr.num_sge = 1;
+        int ret = completion_table_register(&completion_table,
+                                            log_work_completion,
+                                            "client metadata RECV",
+                                            &client_recv_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+
         /* Pre-post the WR to the client queue-pair */
-        int ret = ibv_post_recv(client_queue_pair, /* client QP */
-                                &client_recv_wr, /* Recieve WR */
-                                &bad_client_recv_wr /* Error WR */
-                               );
+        ret = ibv_post_recv(client_queue_pair, /* client QP */
+                            &client_recv_wr, /* Recieve WR */
+                            &bad_client_recv_wr /* Error WR */
+                           );
         if (ret) {
                 fprintf(stderr, "Failed to pre-post client receive WR to QP: %s\n",
                         strerror(ret));
+                completion_table_cancel(&completion_table, client_recv_wr.wr_id);
+                return -ret;
         }
         printf("Successfully pre-posted client metadata receive buffer to client QP:\n");
         print_ibv_mr(client_metadata_mr, 1);
@@ -389,6 +1014,10 @@ static int accept_client_connection()
 {
         struct rdma_conn_param conn_param;
 	struct rdma_cm_event *cm_event = NULL;
+        struct __attribute((packed)) {
+                struct rdma_fast_connect fast_connect;
+                struct kv_regions kv_regions;
+        } private_data;
 
         /* Before we accept a connection we have to fill out an rdma_conn_param
          * struct containing connection properties:
@@ -402,9 +1031,25 @@ static int accept_client_connection()
          * - retry_count: The maximum number of times that a data transfer
          * operation should be retried on the connection when an error occurs.
          */
+        memset(&conn_param, 0, sizeof(conn_param));
         conn_param.initiator_depth = 3;
 	conn_param.responder_resources = 3;
 	conn_param.retry_count = 3;
+        /* A fast connect client gets our metadata with the accept, and a
+         * key-value client learns where the store is, after it if both
+         */
+        if (fast_connect) {
+                fast_connect_init(&private_data.fast_connect, &server_metadata);
+                conn_param.private_data = &private_data;
+                conn_param.private_data_len = sizeof(private_data.fast_connect);
+        }
+        if (kv_bucket_count) {
+                private_data.kv_regions = kv_regions;
+                if (!fast_connect) {
+                        conn_param.private_data = &private_data.kv_regions;
+                }
+                conn_param.private_data_len += sizeof(kv_regions);
+        }
         /* Note how we use rdma_accept() here instead of the client's
          * rdma_connect(). After this, we'll expect an RDMA_CM_EVENT_ESTABLISHED
          * CM event.
@@ -445,6 +1090,111 @@ static int accept_client_connection()
         return 0;
 }
 
+/* Post the receives for the first messages of send benchmarks */
+static int post_echo_recv();
+static int post_sink_recvs();
+/* Post the receive a client's WRITE with immediate consumes */
+static int post_notify_recv();
+/* Post the receives a credit stream's initial credits stand for */
+static int post_stream_recvs();
+/* Post the receives a file transfer's chunk WRITEs with immediate consume */
+static int post_chunk_recvs();
+static int post_kv_recvs();
+
+/*
+ * Allocates the buffer the client will read/write, sized by client_metadata,
+ * posts the receives the client's first messages need, and describes the
+ * buffer in server_metadata.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int setup_client_buffer()
+{
+        int ret = 0;
+
+        /* Allocate the memory where the client will read/write the message
+         * from/to. It comes out of the pre-registered pool, but gets an MR of
+         * its own for the client's rkey, registered right here on the
+         * connection path (see CLIENT_BUFFER_ACCESS).
+         */
+        uint64_t buffer_size = client_metadata.length; /* Size of the source message from the client */
+
+        /* A file transfer's length is its chunk size, and we hold a slot
+         * for each chunk in flight
+         */
+        if (file_output) {
+                buffer_size *= queue_depth;
+                if (buffer_size > UINT32_MAX) {
+                        fprintf(stderr, "%d chunk slots of %u bytes exceed %u bytes\n",
+                                queue_depth, client_metadata.length, UINT32_MAX);
+                        return -EINVAL;
+                }
+        }
+        server_pool_buffer = rdma_pool_alloc_remote(buffer_pool, buffer_size,
+                                                    CLIENT_BUFFER_ACCESS);
+        if (!server_pool_buffer) {
+                fprintf(stderr, "Failed to allocate server buffer from pool\n");
+		return -1;
+        }
+        printf("Allocated server buffer at %p of size %u (lkey %u, rkey %u)\n",
+               server_pool_buffer->addr, server_pool_buffer->length,
+               server_pool_buffer->lkey, server_pool_buffer->rkey);
+        server_buffer = server_pool_buffer->addr;
+
+        /* The client SENDs its first message as soon as it has our metadata,
+         * so the receive for it has to be posted before then.
+         */
+        if (latency_op == BENCHMARK_OP_SEND) {
+                ret = post_echo_recv();
+                if (ret) {
+                        return ret;
+                }
+        }
+        if (bandwidth_op == BENCHMARK_OP_SEND) {
+                ret = post_sink_recvs();
+                if (ret) {
+                        return ret;
+                }
+        }
+        if (write_imm) {
+                ret = post_notify_recv();
+                if (ret) {
+                        return ret;
+                }
+        }
+        if (credit_stream) {
+                ret = post_stream_recvs();
+                if (ret) {
+                        return ret;
+                }
+        }
+        if (file_output) {
+                ret = post_chunk_recvs();
+                if (ret) {
+                        return ret;
+                }
+        }
+        if (kv_bucket_count) {
+                ret = post_kv_recvs();
+                if (ret) {
+                        return ret;
+                }
+        }
+
+        /* Prepare the server metadata buffer with information about the
+         * buffer we just allocated above.
+         */
+        server_metadata.address = (uint64_t) server_pool_buffer->addr;
+        server_metadata.length = buffer_size;
+        server_metadata.stag.local_stag = server_pool_buffer->rkey;
+        if (atomic_counters_mr) {
+                server_metadata.address = (uint64_t) atomic_counters_mr->addr;
+                server_metadata.length = atomic_counters_mr->length;
+                server_metadata.stag.local_stag = atomic_counters_mr->rkey;
+        }
+        return 0;
+}
+
 /*
  * Exchange metadata with the client via pre-registered buffers.
  *
@@ -461,14 +1211,14 @@ static int exchange_metadata_with_client()
          */
         int ret = 0;
         int expected_wc = 1;
-        struct ibv_wc work_completions[expected_wc];
 
         /* Wait for client to send its metadata info. We will receive a work
          * completion (WC) notification for our pre-posted receive request.
          */
-        ret = process_work_completion_event(
+        ret = process_completions(
                 io_completion_channel,
-                work_completions,
+                completion_queue,
+                &completion_table,
                 expected_wc
         );
         if (ret != expected_wc) {
@@ -481,61 +1231,37 @@ static int exchange_metadata_with_client()
         print_rdma_buffer_attr(&client_metadata, 1);
 
         /* Next, we need to satisfy the client's request for the server's
-         * metadata.
+         * metadata, by allocating its buffer and SENDing metadata about it.
+         * This will complete the client's posted WR for server metadata.
          */
+        ret = setup_client_buffer();
+        if (ret) {
+                return ret;
+        }
 
-        /* Allocate and register the memory region where the client will
-         * read/write the message from/to.
+        /* Populate the server send SGE with our metadata. Inlined, it is
+         * copied into the WQE by the CPU and needs no registration.
+         * Otherwise register a server metadata MR.
          */
-        server_buffer_mr = create_rdma_buffer(
-                protection_domain,
-                client_metadata.length,  /* Size of the source message from the client */
-                (IBV_ACCESS_LOCAL_WRITE|
-                 IBV_ACCESS_REMOTE_READ|
-                 IBV_ACCESS_REMOTE_WRITE) /* Access permissions */
-        );
-        if (!server_buffer_mr) {
-                fprintf(stderr, "Failed to allocate/register server_buffer_mr\n");
-		return -1;
+	server_send_sge.addr = (uint64_t) &server_metadata;
+	server_send_sge.length = (uint32_t) sizeof(server_metadata);
+	server_send_sge.lkey = 0;
+        if (sizeof(server_metadata) > max_inline_data) {
+                server_metadata_mr = ibv_reg_mr(
+                        protection_domain, /* Server's PD */
+                        &server_metadata, /* Server's metadata buffer */
+                        sizeof(server_metadata), /* Size of server's metadata buffer */
+                        IBV_ACCESS_LOCAL_WRITE /* Only allow our RDMA device to write */
+                );
+                if (!server_metadata_mr) {
+                        fprintf(stderr, "Failed to register server_metadata_mr: %s\n",
+                                strerror(errno));
+                        return -errno;
+                }
+                printf("Registered server_metadata_mr:\n");
+                print_ibv_mr(server_metadata_mr, 1);
+                server_send_sge.lkey = server_metadata_mr->lkey;
         }
-        printf("Allocated server_buffer_mr at %p of size %u:\n",
-               server_buffer_mr->addr, server_buffer_mr->length);
-        print_ibv_mr(server_buffer_mr, 1);
-
-        /* Set our server_buffer address from MR so we can free it later */
-        server_buffer = server_buffer_mr->addr;
-
-        /* We need to now send metadata about the above buffer to the client.
-         * This will complete the client's posted WR for server metadata.
-         */
-
-        /* Prepare the server metadata buffer with information about the MR
-         * we just registered above.
-         */
-        server_metadata.address = (uint64_t) server_buffer_mr->addr;
-        server_metadata.length = server_buffer_mr->length;
-        server_metadata.stag.local_stag = server_buffer_mr->lkey;
-
-        /* Register server metadata MR */
-        server_metadata_mr = ibv_reg_mr(
-                protection_domain, /* Server's PD */
-		&server_metadata, /* Server's metadata buffer */
-		sizeof(server_metadata), /* Size of server's metadata buffer */
-		IBV_ACCESS_LOCAL_WRITE /* Only allow our RDMA device to write */
-        );
-        if (!server_metadata_mr) {
-		fprintf(stderr, "Failed to register server_metadata_mr: %s\n",
-                        strerror(errno));
-		return -errno;
-	}
-        printf("Registered server_metadata_mr:\n");
-        print_ibv_mr(server_metadata_mr, 1);
-
-        /* Populate the server send SGE with information about our metadata MR
-         */
-	server_send_sge.addr = (uint64_t) server_metadata_mr->addr;
-	server_send_sge.length = (uint32_t) server_metadata_mr->length;
-	server_send_sge.lkey = server_metadata_mr->lkey;
 
         /* Link to the send WR. This is a SEND operation, meaning it will
          * complete some RECV WR.
@@ -544,11 +1270,19 @@ static int exchange_metadata_with_client()
 	server_send_wr.sg_list = &server_send_sge;
 	server_send_wr.num_sge = 1;
 	server_send_wr.opcode = IBV_WR_SEND;
-	server_send_wr.send_flags = IBV_SEND_SIGNALED;
+	server_send_wr.send_flags = signaled_send_flags(IBV_WR_SEND,
+                                                        server_send_sge.length,
+                                                        max_inline_data);
 
         /* Post the send WR to the client QP, containing metadata information
          * that the client requested.
          */
+        ret = completion_table_register(&completion_table, log_work_completion,
+                                        "server metadata SEND",
+                                        &server_send_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
         ret = ibv_post_send(
                 client_queue_pair,
                 &server_send_wr,
@@ -556,23 +1290,26 @@ static int exchange_metadata_with_client()
         );
         if (ret) {
                 fprintf(stderr, "Failed to send server metadata: %s\n",
-                        strerror(errno));
-		return -errno;
+                        strerror(ret));
+                completion_table_cancel(&completion_table, server_send_wr.wr_id);
+		return -ret;
         }
         printf("Sent server metadata to client\n");
 
         /* Process WC event for satisfying the client's WR. We can reuse the
-         * same work_completions array and expected_wc count from above.
+         * same expected_wc count from above. In a send latency benchmark the
+         * client's first message may already be in, and gets dispatched too.
          */
-        ret = process_work_completion_event(
+        ret = process_completions(
                 io_completion_channel,
-                work_completions,
+                completion_queue,
+                &completion_table,
                 expected_wc
         );
-        if (ret != expected_wc) {
+        if (ret < expected_wc) {
                 fprintf(stderr, "Failed to process %d Work Completions: ret=%d\n",
                         expected_wc, ret);
-		return ret;
+		return ret < 0 ? ret : -EIO;
         }
         printf("Got %d Work Completions\n", ret);
         return 0;
@@ -601,67 +1338,3164 @@ static int disconnect_from_client()
                 ret = 0;
         }
 
-        printf("Before we leave: printing contents of server buffer\n");
-        printf("server_buffer: '%s'\n", (char *)server_buffer);
+        /* A benchmark, ring, stream or store leaves nothing worth printing in the buffer,
+         * and a WRITE with immediate was printed as soon as it landed. Atomic
+         * clients never see the buffer, only the counters.
+         */
+        if (latency_op == BENCHMARK_OP_NONE && bandwidth_op == BENCHMARK_OP_NONE &&
+            !write_imm && !ring_mode && !credit_stream && !file_output &&
+            !atomic_counters_mr && !kv_bucket_count) {
+                printf("Before we leave: printing contents of server buffer\n");
+                printf("server_buffer: '%.*s'\n", (int)client_metadata.length,
+                       (char *)server_buffer);
+        }
+        if (atomic_counters_mr) {
+                lock_table ? print_lock_table() : print_atomic_counters();
+        }
 
         return ret;
 }
 
-void print_usage()
+/* --- Write with immediate ---
+ *
+ * With -W, clients WRITE their message with an immediate carrying its length.
+ * The immediate consumes a receive we posted before handing out our metadata,
+ * and that receive's WC tells us the message has landed as soon as it does,
+ * instead of at disconnect. The receive has no SGEs: the payload goes to the
+ * WRITE's target, only the immediate comes with the WC.
+ */
+
+static struct ibv_recv_wr notify_recv_wr, *bad_notify_recv_wr = NULL;
+static int message_notified = 0;
+
+/*
+ * Prints the message a WRITE with immediate just landed in buffer, which
+ * holds buffer_length bytes. The WC for that WRITE carries its length.
+ */
+static void print_notified_message(const struct ibv_wc *wc, const char *buffer,
+                                   uint32_t buffer_length)
 {
-        printf("Usage\n");
-        printf("\t./rdma-server -s <server_address> -p <server_port>\n");
-        printf("Example\n");
-        printf("\t./rdma-server -s 192.168.0.106 -p 7471\n");
+        if (wc->opcode != IBV_WC_RECV_RDMA_WITH_IMM ||
+            !(wc->wc_flags & IBV_WC_WITH_IMM)) {
+                fprintf(stderr, "Expected a WRITE with immediate, got WC opcode %d\n",
+                        wc->opcode);
+                return;
+        }
+
+        uint32_t length = ntohl(wc->imm_data);
+        if (length > buffer_length) {
+                length = buffer_length;
+        }
+        printf("Client WRITE with immediate landed %u bytes: '%.*s'\n",
+               length, (int) length, buffer);
 }
 
-int main(int argc, char **argv)
+/*
+ * Completion handler for the single-client path's notification receive.
+ */
+static void on_message_notified(struct ibv_wc *wc, void *context)
 {
-        int option;
-        while ((option = getopt(argc, argv, "s:p:")) != -1) {
-                switch (option) {
-                        case 's':
-                                server_addr = optarg;
-                                break;
-                        case 'p':
-                                server_port = optarg;
-                                break;
-                        default:
-                                print_usage;
-                                exit(1);
-                }
+        (void) context;
+        if (wc->status != IBV_WC_SUCCESS) {
+                return;
+        }
+        print_notified_message(wc, server_buffer, client_metadata.length);
+        message_notified = 1;
+}
+
+static int post_notify_recv()
+{
+        memset(&notify_recv_wr, 0, sizeof(notify_recv_wr));
+        int ret = completion_table_register(&completion_table,
+                                            on_message_notified, NULL,
+                                            &notify_recv_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+        ret = ibv_post_recv(client_queue_pair, &notify_recv_wr,
+                            &bad_notify_recv_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to post notification receive: %s\n",
+                        strerror(ret));
+                completion_table_cancel(&completion_table, notify_recv_wr.wr_id);
+                return -ret;
+        }
+        return 0;
+}
+
+/*
+ * Waits for the client's WRITE with immediate, unless it already came in
+ * with the metadata exchange's WCs.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int wait_for_notified_message()
+{
+        if (message_notified) {
+                return 0;
+        }
+        int ret = process_completions(io_completion_channel, completion_queue,
+                                      &completion_table, 1);
+        if (ret < 1 || !message_notified) {
+                fprintf(stderr, "Failed to receive the client's WRITE with immediate: ret=%d\n",
+                        ret);
+                return ret < 0 ? ret : -EIO;
+        }
+        return 0;
+}
+
+/* --- Benchmarks ---
+ *
+ * With -L, the single-client path serves the matching rdma-client --latency
+ * run after the metadata exchange, echoing every message back until the client
+ * disconnects:
+ * - write: poll the last byte of our buffer until the client's WRITE lands,
+ *   then WRITE the buffer back into the client's buffer.
+ * - send: SEND every received message back, re-posting the receive first.
+ * - read: nothing to do, the client READs our buffer on its own.
+ *
+ * With -B, it serves a matching rdma-client --bandwidth run. Only send needs
+ * us: queue_depth receives are kept posted, all landing in our buffer, and
+ * each is re-posted as soon as it completes.
+ *
+ * The server always busy-polls while serving, so its own wakeups don't show up
+ * in the client's measurements.
+ */
+
+/* Polls of the CQ between checks for the client's disconnect */
+#define DISCONNECT_CHECK_INTERVAL 4096
+
+static struct ibv_sge echo_recv_sge, echo_send_sge;
+static struct ibv_recv_wr echo_recv_wr, *bad_echo_recv_wr = NULL;
+static struct ibv_send_wr echo_send_wr, *bad_echo_send_wr = NULL;
+static int benchmark_failed = 0;
+static unsigned long echo_count = 0;
+
+static struct ibv_sge sink_recv_sge;
+static unsigned long sink_count = 0;
+
+/*
+ * Completion handler for echoed SENDs and WRITEs.
+ */
+static void on_echo_sent(struct ibv_wc *wc, void *context)
+{
+        (void) context;
+        if (wc->status != IBV_WC_SUCCESS) {
+                benchmark_failed = 1;
+        }
+}
 
+/*
+ * Posts length bytes of the server buffer back to the client, as a SEND or
+ * as a WRITE into the buffer the client advertised.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int post_echo(enum ibv_wr_opcode opcode, uint32_t length)
+{
+        echo_send_sge.addr = (uint64_t) server_pool_buffer->addr;
+        echo_send_sge.length = length;
+        echo_send_sge.lkey = server_pool_buffer->lkey;
+        memset(&echo_send_wr, 0, sizeof(echo_send_wr));
+        echo_send_wr.sg_list = &echo_send_sge;
+        echo_send_wr.num_sge = 1;
+        echo_send_wr.opcode = opcode;
+        echo_send_wr.send_flags = signaled_send_flags(opcode, length,
+                                                      max_inline_data);
+        if (opcode == IBV_WR_RDMA_WRITE) {
+                echo_send_wr.wr.rdma.remote_addr = client_metadata.address;
+                echo_send_wr.wr.rdma.rkey = client_metadata.stag.remote_stag;
         }
 
-        int ret = setup_server();
+        int ret = completion_table_register(&completion_table, on_echo_sent,
+                                            NULL, &echo_send_wr.wr_id);
         if (ret) {
-                cleanup_server();
                 return ret;
         }
+        ret = ibv_post_send(client_queue_pair, &echo_send_wr, &bad_echo_send_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to post echo: %s\n", strerror(ret));
+                completion_table_cancel(&completion_table, echo_send_wr.wr_id);
+                return -ret;
+        }
+        echo_count++;
+        return 0;
+}
 
-        ret = setup_communication_resources();
+/*
+ * Completion handler for the echo receive: re-post the receive, then SEND the
+ * message straight back from the buffer it landed in. The client can't send
+ * again before our SEND reaches it, so the buffer can't be overwritten early.
+ */
+static void on_echo_received(struct ibv_wc *wc, void *context)
+{
+        (void) context;
+        if (wc->status != IBV_WC_SUCCESS ||
+            post_echo_recv() ||
+            post_echo(IBV_WR_SEND, wc->byte_len)) {
+                benchmark_failed = 1;
+        }
+}
+
+static int post_echo_recv()
+{
+        echo_recv_sge.addr = (uint64_t) server_pool_buffer->addr;
+        echo_recv_sge.length = client_metadata.length;
+        echo_recv_sge.lkey = server_pool_buffer->lkey;
+        memset(&echo_recv_wr, 0, sizeof(echo_recv_wr));
+        echo_recv_wr.sg_list = &echo_recv_sge;
+        echo_recv_wr.num_sge = 1;
+
+        int ret = completion_table_register(&completion_table, on_echo_received,
+                                            NULL, &echo_recv_wr.wr_id);
         if (ret) {
-                cleanup_server();
                 return ret;
         }
+        ret = ibv_post_recv(client_queue_pair, &echo_recv_wr, &bad_echo_recv_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to post echo receive: %s\n",
+                        strerror(ret));
+                completion_table_cancel(&completion_table, echo_recv_wr.wr_id);
+                return -ret;
+        }
+        return 0;
+}
+
+static int post_sink_recv(struct ibv_recv_wr *recv_wr);
+
+/*
+ * Completion handler for a bandwidth benchmark receive, which is re-posted
+ * right away.
+ */
+static void on_sink_received(struct ibv_wc *wc, void *context)
+{
+        if (wc->status != IBV_WC_SUCCESS || post_sink_recv(context)) {
+                benchmark_failed = 1;
+                return;
+        }
+        sink_count++;
+}
 
-        ret = post_metadata_recv_buffer();
+static int post_sink_recv(struct ibv_recv_wr *recv_wr)
+{
+        struct ibv_recv_wr *bad_recv_wr = NULL;
+
+        int ret = completion_table_register(&completion_table, on_sink_received,
+                                            recv_wr, &recv_wr->wr_id);
         if (ret) {
-                cleanup_server();
                 return ret;
         }
+        ret = ibv_post_recv(client_queue_pair, recv_wr, &bad_recv_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to post bandwidth receive: %s\n",
+                        strerror(ret));
+                completion_table_cancel(&completion_table, recv_wr->wr_id);
+                return -ret;
+        }
+        return 0;
+}
 
-        ret = accept_client_connection();
+static int post_sink_recvs()
+{
+        /* Every receive lands in the same buffer, only the count matters */
+        sink_recv_sge.addr = (uint64_t) server_pool_buffer->addr;
+        sink_recv_sge.length = client_metadata.length;
+        sink_recv_sge.lkey = server_pool_buffer->lkey;
+
+        sink_recv_wrs = calloc(queue_depth, sizeof(*sink_recv_wrs));
+        if (!sink_recv_wrs) {
+                fprintf(stderr, "Failed to allocate receive WRs: -ENOMEM\n");
+                return -ENOMEM;
+        }
+        for (int i = 0; i < queue_depth; i++) {
+                sink_recv_wrs[i].sg_list = &sink_recv_sge;
+                sink_recv_wrs[i].num_sge = 1;
+                int ret = post_sink_recv(&sink_recv_wrs[i]);
+                if (ret) {
+                        return ret;
+                }
+        }
+        return 0;
+}
+
+/*
+ * Returns 1 once a CM event, which can only be the client's disconnect, is
+ * waiting on the CM event channel. The event is left for
+ * disconnect_from_client() to consume.
+ */
+static int client_disconnect_pending()
+{
+        struct pollfd pfd = { .fd = cm_event_channel->fd, .events = POLLIN };
+        return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * Serves the client's benchmark traffic until it disconnects.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int serve_benchmark()
+{
+        volatile uint8_t *last_byte = (uint8_t *) server_buffer +
+                                      client_metadata.length - 1;
+        uint8_t expected = 1;
+        unsigned long polls = 0;
+
+        if (latency_op != BENCHMARK_OP_NONE) {
+                printf("Serving %s latency benchmark with %u byte messages until the client disconnects\n",
+                       benchmark_op_str(latency_op), client_metadata.length);
+        } else {
+                printf("Serving %s bandwidth benchmark with up to %u byte messages until the client disconnects\n",
+                       benchmark_op_str(bandwidth_op), client_metadata.length);
+        }
+        /* One-sided benchmarks don't need us */
+        if (latency_op != BENCHMARK_OP_WRITE && latency_op != BENCHMARK_OP_SEND &&
+            bandwidth_op != BENCHMARK_OP_SEND) {
+                return 0;
+        }
+
+        while (!benchmark_failed) {
+                /* The client numbers its WRITEs 1 to 255 in the last byte */
+                if (latency_op == BENCHMARK_OP_WRITE && *last_byte == expected) {
+                        if (post_echo(IBV_WR_RDMA_WRITE, client_metadata.length)) {
+                                return -1;
+                        }
+                        expected = expected == 255 ? 1 : expected + 1;
+                }
+
+                if (drain_completion_queue(completion_queue,
+                                           &completion_table) < 0) {
+                        return -1;
+                }
+
+                if (++polls % DISCONNECT_CHECK_INTERVAL == 0 &&
+                    client_disconnect_pending()) {
+                        break;
+                }
+        }
+
+        if (latency_op != BENCHMARK_OP_NONE) {
+                printf("Echoed %lu messages\n", echo_count);
+        } else {
+                printf("Received %lu messages\n", sink_count);
+        }
+        return 0;
+}
+
+/* --- Message ring ---
+ *
+ * With -R, our buffer is a ring (see rdma_ring.h) the client streams messages
+ * into with RDMA WRITEs, sized by the length the client advertised. We consume
+ * messages in place as they land and push our consumer index back into the
+ * buffer the client advertised every quarter ring, or whenever we go idle
+ * with news for it. The client READs it from the ring's control block when
+ * it needs it sooner.
+ */
+
+static struct ibv_sge credit_send_sge;
+static struct ibv_send_wr credit_send_wr, *bad_credit_send_wr = NULL;
+static int credit_write_pending = 0;
+static int credit_write_failed = 0;
+
+/*
+ * Completion handler for credit WRITEs. A failed one most likely raced the
+ * client's disconnect. Either way we stop pushing, and the client can still
+ * READ its credits.
+ */
+static void on_credits_written(struct ibv_wc *wc, void *context)
+{
+        (void) context;
+        credit_write_pending = 0;
+        if (wc->status != IBV_WC_SUCCESS) {
+                credit_write_failed = 1;
+        }
+}
+
+/*
+ * WRITEs the index at *index, registered under lkey, into the client's
+ * credit buffer.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int push_credit_index(const uint64_t *index, uint32_t lkey)
+{
+        credit_send_sge.addr = (uint64_t) index;
+        credit_send_sge.length = sizeof(*index);
+        credit_send_sge.lkey = lkey;
+        memset(&credit_send_wr, 0, sizeof(credit_send_wr));
+        credit_send_wr.sg_list = &credit_send_sge;
+        credit_send_wr.num_sge = 1;
+        credit_send_wr.opcode = IBV_WR_RDMA_WRITE;
+        credit_send_wr.send_flags = signaled_send_flags(IBV_WR_RDMA_WRITE,
+                                                        credit_send_sge.length,
+                                                        max_inline_data);
+        credit_send_wr.wr.rdma.remote_addr = client_metadata.address;
+        credit_send_wr.wr.rdma.rkey = client_metadata.stag.remote_stag;
+
+        int ret = completion_table_register(&completion_table,
+                                            on_credits_written, NULL,
+                                            &credit_send_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+        ret = ibv_post_send(client_queue_pair, &credit_send_wr,
+                            &bad_credit_send_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to post credit WRITE: %s\n",
+                        strerror(ret));
+                completion_table_cancel(&completion_table, credit_send_wr.wr_id);
+                return -ret;
+        }
+        credit_write_pending = 1;
+        return 0;
+}
+
+/*
+ * Consumes the client's message stream until it disconnects.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int serve_ring()
+{
+        struct ring_consumer consumer;
+        unsigned long messages = 0, polls = 0;
+        uint64_t bytes = 0, pushed_index = 0, first_nsec = 0, last_nsec = 0;
+        void *payload = NULL;
+
+        if (!ring_data_size(client_metadata.length)) {
+                fprintf(stderr, "A %u byte buffer is too small for a ring\n",
+                        client_metadata.length);
+                return -EINVAL;
+        }
+        ring_consumer_init(&consumer, server_buffer, client_metadata.length);
+        uint64_t credit_interval = consumer.data_size / 4;
+        printf("Serving a %u byte message ring until the client disconnects\n",
+               client_metadata.length);
+
+        for (;;) {
+                int length = ring_consumer_peek(&consumer, &payload);
+                if (length == -EIO) {
+                        return length;
+                }
+                if (length >= 0) {
+                        if (!messages) {
+                                first_nsec = monotonic_nsec();
+                                printf("First message: '%.*s'\n", length,
+                                       (char *) payload);
+                        }
+                        messages++;
+                        bytes += length;
+                        ring_consumer_release(&consumer);
+                }
+
+                /* Push credits every quarter ring, and when we run dry */
+                if (!credit_write_pending && !credit_write_failed &&
+                    consumer.tail != pushed_index &&
+                    (length < 0 || consumer.tail - pushed_index >= credit_interval)) {
+                        /* Straight out of the ring's control block */
+                        if (push_credit_index(&consumer.control->consumer_index,
+                                              server_pool_buffer->lkey)) {
+                                return -1;
+                        }
+                        pushed_index = consumer.tail;
+                }
+
+                if (drain_completion_queue(completion_queue,
+                                           &completion_table) < 0) {
+                        return -1;
+                }
+
+                if (length < 0 && ++polls % DISCONNECT_CHECK_INTERVAL == 0 &&
+                    client_disconnect_pending()) {
+                        break;
+                }
+                if (length >= 0) {
+                        last_nsec = monotonic_nsec();
+                }
+        }
+
+        double seconds = (last_nsec - first_nsec) / 1e9;
+        printf("Consumed %lu messages, %lu bytes", messages,
+               (unsigned long) bytes);
+        if (messages > 1 && seconds > 0) {
+                printf(", %.3f Mmsgs/s", messages / seconds / 1e6);
+        }
+        printf("\n");
+        return 0;
+}
+
+/* --- Credit stream ---
+ *
+ * With -C, the client SENDs a message stream under credit-based flow control
+ * (see CREDIT_RECV_DEPTH). We keep queue_depth receives posted, each with its
+ * own slot for a message of the length the client advertised, and grant them
+ * all in the first credit message. Every consumed receive is re-posted and
+ * its credit returned, batched up to a quarter of the queue depth, or right
+ * away when we go idle. A credit message can only go out while the client has
+ * a receive posted for it, which it tells us about in its SENDs' immediates.
+ */
+
+static uint32_t credits_to_return = 0; /* Receives re-posted, not yet granted */
+static uint32_t peer_credit_recvs = CREDIT_RECV_DEPTH; /* Client's credit receives */
+static int credit_sends_inflight = 0;
+static unsigned long credit_messages_sent = 0;
+static unsigned long stream_messages = 0;
+static uint64_t stream_bytes = 0;
+
+static struct ibv_send_wr credit_message_wr, *bad_credit_message_wr = NULL;
+
+static int post_stream_recv(struct stream_receive *recv);
+
+/*
+ * Completion handler for a credit stream message. Its immediate returns the
+ * client's credit message receives, and its receive is re-posted for a
+ * credit we return later.
+ */
+static void on_stream_received(struct ibv_wc *wc, void *context)
+{
+        struct stream_receive *recv = context;
+
+        if (wc->status != IBV_WC_SUCCESS || !(wc->wc_flags & IBV_WC_WITH_IMM)) {
+                benchmark_failed = 1;
+                return;
+        }
+        peer_credit_recvs += ntohl(wc->imm_data);
+        if (session_mode) {
+                printf("Message %lu: '%.*s'\n", stream_messages,
+                       (int) wc->byte_len, (char *) recv->sge.addr);
+        } else if (!stream_messages) {
+                printf("First message: '%.*s'\n", (int) wc->byte_len,
+                       (char *) recv->sge.addr);
+        }
+        stream_messages++;
+        stream_bytes += wc->byte_len;
+
+        if (post_stream_recv(recv)) {
+                benchmark_failed = 1;
+                return;
+        }
+        credits_to_return++;
+}
+
+static int post_stream_recv(struct stream_receive *recv)
+{
+        struct ibv_recv_wr *bad_recv_wr = NULL;
+
+        int ret = completion_table_register(&completion_table,
+                                            on_stream_received, recv,
+                                            &recv->wr.wr_id);
         if (ret) {
-                cleanup_server();
                 return ret;
         }
+        ret = ibv_post_recv(client_queue_pair, &recv->wr, &bad_recv_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to post stream receive: %s\n",
+                        strerror(ret));
+                completion_table_cancel(&completion_table, recv->wr.wr_id);
+                return -ret;
+        }
+        return 0;
+}
+
+static int post_stream_recvs()
+{
+        uint32_t length = client_metadata.length;
+
+        stream_pool_buffer = rdma_pool_alloc(buffer_pool,
+                                             (uint64_t) length * queue_depth);
+        stream_receives = calloc(queue_depth, sizeof(*stream_receives));
+        if (!stream_pool_buffer || !stream_receives) {
+                fprintf(stderr, "Failed to allocate %d stream receives\n",
+                        queue_depth);
+                return -ENOMEM;
+        }
+        for (int i = 0; i < queue_depth; i++) {
+                struct stream_receive *recv = &stream_receives[i];
+                recv->sge.addr = (uint64_t) stream_pool_buffer->addr +
+                                 (uint64_t) i * length;
+                recv->sge.length = length;
+                recv->sge.lkey = stream_pool_buffer->lkey;
+                recv->wr.sg_list = &recv->sge;
+                recv->wr.num_sge = 1;
+                int ret = post_stream_recv(recv);
+                if (ret) {
+                        return ret;
+                }
+        }
+        credits_to_return = queue_depth;
+        return 0;
+}
+
+/*
+ * Completion handler for credit messages.
+ */
+static void on_credit_message_sent(struct ibv_wc *wc, void *context)
+{
+        (void) context;
+        credit_sends_inflight--;
+        if (wc->status != IBV_WC_SUCCESS) {
+                benchmark_failed = 1;
+        }
+}
+
+/*
+ * Grants the client every receive re-posted since the last credit message,
+ * in a zero-length SEND with immediate.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int send_credit_message()
+{
+        memset(&credit_message_wr, 0, sizeof(credit_message_wr));
+        credit_message_wr.opcode = IBV_WR_SEND_WITH_IMM;
+        credit_message_wr.send_flags = IBV_SEND_SIGNALED;
+        credit_message_wr.imm_data = htonl(credits_to_return);
 
-        ret = exchange_metadata_with_client();
+        int ret = completion_table_register(&completion_table,
+                                            on_credit_message_sent, NULL,
+                                            &credit_message_wr.wr_id);
         if (ret) {
-                cleanup_server();
                 return ret;
         }
+        ret = ibv_post_send(client_queue_pair, &credit_message_wr,
+                            &bad_credit_message_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to send credit message: %s\n",
+                        strerror(ret));
+                completion_table_cancel(&completion_table,
+                                        credit_message_wr.wr_id);
+                return -ret;
+        }
+        credits_to_return = 0;
+        peer_credit_recvs--;
+        credit_sends_inflight++;
+        credit_messages_sent++;
+        return 0;
+}
+
+/*
+ * Consumes the client's credit stream until it disconnects.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int serve_credit_stream()
+{
+        uint32_t credit_batch = queue_depth / 4 ? queue_depth / 4 : 1;
+        unsigned long polls = 0;
+
+        printf("Serving a credit stream of up to %u byte messages with %d receives until the client disconnects\n",
+               client_metadata.length, queue_depth);
+
+        while (!benchmark_failed) {
+                int ret = drain_completion_queue(completion_queue,
+                                                 &completion_table);
+                if (ret < 0) {
+                        return ret;
+                }
+
+                /* Our send queue holds the same number of credit messages
+                 * as the client has receives for them.
+                 */
+                if (credits_to_return && peer_credit_recvs &&
+                    credit_sends_inflight < CREDIT_RECV_DEPTH &&
+                    (credits_to_return >= credit_batch || !ret)) {
+                        if (send_credit_message()) {
+                                return -1;
+                        }
+                }
+
+                if (!ret && ++polls % DISCONNECT_CHECK_INTERVAL == 0 &&
+                    client_disconnect_pending()) {
+                        break;
+                }
+        }
+
+        printf("Received %lu messages, %lu bytes, sent %lu credit messages\n",
+               stream_messages, (unsigned long) stream_bytes,
+               credit_messages_sent);
+        return benchmark_failed ? -EIO : 0;
+}
+
+/* --- File transfer ---
+ *
+ * With -F, the client WRITEs a file with immediate, one chunk at a time, into
+ * the queue_depth chunk slots of our buffer, in turn. Each immediate holds
+ * the chunk's length and consumes one of our receives. We write the chunk out
+ * while the following ones are still landing in the other slots, then push
+ * the number of chunks written out into the client's credit buffer, which
+ * hands their slots back to the client.
+ */
+
+static uint64_t *chunks_written = NULL;
+static uint64_t file_bytes = 0;
+static int file_write_failed = 0;
+
+static int post_chunk_recv(struct ibv_recv_wr *recv_wr);
+
+/*
+ * Completion handler for a chunk WRITE with immediate. Chunks arrive in
+ * order, so the next slot in turn holds it.
+ */
+static void on_chunk_landed(struct ibv_wc *wc, void *context)
+{
+        if (wc->status != IBV_WC_SUCCESS || wc->opcode != IBV_WC_RECV_RDMA_WITH_IMM) {
+                file_write_failed = 1;
+                return;
+        }
+
+        uint32_t length = ntohl(wc->imm_data);
+        uint64_t slot = *chunks_written % queue_depth;
+        const char *chunk = (const char *) server_buffer +
+                            slot * client_metadata.length;
+        if (length > client_metadata.length) {
+                fprintf(stderr, "Chunk of %u bytes exceeds its %u byte slot\n",
+                        length, client_metadata.length);
+                file_write_failed = 1;
+                return;
+        }
+        for (uint32_t done = 0; done < length; ) {
+                ssize_t n = write(file_fd, chunk + done, length - done);
+                if (n < 0) {
+                        fprintf(stderr, "Failed to write %s: %s\n", file_output,
+                                strerror(errno));
+                        file_write_failed = 1;
+                        return;
+                }
+                done += n;
+        }
+        file_bytes += length;
+
+        /* Only publish the slot once the chunk is out of it */
+        __atomic_store_n(chunks_written, *chunks_written + 1, __ATOMIC_RELEASE);
+        if (post_chunk_recv(context)) {
+                file_write_failed = 1;
+        }
+}
+
+static int post_chunk_recv(struct ibv_recv_wr *recv_wr)
+{
+        struct ibv_recv_wr *bad_recv_wr = NULL;
+
+        int ret = completion_table_register(&completion_table, on_chunk_landed,
+                                            recv_wr, &recv_wr->wr_id);
+        if (ret) {
+                return ret;
+        }
+        ret = ibv_post_recv(client_queue_pair, recv_wr, &bad_recv_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to post chunk receive: %s\n",
+                        strerror(ret));
+                completion_table_cancel(&completion_table, recv_wr->wr_id);
+                return -ret;
+        }
+        return 0;
+}
+
+static int post_chunk_recvs()
+{
+        chunk_recv_wrs = calloc(queue_depth, sizeof(*chunk_recv_wrs));
+        chunk_counter_pool_buffer = rdma_pool_alloc(buffer_pool,
+                                                    sizeof(*chunks_written));
+        if (!chunk_recv_wrs || !chunk_counter_pool_buffer) {
+                fprintf(stderr, "Failed to allocate %d chunk receives\n",
+                        queue_depth);
+                return -ENOMEM;
+        }
+        chunks_written = chunk_counter_pool_buffer->addr;
+        *chunks_written = 0;
+
+        /* The immediate is all they carry, so they need no SGE */
+        for (int i = 0; i < queue_depth; i++) {
+                int ret = post_chunk_recv(&chunk_recv_wrs[i]);
+                if (ret) {
+                        return ret;
+                }
+        }
+        return 0;
+}
+
+/*
+ * Writes the client's file out as its chunks land, until it disconnects.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int serve_file()
+{
+        uint64_t pushed = 0, first_nsec = 0, last_nsec = 0;
+        unsigned long polls = 0;
+
+        printf("Writing %u byte chunks into %s through %d slots until the client disconnects\n",
+               client_metadata.length, file_output, queue_depth);
+
+        while (!file_write_failed) {
+                int ret = drain_completion_queue(completion_queue,
+                                                 &completion_table);
+                if (ret < 0) {
+                        return ret;
+                }
+                if (ret > 0) {
+                        last_nsec = monotonic_nsec();
+                        if (!first_nsec) {
+                                first_nsec = last_nsec;
+                        }
+                }
+
+                if (!credit_write_pending && !credit_write_failed &&
+                    *chunks_written != pushed) {
+                        pushed = *chunks_written;
+                        if (push_credit_index(chunks_written,
+                                              chunk_counter_pool_buffer->lkey)) {
+                                return -1;
+                        }
+                }
+
+                if (!ret && ++polls % DISCONNECT_CHECK_INTERVAL == 0 &&
+                    client_disconnect_pending()) {
+                        break;
+                }
+        }
+        if (file_write_failed) {
+                return -EIO;
+        }
+
+        double seconds = (last_nsec - first_nsec) / 1e9;
+        printf("Wrote %lu chunks, %lu bytes to %s", (unsigned long) *chunks_written,
+               (unsigned long) file_bytes, file_output);
+        if (*chunks_written > 1 && seconds > 0) {
+                printf(", %.2f MB/s, %.2f Gb/s", file_bytes / seconds / 1e6,
+                       file_bytes * 8 / seconds / 1e9);
+        }
+        printf("\n");
+        return 0;
+}
+
+/* --- Key-value store ---
+ *
+ * With -K, we host a key-value store (see rdma_kv.h) for a single client.
+ * Its index and heap are registered for remote READ only and handed to the
+ * client in the private data of our connection accept. The client GETs with
+ * READs of the index and heap, which never involve us. It SENDs its PUTs,
+ * one at a time, into queue_depth receives sized for its advertised value
+ * length, and we apply each one and SEND back a reply.
+ */
+
+static unsigned long kv_puts = 0;
+
+static struct ibv_sge kv_reply_sge;
+static struct ibv_send_wr kv_reply_wr, *bad_kv_reply_wr = NULL;
+
+/*
+ * Registers an empty store of kv_bucket_count buckets and a kv_heap_size
+ * byte heap under pd.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int setup_kv_store(struct ibv_pd *pd)
+{
+        kv_index_mr = create_rdma_buffer(pd, kv_bucket_count *
+                                         sizeof(struct kv_bucket),
+                                         (IBV_ACCESS_LOCAL_WRITE|
+                                          IBV_ACCESS_REMOTE_READ));
+        kv_heap_mr = create_rdma_buffer(pd, kv_heap_size,
+                                        (IBV_ACCESS_LOCAL_WRITE|
+                                         IBV_ACCESS_REMOTE_READ));
+        if (!kv_index_mr || !kv_heap_mr) {
+                return -ENOMEM;
+        }
+        kv_store_init(&kv_store, kv_index_mr->addr, kv_bucket_count,
+                      kv_heap_mr->addr, kv_heap_size);
+
+        kv_regions.index.address = (uint64_t) kv_index_mr->addr;
+        kv_regions.index.length = kv_index_mr->length;
+        kv_regions.index.stag.local_stag = kv_index_mr->rkey;
+        kv_regions.heap.address = (uint64_t) kv_heap_mr->addr;
+        kv_regions.heap.length = kv_heap_mr->length;
+        kv_regions.heap.stag.local_stag = kv_heap_mr->rkey;
+        printf("Key-value store: %u buckets of %d keys, %u byte heap\n",
+               kv_bucket_count, KV_BUCKET_ENTRIES, kv_heap_size);
+        return 0;
+}
+
+/*
+ * Completion handler for a reply to a PUT.
+ */
+static void on_kv_reply_sent(struct ibv_wc *wc, void *context)
+{
+        (void) context;
+        if (wc->status != IBV_WC_SUCCESS) {
+                benchmark_failed = 1;
+        }
+}
+
+/*
+ * SENDs the reply in slot reply.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int send_kv_reply(struct kv_reply *reply)
+{
+        kv_reply_sge.addr = (uint64_t) reply;
+        kv_reply_sge.length = sizeof(*reply);
+        kv_reply_sge.lkey = kv_reply_pool_buffer->lkey;
+        memset(&kv_reply_wr, 0, sizeof(kv_reply_wr));
+        kv_reply_wr.sg_list = &kv_reply_sge;
+        kv_reply_wr.num_sge = 1;
+        kv_reply_wr.opcode = IBV_WR_SEND;
+        kv_reply_wr.send_flags = signaled_send_flags(IBV_WR_SEND,
+                                                     kv_reply_sge.length,
+                                                     max_inline_data);
+
+        int ret = completion_table_register(&completion_table,
+                                            on_kv_reply_sent, NULL,
+                                            &kv_reply_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+        ret = ibv_post_send(client_queue_pair, &kv_reply_wr, &bad_kv_reply_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to send key-value reply: %s\n",
+                        strerror(ret));
+                completion_table_cancel(&completion_table, kv_reply_wr.wr_id);
+                return -ret;
+        }
+        return 0;
+}
+
+static int post_kv_recv(struct stream_receive *recv);
+
+/*
+ * Completion handler for a client request. The request is applied, its
+ * receive re-posted for the client's next one, and then the reply goes out
+ * from the slot paired with the receive.
+ */
+static void on_kv_request(struct ibv_wc *wc, void *context)
+{
+        struct stream_receive *recv = context;
+        struct kv_request *request = (struct kv_request *) recv->sge.addr;
+        struct kv_reply *reply = (struct kv_reply *) kv_reply_pool_buffer->addr +
+                                 (recv - kv_receives);
+
+        if (wc->status != IBV_WC_SUCCESS) {
+                benchmark_failed = 1;
+                return;
+        }
+        memset(reply, 0, sizeof(*reply));
+        reply->key = request->key;
+        if (wc->byte_len < sizeof(*request) || request->op != KV_OP_PUT ||
+            wc->byte_len - sizeof(*request) != request->length) {
+                fprintf(stderr, "Malformed key-value request of %u bytes\n",
+                        wc->byte_len);
+                reply->status = -EINVAL;
+        } else {
+                reply->status = kv_put(&kv_store, request->key, request->value,
+                                       request->length);
+                kv_puts += !reply->status;
+        }
+
+        if (post_kv_recv(recv) || send_kv_reply(reply)) {
+                benchmark_failed = 1;
+        }
+}
+
+static int post_kv_recv(struct stream_receive *recv)
+{
+        struct ibv_recv_wr *bad_recv_wr = NULL;
+
+        int ret = completion_table_register(&completion_table, on_kv_request,
+                                            recv, &recv->wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+        ret = ibv_post_recv(client_queue_pair, &recv->wr, &bad_recv_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to post key-value receive: %s\n",
+                        strerror(ret));
+                completion_table_cancel(&completion_table, recv->wr.wr_id);
+                return -ret;
+        }
+        return 0;
+}
+
+static int post_kv_recvs()
+{
+        uint64_t length = sizeof(struct kv_request) +
+                          (uint64_t) client_metadata.length;
+
+        kv_request_pool_buffer = rdma_pool_alloc(buffer_pool,
+                                                 length * queue_depth);
+        kv_reply_pool_buffer = rdma_pool_alloc(buffer_pool,
+                                               sizeof(struct kv_reply) *
+                                               queue_depth);
+        kv_receives = calloc(queue_depth, sizeof(*kv_receives));
+        if (!kv_request_pool_buffer || !kv_reply_pool_buffer || !kv_receives) {
+                fprintf(stderr, "Failed to allocate %d key-value receives\n",
+                        queue_depth);
+                return -ENOMEM;
+        }
+        for (int i = 0; i < queue_depth; i++) {
+                struct stream_receive *recv = &kv_receives[i];
+                recv->sge.addr = (uint64_t) kv_request_pool_buffer->addr +
+                                 i * length;
+                recv->sge.length = length;
+                recv->sge.lkey = kv_request_pool_buffer->lkey;
+                recv->wr.sg_list = &recv->sge;
+                recv->wr.num_sge = 1;
+                int ret = post_kv_recv(recv);
+                if (ret) {
+                        return ret;
+                }
+        }
+        return 0;
+}
+
+/*
+ * Applies the client's PUTs until it disconnects. Its GETs never show up
+ * here.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int serve_kv()
+{
+        unsigned long polls = 0;
+
+        printf("Serving key-value PUTs of up to %u bytes until the client disconnects\n",
+               client_metadata.length);
+
+        while (!benchmark_failed) {
+                int ret = drain_completion_queue(completion_queue,
+                                                 &completion_table);
+                if (ret < 0) {
+                        return ret;
+                }
+                if (!ret && ++polls % DISCONNECT_CHECK_INTERVAL == 0 &&
+                    client_disconnect_pending()) {
+                        break;
+                }
+        }
+
+        printf("Applied %lu PUTs, store holds %lu keys in %lu of %lu heap bytes\n",
+               kv_puts, (unsigned long) kv_store.keys,
+               (unsigned long) (kv_store.heap_used - kv_store.heap_free),
+               (unsigned long) kv_store.heap_size);
+        return benchmark_failed ? -EIO : 0;
+}
+
+/* --- Atomic counters ---
+ *
+ * With -A, clients are handed an array of 64-bit counters in place of a
+ * buffer, registered for remote atomic access. They FETCH_AND_ADD and
+ * COMPARE_AND_SWAP them directly, e.g. to draw sequence numbers, and the HCA
+ * serializes the operations of every client on a counter. All the server does
+ * is print them when a client leaves.
+ *
+ * With -l, the counters are the lock words of a lock table instead, which
+ * clients acquire and release with COMPARE_AND_SWAP, and we print the locks
+ * still held.
+ */
+
+/* Most counters or held locks printed at a time */
+#define ATOMIC_COUNTERS_PRINTED 16
+
+/*
+ * Registers atomic_counter_count zeroed counters under pd, refusing a device
+ * that can't do atomics at all. A lock table gets the word handing out owner
+ * ids after its locks.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int setup_atomic_counters(struct ibv_pd *pd)
+{
+        struct ibv_device_attr device_attr;
+
+        int ret = ibv_query_device(pd->context, &device_attr);
+        if (ret) {
+                fprintf(stderr, "Failed to query device: %s\n", strerror(ret));
+                return -ret;
+        }
+        if (device_attr.atomic_cap == IBV_ATOMIC_NONE) {
+                fprintf(stderr, "Device doesn't support atomic operations\n");
+                return -EOPNOTSUPP;
+        }
+
+        atomic_counters_mr = create_rdma_buffer(pd,
+                                                (atomic_counter_count + lock_table) *
+                                                sizeof(uint64_t),
+                                                (IBV_ACCESS_LOCAL_WRITE|
+                                                 IBV_ACCESS_REMOTE_READ|
+                                                 IBV_ACCESS_REMOTE_WRITE|
+                                                 IBV_ACCESS_REMOTE_ATOMIC));
+        if (!atomic_counters_mr) {
+                return -ENOMEM;
+        }
+        printf("Registered %u %s (%s atomicity, rkey %u)\n",
+               atomic_counter_count, lock_table ? "lock words" : "atomic counters",
+               device_attr.atomic_cap == IBV_ATOMIC_GLOB ? "global" : "HCA",
+               atomic_counters_mr->rkey);
+        return 0;
+}
+
+/*
+ * Prints the first counters and the sum of them all.
+ */
+static void print_atomic_counters()
+{
+        uint64_t *counters = atomic_counters_mr->addr;
+        uint64_t sum = 0;
+
+        for (uint32_t i = 0; i < atomic_counter_count; i++) {
+                uint64_t value = __atomic_load_n(&counters[i], __ATOMIC_ACQUIRE);
+                if (i < ATOMIC_COUNTERS_PRINTED) {
+                        printf("counter[%u]: %lu\n", i, (unsigned long) value);
+                }
+                sum += value;
+        }
+        if (atomic_counter_count > ATOMIC_COUNTERS_PRINTED) {
+                printf("... %u more counters\n",
+                       atomic_counter_count - ATOMIC_COUNTERS_PRINTED);
+        }
+        printf("Sum of %u counters: %lu\n", atomic_counter_count,
+               (unsigned long) sum);
+}
+
+/*
+ * Prints the first locks still held, and how many are held in each mode.
+ */
+static void print_lock_table()
+{
+        uint64_t *words = atomic_counters_mr->addr;
+        uint32_t now = lock_clock_ms();
+        uint32_t exclusive = 0, shared = 0, expired = 0;
+
+        for (uint32_t i = 0; i < atomic_counter_count; i++) {
+                uint64_t word = __atomic_load_n(&words[i], __ATOMIC_ACQUIRE);
+                if (!lock_word_owner(word) && !lock_word_readers(word)) {
+                        continue;
+                }
+                if (!lock_word_held(word, now)) {
+                        expired++;
+                } else if (lock_word_owner(word)) {
+                        exclusive++;
+                } else {
+                        shared++;
+                }
+                if (exclusive + shared + expired <= ATOMIC_COUNTERS_PRINTED) {
+                        printf("lock[%u]: owner %u, %u shared, lease %s\n", i,
+                               lock_word_owner(word), lock_word_readers(word),
+                               lock_word_held(word, now) ? "live" : "expired");
+                }
+        }
+        printf("%u of %u locks held exclusive, %u shared, %u with an expired lease\n",
+               exclusive, atomic_counter_count, shared, expired);
+        printf("%lu owner ids handed out\n",
+               (unsigned long) __atomic_load_n(&words[atomic_counter_count],
+                                               __ATOMIC_ACQUIRE));
+}
+
+/* --- Multi-client event loop ---
+ *
+ * Instead of serving a single client with blocking calls, the event loop puts
+ * the CM event channel and every client's I/O completion channel into
+ * non-blocking mode and multiplexes them with epoll. Each client gets its own
+ * client_connection with a dedicated CQ, completion channel and QP, while the
+ * Protection Domain and the memory pool registered under it are set up once
+ * and shared by all clients.
+ */
+
+/* Maximum number of epoll events handled per epoll_wait() call */
+#define MAX_EPOLL_EVENTS 64
+
+static void stop_event_loop(int signum)
+{
+        (void) signum;
+        event_loop_running = 0;
+}
+
+static void on_srq_receive(struct ibv_wc *wc, void *context);
+
+/*
+ * Posts every receive not currently posted on the Shared Receive Queue as one
+ * chained list of WRs, then re-arms the SRQ limit so the device notifies us
+ * again once it runs low.
+ *
+ * Returns 0 if successful, -errno otherwise.
+ */
+static int replenish_shared_receive_queue()
+{
+        struct ibv_recv_wr *head = NULL, *tail = NULL, *bad_recv_wr = NULL;
+        struct ibv_srq_attr srq_attr;
+        int count = 0;
+        int ret = 0;
+
+        for (int i = 0; i < srq_depth; i++) {
+                struct srq_receive *recv = &srq_receives[i];
+                if (recv->posted) {
+                        continue;
+                }
+                if (completion_table_register(&completion_table, on_srq_receive,
+                                              recv, &recv->wr.wr_id)) {
+                        break;
+                }
+                recv->wr.next = NULL;
+                recv->posted = 1;
+                if (tail) {
+                        tail->next = &recv->wr;
+                } else {
+                        head = &recv->wr;
+                }
+                tail = &recv->wr;
+                count++;
+        }
+        if (!head) {
+                return 0;
+        }
+
+        ret = ibv_post_srq_recv(shared_receive_queue, head, &bad_recv_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to post receive WRs to SRQ: %s\n",
+                        strerror(ret));
+                /* Everything from bad_recv_wr on was not posted */
+                for (struct ibv_recv_wr *wr = bad_recv_wr; wr; wr = wr->next) {
+                        struct srq_receive *recv = (struct srq_receive *)
+                                ((char *)wr - offsetof(struct srq_receive, wr));
+                        completion_table_cancel(&completion_table, wr->wr_id);
+                        recv->posted = 0;
+                        count--;
+                }
+        }
+        srq_posted += count;
+
+        memset(&srq_attr, 0, sizeof(srq_attr));
+        srq_attr.srq_limit = srq_depth / 4;
+        if (ibv_modify_srq(shared_receive_queue, &srq_attr, IBV_SRQ_LIMIT)) {
+                fprintf(stderr, "Failed to arm SRQ limit: %s\n", strerror(errno));
+                return -errno;
+        }
+        printf("Posted %d receive(s) to SRQ, %d/%d posted\n", count,
+               srq_posted, srq_depth);
+        return ret ? -ret : 0;
+}
+
+/*
+ * Creates the Shared Receive Queue under the shared Protection Domain, takes
+ * its receive buffers from the pool and posts them all. The device's async
+ * event fd is added to epoll, tagged with the SRQ pointer, so the event loop
+ * sees IBV_EVENT_SRQ_LIMIT_REACHED.
+ *
+ * Returns 0 if successful, -errno otherwise.
+ */
+static int setup_shared_receive_queue(struct ibv_context *verbs)
+{
+        struct ibv_srq_init_attr srq_init_attr;
+        struct epoll_event event;
+
+        memset(&srq_init_attr, 0, sizeof(srq_init_attr));
+        srq_init_attr.attr.max_wr = srq_depth;
+        srq_init_attr.attr.max_sge = 1;
+        shared_receive_queue = ibv_create_srq(protection_domain, &srq_init_attr);
+        if (!shared_receive_queue) {
+                fprintf(stderr, "Failed to create SRQ: %s\n", strerror(errno));
+                return -errno;
+        }
+
+        srq_receives = calloc(srq_depth, sizeof(*srq_receives));
+        if (!srq_receives) {
+                fprintf(stderr, "Failed to allocate SRQ receives: -ENOMEM\n");
+                return -ENOMEM;
+        }
+        for (int i = 0; i < srq_depth; i++) {
+                struct srq_receive *recv = &srq_receives[i];
+                recv->buffer = rdma_pool_alloc(buffer_pool,
+                                               sizeof(struct rdma_buffer_attr));
+                if (!recv->buffer) {
+                        fprintf(stderr, "Failed to allocate SRQ receive buffers from pool\n");
+                        return -ENOMEM;
+                }
+                recv->sge.addr = (uint64_t) recv->buffer->addr;
+                recv->sge.length = recv->buffer->length;
+                recv->sge.lkey = recv->buffer->lkey;
+                recv->wr.sg_list = &recv->sge;
+                recv->wr.num_sge = 1;
+        }
+
+        if (set_fd_nonblocking(verbs->async_fd)) {
+                return -errno;
+        }
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = shared_receive_queue;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, verbs->async_fd, &event)) {
+                fprintf(stderr, "Failed to add async event fd to epoll: %s\n",
+                        strerror(errno));
+                return -errno;
+        }
+
+        printf("Created shared receive queue with %d receives\n", srq_depth);
+        return replenish_shared_receive_queue();
+}
+
+/*
+ * Drains the device's non-blocking async event fd. Only the SRQ limit event
+ * is acted on; it fires once per arming, when the posted receive count drops
+ * below the limit.
+ */
+static void handle_async_events()
+{
+        struct ibv_async_event async_event;
+
+        while (ibv_get_async_event(protection_domain->context,
+                                   &async_event) == 0) {
+                enum ibv_event_type type = async_event.event_type;
+                ibv_ack_async_event(&async_event);
+
+                if (type == IBV_EVENT_SRQ_LIMIT_REACHED) {
+                        printf("SRQ limit reached, %d/%d receives posted\n",
+                               srq_posted, srq_depth);
+                        replenish_shared_receive_queue();
+                } else {
+                        printf("Ignoring async event %s\n",
+                               ibv_event_type_str(type));
+                }
+        }
+        if (errno != EAGAIN) {
+                fprintf(stderr, "Failed to get async event: %s\n",
+                        strerror(errno));
+        }
+}
+
+static int setup_accept_pool(struct ibv_context *verbs);
+
+/*
+ * Allocates the Protection Domain shared by every client connection the first
+ * time a client connects. All clients must arrive on the same RDMA device,
+ * which is always the case when the server is bound to a specific address.
+ */
+static int setup_shared_protection_domain(struct ibv_context *verbs)
+{
+        if (protection_domain) {
+                if (protection_domain->context != verbs) {
+                        fprintf(stderr, "Client connected through a different RDMA device than the shared PD\n");
+                        return -EINVAL;
+                }
+                return 0;
+        }
+
+        protection_domain = ibv_alloc_pd(verbs);
+        if (!protection_domain) {
+                fprintf(stderr, "Failed to create Protection Domain: %s\n",
+                        strerror(errno));
+                return -errno;
+        }
+        printf("Created shared Protection Domain:\n");
+        print_ibv_pd(protection_domain, 1);
+
+        /* Every client, whichever worker owns it, hits the same counters */
+        if (atomic_counter_count) {
+                int ret = setup_atomic_counters(protection_domain);
+                if (ret) {
+                        return ret;
+                }
+        }
+
+        /* Workers register their own pools */
+        if (worker_count) {
+                return 0;
+        }
+
+        /* Register all memory clients will use once, up front, for local
+         * access. Each client's buffer gets its rkey from an MR of its own.
+         */
+        buffer_pool = rdma_pool_create(protection_domain, DEFAULT_POOL_MIN_BUFFER,
+                                       pool_max_buffer, pool_class_bytes,
+                                       IBV_ACCESS_LOCAL_WRITE);
+        if (!buffer_pool) {
+                return -ENOMEM;
+        }
+
+        if (use_srq) {
+                int ret = setup_shared_receive_queue(verbs);
+                if (ret) {
+                        return ret;
+                }
+        }
+        if (accept_pool_size) {
+                return setup_accept_pool(verbs);
+        }
+        return 0;
+}
+
+/*
+ * Completion handler for the server metadata SEND, which completes the
+ * metadata exchange with the client.
+ */
+static void on_server_metadata_sent(struct ibv_wc *wc, void *context)
+{
+        struct client_connection *conn = context;
+
+        if (wc->status != IBV_WC_SUCCESS) {
+                rdma_disconnect(conn->cm_id);
+                return;
+        }
+        conn->metadata_sent = 1;
+        printf("Exchanged metadata with client %p\n", conn);
+}
+
+static int post_connection_notify_recv(struct client_connection *conn);
+
+/*
+ * Completion handler for a connection's notification receive, consumed by
+ * the client's WRITE with immediate. Re-posted for the client's next WRITE.
+ */
+static void on_connection_write_notified(struct ibv_wc *wc, void *context)
+{
+        struct client_connection *conn = context;
+
+        if (wc->status != IBV_WC_SUCCESS) {
+                rdma_disconnect(conn->cm_id);
+                return;
+        }
+        printf("Client %p: ", conn);
+        print_notified_message(wc, conn->buffer->addr, conn->buffer->length);
+        if (post_connection_notify_recv(conn)) {
+                rdma_disconnect(conn->cm_id);
+        }
+}
+
+/*
+ * Posts the receive the client's WRITE with immediate consumes, reusing the
+ * metadata receive WR without its SGE.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int post_connection_notify_recv(struct client_connection *conn)
+{
+        struct ibv_recv_wr *bad_recv_wr = NULL;
+
+        memset(&conn->client_recv_wr, 0, sizeof(conn->client_recv_wr));
+        int ret = completion_table_register(connection_completion_table(conn),
+                                            on_connection_write_notified, conn,
+                                            &conn->client_recv_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+        ret = ibv_post_recv(conn->queue_pair, &conn->client_recv_wr,
+                            &bad_recv_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to post notification receive: %s\n",
+                        strerror(ret));
+                completion_table_cancel(connection_completion_table(conn),
+                                        conn->client_recv_wr.wr_id);
+                return -ret;
+        }
+        return 0;
+}
+
+/*
+ * The client's metadata has landed in client_metadata, so allocate a buffer of
+ * the advertised length, registered for the client's rkey alone, and
+ * describe it in server_metadata.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int setup_connection_buffer(struct client_connection *conn)
+{
+        struct rdma_buffer_attr *client_metadata = conn->client_metadata->addr;
+        struct rdma_buffer_attr *server_metadata = conn->server_metadata->addr;
+
+        conn->buffer = rdma_pool_alloc_remote(connection_pool(conn),
+                                              client_metadata->length,
+                                              CLIENT_BUFFER_ACCESS);
+        if (!conn->buffer) {
+                fprintf(stderr, "Failed to allocate client buffer from pool\n");
+                return -ENOMEM;
+        }
+
+        server_metadata->address = (uint64_t) conn->buffer->addr;
+        server_metadata->length = client_metadata->length;
+        server_metadata->stag.local_stag = conn->buffer->rkey;
+        if (atomic_counters_mr) {
+                server_metadata->address = (uint64_t) atomic_counters_mr->addr;
+                server_metadata->length = atomic_counters_mr->length;
+                server_metadata->stag.local_stag = atomic_counters_mr->rkey;
+        }
+
+        /* The client may WRITE as soon as it has our metadata, so its
+         * notification receive goes first. The SRQ has them posted already.
+         */
+        if (write_imm && !shared_receive_queue) {
+                return post_connection_notify_recv(conn);
+        }
+        return 0;
+}
+
+/*
+ * Sets up the buffer the client's metadata asks for and SENDs our metadata
+ * describing it.
+ */
+static void send_server_metadata(struct client_connection *conn)
+{
+        struct ibv_send_wr *bad_send_wr = NULL;
+
+        struct rdma_buffer_attr *server_metadata = conn->server_metadata->addr;
+
+        if (setup_connection_buffer(conn)) {
+                rdma_disconnect(conn->cm_id);
+                return;
+        }
+
+        conn->server_send_sge.addr = (uint64_t) conn->server_metadata->addr;
+        conn->server_send_sge.length = sizeof(*server_metadata);
+        conn->server_send_sge.lkey = conn->server_metadata->lkey;
+        memset(&conn->server_send_wr, 0, sizeof(conn->server_send_wr));
+        conn->server_send_wr.sg_list = &conn->server_send_sge;
+        conn->server_send_wr.num_sge = 1;
+        conn->server_send_wr.opcode = IBV_WR_SEND;
+        conn->server_send_wr.send_flags =
+                signaled_send_flags(IBV_WR_SEND, conn->server_send_sge.length,
+                                    conn->max_inline_data);
+        if (completion_table_register(connection_completion_table(conn),
+                                      on_server_metadata_sent, conn,
+                                      &conn->server_send_wr.wr_id)) {
+                rdma_disconnect(conn->cm_id);
+                return;
+        }
+
+        int ret = ibv_post_send(conn->queue_pair, &conn->server_send_wr,
+                                &bad_send_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to send server metadata: %s\n",
+                        strerror(ret));
+                completion_table_cancel(connection_completion_table(conn),
+                                        conn->server_send_wr.wr_id);
+                rdma_disconnect(conn->cm_id);
+        }
+}
+
+/*
+ * Completion handler for the pre-posted metadata receive.
+ */
+static void on_client_metadata_received(struct ibv_wc *wc, void *context)
+{
+        struct client_connection *conn = context;
+
+        if (wc->status != IBV_WC_SUCCESS) {
+                rdma_disconnect(conn->cm_id);
+                return;
+        }
+        send_server_metadata(conn);
+}
+
+/*
+ * Completion handler for a receive on the Shared Receive Queue. The WC's
+ * qp_num says which client sent it; copy its metadata over to the
+ * connection and release the receive for the next replenishment.
+ */
+static void on_srq_receive(struct ibv_wc *wc, void *context)
+{
+        struct srq_receive *recv = context;
+        recv->posted = 0;
+        srq_posted--;
+
+        struct client_connection *conn = find_connection_by_qp_num(wc->qp_num);
+        if (conn) {
+                if (wc->status == IBV_WC_SUCCESS &&
+                    wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+                        printf("Client %p: ", conn);
+                        print_notified_message(wc, conn->buffer->addr,
+                                               conn->buffer->length);
+                } else if (wc->status == IBV_WC_SUCCESS) {
+                        memcpy(conn->client_metadata->addr, recv->buffer->addr,
+                               sizeof(struct rdma_buffer_attr));
+                        send_server_metadata(conn);
+                } else {
+                        rdma_disconnect(conn->cm_id);
+                }
+        }
+
+        /* Never leave the SRQ empty waiting on the limit event */
+        if (!srq_posted) {
+                replenish_shared_receive_queue();
+        }
+}
+
+/*
+ * Creates a worker's completion channel, its CQ on the worker's completion
+ * vector, and its memory pool, the first time the worker is handed a
+ * connection.
+ *
+ * Returns 0 if successful, -errno otherwise.
+ */
+static int setup_worker_resources(struct worker *worker,
+                                  struct ibv_context *verbs)
+{
+        struct ibv_device_attr device_attr;
+        struct epoll_event event;
+
+        if (worker->completion_queue) {
+                return 0;
+        }
+
+        worker->completion_channel = ibv_create_comp_channel(verbs);
+        if (!worker->completion_channel) {
+                fprintf(stderr, "Failed to create Completion Channel: %s\n",
+                        strerror(errno));
+                return -errno;
+        }
+        if (set_fd_nonblocking(worker->completion_channel->fd)) {
+                return -errno;
+        }
+
+        worker->cq_depth = WORKER_CQ_DEPTH;
+        if (ibv_query_device(verbs, &device_attr) == 0 &&
+            device_attr.max_cqe < worker->cq_depth) {
+                worker->cq_depth = device_attr.max_cqe;
+        }
+        worker->comp_vector = verbs->num_comp_vectors > 0 ?
+                worker->index % verbs->num_comp_vectors : 0;
+        worker->completion_queue = ibv_create_cq(verbs, worker->cq_depth, worker,
+                                                 worker->completion_channel,
+                                                 worker->comp_vector);
+        if (!worker->completion_queue) {
+                fprintf(stderr, "Failed to create Completion Queue: %s\n",
+                        strerror(errno));
+                return -errno;
+        }
+        if (ibv_req_notify_cq(worker->completion_queue, 0)) {
+                fprintf(stderr, "Failed to request notifications on CQ: %s\n",
+                        strerror(errno));
+                return -errno;
+        }
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = worker;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD,
+                      worker->completion_channel->fd, &event)) {
+                fprintf(stderr, "Failed to add completion channel to epoll: %s\n",
+                        strerror(errno));
+                return -errno;
+        }
+
+        worker->buffer_pool = rdma_pool_create(protection_domain,
+                                               DEFAULT_POOL_MIN_BUFFER,
+                                               pool_max_buffer, pool_class_bytes,
+                                               IBV_ACCESS_LOCAL_WRITE);
+        if (!worker->buffer_pool) {
+                return -ENOMEM;
+        }
+
+        printf("Worker %d on CPU %d: CQ of %d entries on completion vector %d\n",
+               worker->index, worker->cpu, worker->cq_depth,
+               worker->comp_vector);
+        return 0;
+}
+
+/*
+ * Fills in the attributes every client QP is created with, on cq.
+ */
+static void init_connection_qp_attr(struct ibv_qp_init_attr *init_attr,
+                                    struct ibv_cq *cq)
+{
+        memset(init_attr, 0, sizeof(*init_attr));
+        init_attr->qp_type = IBV_QPT_RC;
+        init_attr->cap.max_send_sge = 2;
+        init_attr->cap.max_send_wr = 8;
+        init_attr->cap.max_inline_data = inline_size;
+        if (shared_receive_queue) {
+                init_attr->srq = shared_receive_queue;
+        } else {
+                init_attr->cap.max_recv_sge = 2;
+                init_attr->cap.max_recv_wr = 8;
+        }
+        init_attr->recv_cq = cq;
+        init_attr->send_cq = cq;
+}
+
+/*
+ * Posts the receive for the client's metadata SEND on a connection's QP.
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int post_client_metadata_recv(struct client_connection *conn)
+{
+        struct ibv_recv_wr *bad_recv_wr = NULL;
+
+        conn->client_recv_sge.addr = (uint64_t) conn->client_metadata->addr;
+        conn->client_recv_sge.length = sizeof(struct rdma_buffer_attr);
+        conn->client_recv_sge.lkey = conn->client_metadata->lkey;
+        conn->client_recv_wr.sg_list = &conn->client_recv_sge;
+        conn->client_recv_wr.num_sge = 1;
+        int ret = completion_table_register(connection_completion_table(conn),
+                                            on_client_metadata_received, conn,
+                                            &conn->client_recv_wr.wr_id);
+        if (ret) {
+                return ret;
+        }
+        ret = ibv_post_recv(conn->queue_pair, &conn->client_recv_wr,
+                            &bad_recv_wr);
+        if (ret) {
+                fprintf(stderr, "Failed to pre-post client receive WR to QP: %s\n",
+                        strerror(ret));
+                completion_table_cancel(connection_completion_table(conn),
+                                        conn->client_recv_wr.wr_id);
+                return -ret;
+        }
+        return 0;
+}
+
+/*
+ * Creates all per-client resources for a new connection request and pre-posts
+ * the receive for the client's metadata:
+ * 1. Non-blocking completion channel, registered with epoll
+ * 2. Completion Queue, armed for notifications
+ * (A connection owned by a worker uses the worker's channel and CQ instead.)
+ * 3. Queue Pair under the shared Protection Domain
+ * 4. Metadata MRs, and the pre-posted metadata receive WR unless receives
+ *    come from the Shared Receive Queue or the client connects fast
+ *
+ * Returns the new connection, or NULL on failure. On failure the caller still
+ * owns cm_id.
+ */
+static struct client_connection *create_client_connection(struct rdma_cm_id *cm_id,
+                                                          struct worker *worker,
+                                                          int fast_connect)
+{
+        struct ibv_qp_init_attr init_attr;
+        struct epoll_event event;
+        int ret = 0;
+
+        ret = setup_shared_protection_domain(cm_id->verbs);
+        if (ret) {
+                return NULL;
+        }
+
+        if (worker) {
+                if (setup_worker_resources(worker, cm_id->verbs)) {
+                        return NULL;
+                }
+                /* Every connection must fit its WCs in the shared CQ */
+                if ((worker->connection_count + 1) * WRS_PER_CONNECTION >
+                    worker->cq_depth) {
+                        fprintf(stderr, "Worker %d is full with %d clients\n",
+                                worker->index, worker->connection_count);
+                        return NULL;
+                }
+        }
+
+        struct client_connection *conn = calloc(1, sizeof(*conn));
+        if (!conn) {
+                fprintf(stderr, "Failed to allocate client connection: -ENOMEM\n");
+                return NULL;
+        }
+        conn->cm_id = cm_id;
+        conn->worker = worker;
+        /* A worker's CM ids keep pointing at the worker, which is how the
+         * acceptor routes their events.
+         */
+        if (!worker) {
+                cm_id->context = conn;
+        }
+        link_client_connection(conn);
+
+        /* A worker's connections share the worker's channel and CQ */
+        struct ibv_cq *cq = NULL;
+        if (worker) {
+                cq = worker->completion_queue;
+        } else {
+                conn->completion_channel = ibv_create_comp_channel(cm_id->verbs);
+                if (!conn->completion_channel) {
+                        fprintf(stderr, "Failed to create Completion Channel: %s\n",
+                                strerror(errno));
+                        goto err;
+                }
+                if (set_fd_nonblocking(conn->completion_channel->fd)) {
+                        goto err;
+                }
+
+                conn->completion_queue = ibv_create_cq(cm_id->verbs, 16, conn,
+                                                       conn->completion_channel, 0);
+                if (!conn->completion_queue) {
+                        fprintf(stderr, "Failed to create Completion Queue: %s\n",
+                                strerror(errno));
+                        goto err;
+                }
+                if (ibv_req_notify_cq(conn->completion_queue, 0)) {
+                        fprintf(stderr, "Failed to request notifications on CQ: %s\n",
+                                strerror(errno));
+                        goto err;
+                }
+                cq = conn->completion_queue;
+        }
+
+        init_connection_qp_attr(&init_attr, cq);
+        ret = create_queue_pair(cm_id, protection_domain, &init_attr);
+        if (ret) {
+                fprintf(stderr, "Failed to create QP: %s\n", strerror(-ret));
+                goto err;
+        }
+        conn->queue_pair = cm_id->qp;
+        conn->max_inline_data = init_attr.cap.max_inline_data;
+        if (!worker) {
+                index_connection_qp(conn);
+        }
+
+        conn->client_metadata = rdma_pool_alloc(connection_pool(conn),
+                                                sizeof(struct rdma_buffer_attr));
+        conn->server_metadata = rdma_pool_alloc(connection_pool(conn),
+                                                sizeof(struct rdma_buffer_attr));
+        if (!conn->client_metadata || !conn->server_metadata) {
+                fprintf(stderr, "Failed to allocate metadata buffers from pool\n");
+                goto err;
+        }
+
+        /* Pre-post the receive for the client's metadata before accepting, so
+         * the client's SEND always finds a receive buffer waiting. With an SRQ
+         * the shared receives already cover it, and a fast connect client
+         * sends none.
+         */
+        if (!shared_receive_queue && !fast_connect &&
+            post_client_metadata_recv(conn)) {
+                goto err;
+        }
+
+        /* The worker's channel is already in its epoll set */
+        if (worker) {
+                return conn;
+        }
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->completion_channel->fd,
+                      &event)) {
+                fprintf(stderr, "Failed to add completion channel to epoll: %s\n",
+                        strerror(errno));
+                goto err;
+        }
+
+        return conn;
+
+err:
+        /* Hand cm_id back to the caller, who still has to reject it */
+        if (conn->queue_pair) {
+                unindex_connection_qp(conn);
+                rdma_destroy_qp(cm_id);
+                conn->queue_pair = NULL;
+        }
+        conn->cm_id = NULL;
+        if (!worker) {
+                cm_id->context = NULL;
+        }
+        destroy_client_connection(conn);
+        return NULL;
+}
+
+/* --- Accept pool --- ready-made connections for incoming clients */
+
+/*
+ * Moves a pooled connection's QP to state. The CM only drives the QPs it
+ * created, so for ours it just hands over the attributes it negotiated, as
+ * rdma_accept() would for its own.
+ *
+ * Returns 0 if successful, -errno otherwise.
+ */
+static int modify_pooled_qp(struct client_connection *conn,
+                            enum ibv_qp_state state)
+{
+        struct ibv_qp_attr attr;
+        int attr_mask = IBV_QP_STATE;
+        int ret = 0;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.qp_state = state;
+        if (state == IBV_QPS_INIT || state == IBV_QPS_RTR ||
+            state == IBV_QPS_RTS) {
+                if (rdma_init_qp_attr(conn->cm_id, &attr, &attr_mask)) {
+                        fprintf(stderr, "Failed to get attributes for pooled QP: %s\n",
+                                strerror(errno));
+                        return -errno;
+                }
+        }
+        /* Matching the responder resources and initiator depth we accept with */
+        if (state == IBV_QPS_RTR) {
+                attr.max_dest_rd_atomic = 3;
+        } else if (state == IBV_QPS_RTS) {
+                attr.max_rd_atomic = 3;
+        }
+        ret = ibv_modify_qp(conn->queue_pair, &attr, attr_mask);
+        if (ret) {
+                fprintf(stderr, "Failed to move pooled QP to state %d: %s\n",
+                        state, strerror(ret));
+                return -ret;
+        }
+        return 0;
+}
+
+/*
+ * Returns a pooled connection to the spares once its client is gone: its QP
+ * is reset, WCs it already generated are dispatched as usual, and its buffer
+ * is released. The metadata buffers stay with it. A connection that was
+ * established first waits out its CM id's timewait in timewait_connections;
+ * one that never was has no timewait to wait out.
+ *
+ * Returns 0 if successful, or a negative error code if the QP can't be reset,
+ * in which case the connection has to be destroyed instead.
+ */
+static int recycle_pooled_connection(struct client_connection *conn)
+{
+        int ret = quiesce_client_connection(conn);
+        if (ret) {
+                return ret;
+        }
+
+        rdma_pool_free(buffer_pool, conn->buffer);
+        conn->buffer = NULL;
+        conn->metadata_sent = 0;
+        unlink_client_connection(conn);
+
+        if (conn->established) {
+                conn->established = 0;
+                conn->timewait = 1;
+                conn->next = timewait_connections;
+                timewait_connections = conn;
+                return 0;
+        }
+        rdma_destroy_id(conn->cm_id);
+        conn->cm_id = NULL;
+        conn->next = spare_connections;
+        spare_connections = conn;
+        return 0;
+}
+
+/*
+ * Releases the CM id of a connection in timewait_connections, once
+ * RDMA_CM_EVENT_TIMEWAIT_EXIT comes in for it, and puts the connection back
+ * with the spares.
+ */
+static void end_pooled_timewait(struct client_connection *conn)
+{
+        for (struct client_connection **link = &timewait_connections; *link;
+             link = &(*link)->next) {
+                if (*link == conn) {
+                        *link = conn->next;
+                        rdma_destroy_id(conn->cm_id);
+                        conn->cm_id = NULL;
+                        conn->timewait = 0;
+                        conn->next = spare_connections;
+                        spare_connections = conn;
+                        return;
+                }
+        }
+}
+
+/*
+ * Takes a spare connection for a connection request, bringing its QP up to
+ * RTS with the pre-posted metadata receive, as create_client_connection()
+ * would a new one.
+ *
+ * Returns the connection, or NULL if there is no spare or it can't be set up,
+ * in which case the caller still owns cm_id.
+ */
+static struct client_connection *take_pooled_connection(struct rdma_cm_id *cm_id,
+                                                        int fast_connect)
+{
+        if (setup_shared_protection_domain(cm_id->verbs) || !spare_connections) {
+                return NULL;
+        }
+
+        struct client_connection *conn = spare_connections;
+        spare_connections = conn->next;
+        conn->next = NULL;
+        conn->cm_id = cm_id;
+        cm_id->context = conn;
+        link_client_connection(conn);
+        index_connection_qp(conn);
+
+        if (modify_pooled_qp(conn, IBV_QPS_INIT) ||
+            (!shared_receive_queue && !fast_connect &&
+             post_client_metadata_recv(conn)) ||
+            modify_pooled_qp(conn, IBV_QPS_RTR) ||
+            modify_pooled_qp(conn, IBV_QPS_RTS)) {
+                /* Hand cm_id back to the caller, who still has to reject it */
+                conn->cm_id = NULL;
+                cm_id->context = NULL;
+                destroy_client_connection(conn);
+                return NULL;
+        }
+        return conn;
+}
+
+/*
+ * Creates accept_pool_size spare connections, with their QPs in RESET on one
+ * CQ and completion channel, and their metadata buffers.
+ *
+ * Returns 0 if successful, -errno otherwise.
+ */
+static int setup_accept_pool(struct ibv_context *verbs)
+{
+        struct ibv_qp_init_attr init_attr;
+        struct epoll_event event;
+
+        accept_pool_channel = ibv_create_comp_channel(verbs);
+        if (!accept_pool_channel) {
+                fprintf(stderr, "Failed to create accept pool Completion Channel: %s\n",
+                        strerror(errno));
+                return -errno;
+        }
+        if (set_fd_nonblocking(accept_pool_channel->fd)) {
+                return -errno;
+        }
+        accept_pool_cq = ibv_create_cq(verbs, accept_pool_size * WRS_PER_CONNECTION,
+                                       NULL, accept_pool_channel, 0);
+        if (!accept_pool_cq) {
+                fprintf(stderr, "Failed to create accept pool Completion Queue: %s\n",
+                        strerror(errno));
+                return -errno;
+        }
+        if (ibv_req_notify_cq(accept_pool_cq, 0)) {
+                fprintf(stderr, "Failed to request notifications on CQ: %s\n",
+                        strerror(errno));
+                return -errno;
+        }
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = accept_pool_channel;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, accept_pool_channel->fd, &event)) {
+                fprintf(stderr, "Failed to add accept pool channel to epoll: %s\n",
+                        strerror(errno));
+                return -errno;
+        }
+
+        for (int i = 0; i < accept_pool_size; i++) {
+                struct client_connection *conn = calloc(1, sizeof(*conn));
+                if (!conn) {
+                        fprintf(stderr, "Failed to allocate pooled connection: -ENOMEM\n");
+                        return -ENOMEM;
+                }
+                conn->pooled = 1;
+                conn->next = spare_connections;
+                spare_connections = conn;
+
+                init_connection_qp_attr(&init_attr, accept_pool_cq);
+                conn->queue_pair = ibv_create_qp(protection_domain, &init_attr);
+                if (!conn->queue_pair) {
+                        fprintf(stderr, "Failed to create pooled QP: %s\n",
+                                strerror(errno));
+                        return -errno;
+                }
+                conn->max_inline_data = init_attr.cap.max_inline_data;
+
+                conn->client_metadata = rdma_pool_alloc(buffer_pool,
+                                                        sizeof(struct rdma_buffer_attr));
+                conn->server_metadata = rdma_pool_alloc(buffer_pool,
+                                                        sizeof(struct rdma_buffer_attr));
+                if (!conn->client_metadata || !conn->server_metadata) {
+                        fprintf(stderr, "Failed to allocate metadata buffers from pool\n");
+                        return -ENOMEM;
+                }
+        }
+        printf("Created accept pool of %d connections\n", accept_pool_size);
+        return 0;
+}
+
+/*
+ * Destroys the spare connections, those still waiting out their timewait
+ * included, and the accept pool's CQ and channel. Live pooled connections
+ * must already have been recycled.
+ */
+static void destroy_accept_pool()
+{
+        while (timewait_connections) {
+                end_pooled_timewait(timewait_connections);
+        }
+        while (spare_connections) {
+                struct client_connection *conn = spare_connections;
+                spare_connections = conn->next;
+                if (conn->queue_pair) {
+                        ibv_destroy_qp(conn->queue_pair);
+                }
+                rdma_pool_free(buffer_pool, conn->client_metadata);
+                rdma_pool_free(buffer_pool, conn->server_metadata);
+                free(conn);
+        }
+        if (accept_pool_channel && epoll_fd != -1) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, accept_pool_channel->fd, NULL);
+        }
+        if (accept_pool_cq) {
+                ibv_destroy_cq(accept_pool_cq);
+                accept_pool_cq = NULL;
+        }
+        if (accept_pool_channel) {
+                ibv_destroy_comp_channel(accept_pool_channel);
+                accept_pool_channel = NULL;
+        }
+}
+
+/*
+ * Handles an RDMA_CM_EVENT_CONNECT_REQUEST by creating the client's
+ * resources and accepting the connection. Requests we can't serve are
+ * rejected. A fast connect request brings the client's metadata along, and
+ * our accept answers with ours.
+ */
+static void handle_connect_request(struct rdma_cm_id *cm_id,
+                                   struct worker *worker,
+                                   const struct rdma_buffer_attr *fast_connect)
+{
+        struct rdma_conn_param conn_param;
+        struct rdma_fast_connect private_data;
+        struct client_connection *conn = NULL;
+
+        if (accept_pool_size && !worker) {
+                conn = take_pooled_connection(cm_id, fast_connect != NULL);
+        }
+        if (!conn) {
+                conn = create_client_connection(cm_id, worker,
+                                                fast_connect != NULL);
+        }
+        if (!conn) {
+                fprintf(stderr, "Rejecting client connection request\n");
+                rdma_reject(cm_id, NULL, 0);
+                rdma_destroy_id(cm_id);
+                return;
+        }
+
+        memset(&conn_param, 0, sizeof(conn_param));
+        conn_param.initiator_depth = 3;
+        conn_param.responder_resources = 3;
+        conn_param.retry_count = 3;
+        if (conn->pooled) {
+                conn_param.qp_num = conn->queue_pair->qp_num;
+                conn_param.srq = shared_receive_queue != NULL;
+        }
+        if (fast_connect) {
+                memcpy(conn->client_metadata->addr, fast_connect,
+                       sizeof(*fast_connect));
+                if (setup_connection_buffer(conn)) {
+                        fprintf(stderr, "Rejecting client connection request\n");
+                        rdma_reject(cm_id, NULL, 0);
+                        destroy_client_connection(conn);
+                        return;
+                }
+                fast_connect_init(&private_data, conn->server_metadata->addr);
+                conn_param.private_data = &private_data;
+                conn_param.private_data_len = sizeof(private_data);
+                conn->metadata_sent = 1;
+        }
+        if (rdma_accept(cm_id, &conn_param)) {
+                fprintf(stderr, "Failed to accept connection from client: %s\n",
+                        strerror(errno));
+                destroy_client_connection(conn);
+                return;
+        }
+}
+
+/*
+ * Drains all pending completion events from a completion channel that became
+ * readable, then dispatches the Work Completions of its cq in batches through
+ * table. The CQ is re-armed before polling so no completion can slip in
+ * between the poll and the next notification.
+ */
+static void handle_completion_channel(struct ibv_comp_channel *completion_channel,
+                                      struct ibv_cq *cq,
+                                      struct completion_table *table)
+{
+        struct ibv_cq *cq_ptr = NULL;
+        void *context = NULL;
+        unsigned int events = 0;
+
+        /* The channel is non-blocking, so this stops with EAGAIN once empty */
+        while (ibv_get_cq_event(completion_channel, &cq_ptr, &context) == 0) {
+                events++;
+        }
+        if (errno != EAGAIN) {
+                fprintf(stderr, "Failed to get CQ event: %s\n", strerror(errno));
+        }
+        if (!events) {
+                return;
+        }
+        ibv_ack_cq_events(cq, events);
+
+        if (ibv_req_notify_cq(cq, 0)) {
+                fprintf(stderr, "Failed to request notifications for CQ events: %s\n",
+                        strerror(errno));
+                return;
+        }
+
+        drain_completion_queue(cq, table);
+}
+
+static void handle_connection_completions(struct client_connection *conn)
+{
+        handle_completion_channel(conn->completion_channel,
+                                  conn->completion_queue, &completion_table);
+}
+
+/*
+ * The client disconnected. Like the single-client path, print what it left in
+ * our buffer before releasing the connection's resources.
+ */
+static void handle_disconnect(struct client_connection *conn)
+{
+        if (atomic_counters_mr) {
+                printf("Client %p disconnected\n", conn);
+                lock_table ? print_lock_table() : print_atomic_counters();
+        } else if (conn->buffer) {
+                struct rdma_buffer_attr *client_metadata = conn->client_metadata->addr;
+                printf("Client %p disconnected, buffer: '%.*s'\n", conn,
+                       (int)client_metadata->length,
+                       (char *)conn->buffer->addr);
+        } else {
+                printf("Client %p disconnected\n", conn);
+        }
+        destroy_client_connection(conn);
+}
+
+/* --- Per-core workers ---
+ *
+ * With workers, the main thread's event loop becomes a pure acceptor: it only
+ * watches the CM event channel. Each new connection is handed to the worker
+ * with the fewest clients (ties go round-robin), and every later CM event for
+ * that connection is forwarded to the same worker. Workers run the
+ * connection's whole lifecycle on their own core, CQ and completion vector,
+ * so completion processing scales with cores rather than with one loop.
+ */
+
+/*
+ * Appends a command to a worker's queue and wakes the worker through its
+ * eventfd.
+ *
+ * Returns 0 if successful, -ENOMEM otherwise.
+ */
+static int queue_worker_command(struct worker *worker,
+                                enum worker_command_type type,
+                                struct rdma_cm_id *cm_id,
+                                const struct rdma_buffer_attr *fast_connect)
+{
+        uint64_t wakeup = 1;
+
+        struct worker_command *command = calloc(1, sizeof(*command));
+        if (!command) {
+                fprintf(stderr, "Failed to allocate worker command: -ENOMEM\n");
+                return -ENOMEM;
+        }
+        command->type = type;
+        command->cm_id = cm_id;
+        if (fast_connect) {
+                command->fast_connect = 1;
+                command->client_metadata = *fast_connect;
+        }
+
+        pthread_mutex_lock(&worker->command_lock);
+        if (worker->commands_tail) {
+                worker->commands_tail->next = command;
+        } else {
+                worker->commands = command;
+        }
+        worker->commands_tail = command;
+        pthread_mutex_unlock(&worker->command_lock);
+
+        if (write(worker->command_fd, &wakeup, sizeof(wakeup)) != sizeof(wakeup)) {
+                fprintf(stderr, "Failed to wake worker %d: %s\n", worker->index,
+                        strerror(errno));
+        }
+        return 0;
+}
+
+/*
+ * Picks the worker with the fewest connections, starting the search after the
+ * last worker picked so that ties are broken round-robin.
+ */
+static struct worker *pick_worker()
+{
+        struct worker *best = NULL;
+        int best_count = 0;
+
+        for (int i = 0; i < worker_count; i++) {
+                struct worker *worker = &workers[(next_worker + i) % worker_count];
+                int count = __atomic_load_n(&worker->connection_count,
+                                            __ATOMIC_RELAXED);
+                if (!best || count < best_count) {
+                        best = worker;
+                        best_count = count;
+                }
+        }
+        next_worker = (best->index + 1) % worker_count;
+        return best;
+}
+
+/*
+ * Acceptor side: forwards an ACKed CM event to worker, the owner of its CM id
+ * as read before the ACK, assigning a worker to new connection requests. Once
+ * the event is ACKed, the owning worker may destroy any id but a new
+ * connection request's, so id is only dereferenced for those.
+ */
+static void route_cm_event_to_worker(enum rdma_cm_event_type type,
+                                     struct rdma_cm_id *id,
+                                     struct worker *worker, int status,
+                                     const struct rdma_buffer_attr *fast_connect)
+{
+        switch (type) {
+                case RDMA_CM_EVENT_CONNECT_REQUEST:
+                        /* Workers share the PD, create it before any uses it */
+                        if (setup_shared_protection_domain(id->verbs)) {
+                                fprintf(stderr, "Rejecting client connection request\n");
+                                rdma_reject(id, NULL, 0);
+                                rdma_destroy_id(id);
+                                break;
+                        }
+                        worker = pick_worker();
+                        id->context = worker;
+                        if (queue_worker_command(worker, WORKER_CONNECT_REQUEST,
+                                                 id, fast_connect)) {
+                                rdma_reject(id, NULL, 0);
+                                rdma_destroy_id(id);
+                        }
+                        break;
+                case RDMA_CM_EVENT_ESTABLISHED:
+                        queue_worker_command(worker, WORKER_ESTABLISHED, id, NULL);
+                        break;
+                case RDMA_CM_EVENT_DISCONNECTED:
+                        queue_worker_command(worker, WORKER_DISCONNECTED, id, NULL);
+                        break;
+                case RDMA_CM_EVENT_CONNECT_ERROR:
+                case RDMA_CM_EVENT_UNREACHABLE:
+                case RDMA_CM_EVENT_REJECTED:
+                        fprintf(stderr, "CM event %s (status %d) for worker %d\n",
+                                rdma_event_str(type), status, worker->index);
+                        queue_worker_command(worker, WORKER_CONNECT_ERROR, id, NULL);
+                        break;
+                default:
+                        printf("Ignoring CM event %s\n", rdma_event_str(type));
+        }
+}
+
+/*
+ * Finds the connection a worker owns for cm_id, if it still exists. cm_id is
+ * only compared, never dereferenced, since the worker may have destroyed it
+ * after the acceptor ACKed the event it came with.
+ */
+static struct client_connection *find_worker_connection(struct worker *worker,
+                                                        struct rdma_cm_id *cm_id)
+{
+        for (struct client_connection *conn = worker->connections; conn;
+             conn = conn->next) {
+                if (conn->cm_id == cm_id) {
+                        return conn;
+                }
+        }
+        return NULL;
+}
+
+/*
+ * Worker side: runs every command queued by the acceptor, in order.
+ */
+static void handle_worker_commands(struct worker *worker)
+{
+        struct worker_command *commands = NULL;
+        uint64_t wakeups = 0;
+
+        /* Reset the eventfd; the queue itself says how much work there is */
+        if (read(worker->command_fd, &wakeups, sizeof(wakeups)) == -1 &&
+            errno != EAGAIN) {
+                fprintf(stderr, "Failed to read worker %d eventfd: %s\n",
+                        worker->index, strerror(errno));
+        }
+
+        pthread_mutex_lock(&worker->command_lock);
+        commands = worker->commands;
+        worker->commands = worker->commands_tail = NULL;
+        pthread_mutex_unlock(&worker->command_lock);
+
+        while (commands) {
+                struct worker_command *command = commands;
+                struct client_connection *conn = NULL;
+                commands = command->next;
+
+                switch (command->type) {
+                        case WORKER_CONNECT_REQUEST:
+                                handle_connect_request(command->cm_id, worker,
+                                                       command->fast_connect ?
+                                                       &command->client_metadata :
+                                                       NULL);
+                                break;
+                        case WORKER_ESTABLISHED:
+                                conn = find_worker_connection(worker, command->cm_id);
+                                if (!conn) {
+                                        break;
+                                }
+                                conn->established = 1;
+                                printf("Client %p connected to worker %d, %d client(s) on worker\n",
+                                       conn, worker->index,
+                                       worker->connection_count);
+                                break;
+                        case WORKER_DISCONNECTED:
+                                conn = find_worker_connection(worker, command->cm_id);
+                                if (conn) {
+                                        handle_disconnect(conn);
+                                }
+                                break;
+                        case WORKER_CONNECT_ERROR:
+                                conn = find_worker_connection(worker, command->cm_id);
+                                if (conn) {
+                                        destroy_client_connection(conn);
+                                }
+                                break;
+                        case WORKER_STOP:
+                                worker->running = 0;
+                                break;
+                }
+                free(command);
+        }
+}
+
+/*
+ * Worker thread: pins itself to its CPU, then multiplexes its command eventfd
+ * (NULL epoll data pointer) and its completion channel (the worker) until told
+ * to stop. Clients still connected at that point are torn down here, by the
+ * thread that owns them.
+ */
+static void *run_worker(void *arg)
+{
+        struct worker *worker = arg;
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (ret) {
+                fprintf(stderr, "Failed to pin worker %d to CPU %d: %s\n",
+                        worker->index, worker->cpu, strerror(ret));
+        }
+
+        while (worker->running) {
+                int n = epoll_wait(worker->epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+                if (n == -1) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        fprintf(stderr, "Worker %d failed to wait on epoll: %s\n",
+                                worker->index, strerror(errno));
+                        break;
+                }
+
+                /* Commands last: a disconnect destroys its connection, whose
+                 * WCs may still be waiting on the shared CQ.
+                 */
+                int commands_ready = 0;
+                for (int i = 0; i < n; i++) {
+                        if (!events[i].data.ptr) {
+                                commands_ready = 1;
+                        } else {
+                                handle_completion_channel(worker->completion_channel,
+                                                          worker->completion_queue,
+                                                          &worker->completion_table);
+                        }
+                }
+                if (commands_ready) {
+                        handle_worker_commands(worker);
+                }
+        }
+
+        printf("Stopping worker %d with %d client(s) connected\n",
+               worker->index, worker->connection_count);
+        while (worker->connections) {
+                destroy_client_connection(worker->connections);
+        }
+        return NULL;
+}
+
+/*
+ * Creates worker_count workers, worker i pinned to CPU i modulo the number of
+ * online CPUs. SIGINT and SIGTERM are blocked in the workers so that they
+ * keep interrupting the acceptor's epoll_wait().
+ *
+ * Returns 0 if successful, a negative error code otherwise.
+ */
+static int start_workers()
+{
+        sigset_t signals, old_signals;
+        struct epoll_event event;
+        long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        int ret = 0;
+
+        workers = calloc(worker_count, sizeof(*workers));
+        if (!workers) {
+                fprintf(stderr, "Failed to allocate workers: -ENOMEM\n");
+                return -ENOMEM;
+        }
+        for (int i = 0; i < worker_count; i++) {
+                workers[i].epoll_fd = -1;
+                workers[i].command_fd = -1;
+                pthread_mutex_init(&workers[i].command_lock, NULL);
+        }
+
+        /* Workers inherit the signal mask of the thread that creates them */
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+
+        for (int i = 0; i < worker_count; i++) {
+                struct worker *worker = &workers[i];
+                worker->index = i;
+                worker->cpu = cpu_count > 0 ? i % cpu_count : 0;
+                worker->running = 1;
+
+                worker->epoll_fd = epoll_create1(0);
+                worker->command_fd = eventfd(0, EFD_NONBLOCK);
+                if (worker->epoll_fd == -1 || worker->command_fd == -1) {
+                        fprintf(stderr, "Failed to create worker %d fds: %s\n",
+                                i, strerror(errno));
+                        ret = -errno;
+                        break;
+                }
+                memset(&event, 0, sizeof(event));
+                event.events = EPOLLIN;
+                event.data.ptr = NULL;
+                if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD,
+                              worker->command_fd, &event)) {
+                        fprintf(stderr, "Failed to add worker %d eventfd to epoll: %s\n",
+                                i, strerror(errno));
+                        ret = -errno;
+                        break;
+                }
+
+                ret = completion_table_init(&worker->completion_table, 64,
+                                            cq_batch_size);
+                if (ret) {
+                        break;
+                }
+
+                ret = pthread_create(&worker->thread, NULL, run_worker, worker);
+                if (ret) {
+                        fprintf(stderr, "Failed to start worker %d: %s\n", i,
+                                strerror(ret));
+                        ret = -ret;
+                        break;
+                }
+                worker->started = 1;
+        }
+
+        pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+        if (!ret) {
+                printf("Started %d worker(s) on %ld CPU(s)\n", worker_count,
+                       cpu_count);
+        }
+        return ret;
+}
+
+/*
+ * Stops and joins every worker, then releases the resources they owned.
+ */
+static void stop_workers()
+{
+        if (!workers) {
+                return;
+        }
+
+        for (int i = 0; i < worker_count; i++) {
+                if (workers[i].started) {
+                        queue_worker_command(&workers[i], WORKER_STOP, NULL, NULL);
+                }
+        }
+
+        for (int i = 0; i < worker_count; i++) {
+                struct worker *worker = &workers[i];
+                if (worker->started) {
+                        pthread_join(worker->thread, NULL);
+                }
+
+                while (worker->commands) {
+                        struct worker_command *command = worker->commands;
+                        worker->commands = command->next;
+                        free(command);
+                }
+                if (worker->completion_queue) {
+                        ibv_destroy_cq(worker->completion_queue);
+                }
+                if (worker->completion_channel) {
+                        ibv_destroy_comp_channel(worker->completion_channel);
+                }
+                rdma_pool_destroy(worker->buffer_pool);
+                completion_table_destroy(&worker->completion_table);
+                if (worker->command_fd != -1) {
+                        close(worker->command_fd);
+                }
+                if (worker->epoll_fd != -1) {
+                        close(worker->epoll_fd);
+                }
+                pthread_mutex_destroy(&worker->command_lock);
+        }
+
+        free(workers);
+        workers = NULL;
+}
+
+/*
+ * Drains every pending event on the non-blocking CM event channel. Each event
+ * is ACKed before acting on it, since destroying a CM id blocks until all of
+ * its events have been ACKed. Whatever is needed from the id is read before
+ * the ACK, which is all that keeps a worker from destroying it.
+ */
+static void handle_cm_events()
+{
+        struct rdma_cm_event *cm_event = NULL;
+
+        struct rdma_buffer_attr client_metadata;
+
+        while (rdma_get_cm_event(cm_event_channel, &cm_event) == 0) {
+                enum rdma_cm_event_type type = cm_event->event;
+                struct rdma_cm_id *id = cm_event->id;
+                void *context = id->context;
+                int status = cm_event->status;
+                int fast_connect = type == RDMA_CM_EVENT_CONNECT_REQUEST &&
+                        parse_fast_connect(cm_event->param.conn.private_data,
+                                           cm_event->param.conn.private_data_len,
+                                           &client_metadata);
+                rdma_ack_cm_event(cm_event);
+
+                if (workers) {
+                        route_cm_event_to_worker(type, id, context, status,
+                                                 fast_connect ? &client_metadata :
+                                                                NULL);
+                        continue;
+                }
+
+                struct client_connection *conn = context;
+                /* A pooled connection in timewait only waits for its end */
+                if (conn && conn->timewait) {
+                        if (type == RDMA_CM_EVENT_TIMEWAIT_EXIT) {
+                                end_pooled_timewait(conn);
+                        }
+                        continue;
+                }
+                switch (type) {
+                        case RDMA_CM_EVENT_CONNECT_REQUEST:
+                                handle_connect_request(id, NULL,
+                                                       fast_connect ?
+                                                       &client_metadata : NULL);
+                                break;
+                        case RDMA_CM_EVENT_ESTABLISHED:
+                                if (!conn) {
+                                        break;
+                                }
+                                conn->established = 1;
+                                printf("Client %p connected, %d client(s) total\n",
+                                       conn, connection_count);
+                                break;
+                        case RDMA_CM_EVENT_DISCONNECTED:
+                                if (conn) {
+                                        handle_disconnect(conn);
+                                }
+                                break;
+                        case RDMA_CM_EVENT_CONNECT_ERROR:
+                        case RDMA_CM_EVENT_UNREACHABLE:
+                        case RDMA_CM_EVENT_REJECTED:
+                                fprintf(stderr, "CM event %s (status %d) for client %p\n",
+                                        rdma_event_str(type), status, conn);
+                                if (conn) {
+                                        destroy_client_connection(conn);
+                                }
+                                break;
+                        default:
+                                printf("Ignoring CM event %s\n",
+                                       rdma_event_str(type));
+                }
+        }
+        if (errno != EAGAIN) {
+                fprintf(stderr, "Failed to get CM event: %s\n", strerror(errno));
+        }
+}
+
+/*
+ * Serves any number of clients concurrently until interrupted with SIGINT or
+ * SIGTERM. The CM event channel is registered with a NULL epoll data pointer,
+ * completion channels with their client_connection, and in SRQ mode the async
+ * event fd with the SRQ. The accept pool's channel is registered with itself.
+ */
+static int run_event_loop()
+{
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        struct epoll_event event;
+        struct sigaction action;
+        int ret = 0;
+
+        epoll_fd = epoll_create1(0);
+        if (epoll_fd == -1) {
+                fprintf(stderr, "Failed to create epoll instance: %s\n",
+                        strerror(errno));
+                return -errno;
+        }
+
+        ret = set_fd_nonblocking(cm_event_channel->fd);
+        if (ret) {
+                return ret;
+        }
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cm_event_channel->fd, &event)) {
+                fprintf(stderr, "Failed to add CM event channel to epoll: %s\n",
+                        strerror(errno));
+                return -errno;
+        }
+
+        /* Bound to a device, the accept pool is ready before the first
+         * client arrives. Otherwise the first client creates it.
+         */
+        if (accept_pool_size && cm_server_id->verbs) {
+                ret = setup_shared_protection_domain(cm_server_id->verbs);
+                if (ret) {
+                        return ret;
+                }
+        }
+
+        /* No SA_RESTART, so a signal interrupts epoll_wait() */
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = stop_event_loop;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+
+        printf("Serving multiple clients, press Ctrl-C to stop\n");
+        while (event_loop_running) {
+                int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+                if (n == -1) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        fprintf(stderr, "Failed to wait on epoll: %s\n",
+                                strerror(errno));
+                        return -errno;
+                }
+
+                /* Handle CM events last: a disconnect destroys its
+                 * connection, which may still be referenced by a later
+                 * entry in this batch of epoll events.
+                 */
+                int cm_events_ready = 0;
+                for (int i = 0; i < n; i++) {
+                        if (!events[i].data.ptr) {
+                                cm_events_ready = 1;
+                        } else if (events[i].data.ptr == shared_receive_queue) {
+                                handle_async_events();
+                        } else if (events[i].data.ptr == accept_pool_channel) {
+                                handle_completion_channel(accept_pool_channel,
+                                                          accept_pool_cq,
+                                                          &completion_table);
+                        } else {
+                                handle_connection_completions(events[i].data.ptr);
+                        }
+                }
+                if (cm_events_ready) {
+                        handle_cm_events();
+                }
+        }
+        printf("Event loop stopped with %d client(s) connected\n",
+               connection_count);
+        return 0;
+}
+
+void print_usage()
+{
+        printf("Usage\n");
+        printf("\t./rdma-server -s <server_address> -p <server_port> [options]\n");
+        printf("Options\n");
+        printf("\t-e, --event-loop\t\t\tServe many clients concurrently from a non-blocking epoll event loop\n");
+        printf("\t-w, --workers <n>\t\t\tServe clients from n worker threads, one per core, each with its own CQ (implies -e)\n");
+        printf("\t-S, --srq\t\t\t\tShare one receive queue across all clients (implies -e)\n");
+        printf("\t-a, --accept-pool <n>\t\t\tKeep n connections ready to accept clients with (implies -e)\n");
+        printf("\t-Q, --backlog <n>\t\t\tConnection requests queued for accepting (default: %d)\n",
+               DEFAULT_LISTEN_BACKLOG);
+        printf("\t-d, --srq-depth <wrs>\t\t\tReceives kept posted on the shared receive queue (default: %d)\n",
+               DEFAULT_SRQ_DEPTH);
+        printf("\t-L, --latency <write|send|read>\t\tServe a single rdma-client --latency run of the same operation\n");
+        printf("\t-B, --bandwidth <write|send|read>\tServe a single rdma-client --bandwidth run of the same operation\n");
+        printf("\t-q, --queue-depth <wrs>\t\t\tReceives kept posted for a send bandwidth run, credit stream or key-value store, or file chunk slots (default: %d)\n",
+               DEFAULT_QUEUE_DEPTH);
+        printf("\t-W, --write-imm\t\t\t\tExpect clients to WRITE with immediate, printing each message as it lands\n");
+        printf("\t-R, --ring\t\t\t\tServe a single rdma-client --ring message stream\n");
+        printf("\t-C, --credit-stream\t\t\tServe a single rdma-client --credit-stream, keeping -q receives posted\n");
+        printf("\t-T, --session\t\t\t\tServe a single rdma-client --session, printing every message until it disconnects\n");
+        printf("\t-F, --file <path>\t\t\tWrite a single rdma-client --file transfer to path, through -q chunk slots\n");
+        printf("\t-K, --kv-store <buckets>\t\tHost a key-value store of this many buckets for a single rdma-client --kv\n");
+        printf("\t-V, --kv-heap <bytes>\t\t\tKey-value store heap size (default: %d)\n",
+               DEFAULT_KV_HEAP_SIZE);
+        printf("\t-A, --atomic-counters <n>\t\tAdvertise n 64-bit counters for rdma-client --atomic instead of a buffer\n");
+        printf("\t-l, --lock-table <n>\t\t\tAdvertise n 64-bit lock words for rdma-client --locks instead of a buffer\n");
+        printf("\t-c, --completion <event|poll|hybrid>\tHow to wait for Work Completions (default: event)\n");
+        printf("\t-b, --spin-budget <polls>\t\tCQ polls before a hybrid wait blocks (default: %d)\n",
+               DEFAULT_SPIN_BUDGET);
+        printf("\t-n, --cq-batch <wcs>\t\t\tWCs drained per ibv_poll_cq() call (default: %d)\n",
+               DEFAULT_CQ_BATCH_SIZE);
+        printf("\t-P, --pool-class-bytes <bytes>\t\tMemory pool bytes per size class (default: %d)\n",
+               DEFAULT_POOL_CLASS_BYTES);
+        printf("\t-M, --pool-max-buffer <bytes>\t\tLargest pooled buffer; bigger ones are registered on demand (default: %d)\n",
+               DEFAULT_POOL_MAX_BUFFER);
+        printf("\t-H, --hugepages <none|2m|1g>\t\tBack registered buffers with hugepages (default: none)\n");
+        printf("\t-r, --registration <pinned|odp|implicit>\tRegister memory pinned or with On-Demand Paging, falling back to pinned (default: pinned)\n");
+        printf("\t-I, --inline <bytes>\t\t\tInline data requested for client QPs, 0 to disable (default: %d)\n",
+               DEFAULT_INLINE_SIZE);
+        printf("Example\n");
+        printf("\t./rdma-server -s 192.168.0.106 -p 7471\n");
+}
+
+static struct option long_options[] = {
+        {"server", required_argument, NULL, 's'},
+        {"port", required_argument, NULL, 'p'},
+        {"event-loop", no_argument, NULL, 'e'},
+        {"workers", required_argument, NULL, 'w'},
+        {"srq", no_argument, NULL, 'S'},
+        {"srq-depth", required_argument, NULL, 'd'},
+        {"accept-pool", required_argument, NULL, 'a'},
+        {"backlog", required_argument, NULL, 'Q'},
+        {"latency", required_argument, NULL, 'L'},
+        {"bandwidth", required_argument, NULL, 'B'},
+        {"queue-depth", required_argument, NULL, 'q'},
+        {"write-imm", no_argument, NULL, 'W'},
+        {"ring", no_argument, NULL, 'R'},
+        {"credit-stream", no_argument, NULL, 'C'},
+        {"session", no_argument, NULL, 'T'},
+        {"file", required_argument, NULL, 'F'},
+        {"kv-store", required_argument, NULL, 'K'},
+        {"kv-heap", required_argument, NULL, 'V'},
+        {"atomic-counters", required_argument, NULL, 'A'},
+        {"lock-table", required_argument, NULL, 'l'},
+        {"completion", required_argument, NULL, 'c'},
+        {"spin-budget", required_argument, NULL, 'b'},
+        {"cq-batch", required_argument, NULL, 'n'},
+        {"pool-class-bytes", required_argument, NULL, 'P'},
+        {"pool-max-buffer", required_argument, NULL, 'M'},
+        {"hugepages", required_argument, NULL, 'H'},
+        {"registration", required_argument, NULL, 'r'},
+        {"inline", required_argument, NULL, 'I'},
+        {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char **argv)
+{
+        int option;
+        enum completion_mode completion_mode = COMPLETION_MODE_EVENT;
+        unsigned long spin_budget = DEFAULT_SPIN_BUDGET;
+        enum hugepage_mode hugepage_mode = HUGEPAGE_NONE;
+        enum registration_mode registration_mode = REGISTRATION_PINNED;
+        while ((option = getopt_long(argc, argv, "s:p:ew:Sd:a:Q:L:B:q:WRCTF:K:V:A:l:c:b:n:P:M:H:r:I:", long_options,
+                                     NULL)) != -1) {
+                switch (option) {
+                        case 's':
+                                server_addr = optarg;
+                                break;
+                        case 'p':
+                                server_port = optarg;
+                                break;
+                        case 'e':
+                                serve_multiple_clients = 1;
+                                break;
+                        case 'w':
+                                worker_count = atoi(optarg);
+                                if (worker_count < 1) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                serve_multiple_clients = 1;
+                                break;
+                        case 'S':
+                                use_srq = 1;
+                                serve_multiple_clients = 1;
+                                break;
+                        case 'a':
+                                accept_pool_size = atoi(optarg);
+                                if (accept_pool_size < 1) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                serve_multiple_clients = 1;
+                                break;
+                        case 'Q':
+                                listen_backlog = atoi(optarg);
+                                if (listen_backlog < 1) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'L':
+                                if (parse_benchmark_op(optarg, &latency_op)) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'B':
+                                if (parse_benchmark_op(optarg, &bandwidth_op)) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'q':
+                                queue_depth = atoi(optarg);
+                                if (queue_depth < 1) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'W':
+                                write_imm = 1;
+                                break;
+                        case 'R':
+                                ring_mode = 1;
+                                break;
+                        case 'C':
+                                credit_stream = 1;
+                                break;
+                        case 'T':
+                                /* A session is a credit stream */
+                                credit_stream = 1;
+                                session_mode = 1;
+                                break;
+                        case 'F':
+                                file_output = optarg;
+                                break;
+                        case 'K':
+                                kv_bucket_count = strtoul(optarg, NULL, 10);
+                                if (!kv_bucket_count ||
+                                    kv_bucket_count > UINT32_MAX / sizeof(struct kv_bucket)) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'V':
+                                kv_heap_size = strtoul(optarg, NULL, 10);
+                                if (kv_heap_size <= KV_RECORD_ALIGNMENT) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'A':
+                        case 'l':
+                                /* Lock words are counters handled differently */
+                                lock_table = option == 'l';
+                                atomic_counter_count = strtoul(optarg, NULL, 10);
+                                if (!atomic_counter_count ||
+                                    atomic_counter_count > UINT32_MAX / sizeof(uint64_t)) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'd':
+                                srq_depth = atoi(optarg);
+                                if (srq_depth < 4) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'c':
+                                if (parse_completion_mode(optarg,
+                                                          &completion_mode)) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'b':
+                                spin_budget = strtoul(optarg, NULL, 10);
+                                break;
+                        case 'n':
+                                cq_batch_size = atoi(optarg);
+                                if (cq_batch_size < 1) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'P':
+                                pool_class_bytes = strtoul(optarg, NULL, 10);
+                                break;
+                        case 'M':
+                                pool_max_buffer = strtoul(optarg, NULL, 10);
+                                break;
+                        case 'H':
+                                if (parse_hugepage_mode(optarg,
+                                                        &hugepage_mode)) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'r':
+                                if (parse_registration_mode(optarg,
+                                                            &registration_mode)) {
+                                        print_usage();
+                                        exit(1);
+                                }
+                                break;
+                        case 'I':
+                                inline_size = strtoul(optarg, NULL, 10);
+                                break;
+                        default:
+                                print_usage();
+                                exit(1);
+                }
+
+        }
+        set_completion_mode(completion_mode, spin_budget);
+        printf("Completion mode: %s, spin budget: %lu\n",
+               completion_mode_str(completion_mode), spin_budget);
+        set_hugepage_mode(hugepage_mode);
+        printf("Hugepages: %s\n", hugepage_mode_str(hugepage_mode));
+        set_registration_mode(registration_mode);
+        printf("Registration: %s\n", registration_mode_str(registration_mode));
+
+        int ret = completion_table_init(&completion_table, 64 + queue_depth,
+                                        cq_batch_size);
+        if (ret) {
+                return ret;
+        }
+
+        ret = setup_server();
+        if (ret) {
+                cleanup_server();
+                return ret;
+        }
+
+        if ((latency_op != BENCHMARK_OP_NONE || bandwidth_op != BENCHMARK_OP_NONE) &&
+            serve_multiple_clients) {
+                fprintf(stderr, "Benchmarks serve a single client and can't be combined with --event-loop\n");
+                cleanup_server();
+                return -EINVAL;
+        }
+        /* Modes streaming from a single client */
+        int stream_modes = ring_mode + credit_stream + (file_output != NULL) +
+                           (kv_bucket_count != 0);
+        if ((latency_op != BENCHMARK_OP_NONE || bandwidth_op != BENCHMARK_OP_NONE) &&
+            (write_imm || stream_modes)) {
+                fprintf(stderr, "Benchmarks can't be combined with --write-imm, --ring, --credit-stream, --file or --kv-store\n");
+                cleanup_server();
+                return -EINVAL;
+        }
+        if (stream_modes > 1 ||
+            (stream_modes && (write_imm || serve_multiple_clients))) {
+                fprintf(stderr, "--ring, --credit-stream, --file and --kv-store serve a single client and can't be combined with each other, --write-imm or --event-loop\n");
+                cleanup_server();
+                return -EINVAL;
+        }
+        if (atomic_counter_count &&
+            (latency_op != BENCHMARK_OP_NONE || bandwidth_op != BENCHMARK_OP_NONE ||
+             write_imm || stream_modes)) {
+                fprintf(stderr, "--atomic-counters and --lock-table can't be combined with benchmarks, --write-imm, --ring, --credit-stream, --file or --kv-store\n");
+                cleanup_server();
+                return -EINVAL;
+        }
+        if (file_output) {
+                file_fd = open(file_output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (file_fd < 0) {
+                        fprintf(stderr, "Failed to open %s: %s\n", file_output,
+                                strerror(errno));
+                        cleanup_server();
+                        return -errno;
+                }
+        }
+
+        if (worker_count) {
+                if (use_srq) {
+                        fprintf(stderr, "--srq can't be combined with --workers\n");
+                        cleanup_server();
+                        return -EINVAL;
+                }
+                if (accept_pool_size) {
+                        fprintf(stderr, "--accept-pool can't be combined with --workers\n");
+                        cleanup_server();
+                        return -EINVAL;
+                }
+                ret = start_workers();
+                if (ret) {
+                        cleanup_server();
+                        return ret;
+                }
+        }
+
+        if (serve_multiple_clients) {
+                ret = run_event_loop();
+                cleanup_server();
+                return ret;
+        }
+
+        ret = wait_for_client_connection();
+        if (ret) {
+                cleanup_server();
+                return ret;
+        }
+
+        ret = setup_communication_resources();
+        if (ret) {
+                cleanup_server();
+                return ret;
+        }
+
+        /* A fast connect client has already told us its metadata, and
+         * gets ours with the accept
+         */
+        ret = fast_connect ? setup_client_buffer() :
+                             post_metadata_recv_buffer();
+        if (ret) {
+                cleanup_server();
+                return ret;
+        }
+
+        ret = accept_client_connection();
+        if (ret) {
+                cleanup_server();
+                return ret;
+        }
+
+        if (!fast_connect) {
+                ret = exchange_metadata_with_client();
+                if (ret) {
+                        cleanup_server();
+                        return ret;
+                }
+        }
+
+        if (latency_op != BENCHMARK_OP_NONE || bandwidth_op != BENCHMARK_OP_NONE) {
+                ret = serve_benchmark();
+                if (ret) {
+                        cleanup_server();
+                        return ret;
+                }
+        }
+
+        if (write_imm) {
+                ret = wait_for_notified_message();
+                if (ret) {
+                        cleanup_server();
+                        return ret;
+                }
+        }
+
+        if (ring_mode) {
+                ret = serve_ring();
+                if (ret) {
+                        cleanup_server();
+                        return ret;
+                }
+        }
+
+        if (credit_stream) {
+                ret = serve_credit_stream();
+                if (ret) {
+                        cleanup_server();
+                        return ret;
+                }
+        }
+
+        if (file_output) {
+                ret = serve_file();
+                if (ret) {
+                        cleanup_server();
+                        return ret;
+                }
+        }
+
+        if (kv_bucket_count) {
+                ret = serve_kv();
+                if (ret) {
+                        cleanup_server();
+                        return ret;
+                }
+        }
 
         ret = disconnect_from_client();
         if (ret) {
@@ -9,17 +9,80 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <fcntl.h>
 #include "socket_common.h"
 
 void print_usage() {
-        printf("Usage:\n\t./socket-client <server_host> <server_port>\n");
+        printf("Usage:\n\t./socket-client <server_host> <server_port> [file]\n");
+        printf("Sends a line from stdin, or the file if one is given\n");
         printf("Example:\n\t./socket-client 10.214.131.9 8082\n");
+        printf("\t./socket-client 10.214.131.9 8082 dataset.bin\n");
 }
 
 void send_message() {
 
 }
 
+/* send_file() sends the whole file at path over the client socket, a chunk
+ * at a time, and reports the throughput, for comparison with rdma-client
+ * --file. Returns 0 on success, -1 otherwise.
+ */
+int send_file(int client_sockfd, const char *path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                fprintf(stderr, "Unable to open %s: %s\n", path,
+                        strerror(errno));
+                return -1;
+        }
+
+        char *chunk = malloc(FILE_CHUNK_SIZE);
+        if (!chunk) {
+                close(fd);
+                return -1;
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long long total = 0;
+        int ret = 0;
+        while (true) {
+                ssize_t n = read(fd, chunk, FILE_CHUNK_SIZE);
+                if (n == 0) {
+                        break;
+                }
+                if (n < 0) {
+                        fprintf(stderr, "Unable to read %s: %s\n", path,
+                                strerror(errno));
+                        ret = -1;
+                        break;
+                }
+                for (ssize_t done = 0; done < n; ) {
+                        ssize_t sent = send(client_sockfd, chunk + done,
+                                            n - done, 0);
+                        if (sent < 0) {
+                                fprintf(stderr, "Unable to send: %s\n",
+                                        strerror(errno));
+                                ret = -1;
+                                break;
+                        }
+                        done += sent;
+                }
+                if (ret) {
+                        break;
+                }
+                total += n;
+        }
+
+        double seconds = elapsed_seconds(&start);
+        printf("Sent %lld bytes in %.3f s: %.2f MB/s, %.2f Gb/s\n", total,
+               seconds, seconds > 0 ? total / seconds / 1e6 : 0,
+               seconds > 0 ? total * 8 / seconds / 1e9 : 0);
+
+        free(chunk);
+        close(fd);
+        return ret;
+}
+
 void read_stdin(char *buf, int max_size) {
         if (!buf) {
                 return;
@@ -76,6 +139,12 @@ int main(int argc, char **argv) {
         }
         printf("Connected to server: %s:%d\n", server_host, server_port);
 
+        if (argc > 3) {
+                int ret = send_file(client_sockfd, argv[3]);
+                close(client_sockfd);
+                return ret ? 1 : 0;
+        }
+
         char *send_buffer = calloc(sizeof(char), MAX_MSG_SIZE+1);
         read_stdin(send_buffer, MAX_MSG_SIZE);
 
@@ -2,4 +2,11 @@
 
 bool is_valid_port(int port) {
         return port >= 1024 && port <= 49151;
+}
+
+double elapsed_seconds(const struct timespec *start) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - start->tv_sec) +
+               (now.tv_nsec - start->tv_nsec) / 1e9;
 }
\ No newline at end of file
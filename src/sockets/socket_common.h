@@ -2,11 +2,16 @@
 #define SOCKET_COMMON_H
 
 #include <stdbool.h>
+#include <time.h>
 
 #define MAX_MSG_SIZE 255
+#define FILE_CHUNK_SIZE (1 << 20)
 #define MIN_PORT 1024
 #define MAX_PORT 49151
 
 bool is_valid_port(int);
 
+/* Returns the seconds elapsed since start, per CLOCK_MONOTONIC */
+double elapsed_seconds(const struct timespec *start);
+
 #endif /* SOCKET_COMMON_H */
\ No newline at end of file
@@ -8,11 +8,14 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include "socket_common.h"
 
 void print_usage() {
-        printf("Usage:\n\t./socket-server <listen_port>\n");
+        printf("Usage:\n\t./socket-server <listen_port> [output_file]\n");
+        printf("Prints client messages, or writes what a client sends to output_file\n");
         printf("Example:\n\t./socket-server 8082\n");
+        printf("\t./socket-server 8082 received.bin\n");
 }
 
 /* accept_connection() listens on the server socket for incoming client
@@ -58,6 +61,67 @@ void read_client(int client_sockfd) {
         }
 }
 
+/* receive_file() writes everything the client sends to the file at path
+ * until the client disconnects, and reports the throughput, for comparison
+ * with rdma-server --file.
+ */
+void receive_file(int client_sockfd, const char *path) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+                fprintf(stderr, "Unable to open %s: %s\n", path,
+                        strerror(errno));
+                return;
+        }
+
+        char *chunk = malloc(FILE_CHUNK_SIZE);
+        if (!chunk) {
+                close(fd);
+                return;
+        }
+
+        struct timespec start;
+        long long total = 0;
+        while (true) {
+                ssize_t n = read(client_sockfd, chunk, FILE_CHUNK_SIZE);
+                if (n == 0) {
+                        printf("Client has disconnected.\n");
+                        break;
+                }
+                if (n == -1) {
+                        fprintf(stderr, "Error reading file data: %s\n",
+                                strerror(errno));
+                        break;
+                }
+                /* Time from the first byte, like rdma-server */
+                if (!total) {
+                        clock_gettime(CLOCK_MONOTONIC, &start);
+                }
+                for (ssize_t done = 0; done < n; ) {
+                        ssize_t written = write(fd, chunk + done, n - done);
+                        if (written < 0) {
+                                fprintf(stderr, "Unable to write %s: %s\n",
+                                        path, strerror(errno));
+                                free(chunk);
+                                close(fd);
+                                return;
+                        }
+                        done += written;
+                }
+                total += n;
+        }
+
+        double seconds = total ? elapsed_seconds(&start) : 0;
+        printf("Wrote %lld bytes to %s", total, path);
+        if (seconds > 0) {
+                printf(", %.2f MB/s, %.2f Gb/s", total / seconds / 1e6,
+                       total * 8 / seconds / 1e9);
+        }
+        printf("\n");
+
+        free(chunk);
+        close(fd);
+}
+
 int main(int argc, char** argv) {
 
         if (argc < 2) {
@@ -117,7 +181,11 @@ int main(int argc, char** argv) {
                 /* Accept a client connection */
                 int client_sockfd = accept_connection(sockfd);
 
-                read_client(client_sockfd);
+                if (argc > 2) {
+                        receive_file(client_sockfd, argv[2]);
+                } else {
+                        read_client(client_sockfd);
+                }
 
                 /* Close client socket file descriptor */
                 close(client_sockfd);